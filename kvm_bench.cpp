@@ -0,0 +1,156 @@
+// kvm_bench.cpp
+// Microbenchmarks: messages per second for the original text parser, the table-driven
+// text decoder and the binary decoder, plus the portable part of the keyboard hook's
+// fast path (kvm_hook.hpp: modifier mask update and key event) and its ring push. The
+// full hook proc cost, including the Windows calls, is measured in the app itself and
+// logged on every switch back to local control.
+//
+// How to compile (any platform, no Windows headers needed):
+// g++ -std=c++17 -O2 kvm_bench.cpp -o kvm_bench
+//
+// Usage: kvm_bench [iterations]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <utility>
+#include <vector>
+#include "kvm_hook.hpp"
+#include "kvm_protocol.hpp"
+#include "kvm_ring.hpp"
+
+// The parser process_message used before decode_text_frame, minus injection.
+static InputEvent legacy_decode(const std::string& message) {
+    InputEvent ev = {};
+    size_t pos = message.find("event:");
+    if (pos != std::string::npos) {
+        std::string event_str = message.substr(pos + 6);
+        std::string event_type = event_str.substr(0, event_str.find_first_of(",\n"));
+
+        std::vector<std::pair<std::string, std::string>> params;
+        size_t start = event_type.length();
+        while(start < event_str.length()) {
+            start = event_str.find(',', start);
+            if(start == std::string::npos) break;
+            start++;
+            size_t end_key = event_str.find(':', start);
+            if(end_key == std::string::npos) break;
+            std::string key = event_str.substr(start, end_key - start);
+            start = end_key + 1;
+            size_t end_val = event_str.find_first_of(",\n", start);
+            std::string value = event_str.substr(start, end_val - start);
+            params.push_back({key, value});
+            start = end_val;
+        }
+
+        if (event_type == "control_acquire") ev.type = EventType::ControlAcquire;
+        else if (event_type == "control_release") ev.type = EventType::ControlRelease;
+        else if (event_type == "key_press" && !params.empty()) { ev.type = EventType::KeyPress; ev.vk_code = (uint16_t)std::stoi(params[0].second); }
+        else if (event_type == "key_release" && !params.empty()) { ev.type = EventType::KeyRelease; ev.vk_code = (uint16_t)std::stoi(params[0].second); }
+        else if (event_type == "mouse_move" && params.size() >= 2) { ev.type = EventType::MouseMove; ev.dx = std::stoi(params[0].second); ev.dy = std::stoi(params[1].second); }
+        else if (event_type == "mouse_down" && !params.empty()) { ev.type = EventType::MouseDown; ev.button = (params[0].second == "left" ? 0 : (params[0].second == "right" ? 1 : 2)); }
+        else if (event_type == "mouse_up" && !params.empty()) { ev.type = EventType::MouseUp; ev.button = (params[0].second == "left" ? 0 : (params[0].second == "right" ? 1 : 2)); }
+        else if (event_type == "mouse_scroll" && !params.empty()) { ev.type = EventType::MouseScroll; ev.delta = std::stoi(params[0].second); }
+    }
+    return ev;
+}
+
+// A mix that looks like real use: mostly motion, some keys, clicks and wheel.
+static std::vector<InputEvent> make_workload() {
+    std::vector<InputEvent> events;
+    for (int i = 0; i < 64; ++i) {
+        InputEvent ev = {};
+        switch (i % 8) {
+            // Every fourth key is a modifier, so the mask update takes both paths.
+            case 0: ev.type = EventType::KeyPress; ev.vk_code = (i % 32 == 0) ? HOOK_VK_LSHIFT : 0x41 + (i % 26); break;
+            case 1: ev.type = EventType::KeyRelease; ev.vk_code = (i % 32 == 1) ? HOOK_VK_LSHIFT : 0x41 + (i % 26); break;
+            case 2: ev.type = EventType::MouseDown; ev.button = MOUSE_BUTTON_LEFT; break;
+            case 3: ev.type = EventType::MouseUp; ev.button = MOUSE_BUTTON_LEFT; break;
+            case 4: ev.type = EventType::MouseScroll; ev.delta = -120; break;
+            default: ev.type = EventType::MouseMove; ev.dx = i - 30; ev.dy = 17 - i; break;
+        }
+        events.push_back(ev);
+    }
+    return events;
+}
+
+template <typename Fn>
+static void run(const char* name, size_t iterations, size_t messages_per_iteration, Fn&& fn) {
+    uint64_t checksum = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; ++i) checksum += fn();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double rate = (double)(iterations * messages_per_iteration) / seconds;
+    printf("%-22s %12.0f msg/s  (%.3f s, checksum %llu)\n", name, rate, seconds, (unsigned long long)checksum);
+}
+
+int main(int argc, char** argv) {
+    size_t iterations = argc > 1 ? strtoul(argv[1], nullptr, 10) : 20000;
+    std::vector<InputEvent> events = make_workload();
+
+    std::vector<std::string> lines;
+    std::vector<uint8_t> binary;
+    for (const InputEvent& ev : events) {
+        char text[MAX_TEXT_FRAME_SIZE];
+        size_t n = encode_text_frame(ev, text, sizeof(text));
+        lines.emplace_back(text, n - 1); // Without the '\n', as the client hands it over
+        uint8_t frame[MAX_BINARY_FRAME_SIZE];
+        size_t m = encode_binary_frame(ev, frame);
+        binary.insert(binary.end(), frame, frame + m);
+    }
+
+    run("text, legacy parser", iterations, lines.size(), [&]() {
+        uint64_t sum = 0;
+        for (const std::string& line : lines) {
+            InputEvent ev = legacy_decode(line);
+            sum += (uint64_t)ev.type + (uint32_t)ev.dx + ev.vk_code;
+        }
+        return sum;
+    });
+
+    run("text, decode_text_frame", iterations, lines.size(), [&]() {
+        uint64_t sum = 0;
+        for (const std::string& line : lines) {
+            InputEvent ev;
+            if (decode_text_frame(line, ev) == DecodeStatus::Ok) sum += (uint64_t)ev.type + (uint32_t)ev.dx + ev.vk_code;
+        }
+        return sum;
+    });
+
+    run("binary frames", iterations, events.size(), [&]() {
+        uint64_t sum = 0;
+        size_t offset = 0;
+        InputEvent ev;
+        size_t consumed = 0;
+        while (decode_binary_frame(binary.data() + offset, binary.size() - offset, ev, consumed) == DecodeStatus::Ok) {
+            sum += (uint64_t)ev.type + (uint32_t)ev.dx + ev.vk_code;
+            offset += consumed;
+        }
+        return sum;
+    });
+
+    // What the keyboard hook does per forwarded key: track_modifier, make_key_event and
+    // the push into the sender ring. The stamp stands in for the QueryPerformanceCounter
+    // read, and the pop for the sender thread, so the ring never fills.
+    std::vector<InputEvent> keys;
+    for (const InputEvent& ev : events) {
+        if (ev.type == EventType::KeyPress || ev.type == EventType::KeyRelease) keys.push_back(ev);
+    }
+    static SpscRing<InputEvent, 4096> ring;
+    run("hook path, ring push", iterations, keys.size(), [&]() {
+        uint64_t sum = 0;
+        uint8_t modifiers = 0;
+        for (const InputEvent& key : keys) {
+            bool is_key_down = key.type == EventType::KeyPress;
+            track_modifier(modifiers, key.vk_code, is_key_down);
+            InputEvent ev = make_key_event(key.vk_code, is_key_down);
+            ev.timestamp = (int64_t)sum;
+            ring.try_push(ev);
+            InputEvent out;
+            if (ring.try_pop(out)) sum += (uint64_t)out.type + out.vk_code + modifiers;
+        }
+        return sum;
+    });
+    return 0;
+}
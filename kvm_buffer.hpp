@@ -0,0 +1,76 @@
+// kvm_buffer.hpp
+// Fixed-capacity receive buffer for framed byte streams.
+//
+// Bytes are received straight into the free tail of the buffer and consumed from the
+// front as complete frames are decoded. Consuming only advances an index; the leftover
+// partial frame is moved to the front only when the tail runs out of room, so each
+// byte is copied at most once and a burst costs O(n) instead of O(n^2). Nothing here
+// allocates after construction.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+template <size_t Capacity>
+class FrameBuffer {
+    static_assert(Capacity >= 64, "Capacity must hold at least a few frames");
+
+public:
+    // Free space for the next receive. Compacts first if the tail is nearly full, so
+    // the returned span is never smaller than Capacity minus the unconsumed bytes.
+    uint8_t* write_ptr() {
+        if (begin_ > 0 && Capacity - end_ < Capacity / 4) compact();
+        return data_ + end_;
+    }
+    size_t write_space() const { return Capacity - end_; }
+
+    // Room for exactly n more bytes, compacting if the tail is shorter than that.
+    // Returns nullptr if n bytes do not fit next to the unconsumed ones.
+    uint8_t* write_ptr(size_t n) {
+        if (Capacity - end_ < n) compact();
+        return (Capacity - end_ >= n) ? data_ + end_ : nullptr;
+    }
+
+    // Marks n bytes written at write_ptr() as received.
+    void commit(size_t n) { end_ += n; }
+
+    // Unconsumed bytes, valid until the next write_ptr() call.
+    const uint8_t* data() const { return data_ + begin_; }
+    size_t size() const { return end_ - begin_; }
+    bool empty() const { return begin_ == end_; }
+
+    // Returns the next newline-terminated line (without the '\n') and consumes it.
+    // Returns false if no complete line is buffered yet.
+    bool next_line(std::string_view& line) {
+        const void* newline = memchr(data_ + begin_, '\n', end_ - begin_);
+        if (!newline) return false;
+        size_t length = (const uint8_t*)newline - (data_ + begin_);
+        line = std::string_view((const char*)data_ + begin_, length);
+        consume(length + 1);
+        return true;
+    }
+
+    void consume(size_t n) {
+        begin_ += n;
+        if (begin_ == end_) begin_ = end_ = 0;
+    }
+
+    void clear() { begin_ = end_ = 0; }
+
+    static constexpr size_t capacity() { return Capacity; }
+
+private:
+    void compact() {
+        size_t remaining = end_ - begin_;
+        memmove(data_, data_ + begin_, remaining);
+        begin_ = 0;
+        end_ = remaining;
+    }
+
+    uint8_t data_[Capacity];
+    size_t begin_ = 0;
+    size_t end_ = 0;
+};
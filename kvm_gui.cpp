@@ -1,36 +1,81 @@
 // How to compile on Windows with MinGW-w64 (g++):
-// g++ -std=c++17 kvm_gui.cpp resources.o -o Simple_KVM.exe -lws2_32 -luser32 -lgdi32 -lcomctl32 -static -s -mwindows
+// g++ -std=c++17 kvm_gui.cpp resources.o -o Simple_KVM.exe -lws2_32 -luser32 -lgdi32 -lcomctl32 -lbcrypt -static -s -mwindows
+//
+// qwave.dll (QoS/DSCP tagging), avrt.dll (MMCSS thread scheduling) and the ETW functions
+// of advapi32.dll are loaded at runtime when available, so they are not linked.
 //
 // Required libraries to link:
 // -lws2_32  : Windows Sockets API for networking.
 // -luser32  : Windows User API for GUI and input hooks.
 // -lgdi32   : Graphics Device Interface for fonts and drawing.
 // -lcomctl32: Common Controls library for modern UI elements.
-// -lshell32 : For SHGetFolderPathW to find AppData.
+// -lshell32 : For SHGetFolderPathW to find AppData, and DragQueryFileW for dropped files.
+// -lbcrypt  : CNG (BCrypt) for pairing and AES-GCM encryption of the connections.
 
 #define WIN32_LEAN_AND_MEAN
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0A00 // Windows 10 APIs (high-resolution waitable timers etc.)
+#endif
 
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <vector>
+#include <algorithm>
 #include <thread>
 #include <atomic>
 #include <mutex>
+#include <condition_variable>
+#include <deque>
 #include <fstream>      // For file I/O
 #include <filesystem>   // For creating directories
+#include <random>
+#include <memory>
+#include <array>
+#include <cmath>
 #include <winsock2.h>
 #include <ws2tcpip.h>
+#include <mstcpip.h>    // For SIO_KEEPALIVE_VALS
+#include <mswsock.h>    // For TransmitFile (looked up with WSAIoctl, so no -lmswsock)
 #include <windows.h>
+#include <bcrypt.h>     // CNG: AES-GCM, HMAC-SHA256, PBKDF2, random numbers
+#include <wincrypt.h>   // DPAPI blobs for the saved pairing key (crypt32.dll is loaded at runtime)
+#include <qos2.h>       // qWAVE types (qwave.dll is loaded at runtime)
 #include <commctrl.h>   // For modern controls like list views
 #include <shlobj.h>     // For SHGetFolderPathW
+#include <shellapi.h>   // For DragAcceptFiles / DragQueryFileW
+#include <evntprov.h>   // ETW provider types (advapi32 is loaded at runtime)
+
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002 // Missing from older MinGW headers
+#endif
+#ifndef EVENT_DATA_DESCRIPTOR_TYPE_EVENT_METADATA
+#define EVENT_DATA_DESCRIPTOR_TYPE_EVENT_METADATA 1    // Likewise
+#define EVENT_DATA_DESCRIPTOR_TYPE_PROVIDER_METADATA 2
+#endif
 #include "json.hpp"     // For JSON handling
+#include "kvm_protocol.hpp" // Wire protocol (binary frames + legacy text)
+#include "kvm_ring.hpp"   // Lock-free SPSC ring for the hook -> sender pipeline
+#include "kvm_buffer.hpp" // Fixed-capacity receive buffer for the client stream
+#include "kvm_hook.hpp"   // Modifier mask and key events built by the keyboard hook
 
 // For convenience
 using json = nlohmann::json;
 
 // --- Configuration & Control IDs ---
 const int KVM_PORT = 65432;
-const int DISCOVERY_PORT = 65433;
+const int DISCOVERY_PORT = 65433;       // Periodic server broadcasts (older clients listen here)
+const int DISCOVERY_PROBE_PORT = 65434; // Servers answer active discovery probes here
+const int CLIPBOARD_PORT = 65435;       // Clipboard channels (one extra TCP connection per client)
+const int FILE_PORT = 65436;            // File transfer channels (one more per client)
+const DWORD DISCOVERY_WINDOW_MS = 800;        // How long a scan collects replies
+const DWORD DISCOVERY_LEGACY_WINDOW_MS = 3000; // Scan length while nothing has answered a probe
+const DWORD DISCOVERY_PROBE_SCHEDULE_MS[] = { 0, 150, 400 }; // Probes are repeated in case one is lost
+const char* const DISCOVERY_MULTICAST_GROUP = "239.255.65.34"; // Organization-local scope, on the probe port
+const char* const DISCOVERY_MULTICAST_GROUPS_V6[] = { "ff02::4b56:4d22", "ff05::4b56:4d22" }; // Link- and site-local scope
+const std::string SERVER_CACHE_FILE_NAME = "kvm_servers.json"; // Servers past scans found, next to the config
+const int64_t SERVER_CACHE_MAX_AGE_S = 30 * 24 * 3600; // Entries not seen for this long are dropped
+const size_t SERVER_CACHE_MAX_ENTRIES = 32;
 const std::string DISCOVERY_MESSAGE = "KVM_SERVER_DISCOVERY_PING_CPP";
 const std::string CONFIG_FILE_NAME = "kvm_config.json";
 
@@ -43,12 +88,17 @@ const COLORREF g_clrDisabledText = RGB(128, 128, 128);
 
 // Custom Window Messages
 #define WM_APP_CLIENT_DISCONNECTED (WM_APP + 1)
-#define WM_APP_LOG_SERVER (WM_APP + 2)
-#define WM_APP_LOG_CLIENT (WM_APP + 3)
 #define WM_APP_ADD_SERVER (WM_APP + 4)
 #define WM_APP_CLIENT_CONNECTED (WM_APP + 5)
 #define WM_APP_CLIENT_RESET_UI (WM_APP + 6)
 #define WM_APP_UPDATE_HOTKEY_DISPLAY (WM_APP + 7)
+#define WM_APP_EDGE_RETURN (WM_APP + 8)
+#define WM_APP_RELEASE_CONTROL (WM_APP + 9)
+#define WM_APP_CLIENT_RESUMED (WM_APP + 10)
+#define WM_APP_CLIPBOARD_OFFER (WM_APP + 11)
+#define WM_APP_SHOW_DROP_STRIP (WM_APP + 12)
+#define WM_APP_HIDE_DROP_STRIP (WM_APP + 13)
+#define WM_APP_SETTINGS_RELOADED (WM_APP + 14)
 
 
 // Control IDs
@@ -61,35 +111,441 @@ const COLORREF g_clrDisabledText = RGB(128, 128, 128);
 #define IDC_CHANGE_HOTKEY_BTN 204
 #define IDC_HOTKEY_DISPLAY 205
 #define IDC_HOTKEY_LABEL 206
+#define IDC_SERVER_STATS 207
+#define IDC_EXPORT_STATS_BTN 208
 #define IDC_CLIENT_SCAN_BTN 301
 #define IDC_CLIENT_CONNECT_BTN 302
 #define IDC_CLIENT_DISCONNECT_BTN 303
 #define IDC_CLIENT_SERVER_LIST 304
 #define IDC_CLIENT_LOG 305
 
+// Timers
+#define IDT_STATS_TIMER 1
+#define IDT_LOG_TIMER 2
+#define IDT_DROP_STRIP_HIDE 3
+const UINT STATS_REFRESH_MS = 1000;
+const UINT LOG_DRAIN_MS = 50;
+
 // --- Global State ---
 enum class Page { START, SERVER, CLIENT };
 Page g_currentPage = Page::START;
 
-std::atomic<bool> g_is_running(true);
 std::atomic<bool> g_is_server_active(false);
 std::atomic<bool> g_is_controlling_remote(false);
-SOCKET g_client_socket = INVALID_SOCKET;
-std::mutex g_socket_mutex;
+
+// Hybrid transport: mouse motion over UDP, everything else over TCP ("network.transport")
+std::atomic<bool> g_udp_transport_enabled(false);
+const DWORD UDP_BARRIER_WAIT_MS = 5; // How long a client lets in-flight motion land before a click
+// Application heartbeat (v5, "network.heartbeat_interval_ms" / "heartbeat_timeout_ms").
+// The server announces both in its ack; a peer silent for the timeout is treated as gone.
+std::atomic<int> g_heartbeat_interval_ms(250); // 0 = no heartbeat
+std::atomic<int> g_heartbeat_timeout_ms(1000);
+const size_t CLIENT_RECEIVE_BUFFER_SIZE = 32768; // Fixed; holds a whole encrypted record. Larger frames end the session
+
+// Pairing (persisted under "security"). See the Channel Encryption section.
+std::string g_pairing_passphrase; // UTF-8; empty = no pairing, plaintext. Written only by LoadConfiguration
+bool g_pairing_key_unreadable = false; // The saved key is protected for another account or machine
+std::atomic<bool> g_pairing_enabled(false); // A key was derived from it; set by the network thread before it serves or connects
+
+// One direction of an encrypted channel: an AES-256-GCM key and the counter that
+// forms the next record's nonce.
+struct RecordCipher {
+    BCRYPT_KEY_HANDLE key = NULL;
+    uint64_t counter = 0;
+
+    RecordCipher() = default;
+    RecordCipher(const RecordCipher&) = delete;
+    RecordCipher& operator=(const RecordCipher&) = delete;
+    ~RecordCipher() { if (key != NULL) BCryptDestroyKey(key); }
+};
+
+typedef std::array<uint8_t, 32> ChannelSecret;
+
+// Keys of one paired connection. Inactive until pairing succeeds (and always without a
+// pairing key); an inactive link passes bytes through unchanged.
+struct SecureLink {
+    bool active = false;
+    RecordCipher seal;   // What we send
+    RecordCipher open;   // What we receive
+    RecordCipher motion; // Motion datagrams of the KVM connection: the server seals, the client opens
+    ChannelSecret secret = {}; // Per session; side channels derive their keys from it
+};
+
+// A SecureLink over a blocking side-channel socket, with a whole-record buffer for each
+// direction. Each buffer belongs to the one thread that sends or receives.
+struct SecureStream {
+    SecureLink link;
+    std::vector<uint8_t> send_record;
+    std::vector<uint8_t> receive_record;
+    size_t receive_pos = 0; // Plaintext in receive_record not handed out yet
+    size_t receive_end = 0;
+};
+
+// One client connected to the server. The engine thread owns the socket's receive
+// side; the fields after send_mutex are shared with the sender thread and guarded by it.
+struct ClientSession {
+    int id = 0;
+    std::string address;
+    FrameBuffer<1024> receive_buffer; // Engine thread only
+    FrameBuffer<1024> plain_buffer;   // Engine thread: decrypted records, once paired
+    bool handshake_done = false;
+    std::string pairing_hello;        // Engine thread: the hello, kept until the pairing response arrives
+    uint8_t pairing_nonces[2 * PAIRING_NONCE_SIZE] = {}; // The client's nonce, then ours
+    std::vector<std::string> side_channels_opened; // Under g_sessions_mutex: encrypted side channels may open once
+    bool reported_invalid = false;
+    uint32_t session_token = 0;       // Handed out in the ack; lets a reconnect resume this session
+    std::atomic<bool> failed{false};  // A send failed; the engine drops the client
+    ULONGLONG last_heard = 0;         // GetTickCount64 when the client last sent anything
+    ULONGLONG next_heartbeat = 0;     // 0 until the client negotiates v5
+    uint32_t heartbeat_id = 0;        // Last heartbeat sent; its ack yields a round trip
+    int64_t heartbeat_sent_qpc = 0;
+
+    std::mutex send_mutex;
+    SOCKET sock = INVALID_SOCKET;     // Non-blocking
+    int protocol = KVM_PROTOCOL_TEXT; // Until the client says hello
+    std::string send_queue;           // Bytes the kernel has not taken yet; the engine drains it
+    SOCKET udp_socket = INVALID_SOCKET; // Connected to the client's motion port
+    uint32_t udp_token = 0;
+    uint32_t udp_seq = 0;
+    bool udp_barrier_pending = false; // A datagram went out since the last TCP event
+    SecureLink secure;                // Seal side under send_mutex; open side engine thread only
+    std::vector<uint8_t> record_buffer; // One sealed record on its way out
+};
+
+const size_t MAX_CLIENTS = 8;
+const size_t MAX_CLIENT_SEND_QUEUE = 256 * 1024; // A client this far behind is dropped
+std::mutex g_sessions_mutex; // Guards the g_sessions list itself, not the sessions
+std::vector<std::shared_ptr<ClientSession>> g_sessions; // Ordered by id
+int g_next_client_id = 1;    // Engine thread only
+
+// A client whose connection dropped. If it reconnects with the token in time, it gets
+// its old id back, so hotkey order and (if it had control) control itself carry over.
+struct ParkedSession {
+    uint32_t token;
+    int id;
+    std::string address;
+    ULONGLONG expires; // GetTickCount64 deadline
+};
+const ULONGLONG SESSION_RESUME_WINDOW_MS = 30000;
+std::vector<ParkedSession> g_parked_sessions; // Engine thread only
+
+// Client reconnects ("client" in the config file)
+std::atomic<bool> g_auto_reconnect(true);
+const DWORD RECONNECT_INITIAL_DELAY_MS = 100;
+const DWORD RECONNECT_MAX_DELAY_MS = 5000;
+const ULONGLONG RECONNECT_STABLE_MS = 10000; // A link up this long resets the backoff
+const DWORD SIDE_CHANNEL_CONNECT_TIMEOUT_MS = 2000; // Clipboard and file channels
+std::string g_last_server_address;            // GUI thread only; selected by default after a scan
+uint16_t g_last_server_port = KVM_PORT;
+std::atomic<int> g_active_client_id(0); // Client the hooks forward to; 0 = local control
+int g_resume_client_id = 0; // Hook thread: had control when its link dropped; 0 once control moved since
+
+// How relative motion feels on this client ("pointer" in the config file). Applied by
+// the client's injection stage; see PointerShaper.
+struct PointerSettings {
+    double sensitivity = 1.0;
+    std::vector<std::pair<double, double>> acceleration; // (speed, gain) points by speed; empty = none
+    bool dpi_scaling = true;                  // Scale by this client's DPI over the server's
+    bool disable_system_acceleration = false; // Turn off "Enhance pointer precision" while connected
+};
+PointerSettings g_pointer_settings; // Loaded with the config; read when a connection starts
+std::mutex g_pointer_settings_mutex; // A config reload may replace g_pointer_settings at any time
+std::atomic<SOCKET> g_engine_wake_socket = INVALID_SOCKET; // Loopback UDP that interrupts WSAPoll
+sockaddr_in g_engine_wake_addr = {};
 POINT g_center_pos;
 DWORD g_main_thread_id = 0;
-std::thread g_kvm_thread;
-HWND g_hwnd; // Global handle to the main window
-std::vector<std::string> g_found_servers; // Store IPs of found servers
+HWND g_hwnd; // The main window, or the headless front-end's invisible one; owns the clipboard
+// A server found by a scan. version is -1 for servers only heard through the old
+// periodic broadcast, which carries no details.
+struct DiscoveredServer {
+    std::string address;
+    uint16_t port = KVM_PORT;
+    std::string host;
+    int version = -1;
+    int64_t last_seen = 0; // From the server cache: Unix time it last answered. 0 = heard in this scan
+};
+
+// --- Front-End Interface ---
+// The engine (capture, transport, injection) reports to whichever front-end started it
+// through these callbacks rather than to the window directly. They are called from
+// engine threads and must not block: the GUI forwards each one to its window as a
+// WM_APP_* message, the headless front-end keeps what it needs and returns. Null
+// entries are skipped. Clipboard traffic is the exception and stays a message to
+// g_hwnd in both front-ends, since it has to run on the thread that owns the clipboard.
+struct DropStripRequest;
+struct FrontEnd {
+    void (*server_found)(const DiscoveredServer& server); // Scan thread
+    void (*client_connected)();                           // Connect thread, after the first connect
+    void (*client_stopped)();                             // Connect thread, as it exits
+    void (*hotkey_changed)();                             // A hotkey capture ended (g_hotkey_* hold the result)
+    bool (*show_drop_strip)(DropStripRequest* request);   // Hook thread; takes ownership if it returns true
+    void (*hide_drop_strip)();                            // Hook thread
+    void (*settings_reloaded)();                          // Config store thread, after an edit on disk took effect
+};
+const FrontEnd* g_front_end = nullptr; // Set by WinMain before any engine thread starts
+
+enum class HeadlessMode { Off, Server, Client };
+HeadlessMode g_headless_mode = HeadlessMode::Off; // "headless.mode"; the command line overrides it
+bool g_log_to_console = false; // Headless with a parent console: log lines also go to stdout
+
+// What the command line asked for; mode starts out as "headless.mode".
+struct LaunchOptions {
+    HeadlessMode mode = HeadlessMode::Off;
+    std::string address; // Client: server to connect to; empty = the remembered one, else scan
+    uint16_t port = KVM_PORT;
+    bool stop = false;   // --stop: ask the running headless instance to exit
+};
+std::vector<DiscoveredServer> g_found_servers; // GUI thread only, in list box order
+
+// --- Thread Lifecycle ---
+// Asks one network run (the server, a scan or a client connection) and the threads it
+// started to finish. A manual-reset event, so every blocking wait in that run can wait
+// on it next to its sockets instead of polling a flag or having its socket closed.
+class StopSignal {
+public:
+    StopSignal() : event_(CreateEvent(NULL, TRUE, FALSE, NULL)) {}
+    ~StopSignal() { CloseHandle(event_); }
+    StopSignal(const StopSignal&) = delete;
+    StopSignal& operator=(const StopSignal&) = delete;
+
+    void request() const { SetEvent(event_); } // Also by threads of the run that end it on an error
+    bool requested() const { return WaitForSingleObject(event_, 0) == WAIT_OBJECT_0; }
+    HANDLE handle() const { return event_; }
+
+private:
+    HANDLE event_;
+};
+
+// The running network thread and the signal that stops it. Started and joined only by
+// the GUI thread (or the headless main thread), through start_network_thread and
+// stop_network_threads.
+struct NetworkRun {
+    StopSignal stop;
+    std::thread thread;
+};
+std::unique_ptr<NetworkRun> g_network_run;
+
+// Ties a socket to an event with WSAEventSelect for as long as it lives. The socket is
+// non-blocking meanwhile, and blocking again afterwards.
+struct SocketEvent {
+    SOCKET sock = INVALID_SOCKET;
+    WSAEVENT event = WSA_INVALID_EVENT;
+    long fired = 0;        // FD_* bits reported by the last wait_for_sockets
+    int connect_error = 0; // With FD_CONNECT: 0 on success, else the WSA error
+
+    SocketEvent() = default;
+    SocketEvent(const SocketEvent&) = delete;
+    SocketEvent& operator=(const SocketEvent&) = delete;
+    ~SocketEvent() { unwatch(); }
+
+    bool watch(SOCKET s, long network_events) {
+        if (event == WSA_INVALID_EVENT) event = WSACreateEvent();
+        sock = s;
+        return event != WSA_INVALID_EVENT && WSAEventSelect(s, event, network_events) == 0;
+    }
+
+    // Early release, for a socket closed before this goes out of scope.
+    void unwatch() {
+        if (event == WSA_INVALID_EVENT) return;
+        WSAEventSelect(sock, NULL, 0);
+        u_long blocking = 0;
+        ioctlsocket(sock, FIONBIO, &blocking);
+        WSACloseEvent(event);
+        event = WSA_INVALID_EVENT;
+    }
+};
+
+enum class WaitResult { Ready, Timeout, Stopped };
+
+// An IPv4 or IPv6 address and port, in the form the sockets API takes. For accept,
+// recvfrom and getpeername, pass get() with length set to sizeof(storage).
+struct SocketAddress {
+    sockaddr_storage storage = {};
+    int length = 0;
 
-// Sockets that need to be closed by the main thread to unblock background threads
-std::atomic<SOCKET> g_listen_socket = INVALID_SOCKET;
-std::atomic<SOCKET> g_discovery_socket = INVALID_SOCKET;
-std::atomic<SOCKET> g_connect_socket = INVALID_SOCKET;
+    SOCKADDR* get() { return (SOCKADDR*)&storage; }
+    const SOCKADDR* get() const { return (const SOCKADDR*)&storage; }
+    int family() const { return storage.ss_family; }
+    uint16_t port() const {
+        return ntohs(family() == AF_INET6 ? ((const sockaddr_in6*)&storage)->sin6_port : ((const sockaddr_in*)&storage)->sin_port);
+    }
+    void set_port(uint16_t port) {
+        if (family() == AF_INET6) ((sockaddr_in6*)&storage)->sin6_port = htons(port);
+        else ((sockaddr_in*)&storage)->sin_port = htons(port);
+    }
+};
 
-// Input Hooks
+// Input Hooks. Installed by, and only touched from, the hook thread.
 HHOOK g_keyboard_hook = NULL;
 HHOOK g_mouse_hook = NULL;
+std::thread g_hook_thread;
+std::atomic<DWORD> g_hook_thread_id(0); // 0 while no hook thread runs
+
+// Modifier keys currently held (ModifierBit), tracked from the keyboard hook's own
+// event stream so the hotkey check needs no GetAsyncKeyState calls. Hook thread only.
+uint8_t g_hook_modifiers = 0;
+// Keys held on this machine's keyboard, and the keys whose last press the hook let
+// through to this machine. Keys in the second but not the first are stuck down here
+// because their release went to a client. Hook thread only.
+KeySet g_keys_held;
+KeySet g_keys_local;
+// g_keys_held as of the last queued KeySync, for the sender to encode.
+std::mutex g_key_sync_mutex;
+KeySet g_key_sync;
+
+// Time spent inside the hook procs (written by the hook thread, reported on release)
+std::atomic<uint64_t> g_hook_calls(0);
+std::atomic<int64_t> g_hook_ticks(0);
+std::atomic<int64_t> g_hook_max_ticks(0);
+
+// Server event pipeline. The hook procs (producer) only push into the ring; the
+// sender thread (consumer) drains it and writes to the client under control, so a
+// slow or stalled network never blocks a low-level hook.
+const size_t EVENT_RING_CAPACITY = 4096;
+SpscRing<InputEvent, EVENT_RING_CAPACITY> g_event_ring;
+HANDLE g_sender_wake_event = NULL;
+std::atomic<uint64_t> g_ring_overflows(0);  // Events dropped because the ring was full
+std::atomic<size_t> g_ring_peak_depth(0);   // Highest depth seen by the sender
+std::atomic<uint64_t> g_events_coalesced(0); // Mouse moves merged into a previous move
+std::atomic<uint64_t> g_non_move_events_queued(0); // Lets a holding sender notice urgent events
+std::atomic<uint64_t> g_non_wheel_events_queued(0); // Likewise while it holds a wheel delta
+
+// Raw input mouse capture ("capture.mouse" = "raw_input"). While a client is under
+// control, relative motion is read from WM_INPUT on its own thread and pushed into a
+// second ring (that thread is its only producer); the cursor is clipped in place
+// instead of being warped back after every move. Buttons and the wheel stay on the hook.
+// The sender merges both rings by capture timestamp.
+SpscRing<InputEvent, EVENT_RING_CAPACITY> g_raw_motion_ring;
+std::atomic<bool> g_raw_mouse_capture(false); // Configured mode, applied on the next hook install
+std::atomic<bool> g_raw_input_active(false);  // The raw input thread is registered and running
+std::thread g_raw_input_thread;
+DWORD g_raw_input_thread_id = 0;
+int64_t g_last_clip_check = 0; // Hook thread: when the mouse hook last verified the clip
+
+// Throughput counters for the live stats readout (sender thread writes, GUI reads)
+std::atomic<uint64_t> g_stat_events_sent(0);
+std::atomic<uint64_t> g_stat_bytes_sent(0);
+std::atomic<uint64_t> g_stat_records_sealed(0); // Encrypted records and datagrams (any thread)
+std::atomic<uint64_t> g_stat_seal_ticks(0);     // QPC ticks spent sealing them
+// Running totals published to ETW (see the Tracing section); never reset.
+std::atomic<uint64_t> g_stat_events_captured(0); // Pushed to the sender by the hooks and raw input
+std::atomic<uint64_t> g_stat_send_errors(0);     // Client sends that failed, or clients that fell behind
+std::atomic<uint64_t> g_stat_hook_calls(0);
+std::atomic<uint64_t> g_stat_hook_ticks(0);      // QPC ticks spent in the hook procs
+std::atomic<uint64_t> g_stat_events_injected(0); // Client: inputs passed to SendInput
+std::atomic<uint64_t> g_stat_reconnects(0);      // Client: links re-established after a drop
+const int64_t LATENCY_PROBE_INTERVAL_MS = 100; // At most one probe per interval, only while events flow
+
+// What the sender thread is doing, so the hooks know when a SetEvent is needed.
+enum SenderState { SENDER_RUNNING = 0, SENDER_PARKED = 1, SENDER_HOLDING_MOVES = 2, SENDER_HOLDING_WHEEL = 3 };
+std::atomic<int> g_sender_state(SENDER_RUNNING);
+
+// Sender batching configuration (persisted under "sender" in the config file)
+std::atomic<bool> g_coalesce_moves(true);
+std::atomic<int> g_move_flush_interval_us(1000); // Min spacing between move frames; 0 = never hold
+std::atomic<int> g_wheel_flush_interval_us(4000); // Likewise for wheel frames of each axis
+
+int64_t g_qpc_frequency = 1;
+
+// Socket options applied to the KVM connection on both ends (persisted under "network").
+// Written only by LoadConfiguration before any network thread starts.
+struct SocketTuning {
+    bool tcp_nodelay = true;         // Disable Nagle so small input frames go out immediately
+    int send_buffer_bytes = 0;       // SO_SNDBUF; 0 = OS default
+    int receive_buffer_bytes = 0;    // SO_RCVBUF; 0 = OS default
+    bool keepalive = true;
+    int keepalive_time_ms = 2000;    // Idle time before the first probe
+    int keepalive_interval_ms = 500; // Time between unanswered probes
+    std::string qos_traffic_type = "none"; // none, best_effort, background, excellent_effort, audio_video, voice, control
+    int dscp = -1;                   // Explicit DSCP value (0-63, needs admin); -1 = traffic type default
+};
+SocketTuning g_socket_tuning;
+
+// Discovery (persisted under "discovery"). Written only by LoadConfiguration.
+bool g_discovery_multicast = true;    // Probe and answer on DISCOVERY_MULTICAST_GROUP
+int g_discovery_multicast_ttl = 4;    // Router hops a probe may cross where multicast is routed
+bool g_discovery_announce = true;     // Server: the periodic broadcast older clients listen for
+
+// Screen-edge switching (persisted under "layout"). Written only by LoadConfiguration.
+struct LayoutLink {
+    std::string client;  // Client IP address
+    uint8_t edge;        // Server screen edge the client sits beyond
+    int monitor = -1;    // Index in EnumDisplayMonitors order; -1 = every monitor
+};
+bool g_edge_switching = false;
+std::vector<LayoutLink> g_layout_links;
+
+// Logging (persisted under "logging"). Written only by LoadConfiguration.
+enum class LogLevel : uint8_t { Debug, Info, Warning, Error };
+LogLevel g_log_min_level = LogLevel::Info;
+int g_log_rate_limit = 200;  // Messages per second per log; the rest are counted and summarized
+bool g_log_to_file = false;  // Also append every message to kvm_log.txt next to the config
+
+// Clipboard sharing (persisted under "clipboard"). See the Clipboard Sharing section.
+std::atomic<bool> g_clipboard_enabled(true);
+std::atomic<bool> g_clipboard_compress(true); // XPRESS (Windows Compression API) for larger contents
+
+// File transfer (persisted under "files"). See the File Transfer section.
+std::atomic<bool> g_file_transfer_enabled(true);
+std::atomic<int> g_file_max_mbps(200);  // Send pacing in megabits per second; 0 = unpaced
+std::string g_file_receive_folder;      // UTF-8; empty = Downloads\Simple KVM. Written only by LoadConfiguration
+std::atomic<int> g_file_max_megabytes(16384); // Largest file accepted; 0 = any size that fits on the disk
+
+// Contents being sent in answer to one request. The writer cuts the next
+// CLIPBOARD_CHUNK_SIZE message off body only when the socket takes it, so a 64 MB
+// paste is never copied out into a queue of chunks.
+struct ClipboardReply {
+    uint32_t request_id = 0;
+    std::string begin; // The DataBegin message, sent first
+    std::string body;  // Encoded contents
+    size_t sent = 0;   // Bytes of body already sent
+};
+
+// The other end of one clipboard connection. A reader thread handles incoming
+// messages (and serves requests); a writer thread drains the outbox, so nobody else
+// ever blocks on the socket.
+struct ClipboardPeer {
+    int client_id = 0; // Server: the session this channel belongs to. Client: 0 (the server)
+    SOCKET sock = INVALID_SOCKET;
+    SecureStream stream; // Reader and writer each use their own half
+    void (*log)(const std::string&) = nullptr;
+    std::thread reader;
+    std::thread writer;
+
+    std::mutex outbox_mutex; // Guards outbox, replies and closed
+    std::condition_variable outbox_ready;
+    std::deque<std::string> outbox;
+    std::deque<ClipboardReply> replies; // Streamed in order, between outbox messages
+    bool closed = false;
+
+    std::mutex fetch_serial; // Held for a whole fetch; one at a time per peer
+    std::mutex fetch_mutex;  // Guards the fields below, filled in by the reader
+    std::condition_variable fetch_progress;
+    uint32_t fetch_id = 0;   // Request being answered; 0 = none
+    uint8_t fetch_codec = CLIPBOARD_CODEC_NONE;
+    uint32_t fetch_original_size = 0;
+    uint32_t fetch_encoded_size = 0;
+    bool fetch_started = false;
+    bool fetch_refused = false; // The peer answered DataError
+    bool fetch_aborted = false; // The channel closed; stays set
+    std::string fetch_data;
+};
+
+// A format list received from a peer, posted to the GUI as WM_APP_CLIPBOARD_OFFER.
+struct ClipboardOffer {
+    std::shared_ptr<ClipboardPeer> peer;
+    std::vector<uint32_t> formats;
+};
+
+const UINT CLIPBOARD_FORMATS[] = { CF_UNICODETEXT, CF_DIB }; // Text and images
+std::mutex g_clipboard_mutex; // Guards the three below
+std::vector<std::shared_ptr<ClipboardPeer>> g_clipboard_peers;
+std::shared_ptr<ClipboardPeer> g_clipboard_source; // Whose formats our clipboard holds; null = a local copy
+std::vector<uint32_t> g_clipboard_formats;          // What our clipboard offers right now
+uint32_t g_next_clipboard_request = 1;
+bool g_replacing_clipboard = false; // GUI thread: our own EmptyClipboard is running
+std::atomic<SOCKET> g_clipboard_listen_socket = INVALID_SOCKET;
+std::atomic<SOCKET> g_file_listen_socket = INVALID_SOCKET;
 
 // Hotkey Configuration
 std::atomic<int> g_hotkey_vk('Z');
@@ -101,15 +557,24 @@ std::atomic<bool> g_is_waiting_for_hotkey(false);
 // GUI Handles
 HWND g_hStartServerBtn, g_hStartClientBtn;
 HWND g_hBackBtn, g_hServerStartBtn, g_hServerStopBtn, g_hServerLog, g_hChangeHotkeyBtn, g_hHotkeyDisplay, g_hHotkeyLabel;
+HWND g_hServerStats, g_hExportStatsBtn;
 HWND g_hClientScanBtn, g_hClientConnectBtn, g_hClientDisconnectBtn, g_hClientServerList, g_hClientLog;
 HBRUSH g_hbrBackground = NULL;
 HBRUSH g_hbrControlBG = NULL;
 
 // --- Function Prototypes ---
-void run_server_logic();
-void run_client_scan_logic();
-void run_client_connect_logic(std::string server_ip);
+void run_server_logic(const StopSignal& stop);
+void run_client_scan_logic(const StopSignal& stop);
+void run_client_connect_logic(const StopSignal& stop, std::string server_ip, uint16_t port);
+template <typename Fn, typename... Args> void start_network_thread(Fn fn, Args... args);
 void stop_network_threads();
+WaitResult wait_for_sockets(const StopSignal& stop, SocketEvent* const* sockets, size_t socket_count, DWORD timeout_ms);
+WaitResult wait_for_sockets(const StopSignal& stop, std::initializer_list<SocketEvent*> sockets, DWORD timeout_ms);
+bool connect_or_stop(const StopSignal& stop, SOCKET sock, const SocketAddress& addr, DWORD timeout_ms = INFINITE);
+bool parse_socket_address(const std::string& text, uint16_t port, SocketAddress& address);
+std::string format_socket_address(const SocketAddress& address);
+bool same_host(const SocketAddress& a, const SocketAddress& b);
+SOCKET open_tcp_listener(uint16_t port);
 void stop_kvm_logic();
 void InstallHooks();
 void UninstallHooks();
@@ -117,16 +582,88 @@ std::string GetHotkeyString();
 void SaveConfiguration();
 void LoadConfiguration();
 
-void handle_client_connection(SOCKET client_socket);
 LRESULT CALLBACK low_level_keyboard_proc(int nCode, WPARAM wParam, LPARAM lParam);
 LRESULT CALLBACK low_level_mouse_proc(int nCode, WPARAM wParam, LPARAM lParam);
-void send_data(const std::string& data);
-void release_all_server_modifiers();
-void release_all_client_modifiers();
+void queue_event(const InputEvent& ev);
+void run_event_sender(const StopSignal& stop);
+bool send_to_client(ClientSession& session, const char* data, size_t len);
+std::shared_ptr<ClientSession> find_session(int client_id);
+void wake_server_engine();
+void run_discovery_responder(const StopSignal& stop);
+void accept_client(SOCKET listen_socket);
+void remove_client(const std::shared_ptr<ClientSession>& session, bool park = true);
+bool read_from_client(ClientSession& session);
+bool flush_client_queue(ClientSession& session);
+int service_heartbeats(const std::vector<std::shared_ptr<ClientSession>>& sessions);
+void release_stuck_server_keys();
+void report_hook_cost();
+void rebuild_edge_zones();
+void return_control_from_edge(int client_id, uint16_t position);
+void start_raw_input_capture();
+bool post_to_hook_thread(UINT message, WPARAM wParam, LPARAM lParam);
+void switch_control(const std::shared_ptr<ClientSession>& next, const InputEvent* enter);
+HANDLE raise_input_thread_priority(const char* thread_name, void (*log)(const std::string&));
+void restore_input_thread_priority(HANDLE mmcss_task);
+void stop_raw_input_capture();
+void update_pointer_clip();
+void resync_held_keys();
+bool resume_parked_session(ClientSession& session, uint32_t token);
+void close_clipboard_peers_of(int client_id);
+void prune_clipboard_peers(bool close_all);
+SOCKET open_side_channel_listener(int port, const char* feature);
+void run_clipboard_listener(const StopSignal& stop);
+void open_clipboard_channel(const StopSignal& stop, const SocketAddress& server_addr, uint16_t port, uint32_t session_token, const ChannelSecret* secret);
+void advertise_local_clipboard();
+void accept_clipboard_offer(const ClipboardOffer& offer);
+bool render_clipboard_format(UINT format);
+void render_all_clipboard_formats();
+void forget_clipboard_offer();
+struct DropStripRequest;
+struct EdgeZone;
+void close_file_channels_of(int client_id);
+void prune_file_channels(bool close_all);
+void run_file_listener(const StopSignal& stop);
+void open_file_channel(const StopSignal& stop, const SocketAddress& server_addr, uint16_t port, uint32_t session_token, const ChannelSecret* secret);
+void show_drop_strip(const EdgeZone& zone);
+void place_drop_strip(DropStripRequest* request);
+void hide_drop_strip();
+void send_dropped_files(HDROP drop);
+bool parse_launch_options(const char* command_line, LaunchOptions& options);
+int show_usage();
+int stop_headless_instance();
+int run_headless(const LaunchOptions& options);
+extern const FrontEnd HEADLESS_FRONT_END;
+bool load_pairing_key(void (*log)(const std::string&));
+UINT query_system_dpi();
 
 void LogServerMessage(const std::string& msg);
 void LogClientMessage(const std::string& msg);
-void AddServerToList(const std::string& server_ip);
+void LogServerMessage(LogLevel level, const std::string& msg);
+void LogClientMessage(LogLevel level, const std::string& msg);
+void drain_log_ring();
+void start_log_file_writer();
+void stop_log_file_writer();
+void start_config_store();
+void stop_config_store();
+void start_tracing();
+void stop_tracing();
+void apply_socket_tuning(SOCKET sock, void (*log)(const std::string&));
+std::string apply_socket_qos(SOCKET sock, const SocketTuning& tuning);
+void close_tuned_socket(SOCKET sock);
+void close_qos_handle();
+int64_t qpc_now();
+uint32_t register_latency_probe(int64_t hook_qpc, int64_t sent_qpc);
+void record_latency_echo(uint32_t probe_id, uint32_t client_us);
+void record_heartbeat_rtt(uint32_t rtt_us);
+void reset_latency_stats();
+std::string update_live_stats();
+std::string format_inject_histogram();
+void export_latency_csv();
+void AddServerToList(const DiscoveredServer& server);
+void AddServerToListBox(const DiscoveredServer& server);
+std::vector<DiscoveredServer> load_server_cache();
+int64_t unix_time_now();
+std::vector<in_addr> get_broadcast_addresses(SOCKET sock);
 
 void ResizeControls(int width, int height);
 
@@ -141,19 +678,63 @@ void ShowClientPage();
 void DrawCustomButton(LPDRAWITEMSTRUCT lpDrawItem);
 LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam);
 
+// The GUI front-end: every engine event becomes a message to the main window.
+void gui_server_found(const DiscoveredServer& server) {
+    if (g_hwnd != NULL) PostMessage(g_hwnd, WM_APP_ADD_SERVER, (WPARAM)new DiscoveredServer(server), 0);
+}
+void gui_client_connected() { PostMessage(g_hwnd, WM_APP_CLIENT_CONNECTED, 0, 0); }
+void gui_client_stopped() { PostMessage(g_hwnd, WM_APP_CLIENT_RESET_UI, 0, 0); }
+void gui_hotkey_changed() { PostMessage(g_hwnd, WM_APP_UPDATE_HOTKEY_DISPLAY, 0, 0); }
+bool gui_show_drop_strip(DropStripRequest* request) { return PostMessage(g_hwnd, WM_APP_SHOW_DROP_STRIP, (WPARAM)request, 0) != FALSE; }
+void gui_hide_drop_strip() { PostMessage(g_hwnd, WM_APP_HIDE_DROP_STRIP, 0, 0); }
+void gui_settings_reloaded() { PostMessage(g_hwnd, WM_APP_SETTINGS_RELOADED, 0, 0); }
+
+const FrontEnd GUI_FRONT_END = {
+    gui_server_found, gui_client_connected, gui_client_stopped,
+    gui_hotkey_changed, gui_show_drop_strip, gui_hide_drop_strip,
+    gui_settings_reloaded
+};
+
 int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine, int nCmdShow) {
     g_main_thread_id = GetCurrentThreadId();
 
+    LARGE_INTEGER qpc_frequency;
+    QueryPerformanceFrequency(&qpc_frequency);
+    g_qpc_frequency = qpc_frequency.QuadPart;
+
     // Load settings from config file before doing anything else
     LoadConfiguration();
+    LaunchOptions options;
+    if (!parse_launch_options(lpCmdLine, options)) return show_usage();
+    if (options.stop) return stop_headless_instance();
+    bool headless = options.mode != HeadlessMode::Off;
+    if (headless) g_log_to_file = true; // Nobody watches a window, so the file is the log
+    g_front_end = headless ? &HEADLESS_FRONT_END : &GUI_FRONT_END;
+    start_log_file_writer();
+    start_config_store();
+    start_tracing();
 
     // Initialize Winsock
     WSADATA wsaData;
     if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
-        MessageBox(NULL, "WSAStartup failed!", "Error", MB_OK | MB_ICONERROR);
+        if (!headless) MessageBox(NULL, "WSAStartup failed!", "Error", MB_OK | MB_ICONERROR);
         return 1;
     }
 
+    // Auto-reset event used by the hook procs to wake the sender thread
+    g_sender_wake_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+
+    if (headless) {
+        int exit_code = run_headless(options);
+        stop_tracing();
+        stop_config_store();
+        stop_log_file_writer();
+        close_qos_handle();
+        WSACleanup();
+        CloseHandle(g_sender_wake_event);
+        return exit_code;
+    }
+
     // Create brushes for the dark theme
     g_hbrBackground = CreateSolidBrush(g_clrBackground);
     g_hbrControlBG = CreateSolidBrush(g_clrControlBG);
@@ -189,9 +770,13 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
     }
     
     // Global shutdown sequence
-    g_is_running = false;
     stop_kvm_logic(); // Ensure all threads and sockets are cleaned up
+    stop_tracing();
+    stop_config_store(); // Writes out a save still waiting for its delay
+    stop_log_file_writer();
+    close_qos_handle();
     WSACleanup();
+    CloseHandle(g_sender_wake_event);
     
     // Clean up theme resources
     DeleteObject(g_hbrBackground);
@@ -205,6 +790,18 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
             CreateMainGUIControls(hWnd);
             SetWindowText(g_hHotkeyDisplay, GetHotkeyString().c_str());
             ShowStartPage();
+            SetTimer(hWnd, IDT_STATS_TIMER, STATS_REFRESH_MS, NULL);
+            SetTimer(hWnd, IDT_LOG_TIMER, LOG_DRAIN_MS, NULL);
+            AddClipboardFormatListener(hWnd);
+            DragAcceptFiles(hWnd, TRUE);
+            break;
+
+        case WM_TIMER:
+            if (wParam == IDT_STATS_TIMER) {
+                SetWindowText(g_hServerStats, update_live_stats().c_str());
+            } else if (wParam == IDT_LOG_TIMER) {
+                drain_log_ring();
+            }
             break;
 
         case WM_GETMINMAXINFO: {
@@ -260,6 +857,7 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
                     break;
                 case IDC_START_CLIENT_BTN:
                     ShowClientPage();
+                    SendMessage(hWnd, WM_COMMAND, IDC_CLIENT_SCAN_BTN, 0); // A scan takes under a second
                     break;
                 case IDC_BACK_BTN:
                     g_is_server_active = false;
@@ -270,8 +868,9 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
                     EnableWindow(g_hServerStartBtn, FALSE);
                     EnableWindow(g_hServerStopBtn, TRUE);
                     g_is_server_active = true;
-                    stop_network_threads(); 
-                    g_kvm_thread = std::thread(run_server_logic);
+                    stop_network_threads();
+                    reset_latency_stats();
+                    start_network_thread(run_server_logic);
                     break;
                 case IDC_SERVER_STOP_BTN:
                     EnableWindow(g_hServerStartBtn, TRUE);
@@ -280,6 +879,9 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
                     stop_network_threads();
                     LogServerMessage("Server stopped by user.");
                     break;
+                case IDC_EXPORT_STATS_BTN:
+                    export_latency_csv();
+                    break;
                 case IDC_CHANGE_HOTKEY_BTN:
                     g_is_waiting_for_hotkey = true;
                     EnableWindow(g_hChangeHotkeyBtn, FALSE);
@@ -290,16 +892,18 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
                 case IDC_CLIENT_SCAN_BTN:
                     SendMessage(g_hClientServerList, LB_RESETCONTENT, 0, 0);
                     g_found_servers.clear();
-                    stop_network_threads();
-                    g_kvm_thread = std::thread(run_client_scan_logic);
+                    for (const DiscoveredServer& cached : load_server_cache()) AddServerToListBox(cached); // The scan confirms them
+                    start_network_thread(run_client_scan_logic);
                     break;
                 case IDC_CLIENT_CONNECT_BTN: {
                     int selected_index = SendMessage(g_hClientServerList, LB_GETCURSEL, 0, 0);
                     if (selected_index != LB_ERR) {
-                        if (selected_index < g_found_servers.size()) {
-                            std::string server_ip = g_found_servers[selected_index];
-                            stop_network_threads();
-                            g_kvm_thread = std::thread(run_client_connect_logic, server_ip);
+                        if (selected_index < (int)g_found_servers.size()) {
+                            DiscoveredServer server = g_found_servers[selected_index];
+                            g_last_server_address = server.address;
+                            g_last_server_port = server.port;
+                            SaveConfiguration();
+                            start_network_thread(run_client_connect_logic, server.address, server.port);
                         }
                     } else {
                         LogClientMessage("Please select a server from the list first.");
@@ -315,30 +919,10 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
             break;
         }
 
-        case WM_APP_LOG_SERVER: {
-            char* msg_str = (char*)wParam;
-            int len = GetWindowTextLength(g_hServerLog);
-            SendMessage(g_hServerLog, EM_SETSEL, (WPARAM)len, (LPARAM)len);
-            SendMessage(g_hServerLog, EM_REPLACESEL, 0, (LPARAM)msg_str);
-            delete[] msg_str;
-            break;
-        }
-        
-        case WM_APP_LOG_CLIENT: {
-            char* msg_str = (char*)wParam;
-            int len = GetWindowTextLength(g_hClientLog);
-            SendMessage(g_hClientLog, EM_SETSEL, (WPARAM)len, (LPARAM)len);
-            SendMessage(g_hClientLog, EM_REPLACESEL, 0, (LPARAM)msg_str);
-            delete[] msg_str;
-            break;
-        }
-
         case WM_APP_ADD_SERVER: {
-            char* ip_str = (char*)wParam;
-            g_found_servers.push_back(ip_str);
-            std::string display_str = "Server at " + std::string(ip_str);
-            SendMessage(g_hClientServerList, LB_ADDSTRING, 0, (LPARAM)display_str.c_str());
-            delete[] ip_str;
+            DiscoveredServer* server = (DiscoveredServer*)wParam;
+            AddServerToListBox(*server);
+            delete server;
             break;
         }
         
@@ -356,10 +940,8 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
              break;
 
         case WM_APP_UPDATE_HOTKEY_DISPLAY: {
-            char* hotkey_str_c = (char*)wParam;
-            SetWindowText(g_hHotkeyDisplay, hotkey_str_c);
-            delete[] hotkey_str_c;
-            
+            SetWindowText(g_hHotkeyDisplay, GetHotkeyString().c_str());
+
             EnableWindow(g_hChangeHotkeyBtn, TRUE);
             if (g_is_server_active) {
                 EnableWindow(g_hServerStartBtn, FALSE);
@@ -373,20 +955,53 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
             break;
         }
 
-        case WM_APP_CLIENT_DISCONNECTED: {
-            std::lock_guard<std::mutex> lock(g_socket_mutex);
-            if (g_client_socket == (SOCKET)wParam) {
-                 g_client_socket = INVALID_SOCKET;
-                 if (g_is_controlling_remote) {
-                     g_is_controlling_remote = false;
-                     LogServerMessage("--- AUTOMATICALLY SWITCHED TO LOCAL CONTROL (Client D/C) ---");
-                     release_all_server_modifiers();
-                 }
-            }
+        case WM_APP_SETTINGS_RELOADED:
+            if (!g_is_waiting_for_hotkey) SetWindowText(g_hHotkeyDisplay, GetHotkeyString().c_str());
+            break;
+
+        case WM_DISPLAYCHANGE:
+            post_to_hook_thread(WM_DISPLAYCHANGE, 0, 0); // Edge zones belong to the hook thread
+            break;
+
+        case WM_CLIPBOARDUPDATE:
+            advertise_local_clipboard();
+            break;
+
+        case WM_APP_CLIPBOARD_OFFER: {
+            ClipboardOffer* offer = (ClipboardOffer*)wParam;
+            accept_clipboard_offer(*offer);
+            delete offer;
             break;
         }
 
+        case WM_RENDERFORMAT:
+            render_clipboard_format((UINT)wParam);
+            break;
+
+        case WM_RENDERALLFORMATS:
+            render_all_clipboard_formats();
+            break;
+
+        case WM_DESTROYCLIPBOARD:
+            forget_clipboard_offer();
+            break;
+
+        case WM_DROPFILES:
+            send_dropped_files((HDROP)wParam);
+            break;
+
+        case WM_APP_SHOW_DROP_STRIP:
+            place_drop_strip((DropStripRequest*)wParam);
+            break;
+
+        case WM_APP_HIDE_DROP_STRIP:
+            hide_drop_strip();
+            break;
+
         case WM_DESTROY:
+            RemoveClipboardFormatListener(hWnd);
+            KillTimer(hWnd, IDT_STATS_TIMER);
+            KillTimer(hWnd, IDT_LOG_TIMER);
             PostQuitMessage(0);
             break;
 
@@ -427,6 +1042,11 @@ void CreateMainGUIControls(HWND hWnd) {
     g_hChangeHotkeyBtn = CreateWindow("BUTTON", "Change", WS_TABSTOP | WS_CHILD | BS_OWNERDRAW,
         0, 0, 0, 0, hWnd, (HMENU)IDC_CHANGE_HOTKEY_BTN, NULL, NULL);
 
+    g_hServerStats = CreateWindow("STATIC", "Latency: n/a", WS_CHILD | SS_LEFT | WS_BORDER,
+        0, 0, 0, 0, hWnd, (HMENU)IDC_SERVER_STATS, NULL, NULL);
+    g_hExportStatsBtn = CreateWindow("BUTTON", "Export CSV", WS_TABSTOP | WS_CHILD | BS_OWNERDRAW,
+        0, 0, 0, 0, hWnd, (HMENU)IDC_EXPORT_STATS_BTN, NULL, NULL);
+
     g_hServerLog = CreateWindowEx(WS_EX_CLIENTEDGE, "EDIT", "", WS_CHILD | WS_VSCROLL | ES_MULTILINE | ES_READONLY,
         0, 0, 0, 0, hWnd, (HMENU)IDC_SERVER_LOG, NULL, NULL);
 
@@ -436,6 +1056,8 @@ void CreateMainGUIControls(HWND hWnd) {
     SendMessage(g_hHotkeyLabel, WM_SETFONT, (WPARAM)hFont, TRUE);
     SendMessage(g_hHotkeyDisplay, WM_SETFONT, (WPARAM)hFont, TRUE);
     SendMessage(g_hChangeHotkeyBtn, WM_SETFONT, (WPARAM)hFont, TRUE);
+    SendMessage(g_hServerStats, WM_SETFONT, (WPARAM)hFont, TRUE);
+    SendMessage(g_hExportStatsBtn, WM_SETFONT, (WPARAM)hFont, TRUE);
 
     EnableWindow(g_hServerStopBtn, FALSE);
 
@@ -514,6 +1136,7 @@ void ShowStartPage() {
     ShowWindow(g_hBackBtn, SW_HIDE);
     ShowWindow(g_hServerStartBtn, SW_HIDE); ShowWindow(g_hServerStopBtn, SW_HIDE); ShowWindow(g_hServerLog, SW_HIDE);
     ShowWindow(g_hChangeHotkeyBtn, SW_HIDE); ShowWindow(g_hHotkeyDisplay, SW_HIDE); ShowWindow(g_hHotkeyLabel, SW_HIDE);
+    ShowWindow(g_hServerStats, SW_HIDE); ShowWindow(g_hExportStatsBtn, SW_HIDE);
     ShowWindow(g_hClientScanBtn, SW_HIDE); ShowWindow(g_hClientServerList, SW_HIDE); ShowWindow(g_hClientConnectBtn, SW_HIDE); ShowWindow(g_hClientDisconnectBtn, SW_HIDE); ShowWindow(g_hClientLog, SW_HIDE);
     
     RECT rc; GetClientRect(g_hwnd, &rc); ResizeControls(rc.right - rc.left, rc.bottom - rc.top);
@@ -525,17 +1148,59 @@ void ShowServerPage() {
     ShowWindow(g_hBackBtn, SW_SHOW);
     ShowWindow(g_hServerStartBtn, SW_SHOW); ShowWindow(g_hServerStopBtn, SW_SHOW); ShowWindow(g_hServerLog, SW_SHOW);
     ShowWindow(g_hChangeHotkeyBtn, SW_SHOW); ShowWindow(g_hHotkeyDisplay, SW_SHOW); ShowWindow(g_hHotkeyLabel, SW_SHOW);
+    ShowWindow(g_hServerStats, SW_SHOW); ShowWindow(g_hExportStatsBtn, SW_SHOW);
     ShowWindow(g_hClientScanBtn, SW_HIDE); ShowWindow(g_hClientServerList, SW_HIDE); ShowWindow(g_hClientConnectBtn, SW_HIDE); ShowWindow(g_hClientDisconnectBtn, SW_HIDE); ShowWindow(g_hClientLog, SW_HIDE);
 
     RECT rc; GetClientRect(g_hwnd, &rc); ResizeControls(rc.right - rc.left, rc.bottom - rc.top);
 }
 
+std::string describe_server(const DiscoveredServer& server) {
+    std::string text = "Server at " + server.address;
+    if (server.version >= 0) {
+        bool ipv6 = server.address.find(':') != std::string::npos;
+        if (server.port == KVM_PORT) text = server.host + " (" + server.address;
+        else if (ipv6) text = server.host + " ([" + server.address + "]:" + std::to_string(server.port);
+        else text = server.host + " (" + server.address + ":" + std::to_string(server.port);
+        text += ", protocol v" + std::to_string(server.version) + ")";
+    }
+    if (server.last_seen != 0) {
+        int64_t minutes = (std::max)((int64_t)0, unix_time_now() - server.last_seen) / 60;
+        if (minutes < 60) text += " - seen " + std::to_string(minutes) + " min ago";
+        else if (minutes < 48 * 60) text += " - seen " + std::to_string(minutes / 60) + " h ago";
+        else text += " - seen " + std::to_string(minutes / (24 * 60)) + " days ago";
+    }
+    return text;
+}
+
+// Lists a server once. A scan reply for a server listed from the cache replaces its
+// entry in place, so the selection stays where it was.
+void AddServerToListBox(const DiscoveredServer& server) {
+    auto known = std::find_if(g_found_servers.begin(), g_found_servers.end(),
+                              [&](const DiscoveredServer& found) { return found.address == server.address; });
+    if (known != g_found_servers.end()) {
+        if (known->last_seen == 0 || server.last_seen != 0) return;
+        int index = (int)(known - g_found_servers.begin());
+        bool selected = SendMessage(g_hClientServerList, LB_GETCURSEL, 0, 0) == index;
+        *known = server;
+        SendMessage(g_hClientServerList, LB_DELETESTRING, (WPARAM)index, 0);
+        SendMessage(g_hClientServerList, LB_INSERTSTRING, (WPARAM)index, (LPARAM)describe_server(server).c_str());
+        if (selected) SendMessage(g_hClientServerList, LB_SETCURSEL, (WPARAM)index, 0);
+        return;
+    }
+    g_found_servers.push_back(server);
+    SendMessage(g_hClientServerList, LB_ADDSTRING, 0, (LPARAM)describe_server(server).c_str());
+    if (g_found_servers.size() == 1 || server.address == g_last_server_address) {
+        SendMessage(g_hClientServerList, LB_SETCURSEL, (WPARAM)(g_found_servers.size() - 1), 0);
+    }
+}
+
 void ShowClientPage() {
     g_currentPage = Page::CLIENT;
     ShowWindow(g_hStartServerBtn, SW_HIDE); ShowWindow(g_hStartClientBtn, SW_HIDE);
     ShowWindow(g_hBackBtn, SW_SHOW);
     ShowWindow(g_hServerStartBtn, SW_HIDE); ShowWindow(g_hServerStopBtn, SW_HIDE); ShowWindow(g_hServerLog, SW_HIDE);
     ShowWindow(g_hChangeHotkeyBtn, SW_HIDE); ShowWindow(g_hHotkeyDisplay, SW_HIDE); ShowWindow(g_hHotkeyLabel, SW_HIDE);
+    ShowWindow(g_hServerStats, SW_SHOW); ShowWindow(g_hExportStatsBtn, SW_HIDE);
     ShowWindow(g_hClientScanBtn, SW_SHOW); ShowWindow(g_hClientServerList, SW_SHOW); ShowWindow(g_hClientConnectBtn, SW_SHOW); ShowWindow(g_hClientDisconnectBtn, SW_SHOW); ShowWindow(g_hClientLog, SW_SHOW);
 
     RECT rc; GetClientRect(g_hwnd, &rc); ResizeControls(rc.right - rc.left, rc.bottom - rc.top);
@@ -573,7 +1238,13 @@ void ResizeControls(int width, int height) {
             MoveWindow(g_hHotkeyDisplay, MARGIN * 2 + hotkeyLabelWidth, hotkeyY, displayWidth, 23, TRUE);
             MoveWindow(g_hChangeHotkeyBtn, MARGIN * 3 + hotkeyLabelWidth + displayWidth, hotkeyY, changeBtnWidth, 23, TRUE);
 
-            int logY = hotkeyY + 25 + MARGIN;
+            int statsY = hotkeyY + 25 + MARGIN;
+            int exportBtnWidth = 100;
+            int statsWidth = width - exportBtnWidth - MARGIN * 3;
+            MoveWindow(g_hServerStats, MARGIN, statsY, statsWidth, 23, TRUE);
+            MoveWindow(g_hExportStatsBtn, MARGIN * 2 + statsWidth, statsY, exportBtnWidth, 23, TRUE);
+
+            int logY = statsY + 25 + MARGIN;
             int logHeight = height - logY - MARGIN;
             MoveWindow(g_hServerLog, MARGIN, logY, width - MARGIN * 2, logHeight, TRUE);
             break;
@@ -592,7 +1263,10 @@ void ResizeControls(int width, int height) {
              int listHeight = 100;
              MoveWindow(g_hClientServerList, MARGIN, listY, width - MARGIN * 2, listHeight, TRUE);
 
-             int logY = listY + listHeight + MARGIN;
+             int statsY = listY + listHeight + MARGIN;
+             MoveWindow(g_hServerStats, MARGIN, statsY, width - MARGIN * 2, 23, TRUE);
+
+             int logY = statsY + 25 + MARGIN;
              int logHeight = height - logY - MARGIN;
              MoveWindow(g_hClientLog, MARGIN, logY, width - MARGIN * 2, logHeight, TRUE);
             break;
@@ -617,6 +1291,324 @@ std::filesystem::path GetConfigPath() {
     return std::filesystem::current_path() / CONFIG_FILE_NAME;
 }
 
+const char* edge_name(uint8_t edge) {
+    switch (edge) {
+        case EDGE_LEFT:  return "left";
+        case EDGE_RIGHT: return "right";
+        case EDGE_TOP:   return "top";
+        default:         return "bottom";
+    }
+}
+
+bool parse_edge_name(const std::string& name, uint8_t& edge) {
+    if (name == "left")   { edge = EDGE_LEFT; return true; }
+    if (name == "right")  { edge = EDGE_RIGHT; return true; }
+    if (name == "top")    { edge = EDGE_TOP; return true; }
+    if (name == "bottom") { edge = EDGE_BOTTOM; return true; }
+    return false;
+}
+
+const char* log_level_name(LogLevel level) {
+    switch (level) {
+        case LogLevel::Debug:   return "debug";
+        case LogLevel::Warning: return "warning";
+        case LogLevel::Error:   return "error";
+        default:                return "info";
+    }
+}
+
+bool parse_log_level(const std::string& name, LogLevel& level) {
+    if (name == "debug")   { level = LogLevel::Debug; return true; }
+    if (name == "info")    { level = LogLevel::Info; return true; }
+    if (name == "warning") { level = LogLevel::Warning; return true; }
+    if (name == "error")   { level = LogLevel::Error; return true; }
+    return false;
+}
+
+// --- Config Store ---
+// SaveConfiguration only builds the document; a store thread writes it out once saves
+// have stopped for CONFIG_WRITE_DELAY_MS, so a burst of changes costs one write, and
+// the GUI thread never touches the disk. Each write goes to a temporary file that
+// ReplaceFile swaps in, so a crash cannot leave a half-written config behind.
+//
+// The same thread watches the config directory with ReadDirectoryChangesW. When the
+// file changes under us (someone edited it), it re-reads it and applies the sections
+// in LIVE_CONFIG_SECTIONS straight away; the rest take effect on the next start.
+// Saves keep the file's own version of those other sections, so a save never
+// undoes an edit that has not taken effect yet.
+
+const DWORD CONFIG_WRITE_DELAY_MS = 500;      // Quiet time before a save is written
+const DWORD CONFIG_WRITE_MAX_DELAY_MS = 3000; // Longest a save waits under steady changes
+const DWORD CONFIG_RELOAD_DELAY_MS = 200;     // Editors often write a file in several steps
+const char* const LIVE_CONFIG_SECTIONS[] = { "hotkey", "client", "clipboard", "sender", "pointer" };
+
+std::mutex g_config_store_mutex;
+json g_config_document;          // The file as last loaded, reloaded or saved
+std::string g_config_file_text;  // Its text as we last read or wrote it
+std::string g_config_pending;    // Text waiting to be written
+bool g_config_write_pending = false;
+HANDLE g_config_store_wake = NULL; // Auto-reset; set for each queued save
+std::unique_ptr<NetworkRun> g_config_store; // Not network work, but the same stop-and-join shape
+
+bool is_live_config_section(const std::string& section) {
+    return std::any_of(std::begin(LIVE_CONFIG_SECTIONS), std::end(LIVE_CONFIG_SECTIONS),
+                       [&](const char* live) { return section == live; });
+}
+
+// Replaces path with text through a temporary file next to it, so readers see either
+// the old contents or the new ones. Returns 0 on success, else the Windows error.
+DWORD write_file_atomically(const std::filesystem::path& target, const std::string& text) {
+    std::wstring path = target.wstring();
+    std::wstring temp_path = path + L".tmp";
+    {
+        std::ofstream file(std::filesystem::path(temp_path), std::ios::binary | std::ios::trunc);
+        if (!file.is_open() || !(file << text) || !file.flush()) return ERROR_WRITE_FAULT;
+    }
+    // ReplaceFile keeps the original's attributes and ACL, but needs it to exist.
+    if (!ReplaceFileW(path.c_str(), temp_path.c_str(), NULL, REPLACEFILE_IGNORE_MERGE_ERRORS, NULL, NULL) &&
+        !MoveFileExW(temp_path.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+        DWORD error = GetLastError();
+        DeleteFileW(temp_path.c_str());
+        return error;
+    }
+    return 0;
+}
+
+// Store thread, or the caller if the store is not running.
+bool write_config_file(const std::string& text) {
+    DWORD error = write_file_atomically(GetConfigPath(), text);
+    if (error != 0) LogServerMessage(LogLevel::Error, "Error saving configuration: error " + std::to_string(error) + ".");
+    return error == 0;
+}
+
+void queue_config_write(json config) {
+    std::lock_guard<std::mutex> lock(g_config_store_mutex);
+    // Sections read only at startup keep the file's version, as do sections this
+    // build does not know about.
+    if (g_config_document.is_object()) {
+        for (const auto& [section, value] : g_config_document.items()) {
+            if (!is_live_config_section(section)) config[section] = value;
+        }
+    }
+    try {
+        g_config_pending = config.dump(4); // Indented for readability
+    } catch (const std::exception& e) {
+        LogServerMessage(LogLevel::Error, "Error saving configuration: " + std::string(e.what()));
+        return;
+    }
+    g_config_document = config;
+    g_config_write_pending = true;
+    if (g_config_store) {
+        SetEvent(g_config_store_wake);
+    } else if (write_config_file(g_config_pending)) {
+        g_config_file_text.swap(g_config_pending);
+        g_config_write_pending = false;
+        LogServerMessage("Configuration saved.");
+    }
+}
+
+// Store thread: writes the queued text unless the file already holds it.
+void flush_config_write() {
+    std::string text;
+    {
+        std::lock_guard<std::mutex> lock(g_config_store_mutex);
+        if (!g_config_write_pending) return;
+        g_config_write_pending = false;
+        if (g_config_pending == g_config_file_text) return;
+        text = g_config_pending;
+    }
+    if (!write_config_file(text)) return;
+    {
+        std::lock_guard<std::mutex> lock(g_config_store_mutex);
+        g_config_file_text = text; // So the change notification for our own write is ignored
+    }
+    LogServerMessage("Configuration saved.");
+}
+
+bool read_config_file(std::string& text) {
+    std::ifstream file(GetConfigPath(), std::ios::binary);
+    if (!file.is_open()) return false;
+    text.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    return !file.bad();
+}
+
+void apply_live_settings(const json& config);
+
+// Store thread: the file changed on disk. Re-reads it and applies what can change live.
+void reload_config_file() {
+    std::string text;
+    if (!read_config_file(text)) return;
+    {
+        std::lock_guard<std::mutex> lock(g_config_store_mutex);
+        if (text == g_config_file_text) return; // Our own write, or no real change
+    }
+    json config;
+    try {
+        config = json::parse(text);
+    } catch (const json::parse_error& e) {
+        LogServerMessage(LogLevel::Warning, "The config file changed but does not parse (" + std::string(e.what()) +
+                                            "). Keeping the current settings.");
+        return;
+    }
+    if (!config.is_object()) return;
+    try {
+        apply_live_settings(config);
+    } catch (const std::exception& e) {
+        LogServerMessage(LogLevel::Warning, "The config file changed but could not be applied: " + std::string(e.what()));
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(g_config_store_mutex);
+        g_config_file_text = text;
+        g_config_document = config;
+    }
+    LogServerMessage("Config file changed on disk. Reloaded the hotkey, client, clipboard, sender and pointer settings; "
+                     "others apply on the next start.");
+    if (g_front_end->settings_reloaded) g_front_end->settings_reloaded();
+}
+
+// True if a batch of directory change records names the config file. An overflowed
+// batch (bytes == 0) lost its records, so it counts as a change too.
+bool config_file_changed(const uint8_t* records, DWORD bytes) {
+    if (bytes == 0) return true;
+    std::wstring config_name = std::filesystem::path(CONFIG_FILE_NAME).wstring();
+    for (DWORD offset = 0; offset < bytes;) {
+        const FILE_NOTIFY_INFORMATION* info = (const FILE_NOTIFY_INFORMATION*)(records + offset);
+        std::wstring name(info->FileName, info->FileNameLength / sizeof(WCHAR));
+        if (lstrcmpiW(name.c_str(), config_name.c_str()) == 0) return true;
+        if (info->NextEntryOffset == 0) break;
+        offset += info->NextEntryOffset;
+    }
+    return false;
+}
+
+void run_config_store(const StopSignal& stop) {
+    // The watch is best effort: without it, saves still work and edits apply on restart.
+    std::wstring directory_path = GetConfigPath().parent_path().wstring();
+    HANDLE directory = CreateFileW(directory_path.c_str(), FILE_LIST_DIRECTORY,
+                                   FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+                                   FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL);
+    OVERLAPPED overlapped = {};
+    overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    alignas(DWORD) static uint8_t records[4096];
+    const DWORD notify_filter = FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_SIZE;
+    auto arm_watch = [&]() {
+        ResetEvent(overlapped.hEvent);
+        return ReadDirectoryChangesW(directory, records, sizeof(records), FALSE, notify_filter, NULL, &overlapped, NULL) != FALSE;
+    };
+    bool watching = directory != INVALID_HANDLE_VALUE && overlapped.hEvent != NULL && arm_watch();
+    if (!watching) LogServerMessage(LogLevel::Warning, "Not watching the config file for changes. Error: " + std::to_string(GetLastError()));
+
+    ULONGLONG write_due = 0, write_deadline = 0, reload_due = 0; // 0 = nothing scheduled
+    for (;;) {
+        ULONGLONG now = GetTickCount64();
+        DWORD timeout = INFINITE;
+        for (ULONGLONG due : { write_due, reload_due }) {
+            if (due != 0) timeout = (std::min)(timeout, (DWORD)(due > now ? due - now : 0));
+        }
+        HANDLE handles[3] = { stop.handle(), g_config_store_wake, overlapped.hEvent };
+        DWORD woke = WaitForMultipleObjects(watching ? 3 : 2, handles, FALSE, timeout);
+        if (woke == WAIT_OBJECT_0) break;
+        now = GetTickCount64();
+        if (woke == WAIT_OBJECT_0 + 1) {
+            if (write_due == 0) write_deadline = now + CONFIG_WRITE_MAX_DELAY_MS;
+            write_due = (std::min)(now + CONFIG_WRITE_DELAY_MS, write_deadline);
+        } else if (woke == WAIT_OBJECT_0 + 2) {
+            DWORD bytes = 0;
+            bool ok = GetOverlappedResult(directory, &overlapped, &bytes, FALSE) != FALSE;
+            if (!ok || config_file_changed(records, bytes)) reload_due = now + CONFIG_RELOAD_DELAY_MS;
+            watching = ok && arm_watch();
+        }
+        if (write_due != 0 && now >= write_due) {
+            write_due = 0;
+            flush_config_write();
+        }
+        if (reload_due != 0 && now >= reload_due) {
+            reload_due = 0;
+            reload_config_file();
+        }
+    }
+
+    flush_config_write(); // A save still waiting for its delay
+    if (directory != INVALID_HANDLE_VALUE) {
+        if (CancelIoEx(directory, &overlapped) || GetLastError() != ERROR_NOT_FOUND) {
+            DWORD bytes = 0;
+            GetOverlappedResult(directory, &overlapped, &bytes, TRUE);
+        }
+        CloseHandle(directory);
+    }
+    if (overlapped.hEvent != NULL) CloseHandle(overlapped.hEvent);
+}
+
+void start_config_store() {
+    if (g_config_store) return;
+    g_config_store_wake = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (g_config_store_wake == NULL) return; // Saves are then written by the caller
+    std::lock_guard<std::mutex> lock(g_config_store_mutex);
+    g_config_store = std::make_unique<NetworkRun>();
+    g_config_store->thread = std::thread(run_config_store, std::cref(g_config_store->stop));
+}
+
+void stop_config_store() {
+    std::unique_ptr<NetworkRun> store;
+    {
+        std::lock_guard<std::mutex> lock(g_config_store_mutex);
+        store.swap(g_config_store); // Later saves are written by the caller
+    }
+    if (!store) return;
+    store->stop.request();
+    store->thread.join();
+    CloseHandle(g_config_store_wake);
+    g_config_store_wake = NULL;
+}
+
+// --- Protected Pairing Key ---
+// The pairing passphrase is kept in the config file only in DPAPI-protected form,
+// readable by the Windows account that saved it on this machine. A key typed into
+// "pairing_key" is swapped for "protected_pairing_key" when the config is loaded.
+
+typedef BOOL (WINAPI* CryptProtectDataFn)(DATA_BLOB*, LPCWSTR, DATA_BLOB*, PVOID, PVOID, DWORD, DATA_BLOB*);
+typedef BOOL (WINAPI* CryptUnprotectDataFn)(DATA_BLOB*, LPWSTR*, DATA_BLOB*, PVOID, PVOID, DWORD, DATA_BLOB*);
+
+const char PAIRING_KEY_ENTROPY[] = "SimpleKVM pairing key";
+
+// Runs CryptProtectData (protect) or CryptUnprotectData over input.
+bool run_dpapi(bool protect, const std::vector<uint8_t>& input, std::vector<uint8_t>& output) {
+    static HMODULE crypt32 = LoadLibraryA("crypt32.dll");
+    if (crypt32 == NULL) return false;
+    DATA_BLOB in = { (DWORD)input.size(), const_cast<BYTE*>(input.data()) };
+    DATA_BLOB entropy = { sizeof(PAIRING_KEY_ENTROPY) - 1, (BYTE*)PAIRING_KEY_ENTROPY };
+    DATA_BLOB out = {};
+    BOOL ok = FALSE;
+    if (protect) {
+        auto protect_data = (CryptProtectDataFn)(void*)GetProcAddress(crypt32, "CryptProtectData");
+        ok = protect_data && protect_data(&in, L"SimpleKVM pairing key", &entropy, NULL, NULL, CRYPTPROTECT_UI_FORBIDDEN, &out);
+    } else {
+        auto unprotect_data = (CryptUnprotectDataFn)(void*)GetProcAddress(crypt32, "CryptUnprotectData");
+        ok = unprotect_data && unprotect_data(&in, NULL, &entropy, NULL, NULL, CRYPTPROTECT_UI_FORBIDDEN, &out);
+    }
+    if (!ok) return false;
+    output.assign(out.pbData, out.pbData + out.cbData);
+    SecureZeroMemory(out.pbData, out.cbData);
+    LocalFree(out.pbData);
+    return true;
+}
+
+bool protect_pairing_passphrase(const std::string& passphrase, std::string& protected_hex) {
+    std::vector<uint8_t> blob;
+    if (!run_dpapi(true, std::vector<uint8_t>(passphrase.begin(), passphrase.end()), blob)) return false;
+    protected_hex = encode_hex(blob.data(), blob.size());
+    return true;
+}
+
+bool unprotect_pairing_passphrase(const std::string& protected_hex, std::string& passphrase) {
+    std::vector<uint8_t> blob(protected_hex.size() / 2), plain;
+    if (!decode_hex(protected_hex, blob.data(), blob.size()) || !run_dpapi(false, blob, plain)) return false;
+    passphrase.assign(plain.begin(), plain.end());
+    SecureZeroMemory(plain.data(), plain.size());
+    return true;
+}
+
 void SaveConfiguration() {
     json config;
     config["hotkey"] = {
@@ -625,15 +1617,127 @@ void SaveConfiguration() {
         {"alt", g_hotkey_alt.load()},
         {"shift", g_hotkey_shift.load()}
     };
+    config["logging"] = {
+        {"level", log_level_name(g_log_min_level)},
+        {"max_messages_per_second", g_log_rate_limit},
+        {"file", g_log_to_file}
+    };
+    config["client"] = {
+        {"auto_reconnect", g_auto_reconnect.load()},
+        {"last_server", g_last_server_address},
+        {"last_port", g_last_server_port}
+    };
+    // Only written like this when the file has no security section yet; otherwise the
+    // file's own (startup-only) section is kept.
+    json security = { {"pairing_key", ""} };
+    std::string protected_key;
+    if (!g_pairing_passphrase.empty() && protect_pairing_passphrase(g_pairing_passphrase, protected_key)) {
+        security["protected_pairing_key"] = protected_key;
+    }
+    config["security"] = security;
+    config["clipboard"] = {
+        {"enabled", g_clipboard_enabled.load()},
+        {"compress", g_clipboard_compress.load()}
+    };
+    config["files"] = {
+        {"enabled", g_file_transfer_enabled.load()},
+        {"max_megabits_per_second", g_file_max_mbps.load()},
+        {"receive_folder", g_file_receive_folder},
+        {"max_file_megabytes", g_file_max_megabytes.load()}
+    };
+    config["capture"] = {
+        {"mouse", g_raw_mouse_capture ? "raw_input" : "hook"}
+    };
+    config["headless"] = {
+        {"mode", g_headless_mode == HeadlessMode::Server ? "server" : (g_headless_mode == HeadlessMode::Client ? "client" : "off")}
+    };
+    config["sender"] = {
+        {"coalesce_mouse_moves", g_coalesce_moves.load()},
+        {"move_flush_interval_us", g_move_flush_interval_us.load()},
+        {"wheel_flush_interval_us", g_wheel_flush_interval_us.load()}
+    };
+    {
+        std::lock_guard<std::mutex> lock(g_pointer_settings_mutex);
+        config["pointer"] = {
+            {"sensitivity", g_pointer_settings.sensitivity},
+            {"acceleration", g_pointer_settings.acceleration},
+            {"dpi_scaling", g_pointer_settings.dpi_scaling},
+            {"disable_system_acceleration", g_pointer_settings.disable_system_acceleration}
+        };
+    }
+    config["network"] = {
+        {"tcp_nodelay", g_socket_tuning.tcp_nodelay},
+        {"send_buffer_bytes", g_socket_tuning.send_buffer_bytes},
+        {"receive_buffer_bytes", g_socket_tuning.receive_buffer_bytes},
+        {"keepalive", g_socket_tuning.keepalive},
+        {"keepalive_time_ms", g_socket_tuning.keepalive_time_ms},
+        {"keepalive_interval_ms", g_socket_tuning.keepalive_interval_ms},
+        {"qos_traffic_type", g_socket_tuning.qos_traffic_type},
+        {"dscp", g_socket_tuning.dscp},
+        {"transport", g_udp_transport_enabled ? "hybrid" : "tcp"},
+        {"heartbeat_interval_ms", g_heartbeat_interval_ms.load()},
+        {"heartbeat_timeout_ms", g_heartbeat_timeout_ms.load()}
+    };
+    config["discovery"] = {
+        {"multicast", g_discovery_multicast},
+        {"multicast_ttl", g_discovery_multicast_ttl},
+        {"announce", g_discovery_announce}
+    };
+    json links = json::array();
+    for (const LayoutLink& link : g_layout_links) {
+        links.push_back({ {"client", link.client}, {"edge", edge_name(link.edge)}, {"monitor", link.monitor} });
+    }
+    config["layout"] = {
+        {"edge_switching", g_edge_switching},
+        {"links", links}
+    };
+    queue_config_write(config);
+}
 
-    try {
-        std::ofstream file(GetConfigPath());
-        if (file.is_open()) {
-            file << config.dump(4); // Save with an indent of 4 for readability
-            LogServerMessage("Configuration saved.");
+// The settings a reload may change while everything runs: atomics, or guarded by their
+// own mutex. Connections already open keep the values they started with.
+void apply_live_settings(const json& config) {
+    if (config.contains("hotkey")) {
+        json hotkey = config["hotkey"];
+        g_hotkey_vk = hotkey.value("vk_code", 'Z');
+        g_hotkey_ctrl = hotkey.value("ctrl", true);
+        g_hotkey_alt = hotkey.value("alt", true);
+        g_hotkey_shift = hotkey.value("shift", false);
+    }
+
+    if (config.contains("client")) {
+        g_auto_reconnect = config["client"].value("auto_reconnect", true);
+    }
+
+    if (config.contains("clipboard")) {
+        json clipboard = config["clipboard"];
+        g_clipboard_enabled = clipboard.value("enabled", true);
+        g_clipboard_compress = clipboard.value("compress", true);
+    }
+
+    if (config.contains("sender")) {
+        json sender = config["sender"];
+        g_coalesce_moves = sender.value("coalesce_mouse_moves", true);
+        g_move_flush_interval_us = std::clamp(sender.value("move_flush_interval_us", 1000), 0, 100000);
+        g_wheel_flush_interval_us = std::clamp(sender.value("wheel_flush_interval_us", 4000), 0, 100000);
+    }
+
+    if (config.contains("pointer")) {
+        json pointer = config["pointer"];
+        PointerSettings settings;
+        settings.sensitivity = std::clamp(pointer.value("sensitivity", 1.0), 0.05, 20.0);
+        settings.dpi_scaling = pointer.value("dpi_scaling", true);
+        settings.disable_system_acceleration = pointer.value("disable_system_acceleration", false);
+        if (pointer.contains("acceleration") && pointer["acceleration"].is_array()) {
+            for (const json& point : pointer["acceleration"]) {
+                if (!point.is_array() || point.size() != 2 || !point[0].is_number() || !point[1].is_number()) continue;
+                settings.acceleration.emplace_back((std::max)(0.0, point[0].get<double>()),
+                                                   std::clamp(point[1].get<double>(), 0.0, 20.0));
+            }
+            std::sort(settings.acceleration.begin(), settings.acceleration.end());
         }
-    } catch (const std::exception& e) {
-        LogServerMessage("Error saving configuration: " + std::string(e.what()));
+        std::lock_guard<std::mutex> lock(g_pointer_settings_mutex);
+        g_pointer_settings = settings;
     }
 }
 
@@ -641,17 +1745,109 @@ void LoadConfiguration() {
     try {
         std::filesystem::path configPath = GetConfigPath();
         if (std::filesystem::exists(configPath)) {
-            std::ifstream file(configPath);
-            if (file.is_open()) {
-                json config = json::parse(file);
-
-                if (config.contains("hotkey")) {
-                    json hotkey = config["hotkey"];
-                    g_hotkey_vk = hotkey.value("vk_code", 'Z');
-                    g_hotkey_ctrl = hotkey.value("ctrl", true);
-                    g_hotkey_alt = hotkey.value("alt", true);
-                    g_hotkey_shift = hotkey.value("shift", false);
+            std::string text;
+            if (read_config_file(text)) {
+                json config = json::parse(text);
+
+                apply_live_settings(config);
+
+                if (config.contains("logging")) {
+                    json logging = config["logging"];
+                    parse_log_level(logging.value("level", std::string("info")), g_log_min_level);
+                    g_log_rate_limit = (std::max)(1, logging.value("max_messages_per_second", 200));
+                    g_log_to_file = logging.value("file", false);
+                }
+
+                if (config.contains("client")) {
+                    json client = config["client"];
+                    g_last_server_address = client.value("last_server", std::string());
+                    g_last_server_port = (uint16_t)std::clamp(client.value("last_port", KVM_PORT), 1, 65535);
+                }
+
+                bool protect_typed_key = false;
+                if (config.contains("security")) {
+                    json& security = config["security"];
+                    std::string typed_key = security.value("pairing_key", std::string());
+                    std::string protected_key = security.value("protected_pairing_key", std::string());
+                    g_pairing_key_unreadable = false;
+                    if (!typed_key.empty()) {
+                        g_pairing_passphrase = typed_key;
+                        if (protect_pairing_passphrase(typed_key, protected_key)) {
+                            security["pairing_key"] = "";
+                            security["protected_pairing_key"] = protected_key;
+                            protect_typed_key = true;
+                        }
+                    } else if (protected_key.empty()) {
+                        g_pairing_passphrase.clear();
+                    } else if (!unprotect_pairing_passphrase(protected_key, g_pairing_passphrase)) {
+                        g_pairing_passphrase.clear();
+                        g_pairing_key_unreadable = true;
+                    }
+                }
+
+                if (config.contains("files")) {
+                    json files = config["files"];
+                    g_file_transfer_enabled = files.value("enabled", true);
+                    g_file_max_mbps = std::clamp(files.value("max_megabits_per_second", 200), 0, 100000);
+                    g_file_receive_folder = files.value("receive_folder", std::string());
+                    g_file_max_megabytes = (std::max)(files.value("max_file_megabytes", 16384), 0);
+                }
+
+                if (config.contains("capture")) {
+                    g_raw_mouse_capture = (config["capture"].value("mouse", std::string("hook")) == "raw_input");
+                }
+
+                if (config.contains("headless")) {
+                    std::string mode = config["headless"].value("mode", std::string("off"));
+                    g_headless_mode = mode == "server" ? HeadlessMode::Server : (mode == "client" ? HeadlessMode::Client : HeadlessMode::Off);
+                }
+
+                if (config.contains("network")) {
+                    json network = config["network"];
+                    SocketTuning defaults;
+                    g_socket_tuning.tcp_nodelay = network.value("tcp_nodelay", defaults.tcp_nodelay);
+                    g_socket_tuning.send_buffer_bytes = (std::max)(0, network.value("send_buffer_bytes", defaults.send_buffer_bytes));
+                    g_socket_tuning.receive_buffer_bytes = (std::max)(0, network.value("receive_buffer_bytes", defaults.receive_buffer_bytes));
+                    g_socket_tuning.keepalive = network.value("keepalive", defaults.keepalive);
+                    g_socket_tuning.keepalive_time_ms = (std::max)(100, network.value("keepalive_time_ms", defaults.keepalive_time_ms));
+                    g_socket_tuning.keepalive_interval_ms = (std::max)(100, network.value("keepalive_interval_ms", defaults.keepalive_interval_ms));
+                    g_socket_tuning.qos_traffic_type = network.value("qos_traffic_type", defaults.qos_traffic_type);
+                    g_socket_tuning.dscp = std::clamp(network.value("dscp", defaults.dscp), -1, 63);
+                    g_udp_transport_enabled = (network.value("transport", std::string("tcp")) == "hybrid");
+                    g_heartbeat_interval_ms = std::clamp(network.value("heartbeat_interval_ms", 250), 0, 10000);
+                    g_heartbeat_timeout_ms = std::clamp(network.value("heartbeat_timeout_ms", 1000),
+                                                        (std::max)(100, g_heartbeat_interval_ms * 2), 60000);
+                }
+
+                if (config.contains("discovery")) {
+                    json discovery = config["discovery"];
+                    g_discovery_multicast = discovery.value("multicast", true);
+                    g_discovery_multicast_ttl = std::clamp(discovery.value("multicast_ttl", 4), 1, 32);
+                    g_discovery_announce = discovery.value("announce", true);
+                }
+
+                if (config.contains("layout")) {
+                    json layout = config["layout"];
+                    g_edge_switching = layout.value("edge_switching", false);
+                    g_layout_links.clear();
+                    if (layout.contains("links") && layout["links"].is_array()) {
+                        for (const json& entry : layout["links"]) {
+                            LayoutLink link;
+                            link.client = entry.value("client", std::string());
+                            link.monitor = entry.value("monitor", -1);
+                            if (!link.client.empty() && parse_edge_name(entry.value("edge", std::string()), link.edge)) {
+                                g_layout_links.push_back(link);
+                            }
+                        }
+                    }
+                }
+
+                {
+                    std::lock_guard<std::mutex> lock(g_config_store_mutex);
+                    g_config_document = config;
+                    g_config_file_text = text;
                 }
+                if (protect_typed_key) SaveConfiguration(); // Rewrites the file without the plaintext key
             }
         }
     } catch (const json::parse_error& e) {
@@ -702,477 +1898,5326 @@ std::string GetHotkeyString() {
     return hotkey_str;
 }
 
-void InstallHooks() {
-    LogServerMessage("Installing input hooks...");
-    g_keyboard_hook = SetWindowsHookEx(WH_KEYBOARD_LL, low_level_keyboard_proc, GetModuleHandle(NULL), 0);
-    g_mouse_hook = SetWindowsHookEx(WH_MOUSE_LL, low_level_mouse_proc, GetModuleHandle(NULL), 0);
-    if (g_keyboard_hook && g_mouse_hook) {
-        LogServerMessage("Input hooks installed successfully. Hotkey is " + GetHotkeyString());
+// --- Input Thread Priority ---
+// Threads on the input path (hooks, raw input, client injection) join the MMCSS
+// "Games" task, which keeps them scheduled ahead of normal work under load. Without
+// MMCSS they fall back to THREAD_PRIORITY_TIME_CRITICAL.
+
+typedef HANDLE (WINAPI* AvSetMmThreadCharacteristicsFn)(LPCSTR, LPDWORD);
+typedef BOOL (WINAPI* AvSetMmThreadPriorityFn)(HANDLE, int);
+typedef BOOL (WINAPI* AvRevertMmThreadCharacteristicsFn)(HANDLE);
+const int MMCSS_PRIORITY_HIGH = 1; // AVRT_PRIORITY_HIGH
+
+HMODULE g_avrt_dll = NULL; // Loaded on first use and kept for the life of the process
+std::once_flag g_avrt_once;
+AvSetMmThreadCharacteristicsFn g_AvSetMmThreadCharacteristics = nullptr;
+AvSetMmThreadPriorityFn g_AvSetMmThreadPriority = nullptr;
+AvRevertMmThreadCharacteristicsFn g_AvRevertMmThreadCharacteristics = nullptr;
+
+// Returns the MMCSS task handle to pass to restore_input_thread_priority, or NULL.
+HANDLE raise_input_thread_priority(const char* thread_name, void (*log)(const std::string&)) {
+    std::call_once(g_avrt_once, []() {
+        g_avrt_dll = LoadLibraryA("avrt.dll");
+        if (g_avrt_dll == NULL) return;
+        g_AvSetMmThreadCharacteristics = (AvSetMmThreadCharacteristicsFn)(void*)GetProcAddress(g_avrt_dll, "AvSetMmThreadCharacteristicsA");
+        g_AvSetMmThreadPriority = (AvSetMmThreadPriorityFn)(void*)GetProcAddress(g_avrt_dll, "AvSetMmThreadPriority");
+        g_AvRevertMmThreadCharacteristics = (AvRevertMmThreadCharacteristicsFn)(void*)GetProcAddress(g_avrt_dll, "AvRevertMmThreadCharacteristics");
+    });
+
+    HANDLE task = NULL;
+    if (g_AvSetMmThreadCharacteristics && g_AvSetMmThreadPriority && g_AvRevertMmThreadCharacteristics) {
+        DWORD task_index = 0;
+        task = g_AvSetMmThreadCharacteristics("Games", &task_index);
+        if (task != NULL) g_AvSetMmThreadPriority(task, MMCSS_PRIORITY_HIGH);
+    }
+    if (task != NULL) {
+        log(std::string(thread_name) + " thread: MMCSS \"Games\" task, high priority.");
+    } else if (SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL)) {
+        log(std::string(thread_name) + " thread: MMCSS unavailable, using time-critical priority.");
     } else {
-        LogServerMessage("!!! ERROR: Failed to install input hooks! Try running as administrator.");
-        if (!g_keyboard_hook) LogServerMessage("Keyboard hook failed.");
-        if (!g_mouse_hook) LogServerMessage("Mouse hook failed.");
+        log(std::string(thread_name) + " thread: could not raise priority (error " + std::to_string(GetLastError()) + ").");
     }
+    return task;
 }
 
-void UninstallHooks() {
-    LogServerMessage("Uninstalling input hooks...");
-    if (g_is_waiting_for_hotkey) {
-        g_is_waiting_for_hotkey = false;
-        PostMessage(g_hwnd, WM_APP_UPDATE_HOTKEY_DISPLAY, (WPARAM)_strdup(GetHotkeyString().c_str()), 0);
-    }
-    if (g_keyboard_hook) UnhookWindowsHookEx(g_keyboard_hook);
-    if (g_mouse_hook) UnhookWindowsHookEx(g_mouse_hook);
-    g_keyboard_hook = NULL;
-    g_mouse_hook = NULL;
-    LogServerMessage("Input hooks uninstalled.");
+void restore_input_thread_priority(HANDLE mmcss_task) {
+    if (mmcss_task != NULL) g_AvRevertMmThreadCharacteristics(mmcss_task);
+    else SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_NORMAL);
 }
 
-void stop_network_threads() {
-    g_is_running = false; // Signal threads to stop
-
-    // Close sockets to unblock threads
-    SOCKET temp_listen = g_listen_socket.exchange(INVALID_SOCKET);
-    if (temp_listen != INVALID_SOCKET) closesocket(temp_listen);
+// --- Tracing (ETW) ---
+// The "SimpleKVM" ETW provider publishes the traffic counters and hook timings as
+// self-describing TraceLogging events. WPR/WPA, xperf, tracelog or any TraceLogging
+// consumer can record them by name (e.g. "tracelog -start kvm -guid *SimpleKVM"),
+// with no manifest to install. While no session enables the provider, nothing is
+// written; each would-be event costs one relaxed load.
+//
+//   Event        Keyword  Level    When
+//   Counters     0x1      info     every TRACE_COUNTER_INTERVAL_MS: the g_stat_* totals
+//   HookEvent    0x2      verbose  every hook proc call: which hook, message, duration
+//   SendError    0x4      warning  a send to a client failed, or the client fell behind
+//   Reconnected  0x4      info     the client got its link back
+
+const GUID TRACE_PROVIDER_GUID = // Derived from the name, as TraceLogging and EventSource do
+    { 0x775e7aee, 0x7a1d, 0x50b3, { 0xd7, 0xdf, 0x1f, 0x35, 0x4e, 0x8d, 0x1c, 0x9a } };
+const char TRACE_PROVIDER_NAME[] = "SimpleKVM";
+const ULONGLONG TRACE_KEYWORD_COUNTERS = 0x1;
+const ULONGLONG TRACE_KEYWORD_HOT_PATH = 0x2;
+const ULONGLONG TRACE_KEYWORD_NETWORK = 0x4;
+const UCHAR TRACE_LEVEL_WARNING = 3;
+const UCHAR TRACE_LEVEL_INFO = 4;
+const UCHAR TRACE_LEVEL_VERBOSE = 5;
+const UCHAR TRACE_CHANNEL_TRACELOGGING = 11; // Marks an event as TraceLogging to decoders
+const DWORD TRACE_COUNTER_INTERVAL_MS = 1000;
+const EVENT_INFO_CLASS TRACE_PROVIDER_SET_TRAITS = (EVENT_INFO_CLASS)2; // EventProviderSetTraits, not in older MinGW
+const uint8_t TLG_IN_ANSISTRING = 2; // TraceLogging field types (TlgIn_t)
+const uint8_t TLG_IN_INT32 = 7;
+const uint8_t TLG_IN_UINT32 = 8;
+const uint8_t TLG_IN_UINT64 = 10;
+
+typedef ULONG (WINAPI* EventRegisterFn)(LPCGUID, PENABLECALLBACK, PVOID, PREGHANDLE);
+typedef ULONG (WINAPI* EventUnregisterFn)(REGHANDLE);
+typedef ULONG (WINAPI* EventSetInformationFn)(REGHANDLE, EVENT_INFO_CLASS, PVOID, ULONG);
+typedef ULONG (WINAPI* EventWriteTransferFn)(REGHANDLE, PCEVENT_DESCRIPTOR, LPCGUID, LPCGUID, ULONG, PEVENT_DATA_DESCRIPTOR);
+
+HMODULE g_advapi_dll = NULL;
+EventUnregisterFn g_EventUnregister = nullptr;
+EventWriteTransferFn g_EventWriteTransfer = nullptr;
+REGHANDLE g_trace_handle = 0;
+std::atomic<int> g_trace_level_plus1(0);     // Enabled level + 1 (256 = all levels); 0 = nobody listens
+std::atomic<ULONGLONG> g_trace_any_keywords(0);
+std::atomic<ULONGLONG> g_trace_all_keywords(0);
+std::mutex g_trace_timer_mutex;
+HANDLE g_trace_timer = NULL; // Publishes Counters while a session listens
+
+// The same test TraceLogging's own macros make before building an event.
+inline bool trace_enabled(UCHAR level, ULONGLONG keyword) {
+    if (level >= g_trace_level_plus1.load(std::memory_order_relaxed)) return false;
+    ULONGLONG all = g_trace_all_keywords.load(std::memory_order_relaxed);
+    return (keyword & g_trace_any_keywords.load(std::memory_order_relaxed)) != 0 && (keyword & all) == all;
+}
 
-    SOCKET temp_discovery = g_discovery_socket.exchange(INVALID_SOCKET);
-    if (temp_discovery != INVALID_SOCKET) closesocket(temp_discovery);
-    
-    SOCKET temp_connect = g_connect_socket.exchange(INVALID_SOCKET);
-    if (temp_connect != INVALID_SOCKET) closesocket(temp_connect);
+// TraceLogging metadata blobs start with their own size as a u16; names in them are
+// nul-terminated UTF-8.
+void append_trace_name(std::string& metadata, const char* name) {
+    metadata.append(name);
+    metadata.push_back('\0');
+}
+void store_trace_metadata_size(std::string& metadata) {
+    uint16_t size = (uint16_t)metadata.size();
+    memcpy(&metadata[0], &size, sizeof(size));
+}
 
-    SOCKET temp_client = INVALID_SOCKET;
-    {
-        std::lock_guard<std::mutex> lock(g_socket_mutex);
-        if (g_client_socket != INVALID_SOCKET) {
-            temp_client = g_client_socket;
-            g_client_socket = INVALID_SOCKET;
+// One event type: its descriptor and TraceLogging metadata
+// (u16 size | u8 tags | name, then for each field: name | u8 type).
+struct TraceEventType {
+    EVENT_DESCRIPTOR descriptor = {};
+    std::string metadata;
+
+    TraceEventType(const char* name, UCHAR level, ULONGLONG keyword,
+                   std::initializer_list<std::pair<const char*, uint8_t>> fields) : metadata(3, '\0') {
+        descriptor.Channel = TRACE_CHANNEL_TRACELOGGING;
+        descriptor.Level = level;
+        descriptor.Keyword = keyword;
+        append_trace_name(metadata, name);
+        for (const auto& [field, type] : fields) {
+            append_trace_name(metadata, field);
+            metadata.push_back((char)type);
         }
+        store_trace_metadata_size(metadata);
     }
-    if (temp_client != INVALID_SOCKET) closesocket(temp_client);
-
-    // Wait for the thread to finish
-    if(g_kvm_thread.joinable()) {
-        g_kvm_thread.join();
-    }
-    
-    g_is_running = true; // Reset state for next run
-    
-    if (g_is_controlling_remote) {
-        g_is_controlling_remote = false;
+};
+
+const TraceEventType TRACE_COUNTERS("Counters", TRACE_LEVEL_INFO, TRACE_KEYWORD_COUNTERS, {
+    {"EventsCaptured", TLG_IN_UINT64}, {"EventsSent", TLG_IN_UINT64}, {"EventsCoalesced", TLG_IN_UINT64},
+    {"EventsDropped", TLG_IN_UINT64}, {"BytesSent", TLG_IN_UINT64}, {"SendErrors", TLG_IN_UINT64},
+    {"HookCalls", TLG_IN_UINT64}, {"HookTimeUs", TLG_IN_UINT64}, {"EventsInjected", TLG_IN_UINT64},
+    {"Reconnects", TLG_IN_UINT64} });
+const TraceEventType TRACE_HOOK_EVENT("HookEvent", TRACE_LEVEL_VERBOSE, TRACE_KEYWORD_HOT_PATH, {
+    {"Hook", TLG_IN_ANSISTRING}, {"Message", TLG_IN_UINT32}, {"DurationNs", TLG_IN_UINT64} });
+const TraceEventType TRACE_SEND_ERROR("SendError", TRACE_LEVEL_WARNING, TRACE_KEYWORD_NETWORK, {
+    {"ClientId", TLG_IN_INT32}, {"Error", TLG_IN_INT32}, {"Reason", TLG_IN_ANSISTRING} });
+const TraceEventType TRACE_RECONNECTED("Reconnected", TRACE_LEVEL_INFO, TRACE_KEYWORD_NETWORK, {
+    {"DowntimeMs", TLG_IN_UINT64} });
+
+std::string make_trace_provider_metadata() {
+    std::string metadata(2, '\0');
+    append_trace_name(metadata, TRACE_PROVIDER_NAME);
+    store_trace_metadata_size(metadata);
+    return metadata;
+}
+const std::string TRACE_PROVIDER_METADATA = make_trace_provider_metadata();
+
+EVENT_DATA_DESCRIPTOR trace_data(const void* data, size_t size, UCHAR type = 0) {
+    EVENT_DATA_DESCRIPTOR descriptor = {};
+    descriptor.Ptr = (ULONGLONG)(ULONG_PTR)data;
+    descriptor.Size = (ULONG)size;
+    descriptor.Type = type;
+    return descriptor;
+}
+template <typename T>
+EVENT_DATA_DESCRIPTOR trace_data(const T& value) { return trace_data(&value, sizeof(value)); }
+EVENT_DATA_DESCRIPTOR trace_data(const char* text) { return trace_data(text, strlen(text) + 1); }
+
+// Writes one event; fields come in the order its type lists them. Callers check
+// trace_enabled first, so the values are only gathered for a listener.
+void write_trace_event(const TraceEventType& type, std::initializer_list<EVENT_DATA_DESCRIPTOR> fields) {
+    EVENT_DATA_DESCRIPTOR data[16];
+    data[0] = trace_data(TRACE_PROVIDER_METADATA.data(), TRACE_PROVIDER_METADATA.size(), EVENT_DATA_DESCRIPTOR_TYPE_PROVIDER_METADATA);
+    data[1] = trace_data(type.metadata.data(), type.metadata.size(), EVENT_DATA_DESCRIPTOR_TYPE_EVENT_METADATA);
+    ULONG count = 2;
+    for (const EVENT_DATA_DESCRIPTOR& field : fields) {
+        if (count < 16) data[count++] = field;
     }
+    g_EventWriteTransfer(g_trace_handle, &type.descriptor, NULL, NULL, count, data);
 }
 
-void stop_kvm_logic() {
-    stop_network_threads();
-    UninstallHooks();
+void NTAPI publish_trace_counters(PVOID, BOOLEAN) {
+    if (!trace_enabled(TRACE_LEVEL_INFO, TRACE_KEYWORD_COUNTERS)) return;
+    uint64_t values[10] = {
+        g_stat_events_captured.load(std::memory_order_relaxed), g_stat_events_sent.load(std::memory_order_relaxed),
+        g_events_coalesced.load(std::memory_order_relaxed), g_ring_overflows.load(std::memory_order_relaxed),
+        g_stat_bytes_sent.load(std::memory_order_relaxed), g_stat_send_errors.load(std::memory_order_relaxed),
+        g_stat_hook_calls.load(std::memory_order_relaxed),
+        g_stat_hook_ticks.load(std::memory_order_relaxed) * 1000000 / (uint64_t)g_qpc_frequency,
+        g_stat_events_injected.load(std::memory_order_relaxed), g_stat_reconnects.load(std::memory_order_relaxed)
+    };
+    write_trace_event(TRACE_COUNTERS, {
+        trace_data(values[0]), trace_data(values[1]), trace_data(values[2]), trace_data(values[3]), trace_data(values[4]),
+        trace_data(values[5]), trace_data(values[6]), trace_data(values[7]), trace_data(values[8]), trace_data(values[9]) });
 }
 
-void PostLogMessage(UINT msg_type, const std::string& msg) {
-    if (g_main_thread_id != 0 && g_hwnd != NULL) {
-        size_t len = msg.length() + 3;
-        char* msg_copy = new char[len];
-        strcpy_s(msg_copy, len, (msg + "\r\n").c_str());
-        PostMessage(g_hwnd, msg_type, (WPARAM)msg_copy, 0);
+// ETW calls this whenever a session enables or disables the provider, with the
+// combined level and keywords of all sessions.
+void NTAPI trace_enable_callback(LPCGUID, ULONG control_code, UCHAR level, ULONGLONG any_keywords,
+                                 ULONGLONG all_keywords, PEVENT_FILTER_DESCRIPTOR, PVOID) {
+    if (control_code != EVENT_CONTROL_CODE_ENABLE_PROVIDER && control_code != EVENT_CONTROL_CODE_DISABLE_PROVIDER) return;
+    bool enable = control_code == EVENT_CONTROL_CODE_ENABLE_PROVIDER;
+    g_trace_any_keywords = any_keywords != 0 ? any_keywords : ~0ULL; // 0 asks for every keyword
+    g_trace_all_keywords = all_keywords;
+    g_trace_level_plus1 = !enable ? 0 : (level == 0 ? 256 : level + 1);
+
+    std::lock_guard<std::mutex> lock(g_trace_timer_mutex);
+    if (enable && g_trace_timer == NULL) {
+        if (!CreateTimerQueueTimer(&g_trace_timer, NULL, publish_trace_counters, nullptr, 0, TRACE_COUNTER_INTERVAL_MS, WT_EXECUTEDEFAULT)) {
+            g_trace_timer = NULL;
+        }
+    } else if (!enable && g_trace_timer != NULL) {
+        DeleteTimerQueueTimer(NULL, g_trace_timer, INVALID_HANDLE_VALUE); // Waits for a running callback
+        g_trace_timer = NULL;
     }
 }
 
-void LogServerMessage(const std::string& msg) {
-    PostLogMessage(WM_APP_LOG_SERVER, msg);
+void start_tracing() {
+    g_advapi_dll = LoadLibraryA("advapi32.dll");
+    if (g_advapi_dll == NULL) return;
+    auto event_register = (EventRegisterFn)(void*)GetProcAddress(g_advapi_dll, "EventRegister");
+    auto event_set_information = (EventSetInformationFn)(void*)GetProcAddress(g_advapi_dll, "EventSetInformation");
+    g_EventUnregister = (EventUnregisterFn)(void*)GetProcAddress(g_advapi_dll, "EventUnregister");
+    g_EventWriteTransfer = (EventWriteTransferFn)(void*)GetProcAddress(g_advapi_dll, "EventWriteTransfer");
+    if (!event_register || !g_EventUnregister || !g_EventWriteTransfer ||
+        event_register(&TRACE_PROVIDER_GUID, trace_enable_callback, nullptr, &g_trace_handle) != ERROR_SUCCESS) {
+        g_trace_handle = 0;
+        return;
+    }
+    // Names the provider for decoders that see no event of it (Windows 10 and later).
+    if (event_set_information) {
+        event_set_information(g_trace_handle, TRACE_PROVIDER_SET_TRAITS, (PVOID)TRACE_PROVIDER_METADATA.data(),
+                              (ULONG)TRACE_PROVIDER_METADATA.size());
+    }
 }
 
-void LogClientMessage(const std::string& msg) {
-    PostLogMessage(WM_APP_LOG_CLIENT, msg);
+void stop_tracing() {
+    if (g_trace_handle == 0) return;
+    g_EventUnregister(g_trace_handle); // No more callbacks after this returns
+    g_trace_handle = 0;
+    g_trace_level_plus1 = 0;
+    std::lock_guard<std::mutex> lock(g_trace_timer_mutex);
+    if (g_trace_timer != NULL) DeleteTimerQueueTimer(NULL, g_trace_timer, INVALID_HANDLE_VALUE);
+    g_trace_timer = NULL;
 }
 
-void AddServerToList(const std::string& server_ip) {
-     if (g_main_thread_id != 0 && g_hwnd != NULL) {
-        size_t len = server_ip.length() + 1;
-        char* ip_copy = new char[len];
-        strcpy_s(ip_copy, len, server_ip.c_str());
-        PostMessage(g_hwnd, WM_APP_ADD_SERVER, (WPARAM)ip_copy, 0);
+// --- Hook Thread ---
+// The low-level hooks run on their own thread with its own message pump, so edit
+// control appends and button repaints on the GUI thread never delay input capture.
+// State documented as "hook thread only" lives here; other threads reach it with
+// post_to_hook_thread.
+
+// Returns false if no hook thread is running (the message is dropped).
+bool post_to_hook_thread(UINT message, WPARAM wParam, LPARAM lParam) {
+    DWORD thread_id = g_hook_thread_id;
+    return thread_id != 0 && PostThreadMessage(thread_id, message, wParam, lParam);
+}
+
+void handle_hook_thread_message(const MSG& msg) {
+    switch (msg.message) {
+        case WM_APP_EDGE_RETURN:
+            return_control_from_edge((int)msg.wParam, (uint16_t)msg.lParam);
+            break;
+        case WM_DISPLAYCHANGE:
+            rebuild_edge_zones();
+            break;
+        case WM_APP_CLIENT_DISCONNECTED:
+            // wParam is the id of the client the engine just dropped
+            if (g_is_controlling_remote && g_active_client_id == (int)msg.wParam) {
+                LogServerMessage("--- AUTOMATICALLY SWITCHED TO LOCAL CONTROL (Client D/C) ---");
+                switch_control(nullptr, nullptr);
+                g_resume_client_id = (int)msg.wParam; // Hand control back if it resumes
+            }
+            break;
+        case WM_APP_CLIENT_RESUMED:
+            // wParam is the id the reconnected client got back. Only take control again
+            // if nothing else happened since it dropped.
+            if (!g_is_controlling_remote && g_resume_client_id == (int)msg.wParam) {
+                if (std::shared_ptr<ClientSession> session = find_session((int)msg.wParam)) {
+                    LogServerMessage("Client " + std::to_string(session->id) + " resumed. Restoring remote control.");
+                    switch_control(session, nullptr);
+                    resync_held_keys();
+                }
+            }
+            g_resume_client_id = 0;
+            break;
+        case WM_APP_RELEASE_CONTROL: // The server is stopping
+            if (g_is_controlling_remote) switch_control(nullptr, nullptr);
+            break;
     }
 }
 
-void toggle_control() {
-    if (g_client_socket == INVALID_SOCKET) {
-        LogServerMessage("Cannot toggle control: No client connected.");
-        return;
+void run_hook_thread(HANDLE ready_event) {
+    HANDLE mmcss_task = raise_input_thread_priority("Input hook", LogServerMessage);
+    MSG msg;
+    PeekMessage(&msg, NULL, WM_USER, WM_USER, PM_NOREMOVE); // Create the queue before anyone posts to it
+
+    // Seed the modifier mask and key sets once; from here on the hook keeps them current.
+    // Mouse buttons (below VK_BACK) and the generic VK_SHIFT/CONTROL/MENU never reach
+    // the keyboard hook, so they are left out.
+    g_hook_modifiers = 0;
+    g_keys_held = KeySet();
+    for (int vk = VK_BACK; vk <= 0xFE; ++vk) {
+        if (vk >= VK_SHIFT && vk <= VK_MENU) continue;
+        if (!(GetAsyncKeyState(vk) & 0x8000)) continue;
+        g_keys_held.set((uint16_t)vk, true);
+        g_hook_modifiers |= modifier_bit(vk);
     }
-    g_is_controlling_remote = !g_is_controlling_remote;
-    if (g_is_controlling_remote) {
-        GetCursorPos(&g_center_pos);
-        LogServerMessage("--- SWITCHED TO REMOTE CONTROL ---");
-        send_data("event:control_acquire\n");
+    g_keys_local = g_keys_held;
+    g_keyboard_hook = SetWindowsHookEx(WH_KEYBOARD_LL, low_level_keyboard_proc, GetModuleHandle(NULL), 0);
+    g_mouse_hook = SetWindowsHookEx(WH_MOUSE_LL, low_level_mouse_proc, GetModuleHandle(NULL), 0);
+    bool installed = g_keyboard_hook && g_mouse_hook;
+    if (installed) {
+        LogServerMessage("Input hooks installed successfully. Hotkey is " + GetHotkeyString());
+        rebuild_edge_zones();
+        if (g_raw_mouse_capture) start_raw_input_capture();
+        g_hook_thread_id = GetCurrentThreadId();
     } else {
-        LogServerMessage("--- SWITCHED TO LOCAL CONTROL ---");
-        send_data("event:control_release\n");
-        release_all_server_modifiers();
+        LogServerMessage(LogLevel::Error, "!!! ERROR: Failed to install input hooks! Try running as administrator.");
+        if (!g_keyboard_hook) LogServerMessage(LogLevel::Error, "Keyboard hook failed.");
+        if (!g_mouse_hook) LogServerMessage(LogLevel::Error, "Mouse hook failed.");
     }
-}
+    SetEvent(ready_event);
 
-void run_server_logic() {
-    LogServerMessage("Starting Server Networking Thread...");
+    if (installed) {
+        while (GetMessage(&msg, NULL, 0, 0) > 0) {
+            handle_hook_thread_message(msg);
+        }
+    }
 
-    std::thread discovery_thread([]() {
-        SOCKET bcast_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-        if (bcast_socket == INVALID_SOCKET) return;
-        
-        char broadcast = '1';
-        setsockopt(bcast_socket, SOL_SOCKET, SO_BROADCAST, &broadcast, sizeof(broadcast));
-        
-        sockaddr_in broadcast_addr = {};
-        broadcast_addr.sin_family = AF_INET;
-        broadcast_addr.sin_port = htons(DISCOVERY_PORT);
-        broadcast_addr.sin_addr.s_addr = INADDR_BROADCAST;
+    g_hook_thread_id = 0;
+    stop_raw_input_capture();
+    if (g_keyboard_hook) UnhookWindowsHookEx(g_keyboard_hook);
+    if (g_mouse_hook) UnhookWindowsHookEx(g_mouse_hook);
+    g_keyboard_hook = NULL;
+    g_mouse_hook = NULL;
+    restore_input_thread_priority(mmcss_task);
+}
 
-        while (g_is_running) {
-            sendto(bcast_socket, DISCOVERY_MESSAGE.c_str(), DISCOVERY_MESSAGE.length(), 0, (SOCKADDR*)&broadcast_addr, sizeof(broadcast_addr));
-            for(int i=0; i<30 && g_is_running; ++i) std::this_thread::sleep_for(std::chrono::milliseconds(100));
-        }
-        closesocket(bcast_socket);
-    });
-    discovery_thread.detach();
+void InstallHooks() {
+    if (g_hook_thread.joinable()) return;
+    LogServerMessage("Installing input hooks...");
+    HANDLE ready_event = CreateEvent(NULL, TRUE, FALSE, NULL);
+    g_hook_thread = std::thread(run_hook_thread, ready_event);
+    WaitForSingleObject(ready_event, INFINITE);
+    CloseHandle(ready_event);
+    if (g_hook_thread_id == 0) g_hook_thread.join(); // Installation failed; the thread has exited
+}
 
+void UninstallHooks() {
+    LogServerMessage("Uninstalling input hooks...");
+    if (g_is_waiting_for_hotkey) {
+        g_is_waiting_for_hotkey = false;
+        if (g_front_end->hotkey_changed) g_front_end->hotkey_changed();
+    }
+    if (g_hook_thread.joinable()) {
+        post_to_hook_thread(WM_QUIT, 0, 0);
+        g_hook_thread.join();
+    }
+    LogServerMessage("Input hooks uninstalled.");
+}
 
-    SOCKET listen_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    g_listen_socket.store(listen_socket);
+// Stops whatever network run is active, then starts fn on a new thread with its own
+// stop signal as the first argument.
+template <typename Fn, typename... Args>
+void start_network_thread(Fn fn, Args... args) {
+    stop_network_threads();
+    g_network_run = std::make_unique<NetworkRun>();
+    g_network_run->thread = std::thread(fn, std::cref(g_network_run->stop), args...);
+}
 
-    if (listen_socket == INVALID_SOCKET) {
-        LogServerMessage("Failed to create listen socket.");
-        return;
+void stop_network_threads() {
+    if (g_network_run) {
+        g_network_run->stop.request();
+        wake_server_engine(); // WSAPoll cannot wait on the event; the engine then closes every client
+        g_network_run->thread.join();
+        g_network_run.reset();
     }
 
-    sockaddr_in server_addr = {};
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(KVM_PORT);
+    // Control state belongs to the hook thread; without one nothing can be under control.
+    post_to_hook_thread(WM_APP_RELEASE_CONTROL, 0, 0);
+}
 
-    if (bind(listen_socket, (SOCKADDR*)&server_addr, sizeof(server_addr)) == SOCKET_ERROR) {
-        LogServerMessage("Bind failed. Error: " + std::to_string(WSAGetLastError()));
-        closesocket(listen_socket);
-        return;
+// Waits until one of the sockets has a network event or stop is requested. Null
+// entries are skipped. On Ready each socket's fired bits say what happened; socket
+// events stay armed until the matching recv/accept/send re-enables them, so callers
+// must act on what fired before waiting again.
+// At most WSA_MAXIMUM_WAIT_EVENTS - 1 sockets.
+WaitResult wait_for_sockets(const StopSignal& stop, SocketEvent* const* sockets, size_t socket_count, DWORD timeout_ms) {
+    WSAEVENT events[WSA_MAXIMUM_WAIT_EVENTS];
+    DWORD count = 0;
+    events[count++] = stop.handle();
+    for (size_t i = 0; i < socket_count; ++i) {
+        if (!sockets[i]) continue;
+        sockets[i]->fired = 0;
+        events[count++] = sockets[i]->event;
     }
 
-    if (listen(listen_socket, SOMAXCONN) == SOCKET_ERROR) {
-        LogServerMessage("Listen failed.");
-        closesocket(listen_socket);
-        return;
+    DWORD result = WSAWaitForMultipleEvents(count, events, FALSE, timeout_ms, FALSE);
+    if (result == WSA_WAIT_TIMEOUT) return WaitResult::Timeout;
+    if (result == WSA_WAIT_EVENT_0 || result == WSA_WAIT_FAILED || stop.requested()) return WaitResult::Stopped;
+
+    for (size_t i = 0; i < socket_count; ++i) {
+        SocketEvent* socket_event = sockets[i];
+        if (!socket_event) continue;
+        WSANETWORKEVENTS network_events = {};
+        if (WSAEnumNetworkEvents(socket_event->sock, socket_event->event, &network_events) != 0) continue;
+        socket_event->fired = network_events.lNetworkEvents;
+        if (network_events.lNetworkEvents & FD_CONNECT) {
+            socket_event->connect_error = network_events.iErrorCode[FD_CONNECT_BIT];
+        }
     }
+    return WaitResult::Ready;
+}
 
-    LogServerMessage("Server waiting for a client on port " + std::to_string(KVM_PORT));
+WaitResult wait_for_sockets(const StopSignal& stop, std::initializer_list<SocketEvent*> sockets, DWORD timeout_ms) {
+    return wait_for_sockets(stop, sockets.begin(), sockets.size(), timeout_ms);
+}
 
-    while(g_is_running) {
-        SOCKET client_sock = accept(listen_socket, NULL, NULL);
-        if (!g_is_running) break;
-        if (client_sock == INVALID_SOCKET) {
-            if(g_is_running) LogServerMessage("Accept failed or was interrupted.");
-            break;
+// Connects sock to addr, giving up as soon as stop is requested (or timeout_ms has
+// passed) instead of sitting out the TCP connect timeout. The socket is blocking again
+// when this returns.
+bool connect_or_stop(const StopSignal& stop, SOCKET sock, const SocketAddress& addr, DWORD timeout_ms) {
+    SocketEvent connecting;
+    if (!connecting.watch(sock, FD_CONNECT)) return false;
+    if (connect(sock, addr.get(), addr.length) == 0) return true;
+    if (WSAGetLastError() != WSAEWOULDBLOCK) return false;
+
+    ULONGLONG deadline = GetTickCount64() + timeout_ms;
+    for (;;) {
+        DWORD wait_ms = INFINITE;
+        if (timeout_ms != INFINITE) {
+            ULONGLONG now = GetTickCount64();
+            if (now >= deadline) {
+                WSASetLastError(WSAETIMEDOUT);
+                return false;
+            }
+            wait_ms = (DWORD)(deadline - now);
         }
-        
-        std::lock_guard<std::mutex> lock(g_socket_mutex);
-        if (g_client_socket != INVALID_SOCKET) {
-            LogServerMessage("A client is already connected. Rejecting new connection.");
-            closesocket(client_sock);
-        } else {
-            LogServerMessage("Client connected!");
-            g_client_socket = client_sock;
-            std::thread(handle_client_connection, g_client_socket).detach();
+        WaitResult woke = wait_for_sockets(stop, {&connecting}, wait_ms);
+        if (woke == WaitResult::Stopped) return false;
+        if (woke == WaitResult::Ready && (connecting.fired & FD_CONNECT)) {
+            if (connecting.connect_error != 0) WSASetLastError(connecting.connect_error);
+            return connecting.connect_error == 0;
         }
     }
-    
-    g_listen_socket.store(INVALID_SOCKET);
-    LogServerMessage("Server networking thread finished.");
 }
 
-void handle_client_connection(SOCKET client_socket) {
-    char buffer[1024];
-    while (g_is_running) {
-        int result = recv(client_socket, buffer, sizeof(buffer), 0);
-        if (result <= 0) {
-            LogServerMessage("Client disconnected (detected by recv).");
-            break;
+// Parses an IPv4 or IPv6 address (with a %zone for link-local ones). Numeric only:
+// nothing is looked up.
+bool parse_socket_address(const std::string& text, uint16_t port, SocketAddress& address) {
+    addrinfo hints = {};
+    hints.ai_flags = AI_NUMERICHOST;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* result = nullptr;
+    if (text.empty() || getaddrinfo(text.c_str(), NULL, &hints, &result) != 0 || result == nullptr) return false;
+    bool ok = result->ai_addrlen <= sizeof(address.storage);
+    if (ok) {
+        address = SocketAddress();
+        memcpy(&address.storage, result->ai_addr, result->ai_addrlen);
+        address.length = (int)result->ai_addrlen;
+        address.set_port(port);
+    }
+    freeaddrinfo(result);
+    return ok;
+}
+
+// The address as text, without the port. IPv4 peers of a dual-stack socket
+// (::ffff:a.b.c.d) come out in plain IPv4 form, so they still match the layout and
+// the server cache.
+std::string format_socket_address(const SocketAddress& address) {
+    char text[NI_MAXHOST] = "?";
+    if (address.family() == AF_INET6) {
+        const in6_addr& v6 = ((const sockaddr_in6*)&address.storage)->sin6_addr;
+        if (IN6_IS_ADDR_V4MAPPED(&v6)) {
+            inet_ntop(AF_INET, &v6.s6_addr[12], text, sizeof(text));
+            return text;
         }
     }
-    
-    if (g_main_thread_id != 0) {
-        PostMessage(g_hwnd, WM_APP_CLIENT_DISCONNECTED, (WPARAM)client_socket, 0);
+    getnameinfo(address.get(), address.length, text, sizeof(text), NULL, 0, NI_NUMERICHOST);
+    return text;
+}
+
+// The address as IPv6 (IPv4 ones mapped), so either form of a host compares equal.
+in6_addr as_ipv6(const SocketAddress& address) {
+    in6_addr v6 = {};
+    if (address.family() == AF_INET6) return ((const sockaddr_in6*)&address.storage)->sin6_addr;
+    v6.s6_addr[10] = v6.s6_addr[11] = 0xff;
+    memcpy(&v6.s6_addr[12], &((const sockaddr_in*)&address.storage)->sin_addr, 4);
+    return v6;
+}
+
+// True if a and b name the same host, whatever their ports.
+bool same_host(const SocketAddress& a, const SocketAddress& b) {
+    in6_addr first = as_ipv6(a), second = as_ipv6(b);
+    return memcmp(&first, &second, sizeof(first)) == 0;
+}
+
+// A TCP socket listening on port on every address: one dual-stack socket that takes
+// IPv6 and IPv4 clients alike, or IPv4 only where IPv6 is not installed. Returns
+// INVALID_SOCKET on failure, with WSAGetLastError set.
+SOCKET open_tcp_listener(uint16_t port) {
+    SocketAddress any;
+    any.storage.ss_family = AF_INET6;
+    any.length = sizeof(sockaddr_in6);
+    SOCKET sock = socket(AF_INET6, SOCK_STREAM, IPPROTO_TCP);
+    if (sock != INVALID_SOCKET) {
+        DWORD v6_only = 0;
+        setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, (const char*)&v6_only, sizeof(v6_only));
+    } else {
+        any.storage.ss_family = AF_INET;
+        any.length = sizeof(sockaddr_in);
+        sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (sock == INVALID_SOCKET) return INVALID_SOCKET;
     }
+    any.set_port(port);
+    if (bind(sock, any.get(), any.length) == SOCKET_ERROR || listen(sock, SOMAXCONN) == SOCKET_ERROR) {
+        int error = WSAGetLastError();
+        closesocket(sock);
+        WSASetLastError(error);
+        return INVALID_SOCKET;
+    }
+    return sock;
 }
 
-LRESULT CALLBACK low_level_keyboard_proc(int nCode, WPARAM wParam, LPARAM lParam) {
-    if (nCode == HC_ACTION) {
-        KBDLLHOOKSTRUCT* pkb = (KBDLLHOOKSTRUCT*)lParam;
+void stop_kvm_logic() {
+    stop_network_threads();
+    UninstallHooks();
+}
 
-        // --- Hotkey Capture Logic ---
-        if (g_is_waiting_for_hotkey && (wParam == WM_KEYDOWN || wParam == WM_SYSKEYDOWN)) {
-            if (pkb->vkCode != VK_LCONTROL && pkb->vkCode != VK_RCONTROL &&
-                pkb->vkCode != VK_LSHIFT   && pkb->vkCode != VK_RSHIFT &&
-                pkb->vkCode != VK_LMENU    && pkb->vkCode != VK_RMENU &&
-                pkb->vkCode != VK_LWIN     && pkb->vkCode != VK_RWIN)
-            {
-                g_hotkey_vk = pkb->vkCode;
-                g_hotkey_ctrl = (GetAsyncKeyState(VK_CONTROL) & 0x8000) != 0;
-                g_hotkey_alt = (GetAsyncKeyState(VK_MENU) & 0x8000) != 0;
-                g_hotkey_shift = (GetAsyncKeyState(VK_SHIFT) & 0x8000) != 0;
+// --- Logging ---
+// Any thread logs by pushing a fixed-size entry into a lock-free ring; nothing is
+// allocated and no window message is posted per line. The GUI drains the ring on a
+// timer and appends each log's lines to its edit control in one go, trimming the
+// oldest lines to keep the scrollback bounded. With file output on, the same batch is
+// handed to a writer thread so no caller ever waits on the disk.
+
+enum LogTarget : uint8_t { LOG_SERVER = 0, LOG_CLIENT = 1 };
+
+struct LogEntry {
+    uint8_t target;
+    LogLevel level;
+    uint16_t length;
+    uint32_t time_ms; // Local time of day, for the file
+    char text[248];
+};
+
+const size_t LOG_RING_CAPACITY = 1024;
+const int LOG_SCROLLBACK_CHARS = 64 * 1024; // Per edit control
+MpscRing<LogEntry, LOG_RING_CAPACITY> g_log_ring;
+std::atomic<uint64_t> g_log_dropped(0); // Ring was full
+
+// Per-second budget for each log, so a storm of repeated errors cannot flood the UI.
+struct LogBudget {
+    std::atomic<uint64_t> second{0};
+    std::atomic<int> used{0};
+    std::atomic<uint64_t> suppressed{0};
+};
+LogBudget g_log_budget[2];
+
+// File output
+std::mutex g_log_file_mutex;
+std::condition_variable g_log_file_cv;
+std::string g_log_file_pending; // Formatted lines waiting for the writer thread
+bool g_log_file_stop = false;
+std::thread g_log_file_thread;
+
+bool take_log_budget(LogBudget& budget) {
+    uint64_t now = GetTickCount64() / 1000;
+    uint64_t second = budget.second.load(std::memory_order_relaxed);
+    if (second != now && budget.second.compare_exchange_strong(second, now)) {
+        budget.used.store(0, std::memory_order_relaxed);
+    }
+    if (budget.used.fetch_add(1, std::memory_order_relaxed) < g_log_rate_limit) return true;
+    budget.suppressed.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
 
-                g_is_waiting_for_hotkey = false;
+void log_message(LogTarget target, LogLevel level, const std::string& msg) {
+    if (level < g_log_min_level) return;
+    if (!take_log_budget(g_log_budget[target])) return;
+    LogEntry entry;
+    entry.target = target;
+    entry.level = level;
+    entry.length = (uint16_t)(std::min)(msg.size(), sizeof(entry.text));
+    memcpy(entry.text, msg.data(), entry.length);
+    SYSTEMTIME st;
+    GetLocalTime(&st);
+    entry.time_ms = ((st.wHour * 60 + st.wMinute) * 60 + st.wSecond) * 1000 + st.wMilliseconds;
+    if (!g_log_ring.try_push(entry)) g_log_dropped.fetch_add(1, std::memory_order_relaxed);
+}
 
-                std::string hotkey_str = GetHotkeyString();
-                char* msg_copy = new char[hotkey_str.length() + 1];
-                strcpy_s(msg_copy, hotkey_str.length() + 1, hotkey_str.c_str());
-                PostMessage(g_hwnd, WM_APP_UPDATE_HOTKEY_DISPLAY, (WPARAM)msg_copy, 0);
+void LogServerMessage(const std::string& msg) {
+    log_message(LOG_SERVER, LogLevel::Info, msg);
+}
 
-                return 1;
-            }
+void LogClientMessage(const std::string& msg) {
+    log_message(LOG_CLIENT, LogLevel::Info, msg);
+}
+
+void LogServerMessage(LogLevel level, const std::string& msg) {
+    log_message(LOG_SERVER, level, msg);
+}
+
+void LogClientMessage(LogLevel level, const std::string& msg) {
+    log_message(LOG_CLIENT, level, msg);
+}
+
+// Appends text to a log edit control, first dropping whole lines from the top so the
+// control never holds more than LOG_SCROLLBACK_CHARS.
+void append_to_log_control(HWND control, const std::string& text) {
+    const char* data = text.c_str();
+    size_t size = text.size();
+    if (size > (size_t)LOG_SCROLLBACK_CHARS) { // Only the newest part would survive anyway
+        data += size - LOG_SCROLLBACK_CHARS;
+        size = LOG_SCROLLBACK_CHARS;
+    }
+    int len = GetWindowTextLength(control);
+    if (len + (int)size > LOG_SCROLLBACK_CHARS) {
+        // Trim to three quarters so this does not repeat on every batch.
+        int excess = (std::min)(len, len + (int)size - LOG_SCROLLBACK_CHARS * 3 / 4);
+        int line = (int)SendMessage(control, EM_LINEFROMCHAR, (WPARAM)excess, 0);
+        int cut = (int)SendMessage(control, EM_LINEINDEX, (WPARAM)(line + 1), 0);
+        if (cut < 0 || cut < excess) cut = len;
+        SendMessage(control, WM_SETREDRAW, FALSE, 0);
+        SendMessage(control, EM_SETSEL, 0, (LPARAM)cut);
+        SendMessage(control, EM_REPLACESEL, 0, (LPARAM)"");
+        SendMessage(control, WM_SETREDRAW, TRUE, 0);
+        len = GetWindowTextLength(control);
+    }
+    SendMessage(control, EM_SETSEL, (WPARAM)len, (LPARAM)len);
+    SendMessage(control, EM_REPLACESEL, 0, (LPARAM)data);
+}
+
+// GUI thread, on IDT_LOG_TIMER (and once more at shutdown for the file).
+void drain_log_ring() {
+    static std::string display[2]; // Reused between drains
+    static std::string file_lines;
+    display[0].clear();
+    display[1].clear();
+    file_lines.clear();
+
+    LogEntry entry;
+    while (g_log_ring.try_pop(entry)) {
+        display[entry.target].append(entry.text, entry.length).append("\r\n");
+        if (g_log_to_file) {
+            char prefix[48];
+            uint32_t t = entry.time_ms;
+            snprintf(prefix, sizeof(prefix), "%02u:%02u:%02u.%03u %-7s %s ", t / 3600000, t / 60000 % 60, t / 1000 % 60,
+                     t % 1000, log_level_name(entry.level), entry.target == LOG_SERVER ? "server" : "client");
+            file_lines.append(prefix).append(entry.text, entry.length).append("\n");
         }
+    }
+    for (int target = 0; target < 2; ++target) {
+        uint64_t suppressed = g_log_budget[target].suppressed.exchange(0, std::memory_order_relaxed);
+        if (suppressed > 0) display[target] += "(" + std::to_string(suppressed) + " messages suppressed by the rate limit)\r\n";
+    }
+    uint64_t dropped = g_log_dropped.exchange(0, std::memory_order_relaxed);
+    if (dropped > 0) display[LOG_SERVER] += "(" + std::to_string(dropped) + " log messages dropped, log ring full)\r\n";
 
-        // --- Hotkey Detection Logic ---
-        if (g_is_server_active && !g_is_waiting_for_hotkey && (wParam == WM_KEYDOWN || wParam == WM_SYSKEYDOWN)) {
-            bool ctrl_is_down = (GetAsyncKeyState(VK_CONTROL) & 0x8000) != 0;
-            bool alt_is_down = (GetAsyncKeyState(VK_MENU) & 0x8000) != 0;
-            bool shift_is_down = (GetAsyncKeyState(VK_SHIFT) & 0x8000) != 0;
-            
-            if (pkb->vkCode == g_hotkey_vk.load() &&
-                ctrl_is_down == g_hotkey_ctrl.load() &&
-                alt_is_down == g_hotkey_alt.load() &&
-                shift_is_down == g_hotkey_shift.load())
-            {
-                LogServerMessage("Hotkey detected! Toggling control...");
-                toggle_control();
-                return 1;
-            }
+    if (g_log_to_console) {
+        for (const std::string& text : display) fwrite(text.data(), 1, text.size(), stdout);
+        fflush(stdout);
+    }
+    if (g_hServerLog && !display[LOG_SERVER].empty()) append_to_log_control(g_hServerLog, display[LOG_SERVER]);
+    if (g_hClientLog && !display[LOG_CLIENT].empty()) append_to_log_control(g_hClientLog, display[LOG_CLIENT]);
+    if (!file_lines.empty()) {
+        std::lock_guard<std::mutex> lock(g_log_file_mutex);
+        g_log_file_pending += file_lines;
+        g_log_file_cv.notify_one();
+    }
+}
+
+void run_log_file_writer(std::filesystem::path path) {
+    std::ofstream file(path, std::ios::app);
+    std::string batch;
+    std::unique_lock<std::mutex> lock(g_log_file_mutex);
+    for (;;) {
+        g_log_file_cv.wait(lock, []() { return g_log_file_stop || !g_log_file_pending.empty(); });
+        batch.swap(g_log_file_pending);
+        bool stop = g_log_file_stop;
+        lock.unlock();
+        if (file.is_open() && !batch.empty()) {
+            file << batch;
+            file.flush();
         }
+        batch.clear();
+        if (stop) return;
+        lock.lock();
+    }
+}
 
-        // --- Remote Control Logic ---
-        if (g_is_controlling_remote) {
-            std::string event_type = (wParam == WM_KEYDOWN || wParam == WM_SYSKEYDOWN) ? "key_press" : "key_release";
-            std::string data = "event:" + event_type + ",vk_code:" + std::to_string(pkb->vkCode) + "\n";
-            send_data(data);
-            return 1;
+void start_log_file_writer() {
+    if (!g_log_to_file || g_log_file_thread.joinable()) return;
+    g_log_file_stop = false;
+    g_log_file_thread = std::thread(run_log_file_writer, GetConfigPath().parent_path() / "kvm_log.txt");
+}
+
+// Writes out whatever is still queued and stops the writer.
+void stop_log_file_writer() {
+    if (!g_log_file_thread.joinable()) return;
+    drain_log_ring();
+    {
+        std::lock_guard<std::mutex> lock(g_log_file_mutex);
+        g_log_file_stop = true;
+    }
+    g_log_file_cv.notify_one();
+    g_log_file_thread.join();
+}
+
+void AddServerToList(const DiscoveredServer& server) {
+    if (g_front_end->server_found) g_front_end->server_found(server);
+}
+
+// Edge zone control last left through; -1 when control moved by hotkey. Hook thread only.
+int g_entry_zone = -1;
+
+// Hook thread, after control returns to a resumed client. It released its keys when
+// the link dropped, so queue a KeySync with the ones the server user is still holding.
+// The sender turns it into key presses for clients older than v6.
+void resync_held_keys() {
+    if (g_keys_held.empty()) return;
+    {
+        std::lock_guard<std::mutex> lock(g_key_sync_mutex);
+        g_key_sync = g_keys_held;
+    }
+    queue_event({ EventType::KeySync });
+}
+
+// Hands control to next, or back to local control when next is null. Runs on the hook
+// thread. The switch travels through the event ring, so input queued before it still
+// reaches the client it was meant for. enter, if given, follows the acquire.
+void switch_control(const std::shared_ptr<ClientSession>& next, const InputEvent* enter) {
+    g_entry_zone = -1;
+    g_resume_client_id = 0;
+    if (g_is_controlling_remote) queue_event({ EventType::ControlRelease });
+    if (next) {
+        if (!g_is_controlling_remote) {
+            GetCursorPos(&g_center_pos);
+            g_hook_calls = 0; g_hook_ticks = 0; g_hook_max_ticks = 0; // Report covers this session only
         }
+        g_active_client_id = next->id;
+        g_is_controlling_remote = true;
+        InputEvent acquire = { EventType::ControlAcquire };
+        acquire.seq = (uint32_t)next->id; // Target for the sender; not sent on the wire
+        queue_event(acquire);
+        if (enter) queue_event(*enter);
+        update_pointer_clip();
+        LogServerMessage("--- SWITCHED TO REMOTE CONTROL (client " + std::to_string(next->id) + ", " + next->address + ") ---");
+    } else {
+        g_active_client_id = 0;
+        g_is_controlling_remote = false;
+        update_pointer_clip();
+        LogServerMessage("--- SWITCHED TO LOCAL CONTROL ---");
+        release_stuck_server_keys();
+        report_hook_cost();
     }
-    return CallNextHookEx(g_keyboard_hook, nCode, wParam, lParam);
 }
 
+// Cycles control: local -> first client -> next client -> ... -> local.
+void toggle_control() {
+    int current = g_active_client_id;
+    std::shared_ptr<ClientSession> next;
+    size_t client_count = 0;
+    {
+        std::lock_guard<std::mutex> lock(g_sessions_mutex);
+        client_count = g_sessions.size();
+        for (const auto& session : g_sessions) {
+            if (session->id > current) { next = session; break; }
+        }
+    }
+    if (client_count == 0 && !g_is_controlling_remote) {
+        LogServerMessage("Cannot toggle control: No client connected.");
+        return;
+    }
+    switch_control(next, nullptr);
+}
+
+// --- Screen Layout ---
+// Layout links are turned into edge zones once (on hook install and display changes),
+// so the mouse hook only compares the cursor against a handful of precomputed spans.
+
+const LONG EDGE_REENTRY_INSET = 2; // Pixels inside the edge where a returning cursor lands
+
+struct EdgeZone {
+    uint8_t edge;
+    LONG line;       // x (left/right) or y (top/bottom) the cursor has to reach
+    LONG from, to;   // Span along the edge, [from, to)
+    LONG edge_start; // Start and length of the monitor's whole edge, for positions
+    LONG edge_length;
+    RECT monitor;
+    size_t link;     // Index into g_layout_links
+};
+std::vector<EdgeZone> g_edge_zones; // Hook thread only
+uint8_t g_mouse_buttons_down = 0;   // Hook thread; no edge switching while dragging
+
+BOOL CALLBACK collect_monitor_rect(HMONITOR, HDC, LPRECT rect, LPARAM param) {
+    ((std::vector<RECT>*)param)->push_back(*rect);
+    return TRUE;
+}
 
-LRESULT CALLBACK low_level_mouse_proc(int nCode, WPARAM wParam, LPARAM lParam) {
-    if (nCode == HC_ACTION && g_is_controlling_remote) {
-        MSLLHOOKSTRUCT* pms = (MSLLHOOKSTRUCT*)lParam;
-        std::string data;
-        switch (wParam) {
-            case WM_MOUSEMOVE: {
-                int dx = pms->pt.x - g_center_pos.x;
-                int dy = pms->pt.y - g_center_pos.y;
-                if (dx != 0 || dy != 0) {
-                    data = "event:mouse_move,dx:" + std::to_string(dx) + ",dy:" + std::to_string(dy) + "\n";
-                    SetCursorPos(g_center_pos.x, g_center_pos.y);
+bool is_horizontal_edge(uint8_t edge) { return edge == EDGE_TOP || edge == EDGE_BOTTOM; }
+
+void rebuild_edge_zones() {
+    g_edge_zones.clear();
+    if (!g_edge_switching || g_layout_links.empty()) return;
+
+    std::vector<RECT> monitors;
+    EnumDisplayMonitors(NULL, NULL, collect_monitor_rect, (LPARAM)&monitors);
+    for (size_t link_index = 0; link_index < g_layout_links.size(); ++link_index) {
+        const LayoutLink& link = g_layout_links[link_index];
+        const bool horizontal = is_horizontal_edge(link.edge);
+        for (size_t m = 0; m < monitors.size(); ++m) {
+            if (link.monitor >= 0 && (size_t)link.monitor != m) continue;
+            const RECT& r = monitors[m];
+            EdgeZone zone = {};
+            zone.edge = link.edge;
+            zone.monitor = r;
+            zone.link = link_index;
+            switch (link.edge) {
+                case EDGE_LEFT:  zone.line = r.left; break;
+                case EDGE_RIGHT: zone.line = r.right - 1; break;
+                case EDGE_TOP:   zone.line = r.top; break;
+                default:         zone.line = r.bottom - 1; break;
+            }
+            zone.edge_start = horizontal ? r.left : r.top;
+            zone.edge_length = horizontal ? r.right - r.left : r.bottom - r.top;
+
+            // Parts of the edge where a neighbouring monitor continues the desktop are
+            // not exits; cut them out.
+            std::vector<std::pair<LONG, LONG>> spans = { { zone.edge_start, zone.edge_start + zone.edge_length } };
+            for (size_t n = 0; n < monitors.size(); ++n) {
+                if (n == m) continue;
+                const RECT& o = monitors[n];
+                bool touches = (link.edge == EDGE_LEFT && o.right == r.left) || (link.edge == EDGE_RIGHT && o.left == r.right) ||
+                               (link.edge == EDGE_TOP && o.bottom == r.top) || (link.edge == EDGE_BOTTOM && o.top == r.bottom);
+                if (!touches) continue;
+                LONG cut_from = horizontal ? o.left : o.top;
+                LONG cut_to = horizontal ? o.right : o.bottom;
+                std::vector<std::pair<LONG, LONG>> remaining;
+                for (const auto& span : spans) {
+                    if (cut_from > span.first) remaining.push_back({ span.first, (std::min)(span.second, cut_from) });
+                    if (cut_to < span.second) remaining.push_back({ (std::max)(span.first, cut_to), span.second });
                 }
-                break;
+                spans.swap(remaining);
+            }
+            for (const auto& span : spans) {
+                if (span.first >= span.second) continue;
+                zone.from = span.first;
+                zone.to = span.second;
+                g_edge_zones.push_back(zone);
             }
-            case WM_LBUTTONDOWN: data = "event:mouse_down,button:left\n"; break;
-            case WM_LBUTTONUP:   data = "event:mouse_up,button:left\n"; break;
-            case WM_RBUTTONDOWN: data = "event:mouse_down,button:right\n"; break;
-            case WM_RBUTTONUP:   data = "event:mouse_up,button:right\n"; break;
-            case WM_MBUTTONDOWN: data = "event:mouse_down,button:middle\n"; break;
-            case WM_MBUTTONUP:   data = "event:mouse_up,button:middle\n"; break;
-            case WM_MOUSEWHEEL:
-                data = "event:mouse_scroll,delta:" + std::to_string(GET_WHEEL_DELTA_WPARAM(pms->mouseData)) + "\n";
-                break;
         }
-        if (!data.empty()) send_data(data);
-        return 1;
     }
-    return CallNextHookEx(g_mouse_hook, nCode, wParam, lParam);
+    LogServerMessage("Edge switching: " + std::to_string(g_edge_zones.size()) + " edge zone(s) on " +
+                     std::to_string(monitors.size()) + " monitor(s).");
 }
 
-void send_data(const std::string& data) {
-    std::lock_guard<std::mutex> lock(g_socket_mutex);
-    if (g_client_socket != INVALID_SOCKET) {
-        std::string log_data = data;
-        if (!log_data.empty() && log_data.back() == '\n') {
-            log_data.pop_back();
+// Hot path: called from the mouse hook for every local move while zones exist.
+int find_edge_zone(POINT pt) {
+    for (size_t i = 0; i < g_edge_zones.size(); ++i) {
+        const EdgeZone& zone = g_edge_zones[i];
+        LONG along = is_horizontal_edge(zone.edge) ? pt.x : pt.y;
+        if (along < zone.from || along >= zone.to) continue;
+        switch (zone.edge) {
+            case EDGE_LEFT:   if (pt.x <= zone.line) return (int)i; break;
+            case EDGE_RIGHT:  if (pt.x >= zone.line) return (int)i; break;
+            case EDGE_TOP:    if (pt.y <= zone.line) return (int)i; break;
+            case EDGE_BOTTOM: if (pt.y >= zone.line) return (int)i; break;
         }
+    }
+    return -1;
+}
 
-        int bytes_sent = send(g_client_socket, data.c_str(), (int)data.length(), 0);
-        if (bytes_sent == SOCKET_ERROR) {
-            LogServerMessage("!! SEND FAILED with error: " + std::to_string(WSAGetLastError()));
+// Hands control to the client linked to the zone the cursor just hit. Returns false
+// (the cursor simply stops at the edge) if that client is not connected.
+bool switch_control_at_edge(int zone_index, POINT pt) {
+    const EdgeZone& zone = g_edge_zones[zone_index];
+    const std::string& address = g_layout_links[zone.link].client;
+    std::shared_ptr<ClientSession> target;
+    {
+        std::lock_guard<std::mutex> lock(g_sessions_mutex);
+        for (const auto& session : g_sessions) {
+            if (session->address == address) { target = session; break; }
         }
     }
+    if (!target) return false;
+
+    LONG along = is_horizontal_edge(zone.edge) ? pt.x : pt.y;
+    InputEvent enter = { EventType::CursorEnter };
+    enter.edge = zone.edge;
+    enter.position = (uint16_t)(((int64_t)(along - zone.edge_start) * 65535) / (std::max)(1L, zone.edge_length - 1));
+    switch_control(target, &enter);
+    g_entry_zone = zone_index;
+
+    // Park the local cursor mid-monitor so relative motion is never clamped at the edge.
+    g_center_pos.x = (zone.monitor.left + zone.monitor.right) / 2;
+    g_center_pos.y = (zone.monitor.top + zone.monitor.bottom) / 2;
+    SetCursorPos(g_center_pos.x, g_center_pos.y);
+    update_pointer_clip();
+    return true;
+}
+
+// Hook thread, when the client under control reports its cursor left through the edge
+// facing us. Control comes back and the local cursor reappears at the matching spot.
+void return_control_from_edge(int client_id, uint16_t position) {
+    if (!g_is_controlling_remote || g_active_client_id != client_id) return;
+    if (g_entry_zone < 0 || g_entry_zone >= (int)g_edge_zones.size()) return;
+    const EdgeZone zone = g_edge_zones[g_entry_zone];
+    switch_control(nullptr, nullptr);
+
+    LONG along = zone.edge_start + (LONG)(((int64_t)position * (std::max)(1L, zone.edge_length - 1)) / 65535);
+    along = std::clamp(along, zone.from, zone.to - 1);
+    POINT pt;
+    switch (zone.edge) {
+        case EDGE_LEFT:  pt = { zone.line + EDGE_REENTRY_INSET, along }; break;
+        case EDGE_RIGHT: pt = { zone.line - EDGE_REENTRY_INSET, along }; break;
+        case EDGE_TOP:   pt = { along, zone.line + EDGE_REENTRY_INSET }; break;
+        default:         pt = { along, zone.line - EDGE_REENTRY_INSET }; break;
+    }
+    SetCursorPos(pt.x, pt.y);
 }
 
-void simulate_key_event(int vk_code, bool is_down) {
-    INPUT input = {};
-    input.type = INPUT_KEYBOARD;
-    input.ki.wVk = vk_code;
-    input.ki.dwFlags = is_down ? 0 : KEYEVENTF_KEYUP;
-    SendInput(1, &input, sizeof(INPUT));
+// --- Connection Tuning ---
+
+typedef BOOL (WINAPI* QOSCreateHandleFn)(PQOS_VERSION, PHANDLE);
+typedef BOOL (WINAPI* QOSCloseHandleFn)(HANDLE);
+typedef BOOL (WINAPI* QOSAddSocketToFlowFn)(HANDLE, SOCKET, PSOCKADDR, QOS_TRAFFIC_TYPE, DWORD, PQOS_FLOWID);
+typedef BOOL (WINAPI* QOSSetFlowFn)(HANDLE, QOS_FLOWID, QOS_SET_FLOW, ULONG, PVOID, DWORD, LPOVERLAPPED);
+typedef BOOL (WINAPI* QOSRemoveSocketFromFlowFn)(HANDLE, SOCKET, QOS_FLOWID, DWORD);
+
+// qWAVE is optional (e.g. absent on Server SKUs), so it is resolved at runtime.
+std::mutex g_qos_mutex;
+HMODULE g_qwave_dll = NULL;
+HANDLE g_qos_handle = NULL;
+QOSCloseHandleFn g_QOSCloseHandle = nullptr;
+QOSAddSocketToFlowFn g_QOSAddSocketToFlow = nullptr;
+QOSSetFlowFn g_QOSSetFlow = nullptr;
+QOSRemoveSocketFromFlowFn g_QOSRemoveSocketFromFlow = nullptr;
+// The flow each tagged socket was added to, removed again by close_tuned_socket.
+std::vector<std::pair<SOCKET, QOS_FLOWID>> g_qos_flows;
+
+bool parse_qos_traffic_type(const std::string& name, QOS_TRAFFIC_TYPE& type) {
+    if (name == "best_effort")      { type = QOSTrafficTypeBestEffort; return true; }
+    if (name == "background")       { type = QOSTrafficTypeBackground; return true; }
+    if (name == "excellent_effort") { type = QOSTrafficTypeExcellentEffort; return true; }
+    if (name == "audio_video")      { type = QOSTrafficTypeAudioVideo; return true; }
+    if (name == "voice")            { type = QOSTrafficTypeVoice; return true; }
+    if (name == "control")          { type = QOSTrafficTypeControl; return true; }
+    return false;
 }
 
-void release_all_server_modifiers() {
-    LogServerMessage("Failsafe: Releasing all local server modifier keys.");
-    simulate_key_event(VK_LCONTROL, false); simulate_key_event(VK_RCONTROL, false);
-    simulate_key_event(VK_LSHIFT, false); simulate_key_event(VK_RSHIFT, false);
-    simulate_key_event(VK_LMENU, false); simulate_key_event(VK_RMENU, false);
-    simulate_key_event(VK_LWIN, false); simulate_key_event(VK_RWIN, false);
+// Caller must hold g_qos_mutex.
+bool ensure_qos_handle() {
+    if (g_qos_handle != NULL) return true;
+    if (g_qwave_dll == NULL) g_qwave_dll = LoadLibraryA("qwave.dll");
+    if (g_qwave_dll == NULL) return false;
+
+    QOSCreateHandleFn create_handle = (QOSCreateHandleFn)(void*)GetProcAddress(g_qwave_dll, "QOSCreateHandle");
+    g_QOSCloseHandle = (QOSCloseHandleFn)(void*)GetProcAddress(g_qwave_dll, "QOSCloseHandle");
+    g_QOSAddSocketToFlow = (QOSAddSocketToFlowFn)(void*)GetProcAddress(g_qwave_dll, "QOSAddSocketToFlow");
+    g_QOSSetFlow = (QOSSetFlowFn)(void*)GetProcAddress(g_qwave_dll, "QOSSetFlow");
+    g_QOSRemoveSocketFromFlow = (QOSRemoveSocketFromFlowFn)(void*)GetProcAddress(g_qwave_dll, "QOSRemoveSocketFromFlow");
+    if (!create_handle || !g_QOSCloseHandle || !g_QOSAddSocketToFlow || !g_QOSSetFlow || !g_QOSRemoveSocketFromFlow) return false;
+
+    QOS_VERSION version = { 1, 0 };
+    if (!create_handle(&version, &g_qos_handle)) {
+        g_qos_handle = NULL;
+        return false;
+    }
+    return true;
+}
+
+void close_qos_handle() {
+    std::lock_guard<std::mutex> lock(g_qos_mutex);
+    if (g_qos_handle != NULL) g_QOSCloseHandle(g_qos_handle); // Also ends any flow still open
+    g_qos_handle = NULL;
+    g_qos_flows.clear();
+    if (g_qwave_dll != NULL) FreeLibrary(g_qwave_dll);
+    g_qwave_dll = NULL;
 }
 
-void simulate_mouse_event(const std::string& event_type, int val1, int val2, int delta) {
-    INPUT input = {};
-    input.type = INPUT_MOUSE;
-    if (event_type == "mouse_move") {
-        input.mi.dwFlags = MOUSEEVENTF_MOVE;
-        input.mi.dx = val1; input.mi.dy = val2;
-    } else if (event_type == "mouse_down") {
-        if (val1 == 0) input.mi.dwFlags = MOUSEEVENTF_LEFTDOWN;
-        else if (val1 == 1) input.mi.dwFlags = MOUSEEVENTF_RIGHTDOWN;
-        else if (val1 == 2) input.mi.dwFlags = MOUSEEVENTF_MIDDLEDOWN;
-    } else if (event_type == "mouse_up") {
-        if (val1 == 0) input.mi.dwFlags = MOUSEEVENTF_LEFTUP;
-        else if (val1 == 1) input.mi.dwFlags = MOUSEEVENTF_RIGHTUP;
-        else if (val1 == 2) input.mi.dwFlags = MOUSEEVENTF_MIDDLEUP;
-    } else if (event_type == "mouse_scroll") {
-        input.mi.dwFlags = MOUSEEVENTF_WHEEL;
-        input.mi.mouseData = delta;
+// Tags a connected socket with a qWAVE traffic type and optional DSCP value.
+std::string apply_socket_qos(SOCKET sock, const SocketTuning& tuning) {
+    QOS_TRAFFIC_TYPE traffic_type;
+    if (!parse_qos_traffic_type(tuning.qos_traffic_type, traffic_type)) return "off";
+
+    std::lock_guard<std::mutex> lock(g_qos_mutex);
+    if (!ensure_qos_handle()) return "unavailable (qWAVE not installed)";
+
+    QOS_FLOWID flow_id = 0;
+    if (!g_QOSAddSocketToFlow(g_qos_handle, sock, NULL, traffic_type, QOS_NON_ADAPTIVE_FLOW, &flow_id)) {
+        return "failed (error " + std::to_string(GetLastError()) + ")";
+    }
+    g_qos_flows.emplace_back(sock, flow_id);
+    std::string result = tuning.qos_traffic_type;
+    if (tuning.dscp >= 0) {
+        DWORD dscp = (DWORD)tuning.dscp;
+        if (g_QOSSetFlow(g_qos_handle, flow_id, QOSSetOutgoingDSCPValue, sizeof(dscp), &dscp, 0, NULL)) {
+            result += ", DSCP " + std::to_string(dscp);
+        } else {
+            result += ", DSCP " + std::to_string(dscp) + " rejected (error " + std::to_string(GetLastError()) + ", needs admin)";
+        }
     }
-    SendInput(1, &input, sizeof(INPUT));
+    return result;
 }
 
-void release_all_client_modifiers() {
-    LogClientMessage("Failsafe: Releasing all remote modifier keys.");
-    INPUT inputs[8] = {};
-    int keys[] = { VK_LCONTROL, VK_RCONTROL, VK_LSHIFT, VK_RSHIFT, VK_LMENU, VK_RMENU, VK_LWIN, VK_RWIN };
-    for (int i = 0; i < 8; ++i) {
-        inputs[i].type = INPUT_KEYBOARD;
-        inputs[i].ki.wVk = keys[i];
-        inputs[i].ki.dwFlags = KEYEVENTF_KEYUP;
+// Closes a socket that may have been through apply_socket_qos. Its flow is removed
+// first: qWAVE keeps a flow until then, and the socket value may be reused.
+void close_tuned_socket(SOCKET sock) {
+    {
+        std::lock_guard<std::mutex> lock(g_qos_mutex);
+        auto flow = std::find_if(g_qos_flows.begin(), g_qos_flows.end(),
+                                 [&](const std::pair<SOCKET, QOS_FLOWID>& entry) { return entry.first == sock; });
+        if (flow != g_qos_flows.end()) {
+            if (g_qos_handle != NULL) g_QOSRemoveSocketFromFlow(g_qos_handle, sock, flow->second, 0);
+            g_qos_flows.erase(flow);
+        }
     }
-    SendInput(8, inputs, sizeof(INPUT));
+    closesocket(sock);
 }
 
+int get_socket_int_option(SOCKET sock, int level, int name) {
+    int value = 0;
+    int len = sizeof(value);
+    if (getsockopt(sock, level, name, (char*)&value, &len) == SOCKET_ERROR) return -1;
+    return value;
+}
 
-void process_message(const std::string& message) {
-    size_t pos = message.find("event:");
-    if (pos != std::string::npos) {
-        std::string event_str = message.substr(pos + 6);
-        std::string event_type = event_str.substr(0, event_str.find_first_of(",\n"));
-        
-        std::vector<std::pair<std::string, std::string>> params;
-        size_t start = event_type.length();
-        while(start < event_str.length()) {
-            start = event_str.find(',', start);
-            if(start == std::string::npos) break;
-            start++;
-            size_t end_key = event_str.find(':', start);
-            if(end_key == std::string::npos) break;
-            std::string key = event_str.substr(start, end_key - start);
-            start = end_key + 1;
-            size_t end_val = event_str.find_first_of(",\n", start);
-            std::string value = event_str.substr(start, end_val - start);
-            params.push_back({key, value});
-            start = end_val;
-        }
-
-        if (event_type == "control_acquire") { LogClientMessage("Server is now in control."); }
-        else if (event_type == "control_release") { LogClientMessage("Server has released control."); release_all_client_modifiers(); }
-        else if (event_type == "key_press" && !params.empty()) simulate_key_event(std::stoi(params[0].second), true);
-        else if (event_type == "key_release" && !params.empty()) simulate_key_event(std::stoi(params[0].second), false);
-        else if (event_type == "mouse_move" && params.size() >= 2) simulate_mouse_event("mouse_move", std::stoi(params[0].second), std::stoi(params[1].second), 0);
-        else if (event_type == "mouse_down" && !params.empty()) simulate_mouse_event("mouse_down", (params[0].second == "left" ? 0 : (params[0].second == "right" ? 1 : 2)), 0, 0);
-        else if (event_type == "mouse_up" && !params.empty()) simulate_mouse_event("mouse_up", (params[0].second == "left" ? 0 : (params[0].second == "right" ? 1 : 2)), 0, 0);
-        else if (event_type == "mouse_scroll" && !params.empty()) simulate_mouse_event("mouse_scroll", 0, 0, std::stoi(params[0].second));
-    }
-}
-
-void run_client_scan_logic() {
-    LogClientMessage("Scanning for servers...");
+// Applies g_socket_tuning to a connected KVM socket and logs the effective values.
+void apply_socket_tuning(SOCKET sock, void (*log)(const std::string&)) {
+    const SocketTuning& tuning = g_socket_tuning;
 
-    SOCKET discovery_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-    g_discovery_socket.store(discovery_socket);
+    BOOL nodelay = tuning.tcp_nodelay ? TRUE : FALSE;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char*)&nodelay, sizeof(nodelay));
 
-    sockaddr_in client_addr = {};
-    client_addr.sin_family = AF_INET;
-    client_addr.sin_port = htons(DISCOVERY_PORT);
-    client_addr.sin_addr.s_addr = INADDR_ANY;
-    
-    if (bind(discovery_socket, (SOCKADDR*)&client_addr, sizeof(client_addr)) == SOCKET_ERROR) {
-        LogClientMessage("Discovery bind failed.");
-        g_discovery_socket.store(INVALID_SOCKET);
-        closesocket(discovery_socket);
-        return;
+    if (tuning.send_buffer_bytes > 0) {
+        setsockopt(sock, SOL_SOCKET, SO_SNDBUF, (const char*)&tuning.send_buffer_bytes, sizeof(int));
+    }
+    if (tuning.receive_buffer_bytes > 0) {
+        setsockopt(sock, SOL_SOCKET, SO_RCVBUF, (const char*)&tuning.receive_buffer_bytes, sizeof(int));
+    }
+
+    std::string keepalive_str = "off";
+    if (tuning.keepalive) {
+        tcp_keepalive keepalive = {};
+        keepalive.onoff = 1;
+        keepalive.keepalivetime = (ULONG)tuning.keepalive_time_ms;
+        keepalive.keepaliveinterval = (ULONG)tuning.keepalive_interval_ms;
+        DWORD bytes_returned = 0;
+        if (WSAIoctl(sock, SIO_KEEPALIVE_VALS, &keepalive, sizeof(keepalive), NULL, 0, &bytes_returned, NULL, NULL) == 0) {
+            keepalive_str = std::to_string(tuning.keepalive_time_ms) + "/" + std::to_string(tuning.keepalive_interval_ms) + " ms";
+        } else {
+            keepalive_str = "failed (error " + std::to_string(WSAGetLastError()) + ")";
+        }
     }
-    
-    DWORD timeout = 3000;
-    setsockopt(discovery_socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
 
-    char discovery_buffer[1024];
-    sockaddr_in server_addr_from_discovery;
-    int addr_len = sizeof(server_addr_from_discovery);
+    std::string qos_str = apply_socket_qos(sock, tuning);
 
-    int bytes_received = recvfrom(discovery_socket, discovery_buffer, sizeof(discovery_buffer) - 1, 0, (SOCKADDR*)&server_addr_from_discovery, &addr_len);
-    
-    g_discovery_socket.store(INVALID_SOCKET);
-    closesocket(discovery_socket);
+    log("Socket tuning: TCP_NODELAY=" + std::to_string(get_socket_int_option(sock, IPPROTO_TCP, TCP_NODELAY) != 0) +
+        ", SO_SNDBUF=" + std::to_string(get_socket_int_option(sock, SOL_SOCKET, SO_SNDBUF)) +
+        ", SO_RCVBUF=" + std::to_string(get_socket_int_option(sock, SOL_SOCKET, SO_RCVBUF)) +
+        ", keepalive=" + keepalive_str + ", QoS=" + qos_str);
+}
+
+// --- Latency Statistics ---
+// The sender registers each probe with the capture time of the event it follows and
+// the time it went out. When the client's echo arrives, the hook-to-SendInput latency
+// is estimated as:
+//   queue (hook -> send, local) + (round trip - client hold) / 2 + client hold
+// which only assumes the network path is symmetric.
+
+const size_t LATENCY_PROBE_SLOTS = 64;           // Probes that can be in flight
+const size_t LATENCY_WINDOW = 256;               // Most recent samples behind p50/p99/max
+const size_t LATENCY_HISTORY_CAPACITY = 100000;  // Samples kept for CSV export (oldest dropped)
+const size_t HEARTBEAT_RTT_WINDOW = 64;          // Most recent heartbeat round trips behind the RTT readout
+
+struct LatencyProbeRecord {
+    uint32_t id = 0;
+    int64_t hook_qpc = 0;
+    int64_t sent_qpc = 0;
+};
+
+struct LatencySample {
+    int64_t received_qpc;
+    uint32_t probe_id;
+    uint32_t queue_us;
+    uint32_t rtt_us;
+    uint32_t client_us;
+    uint32_t latency_us;
+    double events_per_sec; // Throughput at the time of the sample
+    double bytes_per_sec;
+};
+
+std::mutex g_latency_mutex; // Guards everything below
+LatencyProbeRecord g_latency_probes[LATENCY_PROBE_SLOTS];
+uint32_t g_next_probe_id = 1;
+std::vector<LatencySample> g_latency_history;
+size_t g_latency_history_next = 0; // Ring position once the history is full
+int64_t g_latency_origin_qpc = 0;
+uint32_t g_heartbeat_rtts[HEARTBEAT_RTT_WINDOW]; // Any client, newest at g_heartbeat_rtt_count - 1
+size_t g_heartbeat_rtt_count = 0;
+double g_events_per_sec = 0;
+double g_bytes_per_sec = 0;
+
+uint32_t qpc_to_us(int64_t ticks) {
+    if (ticks <= 0) return 0;
+    int64_t us = ticks * 1000000 / g_qpc_frequency;
+    return us > UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+}
+
+void reset_latency_stats() {
+    std::lock_guard<std::mutex> lock(g_latency_mutex);
+    for (LatencyProbeRecord& probe : g_latency_probes) probe = {};
+    g_latency_history.clear();
+    g_latency_history_next = 0;
+    g_heartbeat_rtt_count = 0;
+    g_latency_origin_qpc = qpc_now();
+}
+
+// Sender thread. Returns the id to put in the LatencyProbe frame.
+uint32_t register_latency_probe(int64_t hook_qpc, int64_t sent_qpc) {
+    std::lock_guard<std::mutex> lock(g_latency_mutex);
+    uint32_t id = g_next_probe_id++;
+    LatencyProbeRecord& probe = g_latency_probes[id % LATENCY_PROBE_SLOTS];
+    probe.id = id;
+    probe.hook_qpc = hook_qpc;
+    probe.sent_qpc = sent_qpc;
+    return id;
+}
+
+// Client connection thread, on a LatencyEcho frame.
+void record_latency_echo(uint32_t probe_id, uint32_t client_us) {
+    int64_t now = qpc_now();
+    std::lock_guard<std::mutex> lock(g_latency_mutex);
+    LatencyProbeRecord& probe = g_latency_probes[probe_id % LATENCY_PROBE_SLOTS];
+    if (probe.id != probe_id) return; // Unknown, or overwritten by a newer probe
+
+    LatencySample sample;
+    sample.received_qpc = now;
+    sample.probe_id = probe_id;
+    sample.queue_us = qpc_to_us(probe.sent_qpc - probe.hook_qpc);
+    sample.rtt_us = qpc_to_us(now - probe.sent_qpc);
+    sample.client_us = (std::min)(client_us, sample.rtt_us);
+    sample.latency_us = sample.queue_us + (sample.rtt_us - sample.client_us) / 2 + sample.client_us;
+    sample.events_per_sec = g_events_per_sec;
+    sample.bytes_per_sec = g_bytes_per_sec;
+    probe.id = 0;
+
+    if (g_latency_history.size() < LATENCY_HISTORY_CAPACITY) {
+        g_latency_history.push_back(sample);
+    } else {
+        g_latency_history[g_latency_history_next] = sample;
+        g_latency_history_next = (g_latency_history_next + 1) % LATENCY_HISTORY_CAPACITY;
+    }
+}
+
+// Engine thread, on a HeartbeatAck. Heartbeats flow even while no input does, so this
+// keeps the round-trip readout current when there are no latency probes.
+void record_heartbeat_rtt(uint32_t rtt_us) {
+    std::lock_guard<std::mutex> lock(g_latency_mutex);
+    g_heartbeat_rtts[g_heartbeat_rtt_count++ % HEARTBEAT_RTT_WINDOW] = rtt_us;
+}
+
+std::string format_us(uint32_t us) {
+    char text[32];
+    snprintf(text, sizeof(text), "%.2f ms", us / 1000.0);
+    return text;
+}
+
+// GUI timer, every STATS_REFRESH_MS. Updates the throughput rates and returns the
+// text for the server's stats readout.
+std::string update_live_stats() {
+    static uint64_t last_events = 0, last_bytes = 0, last_records = 0, last_seal_ticks = 0;
+    static int64_t last_qpc = 0;
+    static double seal_us = -1; // Average cost of sealing one record, kept while idle
+    int64_t now = qpc_now();
+    uint64_t events = g_stat_events_sent.load(std::memory_order_relaxed);
+    uint64_t bytes = g_stat_bytes_sent.load(std::memory_order_relaxed);
+    uint64_t records = g_stat_records_sealed.load(std::memory_order_relaxed);
+    uint64_t seal_ticks = g_stat_seal_ticks.load(std::memory_order_relaxed);
+    if (records > last_records) seal_us = (double)(seal_ticks - last_seal_ticks) * 1e6 / g_qpc_frequency / (records - last_records);
+    last_records = records;
+    last_seal_ticks = seal_ticks;
+    double seconds = last_qpc != 0 ? (double)(now - last_qpc) / g_qpc_frequency : 0;
+
+    std::vector<uint32_t> window;
+    std::vector<uint32_t> rtts;
+    {
+        std::lock_guard<std::mutex> lock(g_latency_mutex);
+        rtts.assign(g_heartbeat_rtts, g_heartbeat_rtts + (std::min)(g_heartbeat_rtt_count, HEARTBEAT_RTT_WINDOW));
+        if (seconds > 0) {
+            g_events_per_sec = (events - last_events) / seconds;
+            g_bytes_per_sec = (bytes - last_bytes) / seconds;
+        }
+        size_t count = (std::min)(g_latency_history.size(), LATENCY_WINDOW);
+        size_t newest = (g_latency_history_next + g_latency_history.size() - 1) % (std::max<size_t>)(g_latency_history.size(), 1);
+        for (size_t i = 0; i < count; ++i) {
+            size_t index = (newest + g_latency_history.size() - i) % g_latency_history.size();
+            window.push_back(g_latency_history[index].latency_us);
+        }
+    }
+    last_events = events;
+    last_bytes = bytes;
+    last_qpc = now;
+
+    char rates[96];
+    snprintf(rates, sizeof(rates), "%.0f events/s, %.1f KB/s", g_events_per_sec, g_bytes_per_sec / 1024.0);
+    std::string rtt_text;
+    if (!rtts.empty()) {
+        std::sort(rtts.begin(), rtts.end());
+        rtt_text = " | RTT " + format_us(rtts[rtts.size() / 2]) + ", max " + format_us(rtts.back());
+    }
+    if (seal_us >= 0) {
+        char aead[48];
+        snprintf(aead, sizeof(aead), " | AEAD %.2f us/record", seal_us);
+        rtt_text += aead;
+    }
+    // Client role: how many inputs each SendInput call carried since startup
+    if (g_stat_events_injected.load(std::memory_order_relaxed) > 0) rtt_text += " | Batches " + format_inject_histogram();
+    if (window.empty()) return std::string("Latency: n/a | ") + rates + rtt_text;
+
+    std::sort(window.begin(), window.end());
+    uint32_t p50 = window[window.size() / 2];
+    uint32_t p99 = window[(std::min)(window.size() - 1, window.size() * 99 / 100)];
+    return "Latency p50 " + format_us(p50) + ", p99 " + format_us(p99) + ", max " + format_us(window.back()) +
+           " | " + rates + rtt_text;
+}
 
-    if (!g_is_running) return;
-    if (bytes_received <= 0) {
-        LogClientMessage("No servers found.");
+// Writes every recorded sample to a timestamped CSV next to the config file.
+void export_latency_csv() {
+    std::vector<LatencySample> samples;
+    int64_t origin = 0;
+    {
+        std::lock_guard<std::mutex> lock(g_latency_mutex);
+        samples.insert(samples.end(), g_latency_history.begin() + g_latency_history_next, g_latency_history.end());
+        samples.insert(samples.end(), g_latency_history.begin(), g_latency_history.begin() + g_latency_history_next);
+        origin = g_latency_origin_qpc;
+    }
+    if (samples.empty()) {
+        LogServerMessage("No latency samples to export yet (needs a client on protocol v3).");
         return;
     }
-    
-    discovery_buffer[bytes_received] = '\0';
-    if (std::string(discovery_buffer) != DISCOVERY_MESSAGE) {
-        LogClientMessage("Received invalid discovery message.");
+
+    SYSTEMTIME st;
+    GetLocalTime(&st);
+    char file_name[64];
+    snprintf(file_name, sizeof(file_name), "latency_%04d%02d%02d_%02d%02d%02d.csv",
+             st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond);
+    std::filesystem::path path = GetConfigPath().parent_path() / file_name;
+
+    std::ofstream file(path);
+    if (!file.is_open()) {
+        LogServerMessage("Could not write " + path.string());
         return;
     }
+    file << "time_s,probe_id,queue_us,rtt_us,client_us,latency_us,events_per_sec,bytes_per_sec\n";
+    for (const LatencySample& sample : samples) {
+        char line[160];
+        snprintf(line, sizeof(line), "%.6f,%u,%u,%u,%u,%u,%.1f,%.1f\n",
+                 (double)(sample.received_qpc - origin) / g_qpc_frequency, sample.probe_id, sample.queue_us,
+                 sample.rtt_us, sample.client_us, sample.latency_us, sample.events_per_sec, sample.bytes_per_sec);
+        file << line;
+    }
+    LogServerMessage("Exported " + std::to_string(samples.size()) + " latency samples to " + path.string());
+}
 
-    char server_ip[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &server_addr_from_discovery.sin_addr, server_ip, INET_ADDRSTRLEN);
-    AddServerToList(server_ip);
-    LogClientMessage(std::string("Found server at ") + server_ip);
+// --- Discovery ---
+
+// Every IPv4 interface that is up, loopback excluded, that has all of the IFF_* flags.
+std::vector<INTERFACE_INFO> get_ipv4_interfaces(SOCKET sock, ULONG flags) {
+    std::vector<INTERFACE_INFO> result;
+    INTERFACE_INFO interfaces[32];
+    DWORD bytes = 0;
+    if (WSAIoctl(sock, SIO_GET_INTERFACE_LIST, NULL, 0, interfaces, sizeof(interfaces), &bytes, NULL, NULL) == 0) {
+        size_t count = bytes / sizeof(INTERFACE_INFO);
+        for (size_t i = 0; i < count; ++i) {
+            const INTERFACE_INFO& info = interfaces[i];
+            if ((info.iiFlags & (IFF_UP | flags)) != (IFF_UP | flags) || (info.iiFlags & IFF_LOOPBACK)) continue;
+            if (info.iiAddress.AddressIn.sin_family != AF_INET) continue;
+            result.push_back(info);
+        }
+    }
+    return result;
 }
 
-void run_client_connect_logic(std::string server_ip) {
-    LogClientMessage("Connecting to " + server_ip + "...");
+// Directed broadcast address of every IPv4 interface that is up, plus the limited
+// broadcast address, so probes and announcements reach every attached network.
+std::vector<in_addr> get_broadcast_addresses(SOCKET sock) {
+    std::vector<in_addr> addresses;
+    for (const INTERFACE_INFO& info : get_ipv4_interfaces(sock, IFF_BROADCAST)) {
+        in_addr broadcast;
+        broadcast.s_addr = info.iiAddress.AddressIn.sin_addr.s_addr | ~info.iiNetmask.AddressIn.sin_addr.s_addr;
+        addresses.push_back(broadcast);
+    }
+    in_addr limited;
+    limited.s_addr = INADDR_BROADCAST;
+    addresses.push_back(limited);
+    std::sort(addresses.begin(), addresses.end(), [](const in_addr& a, const in_addr& b) { return a.s_addr < b.s_addr; });
+    addresses.erase(std::unique(addresses.begin(), addresses.end(), [](const in_addr& a, const in_addr& b) { return a.s_addr == b.s_addr; }),
+                    addresses.end());
+    return addresses;
+}
 
-    SOCKET connect_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    g_connect_socket.store(connect_socket);
+// Joins the discovery multicast group on every multicast-capable interface. Returns
+// how many joined; interfaces that come up later are not covered until a restart.
+int join_discovery_group(SOCKET sock) {
+    ip_mreq membership = {};
+    inet_pton(AF_INET, DISCOVERY_MULTICAST_GROUP, &membership.imr_multiaddr);
+    int joined = 0;
+    for (const INTERFACE_INFO& info : get_ipv4_interfaces(sock, IFF_MULTICAST)) {
+        membership.imr_interface = info.iiAddress.AddressIn.sin_addr;
+        if (setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, (const char*)&membership, sizeof(membership)) == 0) ++joined;
+    }
+    if (joined == 0) {
+        membership.imr_interface.s_addr = INADDR_ANY; // Let the stack pick the default interface
+        if (setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, (const char*)&membership, sizeof(membership)) == 0) ++joined;
+    }
+    return joined;
+}
 
-    sockaddr_in server_connect_addr = {};
-    server_connect_addr.sin_family = AF_INET;
-    server_connect_addr.sin_port = htons(KVM_PORT);
-    inet_pton(AF_INET, server_ip.c_str(), &server_connect_addr.sin_addr);
+// Index of every interface with an IPv6 link-local address, which each interface that
+// runs IPv6 has. sock must be an IPv6 socket.
+std::vector<ULONG> get_ipv6_interfaces(SOCKET sock) {
+    std::vector<ULONG> indexes;
+    alignas(SOCKET_ADDRESS_LIST) char buffer[4096];
+    DWORD bytes = 0;
+    if (WSAIoctl(sock, SIO_ADDRESS_LIST_QUERY, NULL, 0, buffer, sizeof(buffer), &bytes, NULL, NULL) != 0) return indexes;
+    const SOCKET_ADDRESS_LIST* list = (const SOCKET_ADDRESS_LIST*)buffer;
+    for (int i = 0; i < list->iAddressCount; ++i) {
+        const SOCKET_ADDRESS& address = list->Address[i];
+        if (address.iSockaddrLength < (int)sizeof(sockaddr_in6) || address.lpSockaddr->sa_family != AF_INET6) continue;
+        const sockaddr_in6* v6 = (const sockaddr_in6*)address.lpSockaddr;
+        if (!IN6_IS_ADDR_LINKLOCAL(&v6->sin6_addr) || v6->sin6_scope_id == 0) continue;
+        if (std::find(indexes.begin(), indexes.end(), v6->sin6_scope_id) == indexes.end()) indexes.push_back(v6->sin6_scope_id);
+    }
+    return indexes;
+}
 
-    if (connect(connect_socket, (SOCKADDR*)&server_connect_addr, sizeof(server_connect_addr)) == SOCKET_ERROR) {
-        LogClientMessage("Failed to connect to server.");
-        g_connect_socket.store(INVALID_SOCKET);
-        closesocket(connect_socket);
-        return;
+// join_discovery_group for IPv6: joins each of DISCOVERY_MULTICAST_GROUPS_V6 on every
+// IPv6 interface. Returns how many memberships were added.
+int join_discovery_groups_v6(SOCKET sock) {
+    std::vector<ULONG> interfaces = get_ipv6_interfaces(sock);
+    if (interfaces.empty()) interfaces.push_back(0); // Let the stack pick the default interface
+    int joined = 0;
+    for (const char* group : DISCOVERY_MULTICAST_GROUPS_V6) {
+        ipv6_mreq membership = {};
+        inet_pton(AF_INET6, group, &membership.ipv6mr_multiaddr);
+        for (ULONG index : interfaces) {
+            membership.ipv6mr_interface = index;
+            if (setsockopt(sock, IPPROTO_IPV6, IPV6_JOIN_GROUP, (const char*)&membership, sizeof(membership)) == 0) ++joined;
+        }
+    }
+    return joined;
+}
+
+// Discovery thread. Answers every probe queued on sock (either family) with reply.
+void answer_discovery_probes(SOCKET sock, const std::string& reply) {
+    char probe[128];
+    SocketAddress from;
+    from.length = sizeof(from.storage);
+    int bytes;
+    while ((bytes = recvfrom(sock, probe, sizeof(probe), 0, from.get(), &from.length)) > 0) {
+        int version = 0;
+        if (parse_handshake_line(std::string_view(probe, bytes), "discover", version)) {
+            sendto(sock, reply.c_str(), (int)reply.length(), 0, from.get(), from.length);
+        }
+        from.length = sizeof(from.storage);
     }
+}
 
-    PostMessage(g_hwnd, WM_APP_CLIENT_CONNECTED, 0, 0);
-    LogClientMessage("Connected to server. Awaiting remote control...");
+// Server side of discovery. Answers each client probe, sent to the multicast group or
+// to a broadcast address, straight away with a unicast reply naming this host, the
+// KVM port and protocol version. Unless "announce" is off, also keeps sending the old
+// periodic announcement, on every interface, for clients that only listen.
+void run_discovery_responder(const StopSignal& stop) {
+    SOCKET sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock == INVALID_SOCKET) return;
+    BOOL broadcast = TRUE;
+    setsockopt(sock, SOL_SOCKET, SO_BROADCAST, (const char*)&broadcast, sizeof(broadcast));
+
+    sockaddr_in probe_addr = {};
+    probe_addr.sin_family = AF_INET;
+    probe_addr.sin_port = htons(DISCOVERY_PROBE_PORT);
+    probe_addr.sin_addr.s_addr = INADDR_ANY;
+    bool answering = bind(sock, (SOCKADDR*)&probe_addr, sizeof(probe_addr)) != SOCKET_ERROR;
+    if (!answering) {
+        LogServerMessage(LogLevel::Warning, "Discovery probe port " + std::to_string(DISCOVERY_PROBE_PORT) +
+                         " is in use; sending periodic announcements only.");
+    } else if (g_discovery_multicast && join_discovery_group(sock) == 0) {
+        LogServerMessage(LogLevel::Warning, "Could not join the discovery multicast group; answering broadcast probes only.");
+    }
 
-    std::string receive_buffer;
-    char temp_buffer[4096];
-    while (g_is_running) {
-        int bytes = recv(connect_socket, temp_buffer, sizeof(temp_buffer), 0);
-        if (bytes <= 0) {
-            break;
+    // IPv6 has no broadcast: its probes only come to the groups, on a socket of their own.
+    SOCKET sock6 = g_discovery_multicast ? socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP) : INVALID_SOCKET;
+    if (sock6 != INVALID_SOCKET) {
+        DWORD v6_only = 1; // The IPv4 socket has the port there
+        setsockopt(sock6, IPPROTO_IPV6, IPV6_V6ONLY, (const char*)&v6_only, sizeof(v6_only));
+        SocketAddress probe_addr6;
+        probe_addr6.storage.ss_family = AF_INET6;
+        probe_addr6.length = sizeof(sockaddr_in6);
+        probe_addr6.set_port(DISCOVERY_PROBE_PORT);
+        if (bind(sock6, probe_addr6.get(), probe_addr6.length) == SOCKET_ERROR || join_discovery_groups_v6(sock6) == 0) {
+            LogServerMessage(LogLevel::Debug, "Not answering IPv6 discovery probes. Error: " + std::to_string(WSAGetLastError()));
+            closesocket(sock6);
+            sock6 = INVALID_SOCKET;
         }
-        receive_buffer.append(temp_buffer, bytes);
-        size_t pos;
-        while ((pos = receive_buffer.find('\n')) != std::string::npos) {
-            std::string message = receive_buffer.substr(0, pos);
-            receive_buffer.erase(0, pos + 1);
-            if (!message.empty()) process_message(message);
+    }
+
+    char host[256] = "unknown";
+    gethostname(host, sizeof(host));
+    std::replace(host, host + strlen(host), ',', '_'); // Commas separate reply parameters
+    std::string reply = make_handshake_line("server_here", KVM_PROTOCOL_VERSION);
+    reply.pop_back(); // No newline in datagrams
+    reply += ",port:" + std::to_string(KVM_PORT) + ",host:" + host;
+
+    {
+        SocketEvent probes, probes6;
+        if (answering && !probes.watch(sock, FD_READ)) answering = false;
+        bool answering6 = (sock6 != INVALID_SOCKET && probes6.watch(sock6, FD_READ));
+
+        ULONGLONG next_announcement = g_discovery_announce ? 0 : ~0ULL;
+        for (;;) {
+            ULONGLONG now = GetTickCount64();
+            if (now >= next_announcement) {
+                sockaddr_in target = {};
+                target.sin_family = AF_INET;
+                target.sin_port = htons(DISCOVERY_PORT);
+                for (const in_addr& address : get_broadcast_addresses(sock)) {
+                    target.sin_addr = address;
+                    sendto(sock, DISCOVERY_MESSAGE.c_str(), (int)DISCOVERY_MESSAGE.length(), 0, (SOCKADDR*)&target, sizeof(target));
+                }
+                next_announcement = now + 3000;
+            }
+
+            DWORD wait_ms = g_discovery_announce ? (DWORD)(next_announcement - now) : INFINITE;
+            WaitResult woke = wait_for_sockets(stop, {answering ? &probes : nullptr, answering6 ? &probes6 : nullptr}, wait_ms);
+            if (woke == WaitResult::Stopped) break;
+            if (woke == WaitResult::Timeout) continue;
+            if (probes.fired & FD_READ) answer_discovery_probes(sock, reply);
+            if (probes6.fired & FD_READ) answer_discovery_probes(sock6, reply);
         }
     }
-    
-    release_all_client_modifiers();
-    g_connect_socket.store(INVALID_SOCKET);
-    closesocket(connect_socket);
+    closesocket(sock);
+    if (sock6 != INVALID_SOCKET) closesocket(sock6);
+}
 
-    PostMessage(g_hwnd, WM_APP_CLIENT_RESET_UI, 0, 0);
-    LogClientMessage("Client logic thread finished.");
-}
\ No newline at end of file
+void run_server_logic(const StopSignal& stop) {
+    LogServerMessage("Starting Server Networking Thread...");
+    if (!load_pairing_key(LogServerMessage)) return;
+    if (!g_pairing_enabled) {
+        LogServerMessage(LogLevel::Warning, "No pairing key is set, so any machine on the network can connect and input travels unencrypted.");
+    }
+
+    SOCKET listen_socket = open_tcp_listener(KVM_PORT);
+    if (listen_socket == INVALID_SOCKET) {
+        LogServerMessage(LogLevel::Error, "Could not listen on port " + std::to_string(KVM_PORT) + ". Error: " + std::to_string(WSAGetLastError()));
+        return;
+    }
+
+    LogServerMessage("Server waiting for clients on port " + std::to_string(KVM_PORT));
+    g_parked_sessions.clear(); // Tokens from an earlier run are no longer honoured
+
+    // Loopback socket the other threads poke (wake_server_engine) to interrupt WSAPoll.
+    SOCKET wake_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    sockaddr_in wake_addr = {};
+    wake_addr.sin_family = AF_INET;
+    inet_pton(AF_INET, "127.0.0.1", &wake_addr.sin_addr);
+    int wake_addr_len = sizeof(wake_addr);
+    if (wake_socket == INVALID_SOCKET ||
+        bind(wake_socket, (SOCKADDR*)&wake_addr, sizeof(wake_addr)) == SOCKET_ERROR ||
+        getsockname(wake_socket, (SOCKADDR*)&wake_addr, &wake_addr_len) == SOCKET_ERROR) {
+        LogServerMessage(LogLevel::Error, "Failed to create the engine wake-up socket.");
+        if (wake_socket != INVALID_SOCKET) closesocket(wake_socket);
+        closesocket(listen_socket);
+        return;
+    }
+    u_long non_blocking = 1;
+    ioctlsocket(wake_socket, FIONBIO, &non_blocking);
+    g_engine_wake_addr = wake_addr;
+    g_engine_wake_socket.store(wake_socket);
+
+    // Every thread of this run waits on stop; the engine loop below is woken through
+    // wake_socket by stop_network_threads.
+    std::thread sender_thread(run_event_sender, std::cref(stop));
+    std::thread discovery_thread(run_discovery_responder, std::cref(stop));
+    std::thread clipboard_thread;
+    if (g_clipboard_enabled) {
+        g_clipboard_listen_socket.store(open_side_channel_listener(CLIPBOARD_PORT, "Clipboard sharing"));
+        if (g_clipboard_listen_socket != INVALID_SOCKET) clipboard_thread = std::thread(run_clipboard_listener, std::cref(stop));
+    }
+    std::thread file_thread;
+    if (g_file_transfer_enabled) {
+        g_file_listen_socket.store(open_side_channel_listener(FILE_PORT, "File transfer"));
+        if (g_file_listen_socket != INVALID_SOCKET) file_thread = std::thread(run_file_listener, std::cref(stop));
+    }
+
+    // Connection engine: one WSAPoll loop serves the listen socket and every client.
+    std::vector<WSAPOLLFD> poll_fds;
+    std::vector<std::shared_ptr<ClientSession>> polled;
+    int poll_timeout_ms = -1; // Until the next heartbeat deadline
+    while (!stop.requested()) {
+        poll_fds.clear();
+        poll_fds.push_back({ listen_socket, POLLRDNORM, 0 });
+        poll_fds.push_back({ wake_socket, POLLRDNORM, 0 });
+        {
+            std::lock_guard<std::mutex> lock(g_sessions_mutex);
+            polled = g_sessions;
+        }
+        for (const auto& session : polled) {
+            std::lock_guard<std::mutex> lock(session->send_mutex);
+            SHORT events = POLLRDNORM;
+            if (!session->send_queue.empty()) events |= POLLWRNORM;
+            poll_fds.push_back({ session->sock, events, 0 });
+        }
+
+        if (WSAPoll(poll_fds.data(), (ULONG)poll_fds.size(), poll_timeout_ms) == SOCKET_ERROR) {
+            LogServerMessage("WSAPoll failed. Error: " + std::to_string(WSAGetLastError()));
+            break;
+        }
+        if (stop.requested()) break;
+
+        if (poll_fds[1].revents & POLLRDNORM) {
+            char drain[64];
+            while (recv(wake_socket, drain, sizeof(drain), 0) > 0) {}
+        }
+        if (poll_fds[0].revents & (POLLERR | POLLNVAL)) {
+            LogServerMessage("Accept failed or was interrupted.");
+            break;
+        }
+        if (poll_fds[0].revents & POLLRDNORM) accept_client(listen_socket);
+
+        for (size_t i = 0; i < polled.size(); ++i) {
+            ClientSession& session = *polled[i];
+            SHORT revents = poll_fds[i + 2].revents;
+            bool keep = !session.failed;
+            if (keep && (revents & (POLLRDNORM | POLLHUP | POLLERR))) keep = read_from_client(session);
+            if (keep && (revents & POLLWRNORM)) keep = flush_client_queue(session);
+            if (!keep) remove_client(polled[i]);
+        }
+        poll_timeout_ms = service_heartbeats(polled);
+    }
+
+    std::vector<std::shared_ptr<ClientSession>> remaining;
+    {
+        std::lock_guard<std::mutex> lock(g_sessions_mutex);
+        remaining = g_sessions;
+    }
+    for (const auto& session : remaining) remove_client(session, false); // Nothing left to resume into
+    closesocket(listen_socket);
+
+    // The engine can also end on an error, so make sure the other threads stop too.
+    stop.request();
+    sender_thread.join();
+    discovery_thread.join();
+    if (clipboard_thread.joinable()) clipboard_thread.join();
+    SOCKET clipboard_listen = g_clipboard_listen_socket.exchange(INVALID_SOCKET);
+    if (clipboard_listen != INVALID_SOCKET) closesocket(clipboard_listen);
+    prune_clipboard_peers(true);
+    if (file_thread.joinable()) file_thread.join();
+    SOCKET file_listen = g_file_listen_socket.exchange(INVALID_SOCKET);
+    if (file_listen != INVALID_SOCKET) closesocket(file_listen);
+    prune_file_channels(true);
+    g_engine_wake_socket.store(INVALID_SOCKET);
+    closesocket(wake_socket);
+    LogServerMessage("Server networking thread finished.");
+}
+
+// --- Channel Encryption ---
+// With "security.pairing_key" set, a connection only gets going once both ends have
+// proven they know the key (challenge and response, see kvm_protocol.hpp). From then
+// on every byte is AES-256-GCM. The passphrase is stretched with PBKDF2 once, when
+// networking starts; each connection then costs a few HMACs to derive fresh keys from
+// both sides' nonces. Sealing works on preallocated buffers with the nonce and tag on
+// the stack, so no frame allocates, and the sender seals a whole batch as one record.
+
+const ULONG PAIRING_PBKDF2_ITERATIONS = 200000;
+const char PAIRING_SALT[] = "SimpleKVM pairing v1";
+
+std::once_flag g_crypto_once;
+BCRYPT_ALG_HANDLE g_aes_gcm_algorithm = NULL; // Opened once, kept for the life of the process
+BCRYPT_ALG_HANDLE g_hmac_algorithm = NULL;
+ChannelSecret g_pairing_key = {};             // Likewise; read-only afterwards
+
+bool ensure_crypto_providers() {
+    std::call_once(g_crypto_once, []() {
+        BCRYPT_ALG_HANDLE aes = NULL, hmac = NULL;
+        if (BCRYPT_SUCCESS(BCryptOpenAlgorithmProvider(&aes, BCRYPT_AES_ALGORITHM, NULL, 0)) &&
+            BCRYPT_SUCCESS(BCryptSetProperty(aes, BCRYPT_CHAINING_MODE, (PUCHAR)BCRYPT_CHAIN_MODE_GCM, sizeof(BCRYPT_CHAIN_MODE_GCM), 0))) {
+            g_aes_gcm_algorithm = aes;
+        } else if (aes != NULL) {
+            BCryptCloseAlgorithmProvider(aes, 0);
+        }
+        if (BCRYPT_SUCCESS(BCryptOpenAlgorithmProvider(&hmac, BCRYPT_SHA256_ALGORITHM, NULL, BCRYPT_ALG_HANDLE_HMAC_FLAG))) {
+            g_hmac_algorithm = hmac;
+        }
+    });
+    return g_aes_gcm_algorithm != NULL && g_hmac_algorithm != NULL;
+}
+
+// Network thread, before serving or connecting. Stretches the configured passphrase
+// into g_pairing_key. Returns false (after logging) if a key is set but unusable.
+bool load_pairing_key(void (*log)(const std::string&)) {
+    g_pairing_enabled = false;
+    if (g_pairing_key_unreadable) {
+        log("!! The saved pairing key was protected by another Windows account or machine. "
+            "Set security.pairing_key again in the config file.");
+        return false;
+    }
+    if (g_pairing_passphrase.empty()) return true;
+    if (!ensure_crypto_providers() ||
+        !BCRYPT_SUCCESS(BCryptDeriveKeyPBKDF2(g_hmac_algorithm, (PUCHAR)g_pairing_passphrase.data(), (ULONG)g_pairing_passphrase.size(),
+                                              (PUCHAR)PAIRING_SALT, sizeof(PAIRING_SALT) - 1, PAIRING_PBKDF2_ITERATIONS,
+                                              g_pairing_key.data(), (ULONG)g_pairing_key.size(), 0))) {
+        log("!! Windows cryptography (CNG) is not available, so the pairing key cannot be used.");
+        return false;
+    }
+    g_pairing_enabled = true;
+    return true;
+}
+
+bool random_bytes(uint8_t* out, size_t length) {
+    return BCRYPT_SUCCESS(BCryptGenRandom(NULL, out, (ULONG)length, BCRYPT_USE_SYSTEM_PREFERRED_RNG));
+}
+
+// HMAC-SHA256 over the concatenation of parts; out receives 32 bytes.
+bool hmac_sha256(const uint8_t* key, size_t key_length, std::initializer_list<std::string_view> parts, uint8_t* out) {
+    BCRYPT_HASH_HANDLE hash = NULL;
+    if (!BCRYPT_SUCCESS(BCryptCreateHash(g_hmac_algorithm, &hash, NULL, 0, (PUCHAR)key, (ULONG)key_length, 0))) return false;
+    bool ok = true;
+    for (std::string_view part : parts) {
+        ok = ok && BCRYPT_SUCCESS(BCryptHashData(hash, (PUCHAR)part.data(), (ULONG)part.size(), 0));
+    }
+    ok = ok && BCRYPT_SUCCESS(BCryptFinishHash(hash, out, 32, 0));
+    BCryptDestroyHash(hash);
+    return ok;
+}
+
+// Both proofs and the session secret of one connection, from the client's nonce
+// followed by the server's (2 * PAIRING_NONCE_SIZE bytes).
+bool derive_pairing(const uint8_t* nonces, uint8_t* server_proof, uint8_t* client_proof, ChannelSecret& secret) {
+    std::string_view both((const char*)nonces, 2 * PAIRING_NONCE_SIZE);
+    return hmac_sha256(g_pairing_key.data(), g_pairing_key.size(), { "server proof", both }, server_proof) &&
+           hmac_sha256(g_pairing_key.data(), g_pairing_key.size(), { "client proof", both }, client_proof) &&
+           hmac_sha256(g_pairing_key.data(), g_pairing_key.size(), { "session secret", both }, secret.data());
+}
+
+// Constant time, so a forged proof learns nothing from how long the check took.
+bool proofs_equal(const uint8_t* a, const uint8_t* b) {
+    uint8_t difference = 0;
+    for (size_t i = 0; i < PAIRING_PROOF_SIZE; ++i) difference |= a[i] ^ b[i];
+    return difference == 0;
+}
+
+bool set_cipher_key(RecordCipher& cipher, const ChannelSecret& secret, const std::string& label) {
+    uint8_t key[32];
+    if (!hmac_sha256(secret.data(), secret.size(), { label }, key)) return false;
+    if (cipher.key != NULL) BCryptDestroyKey(cipher.key);
+    cipher.key = NULL;
+    cipher.counter = 0;
+    bool ok = BCRYPT_SUCCESS(BCryptGenerateSymmetricKey(g_aes_gcm_algorithm, &cipher.key, NULL, 0, key, sizeof(key), 0));
+    SecureZeroMemory(key, sizeof(key));
+    return ok;
+}
+
+// Derives the keys of one channel ("input", "clipboard" or "files") from the session
+// secret and activates the link. Both directions get their own key, so the two record
+// counters never produce the same nonce under one key.
+bool start_secure_link(SecureLink& link, const ChannelSecret& secret, const std::string& channel, bool is_server) {
+    std::string to_client = channel + " server to client";
+    std::string to_server = channel + " client to server";
+    if (!set_cipher_key(link.seal, secret, is_server ? to_client : to_server) ||
+        !set_cipher_key(link.open, secret, is_server ? to_server : to_client) ||
+        !set_cipher_key(link.motion, secret, channel + " motion")) {
+        return false;
+    }
+    link.secret = secret;
+    link.active = true;
+    return true;
+}
+
+// Encrypts length bytes from in to out (which may be the same buffer) and writes the
+// RECORD_TAG_SIZE-byte tag. aad is authenticated but stays readable.
+bool aead_seal(RecordCipher& cipher, uint64_t nonce_counter, const uint8_t* aad, size_t aad_length,
+               const uint8_t* in, size_t length, uint8_t* out, uint8_t* tag) {
+    int64_t start = qpc_now();
+    uint8_t nonce[RECORD_NONCE_SIZE];
+    make_record_nonce(nonce_counter, nonce);
+    BCRYPT_AUTHENTICATED_CIPHER_MODE_INFO info;
+    BCRYPT_INIT_AUTH_MODE_INFO(info);
+    info.pbNonce = nonce;
+    info.cbNonce = sizeof(nonce);
+    info.pbAuthData = (PUCHAR)aad;
+    info.cbAuthData = (ULONG)aad_length;
+    info.pbTag = tag;
+    info.cbTag = RECORD_TAG_SIZE;
+    ULONG written = 0;
+    bool ok = BCRYPT_SUCCESS(BCryptEncrypt(cipher.key, (PUCHAR)in, (ULONG)length, &info, NULL, 0, out, (ULONG)length, &written, 0));
+    g_stat_records_sealed.fetch_add(1, std::memory_order_relaxed);
+    g_stat_seal_ticks.fetch_add(qpc_now() - start, std::memory_order_relaxed);
+    return ok;
+}
+
+// The reverse of aead_seal. False if the data or aad was altered, or sealed under
+// another key or nonce; out then holds nothing usable.
+bool aead_open(RecordCipher& cipher, uint64_t nonce_counter, const uint8_t* aad, size_t aad_length,
+               const uint8_t* in, size_t length, uint8_t* out, const uint8_t* tag) {
+    uint8_t nonce[RECORD_NONCE_SIZE];
+    make_record_nonce(nonce_counter, nonce);
+    BCRYPT_AUTHENTICATED_CIPHER_MODE_INFO info;
+    BCRYPT_INIT_AUTH_MODE_INFO(info);
+    info.pbNonce = nonce;
+    info.cbNonce = sizeof(nonce);
+    info.pbAuthData = (PUCHAR)aad;
+    info.cbAuthData = (ULONG)aad_length;
+    info.pbTag = (PUCHAR)tag;
+    info.cbTag = RECORD_TAG_SIZE;
+    ULONG written = 0;
+    return BCRYPT_SUCCESS(BCryptDecrypt(cipher.key, (PUCHAR)in, (ULONG)length, &info, NULL, 0, out, (ULONG)length, &written, 0));
+}
+
+// Seals length (at most MAX_RECORD_PAYLOAD) bytes as the next record into out, which
+// needs RECORD_OVERHEAD more bytes than that. Returns the record size, or 0.
+size_t seal_record(RecordCipher& cipher, const uint8_t* data, size_t length, uint8_t* out) {
+    put_u32_le(out, (uint32_t)length);
+    uint64_t counter = cipher.counter++;
+    uint8_t* body = out + RECORD_HEADER_SIZE;
+    if (!aead_seal(cipher, counter, out, RECORD_HEADER_SIZE, data, length, body, body + length)) return 0;
+    return RECORD_OVERHEAD + length;
+}
+
+// Decrypts a whole record (see decode_record_header) into out.
+bool open_record(RecordCipher& cipher, const uint8_t* record, uint32_t length, uint8_t* out) {
+    const uint8_t* body = record + RECORD_HEADER_SIZE;
+    return aead_open(cipher, cipher.counter++, record, RECORD_HEADER_SIZE, body, length, out, body + length);
+}
+
+// Decrypts every whole record buffered in raw and appends the plaintext to plain.
+// Records are always bigger than their plaintext, so plain has room as long as it held
+// no more than a partial frame beforehand. False if a record is oversized or fails
+// authentication: the stream can no longer be trusted.
+template <size_t Capacity>
+bool open_records(RecordCipher& cipher, FrameBuffer<Capacity>& raw, FrameBuffer<Capacity>& plain, size_t max_payload) {
+    uint32_t length = 0;
+    DecodeStatus status;
+    while ((status = decode_record_header(raw.data(), raw.size(), max_payload, length)) == DecodeStatus::Ok) {
+        uint8_t* out = plain.write_ptr((size_t)length);
+        if (out == nullptr || !open_record(cipher, raw.data(), length, out)) return false;
+        plain.commit(length);
+        raw.consume(RECORD_OVERHEAD + length);
+    }
+    return status == DecodeStatus::NeedMore;
+}
+
+// Also works on sockets made non-blocking by a SocketEvent: when the send buffer is
+// full it waits up to 5 s for room, then gives up.
+bool send_all(SOCKET sock, const char* data, size_t length) {
+    while (length > 0) {
+        int bytes = send(sock, data, (int)length, 0);
+        if (bytes == SOCKET_ERROR) {
+            if (WSAGetLastError() != WSAEWOULDBLOCK) return false;
+            fd_set writable;
+            FD_ZERO(&writable);
+            FD_SET(sock, &writable);
+            timeval stall = { 5, 0 };
+            if (select(0, NULL, &writable, NULL, &stall) != 1) return false;
+            continue;
+        }
+        data += bytes;
+        length -= bytes;
+    }
+    return true;
+}
+
+bool recv_exact(SOCKET sock, char* data, size_t length) {
+    while (length > 0) {
+        int bytes = recv(sock, data, (int)length, 0);
+        if (bytes <= 0) return false;
+        data += bytes;
+        length -= bytes;
+    }
+    return true;
+}
+
+// Side-channel sending thread. Sends all of data, sealed into records when the stream
+// is encrypted.
+bool stream_send(SOCKET sock, SecureStream& stream, const char* data, size_t length) {
+    if (!stream.link.active) return send_all(sock, data, length);
+    stream.send_record.resize(MAX_RECORD_PAYLOAD + RECORD_OVERHEAD); // Allocates only the first time
+    while (length > 0) {
+        size_t chunk = (std::min)(length, MAX_RECORD_PAYLOAD);
+        size_t record = seal_record(stream.link.seal, (const uint8_t*)data, chunk, stream.send_record.data());
+        if (record == 0 || !send_all(sock, (const char*)stream.send_record.data(), record)) return false;
+        data += chunk;
+        length -= chunk;
+    }
+    return true;
+}
+
+// Side-channel receiving thread. Like recv: returns how many bytes (at most capacity)
+// were stored, or <= 0 once the connection is closed or a record fails authentication.
+int stream_recv(SOCKET sock, SecureStream& stream, char* data, size_t capacity) {
+    if (!stream.link.active) return recv(sock, data, (int)capacity, 0);
+    while (stream.receive_pos == stream.receive_end) {
+        stream.receive_record.resize(MAX_RECORD_PAYLOAD + RECORD_OVERHEAD);
+        uint8_t* record = stream.receive_record.data();
+        uint32_t length = 0;
+        if (!recv_exact(sock, (char*)record, RECORD_HEADER_SIZE) ||
+            decode_record_header(record, RECORD_HEADER_SIZE, MAX_RECORD_PAYLOAD, length) == DecodeStatus::Invalid ||
+            !recv_exact(sock, (char*)record + RECORD_HEADER_SIZE, length + RECORD_TAG_SIZE) ||
+            !open_record(stream.link.open, record, length, record + RECORD_HEADER_SIZE)) {
+            return -1;
+        }
+        stream.receive_pos = RECORD_HEADER_SIZE;
+        stream.receive_end = RECORD_HEADER_SIZE + length;
+    }
+    size_t n = (std::min)(capacity, stream.receive_end - stream.receive_pos);
+    memcpy(data, stream.receive_record.data() + stream.receive_pos, n);
+    stream.receive_pos += n;
+    return (int)n;
+}
+
+bool stream_recv_exact(SOCKET sock, SecureStream& stream, char* data, size_t length) {
+    while (length > 0) {
+        int bytes = stream_recv(sock, stream, data, length);
+        if (bytes <= 0) return false;
+        data += bytes;
+        length -= bytes;
+    }
+    return true;
+}
+
+// --- Clipboard Sharing ---
+// Each client has a second TCP connection for the clipboard (see kvm_protocol.hpp), so
+// a large paste never sits in front of input frames. A copy only sends the list of
+// formats. The receiving side takes ownership of its clipboard with those formats
+// unrendered (delayed rendering): only when something pastes does Windows send
+// WM_RENDERFORMAT, and the data is fetched from the peer in CLIPBOARD_CHUNK_SIZE pieces,
+// compressed when that helps. The server relays offers between clients, so a copy on
+// one client can be pasted on another.
+
+// Windows Compression API (cabinet.dll, Windows 8+), loaded at runtime.
+typedef BOOL (WINAPI* CreateCompressorFn)(DWORD, void*, HANDLE*);
+typedef BOOL (WINAPI* CompressFn)(HANDLE, const void*, SIZE_T, void*, SIZE_T, SIZE_T*);
+typedef BOOL (WINAPI* CloseCompressorFn)(HANDLE);
+const DWORD COMPRESS_ALGORITHM_XPRESS_HUFF_ID = 4; // COMPRESS_ALGORITHM_XPRESS_HUFF
+const size_t CLIPBOARD_COMPRESS_MIN_BYTES = 4096;  // Smaller contents go out as they are
+const DWORD CLIPBOARD_FETCH_TIMEOUT_MS = 5000;     // Longest silence while a paste waits for data
+
+HMODULE g_cabinet_dll = NULL; // Loaded on first use and kept for the life of the process
+std::once_flag g_cabinet_once;
+CreateCompressorFn g_CreateCompressor = nullptr;
+CompressFn g_Compress = nullptr;
+CloseCompressorFn g_CloseCompressor = nullptr;
+CreateCompressorFn g_CreateDecompressor = nullptr;
+CompressFn g_Decompress = nullptr;
+CloseCompressorFn g_CloseDecompressor = nullptr;
+
+bool load_compression_api() {
+    std::call_once(g_cabinet_once, []() {
+        g_cabinet_dll = LoadLibraryA("cabinet.dll");
+        if (g_cabinet_dll == NULL) return;
+        g_CreateCompressor = (CreateCompressorFn)(void*)GetProcAddress(g_cabinet_dll, "CreateCompressor");
+        g_Compress = (CompressFn)(void*)GetProcAddress(g_cabinet_dll, "Compress");
+        g_CloseCompressor = (CloseCompressorFn)(void*)GetProcAddress(g_cabinet_dll, "CloseCompressor");
+        g_CreateDecompressor = (CreateCompressorFn)(void*)GetProcAddress(g_cabinet_dll, "CreateDecompressor");
+        g_Decompress = (CompressFn)(void*)GetProcAddress(g_cabinet_dll, "Decompress");
+        g_CloseDecompressor = (CloseCompressorFn)(void*)GetProcAddress(g_cabinet_dll, "CloseDecompressor");
+    });
+    return g_CreateCompressor && g_Compress && g_CloseCompressor && g_CreateDecompressor && g_Decompress && g_CloseDecompressor;
+}
+
+// Returns CLIPBOARD_CODEC_NONE (and leaves encoded empty) when compression is off,
+// unavailable, or would not make the data smaller.
+uint8_t compress_clipboard_data(const std::string& data, std::string& encoded) {
+    if (!g_clipboard_compress || data.size() < CLIPBOARD_COMPRESS_MIN_BYTES || !load_compression_api()) return CLIPBOARD_CODEC_NONE;
+    HANDLE compressor = NULL;
+    if (!g_CreateCompressor(COMPRESS_ALGORITHM_XPRESS_HUFF_ID, nullptr, &compressor)) return CLIPBOARD_CODEC_NONE;
+    encoded.resize(data.size());
+    SIZE_T encoded_size = 0;
+    bool ok = g_Compress(compressor, data.data(), data.size(), &encoded[0], encoded.size(), &encoded_size) && encoded_size < data.size();
+    g_CloseCompressor(compressor);
+    if (!ok) {
+        encoded.clear();
+        return CLIPBOARD_CODEC_NONE;
+    }
+    encoded.resize(encoded_size);
+    return CLIPBOARD_CODEC_XPRESS_HUFF;
+}
+
+bool decompress_clipboard_data(const std::string& encoded, uint32_t original_size, std::string& data) {
+    if (!load_compression_api()) return false;
+    HANDLE decompressor = NULL;
+    if (!g_CreateDecompressor(COMPRESS_ALGORITHM_XPRESS_HUFF_ID, nullptr, &decompressor)) return false;
+    data.resize(original_size);
+    SIZE_T decoded_size = 0;
+    bool ok = g_Decompress(decompressor, encoded.data(), encoded.size(), &data[0], data.size(), &decoded_size) &&
+              decoded_size == original_size;
+    g_CloseDecompressor(decompressor);
+    return ok;
+}
+
+void queue_clipboard_message(ClipboardPeer& peer, ClipboardMessage kind, uint32_t arg, const char* payload, size_t length) {
+    std::string message(CLIPBOARD_HEADER_SIZE, '\0');
+    encode_clipboard_header((uint8_t*)&message[0], kind, arg, (uint32_t)length);
+    message.append(payload, length);
+    std::lock_guard<std::mutex> lock(peer.outbox_mutex);
+    if (peer.closed) return;
+    peer.outbox.push_back(std::move(message));
+    peer.outbox_ready.notify_one();
+}
+
+void queue_clipboard_reply(ClipboardPeer& peer, ClipboardReply reply) {
+    std::lock_guard<std::mutex> lock(peer.outbox_mutex);
+    if (peer.closed) return;
+    peer.replies.push_back(std::move(reply));
+    peer.outbox_ready.notify_one();
+}
+
+void queue_clipboard_formats(ClipboardPeer& peer, const std::vector<uint32_t>& formats) {
+    std::string payload(formats.size() * 4, '\0');
+    for (size_t i = 0; i < formats.size(); ++i) put_u32_le((uint8_t*)&payload[i * 4], formats[i]);
+    queue_clipboard_message(peer, ClipboardMessage::Formats, 0, payload.data(), payload.size());
+}
+
+// Any thread. Unblocks both threads of the peer; they are joined by prune or stop.
+void close_clipboard_peer(ClipboardPeer& peer) {
+    {
+        std::lock_guard<std::mutex> lock(peer.outbox_mutex);
+        if (peer.closed) return;
+        peer.closed = true;
+        peer.outbox.clear();
+        peer.replies.clear();
+        peer.outbox_ready.notify_one();
+    }
+    shutdown(peer.sock, SD_BOTH);
+    std::lock_guard<std::mutex> lock(peer.fetch_mutex);
+    peer.fetch_aborted = true;
+    peer.fetch_progress.notify_all();
+}
+
+// Engine thread, from remove_client.
+void close_clipboard_peers_of(int client_id) {
+    std::lock_guard<std::mutex> lock(g_clipboard_mutex);
+    for (const auto& peer : g_clipboard_peers) {
+        if (peer->client_id == client_id) close_clipboard_peer(*peer);
+    }
+}
+
+void run_clipboard_writer(std::shared_ptr<ClipboardPeer> peer) {
+    for (;;) {
+        std::string message;
+        {
+            std::unique_lock<std::mutex> lock(peer->outbox_mutex);
+            peer->outbox_ready.wait(lock, [&]() { return peer->closed || !peer->outbox.empty() || !peer->replies.empty(); });
+            if (peer->closed) return;
+            if (!peer->outbox.empty()) {
+                // Offers and requests go ahead of a transfer's remaining chunks.
+                message = std::move(peer->outbox.front());
+                peer->outbox.pop_front();
+            } else {
+                ClipboardReply& reply = peer->replies.front();
+                if (!reply.begin.empty()) {
+                    message = std::move(reply.begin);
+                    reply.begin.clear();
+                } else {
+                    size_t length = (std::min)(CLIPBOARD_CHUNK_SIZE, reply.body.size() - reply.sent);
+                    message.resize(CLIPBOARD_HEADER_SIZE);
+                    encode_clipboard_header((uint8_t*)&message[0], ClipboardMessage::DataChunk, reply.request_id, (uint32_t)length);
+                    message.append(reply.body, reply.sent, length);
+                    reply.sent += length;
+                }
+                if (reply.begin.empty() && reply.sent == reply.body.size()) peer->replies.pop_front();
+            }
+        }
+        if (!stream_send(peer->sock, peer->stream, message.data(), message.size())) {
+            close_clipboard_peer(*peer);
+            return;
+        }
+    }
+}
+
+// Formats from CLIPBOARD_FORMATS currently on the local clipboard. Any thread.
+std::vector<uint32_t> local_clipboard_formats() {
+    std::vector<uint32_t> formats;
+    for (UINT format : CLIPBOARD_FORMATS) {
+        if (IsClipboardFormatAvailable(format)) formats.push_back(format);
+    }
+    return formats;
+}
+
+// Copies one format off the local clipboard. Retries briefly, since whichever program
+// just wrote it may still have the clipboard open.
+bool read_local_clipboard(UINT format, std::string& data) {
+    bool opened = false;
+    for (int attempt = 0; attempt < 10 && !(opened = OpenClipboard(NULL)); ++attempt) Sleep(20);
+    if (!opened) return false;
+    bool ok = false;
+    HANDLE handle = GetClipboardData(format);
+    SIZE_T size = handle ? GlobalSize(handle) : 0;
+    if (size > 0 && size <= MAX_CLIPBOARD_DATA_SIZE) {
+        if (const char* bytes = (const char*)GlobalLock(handle)) {
+            data.assign(bytes, size);
+            GlobalUnlock(handle);
+            ok = true;
+        }
+    }
+    CloseClipboard();
+    return ok;
+}
+
+// Asks peer for one format and waits for all of it. Called on the GUI thread from
+// WM_RENDERFORMAT, or on a reader thread when the server relays between clients.
+bool fetch_clipboard_data(ClipboardPeer& peer, uint32_t format, std::string& data) {
+    std::lock_guard<std::mutex> serial(peer.fetch_serial);
+    uint32_t request_id;
+    {
+        std::lock_guard<std::mutex> lock(g_clipboard_mutex);
+        request_id = g_next_clipboard_request++;
+    }
+    {
+        std::lock_guard<std::mutex> lock(peer.fetch_mutex);
+        if (peer.fetch_aborted) return false;
+        peer.fetch_id = request_id;
+        peer.fetch_started = false;
+        peer.fetch_refused = false;
+        peer.fetch_data.clear();
+    }
+    uint8_t payload[4];
+    put_u32_le(payload, format);
+    queue_clipboard_message(peer, ClipboardMessage::Request, request_id, (const char*)payload, sizeof(payload));
+
+    // The timeout only runs while nothing arrives, so a large transfer can take as
+    // long as it needs.
+    int64_t start_qpc = qpc_now();
+    std::unique_lock<std::mutex> lock(peer.fetch_mutex);
+    bool complete = false;
+    for (;;) {
+        complete = peer.fetch_started && peer.fetch_data.size() >= peer.fetch_encoded_size;
+        if (complete || peer.fetch_refused || peer.fetch_aborted) break;
+        size_t received = peer.fetch_data.size();
+        bool started = peer.fetch_started;
+        if (!peer.fetch_progress.wait_for(lock, std::chrono::milliseconds(CLIPBOARD_FETCH_TIMEOUT_MS), [&]() {
+                return peer.fetch_refused || peer.fetch_aborted || peer.fetch_started != started ||
+                       peer.fetch_data.size() != received;
+            })) {
+            break;
+        }
+    }
+    peer.fetch_id = 0;
+    std::string encoded = std::move(peer.fetch_data);
+    uint8_t codec = peer.fetch_codec;
+    uint32_t original_size = peer.fetch_original_size;
+    bool refused = peer.fetch_refused;
+    lock.unlock();
+    if (!complete) {
+        if (!refused) peer.log("Clipboard: the other side did not deliver the pasted data.");
+        return false;
+    }
+
+    size_t wire_size = encoded.size();
+    if (codec == CLIPBOARD_CODEC_NONE) {
+        data = std::move(encoded);
+    } else if (!decompress_clipboard_data(encoded, original_size, data)) {
+        peer.log("Clipboard: could not decompress the pasted data.");
+        return false;
+    }
+    if (data.size() >= 1024 * 1024) {
+        char text[128];
+        snprintf(text, sizeof(text), "Clipboard: pasted %.1f MB (%.1f MB sent) in %.0f ms.", data.size() / 1048576.0,
+                 wire_size / 1048576.0, (double)(qpc_now() - start_qpc) * 1000.0 / g_qpc_frequency);
+        peer.log(text);
+    }
+    return true;
+}
+
+// Reader thread. Answers a request with our clipboard contents, relayed from the
+// current source when our clipboard only holds another peer's offer.
+void serve_clipboard_request(const std::shared_ptr<ClipboardPeer>& requester, uint32_t request_id, uint32_t format) {
+    std::shared_ptr<ClipboardPeer> source;
+    {
+        std::lock_guard<std::mutex> lock(g_clipboard_mutex);
+        source = g_clipboard_source;
+    }
+    std::string data;
+    bool ok = false;
+    if (source) {
+        // The requester's own offer is never asked back from it.
+        ok = source != requester && fetch_clipboard_data(*source, format, data);
+    } else if (std::find(std::begin(CLIPBOARD_FORMATS), std::end(CLIPBOARD_FORMATS), format) != std::end(CLIPBOARD_FORMATS) &&
+               GetClipboardOwner() != g_hwnd) {
+        // (If we still own the clipboard, it is an offer from a channel that has since
+        // closed; reading it would only wait on our own WM_RENDERFORMAT.)
+        ok = read_local_clipboard(format, data);
+    }
+    if (!ok) {
+        queue_clipboard_message(*requester, ClipboardMessage::DataError, request_id, nullptr, 0);
+        return;
+    }
+
+    std::string encoded;
+    uint8_t codec = compress_clipboard_data(data, encoded);
+    uint32_t original_size = (uint32_t)data.size();
+    ClipboardReply reply;
+    reply.request_id = request_id;
+    reply.body = std::move(codec == CLIPBOARD_CODEC_NONE ? data : encoded);
+    reply.begin.resize(CLIPBOARD_HEADER_SIZE + 9);
+    uint8_t* begin = (uint8_t*)&reply.begin[0];
+    encode_clipboard_header(begin, ClipboardMessage::DataBegin, request_id, 9);
+    begin[CLIPBOARD_HEADER_SIZE] = codec;
+    put_u32_le(begin + CLIPBOARD_HEADER_SIZE + 1, original_size);
+    put_u32_le(begin + CLIPBOARD_HEADER_SIZE + 5, (uint32_t)reply.body.size());
+    queue_clipboard_reply(*requester, std::move(reply));
+}
+
+void run_clipboard_reader(std::shared_ptr<ClipboardPeer> peer) {
+    uint8_t header[CLIPBOARD_HEADER_SIZE];
+    std::string payload;
+    while (stream_recv_exact(peer->sock, peer->stream, (char*)header, sizeof(header))) {
+        ClipboardMessage kind;
+        uint32_t arg = 0, length = 0;
+        if (!decode_clipboard_header(header, kind, arg, length)) {
+            peer->log("Clipboard: unexpected data on the clipboard channel. Closing it.");
+            break;
+        }
+        payload.resize(length);
+        if (length > 0 && !stream_recv_exact(peer->sock, peer->stream, &payload[0], length)) break;
+        const uint8_t* bytes = (const uint8_t*)payload.data();
+
+        if (kind == ClipboardMessage::Formats) {
+            ClipboardOffer* offer = new ClipboardOffer{ peer, {} };
+            for (size_t i = 0; i + 4 <= length; i += 4) offer->formats.push_back(get_u32_le(bytes + i));
+            if (!PostMessage(g_hwnd, WM_APP_CLIPBOARD_OFFER, (WPARAM)offer, 0)) delete offer;
+        } else if (kind == ClipboardMessage::Request) {
+            if (length >= 4) serve_clipboard_request(peer, arg, get_u32_le(bytes));
+        } else {
+            std::lock_guard<std::mutex> lock(peer->fetch_mutex);
+            if (arg == 0 || arg != peer->fetch_id) continue; // Answer to a request we gave up on
+            if (kind == ClipboardMessage::DataBegin && length >= 9) {
+                peer->fetch_codec = bytes[0];
+                peer->fetch_original_size = get_u32_le(bytes + 1);
+                peer->fetch_encoded_size = get_u32_le(bytes + 5);
+                if (peer->fetch_original_size > MAX_CLIPBOARD_DATA_SIZE || peer->fetch_encoded_size > MAX_CLIPBOARD_DATA_SIZE) {
+                    peer->fetch_refused = true;
+                } else {
+                    peer->fetch_data.reserve(peer->fetch_encoded_size);
+                    peer->fetch_started = true;
+                }
+            } else if (kind == ClipboardMessage::DataChunk && peer->fetch_started) {
+                peer->fetch_data.append(payload);
+            } else if (kind == ClipboardMessage::DataError) {
+                peer->fetch_refused = true;
+            }
+            peer->fetch_progress.notify_all();
+        }
+    }
+    close_clipboard_peer(*peer);
+}
+
+// Takes over sock. secret, if given, encrypts the channel (see accept_side_channel).
+// Returns null (with sock closed) if that fails.
+std::shared_ptr<ClipboardPeer> start_clipboard_peer(SOCKET sock, int client_id, void (*log)(const std::string&),
+                                                    const ChannelSecret* secret) {
+    auto peer = std::make_shared<ClipboardPeer>();
+    peer->client_id = client_id;
+    peer->sock = sock;
+    peer->log = log;
+    if (secret != nullptr && !start_secure_link(peer->stream.link, *secret, "clipboard", client_id != 0)) {
+        log("!! Could not set up encryption for the clipboard channel.");
+        closesocket(sock);
+        return nullptr;
+    }
+    peer->reader = std::thread(run_clipboard_reader, peer);
+    peer->writer = std::thread(run_clipboard_writer, peer);
+    std::lock_guard<std::mutex> lock(g_clipboard_mutex);
+    g_clipboard_peers.push_back(peer);
+    return peer;
+}
+
+// Joins and forgets channels that have closed (all of them with close_all). Never
+// called from a clipboard thread.
+void prune_clipboard_peers(bool close_all) {
+    std::vector<std::shared_ptr<ClipboardPeer>> finished;
+    {
+        std::lock_guard<std::mutex> lock(g_clipboard_mutex);
+        for (auto it = g_clipboard_peers.begin(); it != g_clipboard_peers.end();) {
+            if (close_all) close_clipboard_peer(**it);
+            bool closed;
+            {
+                std::lock_guard<std::mutex> outbox_lock((*it)->outbox_mutex);
+                closed = (*it)->closed;
+            }
+            if (closed) {
+                finished.push_back(*it);
+                it = g_clipboard_peers.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        if (close_all && g_clipboard_source) {
+            // Withdraw the offer we can no longer render.
+            g_clipboard_source = nullptr;
+            ClipboardOffer* withdraw = new ClipboardOffer{ nullptr, {} };
+            if (!PostMessage(g_hwnd, WM_APP_CLIPBOARD_OFFER, (WPARAM)withdraw, 0)) delete withdraw;
+        }
+    }
+    for (const auto& peer : finished) {
+        peer->reader.join();
+        peer->writer.join();
+        closesocket(peer->sock);
+    }
+}
+
+// Server thread. Returns a listening socket for a side channel, or INVALID_SOCKET.
+SOCKET open_side_channel_listener(int port, const char* feature) {
+    SOCKET listen_socket = open_tcp_listener((uint16_t)port);
+    if (listen_socket == INVALID_SOCKET) {
+        LogServerMessage(LogLevel::Warning, std::string(feature) + " is off: port " + std::to_string(port) +
+                         " is not available. Error: " + std::to_string(WSAGetLastError()));
+    }
+    return listen_socket;
+}
+
+const size_t MAX_PENDING_SIDE_CHANNELS = 16;    // Connections still owing their first line
+const ULONGLONG SIDE_CHANNEL_HELLO_TIMEOUT_MS = 2000;
+
+// A side-channel connection whose first line has not arrived yet. Owned by the
+// listener thread; closes the socket unless it is handed on.
+struct PendingSideChannel {
+    SOCKET sock = INVALID_SOCKET;
+    std::string address;
+    SocketEvent readable;
+    char line[MAX_TEXT_FRAME_SIZE];
+    size_t length = 0;
+    ULONGLONG deadline = 0;
+
+    ~PendingSideChannel() {
+        readable.unwatch();
+        if (sock != INVALID_SOCKET) closesocket(sock);
+    }
+
+    // Blocking again, and no longer closed by this.
+    SOCKET release() {
+        readable.unwatch();
+        SOCKET released = sock;
+        sock = INVALID_SOCKET;
+        return released;
+    }
+};
+
+// Reads what has arrived of the first line without taking anything past its newline,
+// which already belongs to the channel. Returns true once the line is complete (or
+// the connection is done for: closed, or a line too long); line_complete says which.
+bool read_side_channel_hello(PendingSideChannel& pending, bool& line_complete) {
+    line_complete = false;
+    int got = recv(pending.sock, pending.line + pending.length, (int)(sizeof(pending.line) - pending.length), MSG_PEEK);
+    if (got == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK) return false;
+    if (got <= 0) return true;
+    const char* newline = (const char*)memchr(pending.line + pending.length, '\n', got);
+    int take = newline ? (int)(newline - (pending.line + pending.length)) + 1 : got;
+    if (recv(pending.sock, pending.line + pending.length, take, 0) != take) return true;
+    pending.length += take;
+    if (newline) {
+        --pending.length; // Without the newline
+        line_complete = true;
+        return true;
+    }
+    return pending.length == sizeof(pending.line);
+}
+
+// Server side-channel listener thread. Accepts the next connection whose first line,
+// "event:<name>,version:<n>,session:<t>", names the session token of a connected client
+// from the same address, and returns its socket and client id. Connections that fail
+// the check are closed. Returns INVALID_SOCKET once stop is requested.
+// Connections wait in pending, owned by the caller across calls, until their line
+// arrives, so a slow or silent one holds up no other.
+// If the session is paired, encrypted is set and secret receives the session secret.
+// Each encrypted channel may then be opened only once per session: its keys follow from
+// the secret alone, so a second connection would reuse them.
+SOCKET accept_side_channel(const StopSignal& stop, SOCKET listen_socket, const char* name,
+                           std::vector<std::unique_ptr<PendingSideChannel>>& pending,
+                           int& client_id, ChannelSecret& secret, bool& encrypted) {
+    SocketEvent incoming;
+    if (!incoming.watch(listen_socket, FD_ACCEPT)) return INVALID_SOCKET;
+    for (;;) {
+        SocketAddress peer_addr;
+        peer_addr.length = sizeof(peer_addr.storage);
+        SOCKET sock;
+        while ((sock = accept(listen_socket, peer_addr.get(), &peer_addr.length)) != INVALID_SOCKET) {
+            if (pending.size() >= MAX_PENDING_SIDE_CHANNELS) pending.erase(pending.begin()); // Oldest goes
+            auto connection = std::make_unique<PendingSideChannel>();
+            connection->sock = sock;
+            connection->address = format_socket_address(peer_addr);
+            peer_addr.length = sizeof(peer_addr.storage);
+            connection->deadline = GetTickCount64() + SIDE_CHANNEL_HELLO_TIMEOUT_MS;
+            // The accepted socket inherits the listen socket's event selection; this replaces it.
+            if (!connection->readable.watch(sock, FD_READ | FD_CLOSE)) continue;
+            pending.push_back(std::move(connection));
+        }
+        if (WSAGetLastError() != WSAEWOULDBLOCK) return INVALID_SOCKET;
+
+        ULONGLONG now = GetTickCount64();
+        for (size_t i = 0; i < pending.size(); ++i) {
+            bool line_complete = false;
+            if (!read_side_channel_hello(*pending[i], line_complete) && now < pending[i]->deadline) continue;
+            std::unique_ptr<PendingSideChannel> connection = std::move(pending[i]);
+            pending.erase(pending.begin() + i--);
+
+            std::string_view hello(connection->line, line_complete ? connection->length : 0);
+            int version = 0;
+            uint32_t token = 0;
+            client_id = 0;
+            encrypted = false;
+            if (parse_handshake_line(hello, name, version) && find_handshake_param(hello, "session", token) && token != 0) {
+                std::lock_guard<std::mutex> lock(g_sessions_mutex);
+                for (const auto& session : g_sessions) {
+                    if (session->session_token != token || session->address != connection->address) continue;
+                    std::vector<std::string>& opened = session->side_channels_opened;
+                    if (g_pairing_enabled && std::find(opened.begin(), opened.end(), name) != opened.end()) break;
+                    client_id = session->id;
+                    if (g_pairing_enabled) {
+                        // Set once by the engine before the ack went out with the token, never changed.
+                        secret = session->secure.secret;
+                        encrypted = true;
+                        opened.push_back(name);
+                    }
+                }
+            }
+            if (client_id == 0) {
+                LogServerMessage(LogLevel::Warning, "Rejected a " + std::string(name) + " connection from " + connection->address + ".");
+                continue;
+            }
+            return connection->release();
+        }
+
+        // Wake for the next connection, more of a pending line, or the oldest deadline.
+        SocketEvent* events[1 + MAX_PENDING_SIDE_CHANNELS];
+        size_t count = 0;
+        events[count++] = &incoming;
+        DWORD wait_ms = INFINITE;
+        for (const auto& connection : pending) {
+            events[count++] = &connection->readable;
+            wait_ms = (std::min)(wait_ms, (DWORD)(connection->deadline > now ? connection->deadline - now : 0));
+        }
+        if (wait_for_sockets(stop, events, count, wait_ms) == WaitResult::Stopped) return INVALID_SOCKET;
+    }
+}
+
+// Client side-channel thread. Opens a side channel to the server and introduces it with
+// the session token. A port the server's firewall drops costs at most
+// SIDE_CHANNEL_CONNECT_TIMEOUT_MS, and nothing once stop is requested. Returns
+// INVALID_SOCKET (after logging) on failure.
+SOCKET connect_side_channel(const StopSignal& stop, const SocketAddress& server_addr, uint16_t port, const char* name, uint32_t session_token) {
+    SocketAddress addr = server_addr;
+    addr.set_port(port);
+    SOCKET sock = socket(addr.family(), SOCK_STREAM, IPPROTO_TCP);
+    if (sock == INVALID_SOCKET || !connect_or_stop(stop, sock, addr, SIDE_CHANNEL_CONNECT_TIMEOUT_MS)) {
+        if (!stop.requested()) {
+            LogClientMessage(LogLevel::Warning, "Could not open the " + std::string(name) + " channel. Error: " + std::to_string(WSAGetLastError()));
+        }
+        if (sock != INVALID_SOCKET) closesocket(sock);
+        return INVALID_SOCKET;
+    }
+    std::string hello = "event:" + std::string(name) + ",version:" + std::to_string(KVM_PROTOCOL_VERSION) +
+                        ",session:" + std::to_string(session_token) + "\n";
+    send(sock, hello.c_str(), (int)hello.length(), 0);
+    return sock;
+}
+
+// Server: accepts clipboard channels until the server is stopped.
+void run_clipboard_listener(const StopSignal& stop) {
+    SOCKET listen_socket = g_clipboard_listen_socket;
+    int client_id = 0;
+    ChannelSecret secret;
+    bool encrypted = false;
+    std::vector<std::unique_ptr<PendingSideChannel>> pending;
+    SOCKET sock;
+    while ((sock = accept_side_channel(stop, listen_socket, "clipboard", pending, client_id, secret, encrypted)) != INVALID_SOCKET) {
+        prune_clipboard_peers(false);
+
+        std::shared_ptr<ClipboardPeer> peer = start_clipboard_peer(sock, client_id, LogServerMessage, encrypted ? &secret : nullptr);
+        if (!peer) continue;
+        {
+            // Let the client paste whatever is on our clipboard right now.
+            std::lock_guard<std::mutex> lock(g_clipboard_mutex);
+            if (g_clipboard_source == nullptr) g_clipboard_formats = local_clipboard_formats();
+            queue_clipboard_formats(*peer, g_clipboard_formats);
+        }
+        LogServerMessage("Client " + std::to_string(client_id) + " opened the clipboard channel.");
+    }
+}
+
+// Client side-channel thread, once the server's ack offered a clipboard port. secret is
+// the paired session's, or null.
+void open_clipboard_channel(const StopSignal& stop, const SocketAddress& server_addr, uint16_t port, uint32_t session_token, const ChannelSecret* secret) {
+    SOCKET sock = connect_side_channel(stop, server_addr, port, "clipboard", session_token);
+    if (sock == INVALID_SOCKET) return;
+    if (start_clipboard_peer(sock, 0, LogClientMessage, secret)) LogClientMessage("Clipboard sharing is on.");
+}
+
+// GUI thread, on WM_CLIPBOARDUPDATE: something on this machine was copied.
+void advertise_local_clipboard() {
+    if (!g_clipboard_enabled || GetClipboardOwner() == g_hwnd) return; // Our own delayed offer
+    std::vector<uint32_t> formats = local_clipboard_formats();
+    std::lock_guard<std::mutex> lock(g_clipboard_mutex);
+    g_clipboard_source = nullptr;
+    g_clipboard_formats = formats;
+    for (const auto& peer : g_clipboard_peers) queue_clipboard_formats(*peer, formats);
+}
+
+// GUI thread, on WM_APP_CLIPBOARD_OFFER. Puts the peer's formats on our clipboard
+// without data, and on the server passes the offer on to the other clients.
+void accept_clipboard_offer(const ClipboardOffer& offer) {
+    if (!g_clipboard_enabled) return;
+    std::vector<uint32_t> formats;
+    for (uint32_t format : offer.formats) {
+        if (std::find(std::begin(CLIPBOARD_FORMATS), std::end(CLIPBOARD_FORMATS), format) != std::end(CLIPBOARD_FORMATS)) {
+            formats.push_back(format);
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(g_clipboard_mutex);
+        // An empty list (the peer copied something we cannot share, or its channel
+        // closed) only matters if our clipboard still holds that peer's offer.
+        if (formats.empty() && g_clipboard_source != offer.peer) return;
+        g_clipboard_source = formats.empty() ? nullptr : offer.peer;
+        g_clipboard_formats = formats;
+        for (const auto& peer : g_clipboard_peers) {
+            if (peer != offer.peer) queue_clipboard_formats(*peer, formats);
+        }
+    }
+    if (formats.empty() && GetClipboardOwner() != g_hwnd) return; // Something else was copied since
+    if (!OpenClipboard(g_hwnd)) {
+        if (offer.peer) offer.peer->log("Clipboard: could not take over the local clipboard. Error: " + std::to_string(GetLastError()));
+        return;
+    }
+    g_replacing_clipboard = true; // The WM_DESTROYCLIPBOARD this sends us is not a new copy
+    EmptyClipboard();
+    g_replacing_clipboard = false;
+    for (uint32_t format : formats) SetClipboardData(format, NULL); // Rendered on WM_RENDERFORMAT
+    CloseClipboard();
+}
+
+// GUI thread, on WM_RENDERFORMAT (and for each format on WM_RENDERALLFORMATS): a
+// program is pasting from a peer's offer. Returns false if the peer could not supply it.
+bool render_clipboard_format(UINT format) {
+    std::shared_ptr<ClipboardPeer> source;
+    {
+        std::lock_guard<std::mutex> lock(g_clipboard_mutex);
+        source = g_clipboard_source;
+    }
+    std::string data;
+    if (!source || !fetch_clipboard_data(*source, format, data) || data.empty()) return false;
+    HGLOBAL handle = GlobalAlloc(GMEM_MOVEABLE, data.size());
+    if (handle == NULL) return false;
+    memcpy(GlobalLock(handle), data.data(), data.size());
+    GlobalUnlock(handle);
+    if (SetClipboardData(format, handle) == NULL) {
+        GlobalFree(handle);
+        return false;
+    }
+    return true;
+}
+
+// GUI thread, on WM_RENDERALLFORMATS: our window is going away while the clipboard
+// still holds a peer's unrendered offer. Renders what the peer can still supply so
+// the copy outlives us, and empties the clipboard if it supplies nothing, rather than
+// leave formats no one can render.
+void render_all_clipboard_formats() {
+    if (!OpenClipboard(g_hwnd)) return;
+    if (GetClipboardOwner() == g_hwnd) {
+        std::vector<uint32_t> formats;
+        {
+            std::lock_guard<std::mutex> lock(g_clipboard_mutex);
+            if (g_clipboard_source) formats = g_clipboard_formats;
+        }
+        bool rendered = false;
+        for (uint32_t format : formats) rendered |= render_clipboard_format(format);
+        if (!rendered) EmptyClipboard();
+    }
+    CloseClipboard();
+}
+
+// GUI thread, on WM_DESTROYCLIPBOARD: something emptied the clipboard, so it no longer
+// holds the peer's offer.
+void forget_clipboard_offer() {
+    if (g_replacing_clipboard) return;
+    std::lock_guard<std::mutex> lock(g_clipboard_mutex);
+    g_clipboard_source = nullptr;
+}
+
+// --- File Transfer ---
+// Files dropped on a drop strip (see show_drop_strip) or on the main window are sent
+// over one more TCP connection per client, so moving gigabytes never queues behind
+// input or clipboard traffic. The sender hands the kernel whole slices with
+// TransmitFile (no copies through user space), paced to "files.max_megabits_per_second",
+// and marks the socket as background traffic for QoS. The receiver writes large
+// buffered blocks into a ".part" file and renames it when complete.
+
+const size_t FILE_SLICE_BYTES = 256 * 1024;        // TransmitFile call size; also the pacing step
+const size_t FILE_WRITE_BUFFER_BYTES = 1024 * 1024; // Receiver's write size
+const int64_t FILE_PROGRESS_INTERVAL_MS = 1000;
+
+// One file channel. The sender thread works through batches of dropped files; the
+// receiver thread stores whatever the other side sends.
+struct FileChannel {
+    int client_id = 0; // Server: the session this channel belongs to. Client: 0 (the server)
+    SOCKET sock = INVALID_SOCKET;
+    SecureStream stream; // Sender and receiver each use their own half
+    void (*log)(const std::string&) = nullptr;
+    std::thread sender;
+    std::thread receiver;
+
+    std::mutex batches_mutex; // Guards batches and closed
+    std::condition_variable batches_ready;
+    std::deque<std::vector<std::wstring>> batches;
+    bool closed = false;
+};
+
+std::mutex g_file_channels_mutex; // Guards g_file_channels
+std::vector<std::shared_ptr<FileChannel>> g_file_channels;
+uint32_t g_next_file_batch = 1; // Sender threads; guarded by g_file_channels_mutex
+
+// Any thread. Unblocks both threads of the channel; prune_file_channels joins them.
+void close_file_channel(FileChannel& channel) {
+    {
+        std::lock_guard<std::mutex> lock(channel.batches_mutex);
+        if (channel.closed) return;
+        channel.closed = true;
+        channel.batches.clear();
+        channel.batches_ready.notify_one();
+    }
+    shutdown(channel.sock, SD_BOTH);
+}
+
+// Engine thread, from remove_client.
+void close_file_channels_of(int client_id) {
+    std::lock_guard<std::mutex> lock(g_file_channels_mutex);
+    for (const auto& channel : g_file_channels) {
+        if (channel->client_id == client_id) close_file_channel(*channel);
+    }
+}
+
+// Logs "<verb> <name>: 45% (117.0 of 260.0 MB, 24.8 MB/s)" at most once a second, and
+// once at the end.
+struct TransferProgress {
+    void (*log)(const std::string&);
+    const char* verb;
+    std::string name;
+    uint64_t total;
+    int64_t start_qpc = qpc_now();
+    int64_t last_report_qpc = qpc_now();
+
+    void update(uint64_t done, bool finished) {
+        int64_t now = qpc_now();
+        if (!finished && (now - last_report_qpc) * 1000 < FILE_PROGRESS_INTERVAL_MS * g_qpc_frequency) return;
+        last_report_qpc = now;
+        double seconds = (std::max)((double)(now - start_qpc) / g_qpc_frequency, 0.001);
+        char text[160];
+        snprintf(text, sizeof(text), ": %.0f%% (%.1f of %.1f MB, %.1f MB/s)", total ? done * 100.0 / total : 100.0,
+                 done / 1048576.0, total / 1048576.0, done / 1048576.0 / seconds);
+        log(std::string(verb) + " " + name + text);
+    }
+};
+
+// Sender thread. Streams one open file; false means the connection is no longer usable.
+bool stream_file(FileChannel& channel, LPFN_TRANSMITFILE transmit_file, HANDLE file, uint64_t size, TransferProgress& progress) {
+    double bytes_per_second = g_file_max_mbps * 125000.0;
+    std::vector<char> buffer;
+    uint64_t sent = 0;
+    while (sent < size) {
+        DWORD slice = (DWORD)(std::min<uint64_t>)(FILE_SLICE_BYTES, size - sent);
+        if (transmit_file) {
+            LARGE_INTEGER offset;
+            offset.QuadPart = (LONGLONG)sent;
+            if (!SetFilePointerEx(file, offset, NULL, FILE_BEGIN) ||
+                !transmit_file(channel.sock, file, slice, 0, NULL, NULL, 0)) {
+                return false;
+            }
+        } else {
+            buffer.resize(slice);
+            DWORD read = 0;
+            if (!ReadFile(file, buffer.data(), slice, &read, NULL) || read != slice) return false;
+            if (!stream_send(channel.sock, channel.stream, buffer.data(), slice)) return false;
+        }
+        sent += slice;
+        progress.update(sent, sent == size);
+
+        // Pace to the configured rate, so the transfer never fills the link that input
+        // and the clipboard share.
+        if (bytes_per_second > 0) {
+            double ahead_ms = (sent / bytes_per_second - (double)(qpc_now() - progress.start_qpc) / g_qpc_frequency) * 1000.0;
+            if (ahead_ms >= 1) Sleep((DWORD)ahead_ms);
+        }
+        std::lock_guard<std::mutex> lock(channel.batches_mutex);
+        if (channel.closed) return false;
+    }
+    return true;
+}
+
+void run_file_sender(std::shared_ptr<FileChannel> channel) {
+    LPFN_TRANSMITFILE transmit_file = nullptr;
+    GUID transmit_file_id = WSAID_TRANSMITFILE;
+    DWORD returned = 0;
+    if (channel->stream.link.active ||
+        WSAIoctl(channel->sock, SIO_GET_EXTENSION_FUNCTION_POINTER, &transmit_file_id, sizeof(transmit_file_id),
+                 &transmit_file, sizeof(transmit_file), &returned, NULL, NULL) == SOCKET_ERROR) {
+        transmit_file = nullptr; // ReadFile + send instead; encrypted data has to pass through us anyway
+    }
+
+    for (;;) {
+        std::vector<std::wstring> paths;
+        {
+            std::unique_lock<std::mutex> lock(channel->batches_mutex);
+            channel->batches_ready.wait(lock, [&]() { return channel->closed || !channel->batches.empty(); });
+            if (channel->closed) return;
+            paths = std::move(channel->batches.front());
+            channel->batches.pop_front();
+        }
+        uint32_t batch_id;
+        {
+            std::lock_guard<std::mutex> lock(g_file_channels_mutex);
+            batch_id = g_next_file_batch++;
+        }
+
+        uint32_t file_count = 0;
+        for (const std::wstring& path : paths) {
+            std::string name = std::filesystem::path(path).filename().u8string();
+            HANDLE file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                                      FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+            LARGE_INTEGER size = {};
+            if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &size) || name.empty() || name.size() > MAX_FILE_NAME_BYTES) {
+                channel->log("Skipping " + name + ": it cannot be read. Only files can be sent, not folders.");
+                if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+                continue;
+            }
+            uint8_t header[FILE_HEADER_SIZE];
+            encode_file_header(header, batch_id, (uint64_t)size.QuadPart, (uint16_t)name.size());
+            TransferProgress progress{ channel->log, "Sending", name, (uint64_t)size.QuadPart };
+            bool ok = stream_send(channel->sock, channel->stream, (const char*)header, sizeof(header)) &&
+                      stream_send(channel->sock, channel->stream, name.data(), name.size()) &&
+                      stream_file(*channel, transmit_file, file, (uint64_t)size.QuadPart, progress);
+            CloseHandle(file);
+            if (!ok) {
+                // The receiver cannot tell where the next file would begin, so the
+                // channel is done.
+                channel->log("File transfer of " + name + " failed. Closing the file channel.");
+                close_file_channel(*channel);
+                return;
+            }
+            ++file_count;
+        }
+        uint8_t batch_end[FILE_BATCH_END_SIZE];
+        encode_file_batch_end(batch_end, batch_id, file_count);
+        if (!stream_send(channel->sock, channel->stream, (const char*)batch_end, sizeof(batch_end))) break;
+    }
+    close_file_channel(*channel);
+}
+
+// Where received files go: "files.receive_folder", or Downloads\Simple KVM.
+std::filesystem::path get_receive_folder() {
+    if (!g_file_receive_folder.empty()) return std::filesystem::u8path(g_file_receive_folder);
+    wchar_t path[MAX_PATH];
+    if (SUCCEEDED(SHGetFolderPathW(NULL, CSIDL_PROFILE, NULL, 0, path))) {
+        return std::filesystem::path(path) / L"Downloads" / L"Simple KVM";
+    }
+    return GetConfigPath().parent_path() / L"Received";
+}
+
+// True for names Windows maps to a device whatever the folder: CON, PRN, AUX, NUL,
+// COM1-9 and LPT1-9, also with an extension ("nul.txt") or spaces before it.
+bool is_reserved_device_name(const std::wstring& name) {
+    std::wstring base = name.substr(0, name.find(L'.'));
+    while (!base.empty() && base.back() == L' ') base.pop_back();
+    static const wchar_t* const DEVICES[] = { L"CON", L"PRN", L"AUX", L"NUL" };
+    for (const wchar_t* device : DEVICES) {
+        if (lstrcmpiW(base.c_str(), device) == 0) return true;
+    }
+    return base.size() == 4 && base[3] >= L'1' && base[3] <= L'9' &&
+           (lstrcmpiW(base.substr(0, 3).c_str(), L"COM") == 0 || lstrcmpiW(base.substr(0, 3).c_str(), L"LPT") == 0);
+}
+
+// Keeps only a plain file name from whatever the peer sent, and picks a path in
+// folder that does not exist yet ("name (2).ext", ...). Trailing dots and spaces,
+// which Windows would strip, go, and device names get a leading underscore.
+std::filesystem::path make_receive_path(const std::filesystem::path& folder, const std::string& sent_name) {
+    std::wstring name = std::filesystem::u8path(sent_name).filename().wstring();
+    name.erase(std::remove_if(name.begin(), name.end(), [](wchar_t c) { return c < 32 || wcschr(L"<>:\"/\\|?*", c); }),
+               name.end());
+    while (!name.empty() && (name.back() == L'.' || name.back() == L' ')) name.pop_back();
+    if (name.empty()) name = L"received file";
+    if (is_reserved_device_name(name)) name = L"_" + name;
+    std::filesystem::path candidate = folder / name;
+    std::filesystem::path stem = candidate.stem(), extension = candidate.extension();
+    std::error_code error;
+    for (int n = 2; std::filesystem::exists(candidate, error) || std::filesystem::exists(candidate.wstring() + L".part", error); ++n) {
+        candidate = folder / (stem.wstring() + L" (" + std::to_wstring(n) + L")" + extension.wstring());
+    }
+    return candidate;
+}
+
+// Receiver thread. Reads one file's contents off the socket. If the file is over
+// "files.max_file_megabytes", does not fit on the disk or cannot be written, the
+// contents are still read (and dropped) so the next file lines up.
+bool receive_file(FileChannel& channel, const std::string& name, uint64_t size, std::vector<char>& buffer) {
+    std::error_code error;
+    std::filesystem::path folder = get_receive_folder();
+    std::filesystem::create_directories(folder, error);
+    std::filesystem::path final_path = make_receive_path(folder, name);
+    std::wstring part_path = final_path.wstring() + L".part";
+    std::wstring folder_path = folder.wstring();
+    uint64_t max_bytes = (uint64_t)g_file_max_megabytes.load() * 1024 * 1024;
+    ULARGE_INTEGER available = {};
+    HANDLE file = INVALID_HANDLE_VALUE;
+    if (max_bytes != 0 && size > max_bytes) {
+        channel.log("Refusing " + final_path.u8string() + ": " + std::to_string(size / (1024 * 1024)) +
+                    " MB is over the " + std::to_string(g_file_max_megabytes.load()) + " MB limit. Discarding it.");
+    } else if (GetDiskFreeSpaceExW(folder_path.c_str(), &available, NULL, NULL) && available.QuadPart < size) {
+        channel.log("Refusing " + final_path.u8string() + ": only " + std::to_string(available.QuadPart / (1024 * 1024)) +
+                    " MB free for " + std::to_string(size / (1024 * 1024)) + " MB. Discarding it.");
+    } else {
+        file = CreateFileW(part_path.c_str(), GENERIC_WRITE, 0, NULL, CREATE_NEW, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (file == INVALID_HANDLE_VALUE) {
+            channel.log("Cannot create " + final_path.u8string() + " (error " + std::to_string(GetLastError()) + "). Discarding it.");
+        }
+    }
+
+    TransferProgress progress{ channel.log, "Receiving", name, size };
+    uint64_t received = 0;
+    size_t buffered = 0;
+    bool write_ok = (file != INVALID_HANDLE_VALUE);
+    while (received < size) {
+        size_t want = (size_t)(std::min<uint64_t>)(buffer.size() - buffered, size - received);
+        int bytes = stream_recv(channel.sock, channel.stream, buffer.data() + buffered, want);
+        if (bytes <= 0) break;
+        buffered += bytes;
+        received += bytes;
+        if (buffered == buffer.size() || received == size) {
+            DWORD written = 0;
+            if (write_ok && (!WriteFile(file, buffer.data(), (DWORD)buffered, &written, NULL) || written != buffered)) {
+                channel.log("Writing " + final_path.u8string() + " failed (error " + std::to_string(GetLastError()) + "). Discarding it.");
+                write_ok = false;
+            }
+            buffered = 0;
+        }
+        progress.update(received, received == size);
+    }
+    if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+    bool complete = (received == size);
+    if (complete && write_ok && MoveFileExW(part_path.c_str(), final_path.wstring().c_str(), 0)) {
+        channel.log("Saved " + final_path.u8string());
+    } else if (file != INVALID_HANDLE_VALUE) {
+        DeleteFileW(part_path.c_str());
+    }
+    return complete;
+}
+
+void run_file_receiver(std::shared_ptr<FileChannel> channel) {
+    std::vector<char> buffer(FILE_WRITE_BUFFER_BYTES);
+    uint8_t header[FILE_HEADER_SIZE];
+    while (stream_recv_exact(channel->sock, channel->stream, (char*)header, 1)) {
+        if (header[0] == (uint8_t)FileMessage::BatchEnd) {
+            if (!stream_recv_exact(channel->sock, channel->stream, (char*)header + 1, FILE_BATCH_END_SIZE - 1)) break;
+            uint32_t file_count = get_u32_le(header + 5);
+            channel->log("Received " + std::to_string(file_count) + " file(s) into " + get_receive_folder().u8string() + ".");
+            continue;
+        }
+        if (header[0] != (uint8_t)FileMessage::FileHeader ||
+            !stream_recv_exact(channel->sock, channel->stream, (char*)header + 1, FILE_HEADER_SIZE - 1)) break;
+        uint64_t size = get_u64_le(header + 5);
+        uint16_t name_length = get_u16_le(header + 13);
+        std::string name(name_length, '\0');
+        if (name_length > MAX_FILE_NAME_BYTES ||
+            (name_length > 0 && !stream_recv_exact(channel->sock, channel->stream, &name[0], name_length))) break;
+        if (!receive_file(*channel, name, size, buffer)) break;
+    }
+    close_file_channel(*channel);
+}
+
+// Takes over sock, like start_clipboard_peer.
+std::shared_ptr<FileChannel> start_file_channel(SOCKET sock, int client_id, void (*log)(const std::string&),
+                                                const ChannelSecret* secret) {
+    // File data is bulk traffic: let QoS put input ahead of it.
+    SocketTuning background;
+    background.qos_traffic_type = "background";
+    apply_socket_qos(sock, background);
+
+    auto channel = std::make_shared<FileChannel>();
+    channel->client_id = client_id;
+    channel->sock = sock;
+    channel->log = log;
+    if (secret != nullptr && !start_secure_link(channel->stream.link, *secret, "files", client_id != 0)) {
+        log("!! Could not set up encryption for the file channel.");
+        close_tuned_socket(sock);
+        return nullptr;
+    }
+    channel->sender = std::thread(run_file_sender, channel);
+    channel->receiver = std::thread(run_file_receiver, channel);
+    std::lock_guard<std::mutex> lock(g_file_channels_mutex);
+    g_file_channels.push_back(channel);
+    return channel;
+}
+
+// Joins and forgets channels that have closed (all of them with close_all). Never
+// called from a file channel thread.
+void prune_file_channels(bool close_all) {
+    std::vector<std::shared_ptr<FileChannel>> finished;
+    {
+        std::lock_guard<std::mutex> lock(g_file_channels_mutex);
+        for (auto it = g_file_channels.begin(); it != g_file_channels.end();) {
+            if (close_all) close_file_channel(**it);
+            bool closed;
+            {
+                std::lock_guard<std::mutex> batches_lock((*it)->batches_mutex);
+                closed = (*it)->closed;
+            }
+            if (closed) {
+                finished.push_back(*it);
+                it = g_file_channels.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    for (const auto& channel : finished) {
+        channel->sender.join();
+        channel->receiver.join();
+        close_tuned_socket(channel->sock);
+    }
+}
+
+// Server: accepts file channels until the server is stopped.
+void run_file_listener(const StopSignal& stop) {
+    SOCKET listen_socket = g_file_listen_socket;
+    int client_id = 0;
+    ChannelSecret secret;
+    bool encrypted = false;
+    std::vector<std::unique_ptr<PendingSideChannel>> pending;
+    SOCKET sock;
+    while ((sock = accept_side_channel(stop, listen_socket, "files", pending, client_id, secret, encrypted)) != INVALID_SOCKET) {
+        prune_file_channels(false);
+        if (start_file_channel(sock, client_id, LogServerMessage, encrypted ? &secret : nullptr)) {
+            LogServerMessage("Client " + std::to_string(client_id) + " opened the file channel.");
+        }
+    }
+}
+
+// Client side-channel thread, once the server's ack offered a file port.
+void open_file_channel(const StopSignal& stop, const SocketAddress& server_addr, uint16_t port, uint32_t session_token, const ChannelSecret* secret) {
+    SOCKET sock = connect_side_channel(stop, server_addr, port, "files", session_token);
+    if (sock == INVALID_SOCKET) return;
+    start_file_channel(sock, 0, LogClientMessage, secret);
+}
+
+// Queues dropped files for the channel of client_id (0 on the client: the server).
+// Returns false if that machine has no file channel.
+bool send_files(int client_id, std::vector<std::wstring> paths) {
+    std::lock_guard<std::mutex> lock(g_file_channels_mutex);
+    for (const auto& channel : g_file_channels) {
+        if (channel->client_id != client_id) continue;
+        std::lock_guard<std::mutex> batches_lock(channel->batches_mutex);
+        if (channel->closed) continue;
+        channel->batches.push_back(std::move(paths));
+        channel->batches_ready.notify_one();
+        return true;
+    }
+    return false;
+}
+
+// Reads the file list of a WM_DROPFILES and releases the drop handle.
+std::vector<std::wstring> take_dropped_files(HDROP drop) {
+    std::vector<std::wstring> paths;
+    UINT count = DragQueryFileW(drop, 0xFFFFFFFF, NULL, 0);
+    for (UINT i = 0; i < count; ++i) {
+        std::wstring path(DragQueryFileW(drop, i, NULL, 0) + 1, L'\0');
+        path.resize(DragQueryFileW(drop, i, &path[0], (UINT)path.size()));
+        paths.push_back(path);
+    }
+    DragFinish(drop);
+    return paths;
+}
+
+// --- Drop Strip ---
+// Dragging files with the left button into a linked screen edge raises a thin topmost
+// strip over that edge. Dropping on it sends the files to the client beyond the edge.
+// The strip accepts files the classic way (WS_EX_ACCEPTFILES), so Explorer needs no
+// OLE drop target.
+
+const LONG DROP_STRIP_THICKNESS = 32;
+const UINT DROP_STRIP_HIDE_DELAY_MS = 500; // Lets a drop on release arrive before the strip goes
+
+struct DropStripRequest {
+    RECT rect;
+    std::string client; // Client address from the layout link
+};
+
+HWND g_drop_strip = NULL;        // GUI thread only
+std::string g_drop_strip_client; // GUI thread only
+bool g_drop_strip_requested = false; // Hook thread: shown for the current drag
+
+// Hook thread, from the mouse hook: a left-button drag reached an edge zone.
+void show_drop_strip(const EdgeZone& zone) {
+    if (!g_front_end->show_drop_strip) return;
+    RECT rect;
+    switch (zone.edge) {
+        case EDGE_LEFT:  rect = { zone.line, zone.from, zone.line + DROP_STRIP_THICKNESS, zone.to }; break;
+        case EDGE_RIGHT: rect = { zone.line + 1 - DROP_STRIP_THICKNESS, zone.from, zone.line + 1, zone.to }; break;
+        case EDGE_TOP:   rect = { zone.from, zone.line, zone.to, zone.line + DROP_STRIP_THICKNESS }; break;
+        default:         rect = { zone.from, zone.line + 1 - DROP_STRIP_THICKNESS, zone.to, zone.line + 1 }; break;
+    }
+    DropStripRequest* request = new DropStripRequest{ rect, g_layout_links[zone.link].client };
+    if (g_front_end->show_drop_strip(request)) g_drop_strip_requested = true;
+    else delete request;
+}
+
+LRESULT CALLBACK drop_strip_wnd_proc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam) {
+    switch (message) {
+        case WM_DROPFILES: {
+            std::vector<std::wstring> paths = take_dropped_files((HDROP)wParam);
+            ShowWindow(hWnd, SW_HIDE);
+            int client_id = 0;
+            {
+                std::lock_guard<std::mutex> lock(g_sessions_mutex);
+                for (const auto& session : g_sessions) {
+                    if (session->address == g_drop_strip_client) { client_id = session->id; break; }
+                }
+            }
+            if (client_id == 0 || !send_files(client_id, std::move(paths))) {
+                LogServerMessage(LogLevel::Warning, "Cannot send files to " + g_drop_strip_client + ": it has no file channel.");
+            }
+            return 0;
+        }
+        case WM_TIMER:
+            KillTimer(hWnd, IDT_DROP_STRIP_HIDE);
+            ShowWindow(hWnd, SW_HIDE);
+            return 0;
+        case WM_PAINT: {
+            PAINTSTRUCT ps;
+            HDC hdc = BeginPaint(hWnd, &ps);
+            HBRUSH brush = CreateSolidBrush(g_clrAccentBlue);
+            FillRect(hdc, &ps.rcPaint, brush);
+            DeleteObject(brush);
+            EndPaint(hWnd, &ps);
+            return 0;
+        }
+    }
+    return DefWindowProc(hWnd, message, wParam, lParam);
+}
+
+// GUI thread, on WM_APP_SHOW_DROP_STRIP. Takes ownership of the request.
+void place_drop_strip(DropStripRequest* request_ptr) {
+    std::unique_ptr<DropStripRequest> owned(request_ptr);
+    const DropStripRequest& request = *owned;
+    if (g_drop_strip == NULL) {
+        WNDCLASS wc = {};
+        wc.lpfnWndProc = drop_strip_wnd_proc;
+        wc.hInstance = GetModuleHandle(NULL);
+        wc.lpszClassName = "KVMDropStrip";
+        wc.hCursor = LoadCursor(NULL, IDC_ARROW);
+        RegisterClass(&wc);
+        g_drop_strip = CreateWindowEx(WS_EX_ACCEPTFILES | WS_EX_TOPMOST | WS_EX_TOOLWINDOW | WS_EX_LAYERED | WS_EX_NOACTIVATE,
+                                      wc.lpszClassName, "Drop files to send", WS_POPUP, 0, 0, 0, 0, NULL, NULL, wc.hInstance, NULL);
+        if (g_drop_strip == NULL) return;
+        SetLayeredWindowAttributes(g_drop_strip, 0, 160, LWA_ALPHA);
+    }
+    g_drop_strip_client = request.client;
+    KillTimer(g_drop_strip, IDT_DROP_STRIP_HIDE);
+    SetWindowPos(g_drop_strip, HWND_TOPMOST, request.rect.left, request.rect.top, request.rect.right - request.rect.left,
+                 request.rect.bottom - request.rect.top, SWP_NOACTIVATE | SWP_SHOWWINDOW);
+}
+
+// GUI thread, on WM_APP_HIDE_DROP_STRIP (the drag ended).
+void hide_drop_strip() {
+    if (g_drop_strip != NULL && IsWindowVisible(g_drop_strip)) SetTimer(g_drop_strip, IDT_DROP_STRIP_HIDE, DROP_STRIP_HIDE_DELAY_MS, NULL);
+}
+
+// GUI thread, on WM_DROPFILES over the main window: the server sends to the client
+// under control (or the first one), a client sends to its server.
+void send_dropped_files(HDROP drop) {
+    std::vector<std::wstring> paths = take_dropped_files(drop);
+    void (*log)(const std::string&) = LogClientMessage;
+    int client_id = 0;
+    if (g_is_server_active) {
+        log = LogServerMessage;
+        client_id = g_active_client_id;
+        std::lock_guard<std::mutex> lock(g_sessions_mutex);
+        if (client_id == 0 && !g_sessions.empty()) client_id = g_sessions.front()->id;
+    }
+    if ((g_is_server_active && client_id == 0) || !send_files(client_id, std::move(paths))) {
+        log("Dropped files were not sent: no connected machine has a file channel.");
+    }
+}
+
+// --- Client Sessions ---
+
+void wake_server_engine() {
+    SOCKET wake_socket = g_engine_wake_socket.load();
+    if (wake_socket != INVALID_SOCKET) {
+        sendto(wake_socket, "w", 1, 0, (SOCKADDR*)&g_engine_wake_addr, sizeof(g_engine_wake_addr));
+    }
+}
+
+std::shared_ptr<ClientSession> find_session(int client_id) {
+    std::lock_guard<std::mutex> lock(g_sessions_mutex);
+    for (const auto& session : g_sessions) {
+        if (session->id == client_id) return session;
+    }
+    return nullptr;
+}
+
+// Engine thread. Accepts one pending connection and registers it as a new session.
+void accept_client(SOCKET listen_socket) {
+    SocketAddress peer_addr;
+    peer_addr.length = sizeof(peer_addr.storage);
+    SOCKET client_sock = accept(listen_socket, peer_addr.get(), &peer_addr.length);
+    if (client_sock == INVALID_SOCKET) return;
+
+    std::lock_guard<std::mutex> lock(g_sessions_mutex);
+    if (g_sessions.size() >= MAX_CLIENTS) {
+        LogServerMessage("Already serving " + std::to_string(MAX_CLIENTS) + " clients. Rejecting new connection.");
+        closesocket(client_sock);
+        return;
+    }
+
+    apply_socket_tuning(client_sock, LogServerMessage);
+    u_long non_blocking = 1;
+    ioctlsocket(client_sock, FIONBIO, &non_blocking);
+
+    auto session = std::make_shared<ClientSession>();
+    session->id = g_next_client_id++;
+    session->sock = client_sock;
+    session->address = format_socket_address(peer_addr);
+    session->last_heard = GetTickCount64();
+    g_sessions.push_back(session);
+    LogServerMessage("Client " + std::to_string(session->id) + " connected from " + session->address +
+                     " (" + std::to_string(g_sessions.size()) + " connected).");
+}
+
+// Engine thread. Closes the client's sockets and forgets it. The sender may still hold
+// a reference for a moment; its sends then see an invalid socket and do nothing.
+void remove_client(const std::shared_ptr<ClientSession>& session, bool park) {
+    {
+        std::lock_guard<std::mutex> lock(session->send_mutex);
+        if (session->sock == INVALID_SOCKET) return; // Already removed
+        close_tuned_socket(session->sock);
+        session->sock = INVALID_SOCKET;
+        if (session->udp_socket != INVALID_SOCKET) close_tuned_socket(session->udp_socket);
+        session->udp_socket = INVALID_SOCKET;
+        session->send_queue.clear();
+    }
+    close_clipboard_peers_of(session->id);
+    close_file_channels_of(session->id);
+    size_t remaining = 0;
+    {
+        std::lock_guard<std::mutex> lock(g_sessions_mutex);
+        g_sessions.erase(std::remove(g_sessions.begin(), g_sessions.end(), session), g_sessions.end());
+        remaining = g_sessions.size();
+    }
+    if (session->session_token != 0 && park) {
+        g_parked_sessions.push_back({ session->session_token, session->id, session->address,
+                                      GetTickCount64() + SESSION_RESUME_WINDOW_MS });
+    }
+    LogServerMessage("Client " + std::to_string(session->id) + " (" + session->address + ") disconnected (" +
+                     std::to_string(remaining) + " connected).");
+    if (g_main_thread_id != 0) {
+        post_to_hook_thread(WM_APP_CLIENT_DISCONNECTED, (WPARAM)session->id, 0);
+    }
+}
+
+// Counts a client the sender gave up on, and traces it for ETW listeners.
+void trace_send_error(int client_id, int error, const char* reason) {
+    g_stat_send_errors.fetch_add(1, std::memory_order_relaxed);
+    if (trace_enabled(TRACE_LEVEL_WARNING, TRACE_KEYWORD_NETWORK)) {
+        int32_t id = client_id, code = error;
+        write_trace_event(TRACE_SEND_ERROR, { trace_data(id), trace_data(code), trace_data(reason) });
+    }
+}
+
+// Caller must hold session.send_mutex. Sends what the kernel will take right now and
+// queues the rest for the engine, so the sender thread never blocks on a slow client.
+bool send_bytes_to_client(ClientSession& session, const char* data, size_t len) {
+    if (session.sock == INVALID_SOCKET || session.failed) return false;
+    if (session.send_queue.empty()) {
+        int bytes_sent = send(session.sock, data, (int)len, 0);
+        if (bytes_sent == SOCKET_ERROR) {
+            int error = WSAGetLastError();
+            if (error != WSAEWOULDBLOCK) {
+                LogServerMessage(LogLevel::Warning, "!! SEND FAILED to client " + std::to_string(session.id) + " with error: " + std::to_string(error));
+                trace_send_error(session.id, error, "send failed");
+                session.failed = true;
+                wake_server_engine();
+                return false;
+            }
+            bytes_sent = 0;
+        }
+        if ((size_t)bytes_sent == len) return true;
+        data += bytes_sent;
+        len -= bytes_sent;
+    }
+    if (session.send_queue.size() + len > MAX_CLIENT_SEND_QUEUE) {
+        LogServerMessage(LogLevel::Warning, "Client " + std::to_string(session.id) + " is not keeping up. Dropping it.");
+        trace_send_error(session.id, 0, "send queue full");
+        session.failed = true;
+        wake_server_engine();
+        return false;
+    }
+    bool was_empty = session.send_queue.empty();
+    session.send_queue.append(data, len);
+    if (was_empty) wake_server_engine(); // Start polling for writability
+    return true;
+}
+
+// Caller must hold session.send_mutex. Once the client is paired, data is sealed into
+// records (a whole sender batch is usually one) before it goes out.
+bool send_to_client(ClientSession& session, const char* data, size_t len) {
+    if (!session.secure.active) return send_bytes_to_client(session, data, len);
+    while (len > 0) {
+        size_t chunk = (std::min)(len, MAX_RECORD_PAYLOAD);
+        size_t record = seal_record(session.secure.seal, (const uint8_t*)data, chunk, session.record_buffer.data());
+        if (record == 0) {
+            session.failed = true;
+            wake_server_engine();
+            return false;
+        }
+        if (!send_bytes_to_client(session, (const char*)session.record_buffer.data(), record)) return false;
+        data += chunk;
+        len -= chunk;
+    }
+    return true;
+}
+
+// Engine thread, when the socket is writable again.
+bool flush_client_queue(ClientSession& session) {
+    std::lock_guard<std::mutex> lock(session.send_mutex);
+    if (session.send_queue.empty()) return true;
+    int bytes_sent = send(session.sock, session.send_queue.data(), (int)session.send_queue.size(), 0);
+    if (bytes_sent == SOCKET_ERROR) return WSAGetLastError() == WSAEWOULDBLOCK;
+    session.send_queue.erase(0, bytes_sent);
+    return true;
+}
+
+// Opens a UDP socket connected to the client's motion port (same host as the TCP peer).
+SOCKET open_client_udp_channel(SOCKET client_socket, uint16_t udp_port) {
+    SocketAddress peer_addr;
+    peer_addr.length = sizeof(peer_addr.storage);
+    if (getpeername(client_socket, peer_addr.get(), &peer_addr.length) == SOCKET_ERROR) return INVALID_SOCKET;
+    peer_addr.set_port(udp_port);
+
+    SOCKET udp_socket = socket(peer_addr.family(), SOCK_DGRAM, IPPROTO_UDP);
+    if (udp_socket == INVALID_SOCKET) return INVALID_SOCKET;
+    if (peer_addr.family() == AF_INET6) {
+        DWORD v6_only = 0; // An IPv4 client of the dual-stack listener has a mapped address
+        setsockopt(udp_socket, IPPROTO_IPV6, IPV6_V6ONLY, (const char*)&v6_only, sizeof(v6_only));
+    }
+    if (connect(udp_socket, peer_addr.get(), peer_addr.length) == SOCKET_ERROR) {
+        LogServerMessage("UDP motion channel setup failed. Error: " + std::to_string(WSAGetLastError()));
+        closesocket(udp_socket);
+        return INVALID_SOCKET;
+    }
+    LogServerMessage("UDP motion channel to port " + std::to_string(udp_port) +
+                     " (QoS=" + apply_socket_qos(udp_socket, g_socket_tuning) + ").");
+    return udp_socket;
+}
+
+// Engine thread. If token names a session that dropped recently (or one whose dead
+// connection we have not noticed yet) from the same address, session takes over its
+// id, and the hook thread is told so it can hand control back.
+bool resume_parked_session(ClientSession& session, uint32_t token) {
+    std::shared_ptr<ClientSession> stale;
+    {
+        std::lock_guard<std::mutex> lock(g_sessions_mutex);
+        for (const auto& other : g_sessions) {
+            if (other.get() != &session && other->session_token == token) stale = other;
+        }
+    }
+    if (stale) remove_client(stale); // Parks it under the same token
+
+    ULONGLONG now = GetTickCount64();
+    g_parked_sessions.erase(std::remove_if(g_parked_sessions.begin(), g_parked_sessions.end(),
+                                           [now](const ParkedSession& parked) { return parked.expires <= now; }),
+                            g_parked_sessions.end());
+    auto parked = std::find_if(g_parked_sessions.begin(), g_parked_sessions.end(), [&](const ParkedSession& p) {
+        return p.token == token && p.address == session.address;
+    });
+    if (parked == g_parked_sessions.end()) return false;
+
+    int old_id = session.id;
+    {
+        std::lock_guard<std::mutex> lock(g_sessions_mutex);
+        session.id = parked->id;
+        std::sort(g_sessions.begin(), g_sessions.end(),
+                  [](const std::shared_ptr<ClientSession>& a, const std::shared_ptr<ClientSession>& b) { return a->id < b->id; });
+    }
+    g_parked_sessions.erase(parked);
+    LogServerMessage("Client " + std::to_string(old_id) + " resumed the session of client " + std::to_string(session.id) + ".");
+    post_to_hook_thread(WM_APP_CLIENT_RESUMED, (WPARAM)session.id, 0);
+    return true;
+}
+
+// Engine thread, on the client's hello while a pairing key is set. Answers with the
+// pairing challenge and keeps the hello for when the response arrives. False if the
+// client offered no nonce; it is told pairing is required and then dropped.
+bool send_pairing_challenge(ClientSession& session, std::string_view hello_line) {
+    std::string_view nonce_hex;
+    std::lock_guard<std::mutex> lock(session.send_mutex);
+    if (!find_handshake_text(hello_line, "auth_nonce", nonce_hex) ||
+        !decode_hex(nonce_hex, session.pairing_nonces, PAIRING_NONCE_SIZE)) {
+        LogServerMessage(LogLevel::Warning, "Client " + std::to_string(session.id) + " (" + session.address +
+                         ") has no pairing key. Rejecting it.");
+        static const char required[] = "event:auth_required\n";
+        send_to_client(session, required, sizeof(required) - 1);
+        return false;
+    }
+    uint8_t server_proof[PAIRING_PROOF_SIZE], client_proof[PAIRING_PROOF_SIZE];
+    ChannelSecret secret;
+    if (!random_bytes(session.pairing_nonces + PAIRING_NONCE_SIZE, PAIRING_NONCE_SIZE) ||
+        !derive_pairing(session.pairing_nonces, server_proof, client_proof, secret)) {
+        return false;
+    }
+    SecureZeroMemory(secret.data(), secret.size());
+    std::string challenge = "event:auth_challenge,nonce:" + encode_hex(session.pairing_nonces + PAIRING_NONCE_SIZE, PAIRING_NONCE_SIZE) +
+                            ",proof:" + encode_hex(server_proof, sizeof(server_proof)) + "\n";
+    send_to_client(session, challenge.c_str(), challenge.length());
+    session.pairing_hello.assign(hello_line.data(), hello_line.size());
+    return true;
+}
+
+// Engine thread, on the line after our challenge. If the client's proof holds, the
+// connection switches to encrypted records in both directions; the ack is the first.
+bool accept_pairing_response(ClientSession& session, std::string_view line) {
+    std::string_view proof_hex;
+    uint8_t proof[PAIRING_PROOF_SIZE], server_proof[PAIRING_PROOF_SIZE], client_proof[PAIRING_PROOF_SIZE];
+    ChannelSecret secret;
+    if (!is_handshake_message(line, "auth_response") || !find_handshake_text(line, "proof", proof_hex) ||
+        !decode_hex(proof_hex, proof, sizeof(proof)) ||
+        !derive_pairing(session.pairing_nonces, server_proof, client_proof, secret) || !proofs_equal(proof, client_proof)) {
+        LogServerMessage(LogLevel::Warning, "Client " + std::to_string(session.id) + " (" + session.address +
+                         ") does not know the pairing key. Rejecting it.");
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(session.send_mutex);
+    session.record_buffer.resize(MAX_RECORD_PAYLOAD + RECORD_OVERHEAD);
+    bool started = start_secure_link(session.secure, secret, "input", true);
+    SecureZeroMemory(secret.data(), secret.size());
+    if (!started) LogServerMessage(LogLevel::Error, "!! Could not set up encryption for client " + std::to_string(session.id) + ".");
+    return started;
+}
+
+// Answers the client's protocol hello. Clients that never send one (older builds)
+// simply stay on the legacy text protocol.
+void negotiate_client_protocol(ClientSession& session, std::string_view hello_line) {
+    std::string client_name = "Client " + std::to_string(session.id);
+    int client_version = 0;
+    if (!parse_handshake_line(hello_line, "hello", client_version)) {
+        LogServerMessage(client_name + " did not send a protocol hello. Using text protocol.");
+        return;
+    }
+    int version = (std::min)(client_version, KVM_PROTOCOL_VERSION);
+    if (version <= KVM_PROTOCOL_TEXT) {
+        LogServerMessage(client_name + " does not support the binary protocol. Using text protocol.");
+        return;
+    }
+
+    // Hybrid transport needs v2 on both ends, the client's motion port, and our config.
+    uint32_t udp_port = 0;
+    SOCKET udp_socket = INVALID_SOCKET;
+    if (version >= 2 && g_udp_transport_enabled &&
+        find_handshake_param(hello_line, "udp_port", udp_port) && udp_port > 0 && udp_port <= 0xFFFF) {
+        udp_socket = open_client_udp_channel(session.sock, (uint16_t)udp_port);
+    }
+
+    uint32_t resume_token = 0;
+    if (find_handshake_param(hello_line, "resume", resume_token) && resume_token != 0) {
+        if (resume_parked_session(session, resume_token)) client_name = "Client " + std::to_string(session.id);
+    }
+    do session.session_token = std::random_device{}(); while (session.session_token == 0);
+
+    std::lock_guard<std::mutex> lock(session.send_mutex);
+    // The ack goes out under the session lock, so every frame after it is binary.
+    std::string ack = "event:hello_ack,version:" + std::to_string(version) +
+                      ",session:" + std::to_string(session.session_token) +
+                      ",dpi:" + std::to_string(query_system_dpi());
+    if (udp_socket != INVALID_SOCKET) {
+        if (session.udp_socket != INVALID_SOCKET) close_tuned_socket(session.udp_socket);
+        session.udp_socket = udp_socket;
+        session.udp_token = std::random_device{}();
+        session.udp_seq = 0;
+        session.udp_barrier_pending = false;
+        ack += ",udp_token:" + std::to_string(session.udp_token);
+    }
+    if (g_clipboard_listen_socket != INVALID_SOCKET) ack += ",clipboard_port:" + std::to_string(CLIPBOARD_PORT);
+    if (g_file_listen_socket != INVALID_SOCKET) ack += ",file_port:" + std::to_string(FILE_PORT);
+    int heartbeat_ms = g_heartbeat_interval_ms;
+    if (version >= 5 && heartbeat_ms > 0) {
+        ack += ",heartbeat_ms:" + std::to_string(heartbeat_ms) + ",heartbeat_timeout_ms:" + std::to_string(g_heartbeat_timeout_ms);
+        session.next_heartbeat = GetTickCount64() + heartbeat_ms;
+    }
+    ack += "\n";
+    send_to_client(session, ack.c_str(), ack.length());
+    session.protocol = version;
+    LogServerMessage(client_name + " negotiated binary protocol v" + std::to_string(version) +
+                     (udp_socket != INVALID_SOCKET ? " with UDP mouse motion." : " over TCP only."));
+}
+
+// Engine thread, when the client's socket is readable: the protocol hello first, then
+// (v3) latency echoes and (v5) heartbeat acks. Returns false once the client has gone away.
+bool read_from_client(ClientSession& session) {
+    FrameBuffer<1024>& receive_buffer = session.receive_buffer;
+    uint8_t* write_ptr = receive_buffer.write_ptr(); // May compact, so before write_space()
+    int result = recv(session.sock, (char*)write_ptr, (int)receive_buffer.write_space(), 0);
+    if (result == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK) return true;
+    if (result <= 0) return false;
+    receive_buffer.commit(result);
+    session.last_heard = GetTickCount64();
+
+    if (!session.handshake_done) {
+        // With a pairing key: hello, our challenge, the client's response, then the ack.
+        std::string_view line;
+        if (receive_buffer.next_line(line)) {
+            if (!g_pairing_enabled) {
+                session.handshake_done = true;
+                negotiate_client_protocol(session, line);
+            } else if (session.pairing_hello.empty()) {
+                return send_pairing_challenge(session, line);
+            } else {
+                if (!accept_pairing_response(session, line)) return false;
+                session.handshake_done = true;
+                negotiate_client_protocol(session, session.pairing_hello);
+                std::string().swap(session.pairing_hello);
+            }
+        } else if (receive_buffer.size() > MAX_HANDSHAKE_LINE_SIZE) {
+            if (g_pairing_enabled) return false;
+            session.handshake_done = true;
+            negotiate_client_protocol(session, std::string_view((const char*)receive_buffer.data(), receive_buffer.size()));
+            receive_buffer.clear();
+        }
+        if (!session.handshake_done) return true;
+    }
+
+    FrameBuffer<1024>& frames = session.secure.active ? session.plain_buffer : receive_buffer;
+    if (session.secure.active && !open_records(session.secure.open, receive_buffer, frames, MAX_CLIENT_RECORD_PAYLOAD)) {
+        LogServerMessage(LogLevel::Warning, "Data from client " + std::to_string(session.id) + " failed authentication. Dropping it.");
+        return false;
+    }
+    InputEvent ev;
+    size_t consumed = 0;
+    DecodeStatus status;
+    while ((status = decode_binary_frame(frames.data(), frames.size(), ev, consumed)) == DecodeStatus::Ok) {
+        frames.consume(consumed);
+        if (ev.type == EventType::LatencyEcho) record_latency_echo(ev.seq, ev.elapsed_us);
+        else if (ev.type == EventType::HeartbeatAck) {
+            if (ev.seq == session.heartbeat_id && session.heartbeat_sent_qpc != 0) {
+                record_heartbeat_rtt(qpc_to_us(qpc_now() - session.heartbeat_sent_qpc));
+                session.heartbeat_sent_qpc = 0;
+            }
+        }
+        else if (ev.type == EventType::EdgeReturn && g_main_thread_id != 0) {
+            post_to_hook_thread(WM_APP_EDGE_RETURN, (WPARAM)session.id, (LPARAM)ev.position);
+        }
+    }
+    if (status == DecodeStatus::Invalid) {
+        if (!session.reported_invalid) LogServerMessage("Ignoring unexpected data from client " + std::to_string(session.id) + ".");
+        session.reported_invalid = true;
+        frames.clear();
+    }
+    return true;
+}
+
+// Engine thread, after every poll. Sends each v5 client its heartbeat when one is due
+// and drops clients that have been silent for the timeout; remove_client then returns
+// control to the server and parks the session for a resume. Returns how long the
+// engine may wait before the next deadline (-1 = no deadline).
+int service_heartbeats(const std::vector<std::shared_ptr<ClientSession>>& sessions) {
+    int interval_ms = g_heartbeat_interval_ms;
+    if (interval_ms <= 0) return -1;
+    ULONGLONG timeout_ms = (ULONGLONG)g_heartbeat_timeout_ms.load();
+    ULONGLONG now = GetTickCount64();
+    ULONGLONG next_deadline = 0;
+    for (const auto& session : sessions) {
+        if (session->next_heartbeat == 0 || session->sock == INVALID_SOCKET) continue;
+        if (now - session->last_heard >= timeout_ms) {
+            LogServerMessage(LogLevel::Warning, "No heartbeat from client " + std::to_string(session->id) + " for " +
+                             std::to_string(now - session->last_heard) + " ms. Dropping it.");
+            remove_client(session);
+            continue;
+        }
+        if (now >= session->next_heartbeat) {
+            InputEvent ping = { EventType::Heartbeat };
+            ping.seq = ++session->heartbeat_id;
+            uint8_t frame[MAX_BINARY_FRAME_SIZE];
+            size_t len = encode_binary_frame(ping, frame);
+            std::lock_guard<std::mutex> lock(session->send_mutex);
+            session->heartbeat_sent_qpc = qpc_now();
+            send_to_client(*session, (const char*)frame, len);
+            session->next_heartbeat = now + interval_ms;
+        }
+        ULONGLONG deadline = (std::min)(session->next_heartbeat, session->last_heard + timeout_ms);
+        if (next_deadline == 0 || deadline < next_deadline) next_deadline = deadline;
+    }
+    if (next_deadline == 0) return -1;
+    return next_deadline > now ? (int)(next_deadline - now) : 0;
+}
+
+// Accumulates the time spent in a hook proc for the per-event cost report and the
+// ETW totals, and traces the call when HookEvent is enabled.
+struct HookTimer {
+    const char* hook;
+    UINT message;
+    int64_t start = qpc_now();
+
+    HookTimer(const char* hook_name, WPARAM wParam) : hook(hook_name), message((UINT)wParam) {}
+    ~HookTimer() {
+        int64_t elapsed = qpc_now() - start;
+        g_hook_calls.fetch_add(1, std::memory_order_relaxed);
+        g_hook_ticks.fetch_add(elapsed, std::memory_order_relaxed);
+        if (elapsed > g_hook_max_ticks.load(std::memory_order_relaxed)) g_hook_max_ticks.store(elapsed, std::memory_order_relaxed);
+        g_stat_hook_calls.fetch_add(1, std::memory_order_relaxed);
+        g_stat_hook_ticks.fetch_add((uint64_t)elapsed, std::memory_order_relaxed);
+        if (trace_enabled(TRACE_LEVEL_VERBOSE, TRACE_KEYWORD_HOT_PATH)) {
+            uint64_t duration_ns = (uint64_t)elapsed * 1000000000 / (uint64_t)g_qpc_frequency;
+            write_trace_event(TRACE_HOOK_EVENT, { trace_data(hook), trace_data(message), trace_data(duration_ns) });
+        }
+    }
+};
+
+// Logs and resets the hook cost counters. Called when control returns to the server.
+void report_hook_cost() {
+    uint64_t calls = g_hook_calls.exchange(0);
+    int64_t ticks = g_hook_ticks.exchange(0);
+    int64_t max_ticks = g_hook_max_ticks.exchange(0);
+    if (calls == 0) return;
+    char text[128];
+    snprintf(text, sizeof(text), "Hook cost: %llu events, avg %.2f us, max %.2f us.", (unsigned long long)calls,
+             (double)ticks * 1000000.0 / g_qpc_frequency / calls, (double)max_ticks * 1000000.0 / g_qpc_frequency);
+    LogServerMessage(text);
+}
+
+LRESULT CALLBACK low_level_keyboard_proc(int nCode, WPARAM wParam, LPARAM lParam) {
+    if (nCode == HC_ACTION) {
+        HookTimer timer("keyboard", wParam);
+        KBDLLHOOKSTRUCT* pkb = (KBDLLHOOKSTRUCT*)lParam;
+        const bool is_key_down = (wParam == WM_KEYDOWN || wParam == WM_SYSKEYDOWN);
+        if (!(pkb->flags & LLKHF_INJECTED)) g_keys_held.set((uint16_t)pkb->vkCode, is_key_down);
+        track_modifier(g_hook_modifiers, pkb->vkCode, is_key_down);
+
+        // --- Hotkey Capture Logic ---
+        if (g_is_waiting_for_hotkey && is_key_down) {
+            if (pkb->vkCode != VK_LCONTROL && pkb->vkCode != VK_RCONTROL &&
+                pkb->vkCode != VK_LSHIFT   && pkb->vkCode != VK_RSHIFT &&
+                pkb->vkCode != VK_LMENU    && pkb->vkCode != VK_RMENU &&
+                pkb->vkCode != VK_LWIN     && pkb->vkCode != VK_RWIN)
+            {
+                g_hotkey_vk = pkb->vkCode;
+                g_hotkey_ctrl = (g_hook_modifiers & MOD_CONTROL) != 0;
+                g_hotkey_alt = (g_hook_modifiers & MOD_MENU) != 0;
+                g_hotkey_shift = (g_hook_modifiers & MOD_SHIFT) != 0;
+
+                g_is_waiting_for_hotkey = false;
+                if (g_front_end->hotkey_changed) g_front_end->hotkey_changed();
+
+                return 1;
+            }
+        }
+
+        // --- Hotkey Detection Logic ---
+        if (g_is_server_active && !g_is_waiting_for_hotkey && is_key_down) {
+            bool ctrl_is_down = (g_hook_modifiers & MOD_CONTROL) != 0;
+            bool alt_is_down = (g_hook_modifiers & MOD_MENU) != 0;
+            bool shift_is_down = (g_hook_modifiers & MOD_SHIFT) != 0;
+            
+            if (pkb->vkCode == g_hotkey_vk.load() &&
+                ctrl_is_down == g_hotkey_ctrl.load() &&
+                alt_is_down == g_hotkey_alt.load() &&
+                shift_is_down == g_hotkey_shift.load())
+            {
+                LogServerMessage("Hotkey detected! Toggling control...");
+                toggle_control();
+                return 1;
+            }
+        }
+
+        // --- Remote Control Logic ---
+        if (g_is_controlling_remote) {
+            queue_event(make_key_event(pkb->vkCode, is_key_down));
+            return 1;
+        }
+        g_keys_local.set((uint16_t)pkb->vkCode, is_key_down); // Passed on to this machine
+    }
+    return CallNextHookEx(g_keyboard_hook, nCode, wParam, lParam);
+}
+
+
+LRESULT CALLBACK low_level_mouse_proc(int nCode, WPARAM wParam, LPARAM lParam) {
+    if (nCode == HC_ACTION && !g_is_controlling_remote) {
+        switch (wParam) {
+            case WM_LBUTTONDOWN: g_mouse_buttons_down |= 1; break;
+            case WM_LBUTTONUP:
+                g_mouse_buttons_down &= ~1;
+                if (g_drop_strip_requested) {
+                    g_drop_strip_requested = false;
+                    if (g_front_end->hide_drop_strip) g_front_end->hide_drop_strip();
+                }
+                break;
+            case WM_RBUTTONDOWN: g_mouse_buttons_down |= 2; break;
+            case WM_RBUTTONUP:   g_mouse_buttons_down &= ~2; break;
+            case WM_MBUTTONDOWN: g_mouse_buttons_down |= 4; break;
+            case WM_MBUTTONUP:   g_mouse_buttons_down &= ~4; break;
+            case WM_MOUSEMOVE:
+                if (!g_edge_zones.empty() && g_mouse_buttons_down == 0 && g_is_server_active) {
+                    POINT pt = ((MSLLHOOKSTRUCT*)lParam)->pt;
+                    int zone = find_edge_zone(pt);
+                    if (zone >= 0 && switch_control_at_edge(zone, pt)) return 1;
+                } else if (!g_edge_zones.empty() && g_mouse_buttons_down == 1 && !g_drop_strip_requested &&
+                           g_file_transfer_enabled && g_is_server_active) {
+                    // A left-button drag (perhaps of files) into a linked edge.
+                    int zone = find_edge_zone(((MSLLHOOKSTRUCT*)lParam)->pt);
+                    if (zone >= 0) show_drop_strip(g_edge_zones[zone]);
+                }
+                break;
+        }
+    }
+    if (nCode == HC_ACTION && g_is_controlling_remote) {
+        HookTimer timer("mouse", wParam);
+        MSLLHOOKSTRUCT* pms = (MSLLHOOKSTRUCT*)lParam;
+        InputEvent ev = {};
+        switch (wParam) {
+            case WM_MOUSEMOVE: {
+                if (g_raw_input_active) {
+                    // Motion arrives over raw input and the clip holds the cursor still,
+                    // so let the move through. The system drops the clip on secure
+                    // desktop switches; re-check it a few times a second.
+                    int64_t now = timer.start;
+                    if (now - g_last_clip_check >= g_qpc_frequency / 4) {
+                        g_last_clip_check = now;
+                        RECT clip;
+                        if (GetClipCursor(&clip) && (clip.left != g_center_pos.x || clip.top != g_center_pos.y ||
+                                                     clip.right != g_center_pos.x + 1 || clip.bottom != g_center_pos.y + 1)) {
+                            update_pointer_clip();
+                        }
+                    }
+                    return CallNextHookEx(g_mouse_hook, nCode, wParam, lParam);
+                }
+                int dx = pms->pt.x - g_center_pos.x;
+                int dy = pms->pt.y - g_center_pos.y;
+                if (dx != 0 || dy != 0) {
+                    ev.type = EventType::MouseMove;
+                    ev.dx = dx; ev.dy = dy;
+                    SetCursorPos(g_center_pos.x, g_center_pos.y);
+                }
+                break;
+            }
+            case WM_LBUTTONDOWN: ev.type = EventType::MouseDown; ev.button = MOUSE_BUTTON_LEFT; break;
+            case WM_LBUTTONUP:   ev.type = EventType::MouseUp;   ev.button = MOUSE_BUTTON_LEFT; break;
+            case WM_RBUTTONDOWN: ev.type = EventType::MouseDown; ev.button = MOUSE_BUTTON_RIGHT; break;
+            case WM_RBUTTONUP:   ev.type = EventType::MouseUp;   ev.button = MOUSE_BUTTON_RIGHT; break;
+            case WM_MBUTTONDOWN: ev.type = EventType::MouseDown; ev.button = MOUSE_BUTTON_MIDDLE; break;
+            case WM_MBUTTONUP:   ev.type = EventType::MouseUp;   ev.button = MOUSE_BUTTON_MIDDLE; break;
+            case WM_XBUTTONDOWN:
+            case WM_XBUTTONUP:
+                ev.type = (wParam == WM_XBUTTONDOWN) ? EventType::MouseDown : EventType::MouseUp;
+                ev.button = (GET_XBUTTON_WPARAM(pms->mouseData) == XBUTTON2) ? MOUSE_BUTTON_X2 : MOUSE_BUTTON_X1;
+                break;
+            case WM_MOUSEWHEEL:
+            case WM_MOUSEHWHEEL:
+                // Precision touchpads report fractions of a notch; keep them as they are.
+                ev.type = (wParam == WM_MOUSEWHEEL) ? EventType::MouseScroll : EventType::MouseHScroll;
+                ev.delta = GET_WHEEL_DELTA_WPARAM(pms->mouseData);
+                break;
+        }
+        if (ev.type != EventType::None) queue_event(ev);
+        return 1;
+    }
+    return CallNextHookEx(g_mouse_hook, nCode, wParam, lParam);
+}
+
+int64_t qpc_now() {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+// Never blocks: if the sender has fallen behind and the ring is full, the event is
+// dropped and counted. The event is stamped with the capture time, which orders it
+// against the other ring and feeds the latency probes. Each ring has one producer
+// thread; the wake-up handshake below is safe from either of them.
+void push_to_sender(SpscRing<InputEvent, EVENT_RING_CAPACITY>& ring, const InputEvent& ev) {
+    bool is_move = (ev.type == EventType::MouseMove);
+    bool is_wheel = is_wheel_event(ev.type);
+    if (!is_move) g_non_move_events_queued.fetch_add(1, std::memory_order_relaxed);
+    if (!is_wheel) g_non_wheel_events_queued.fetch_add(1, std::memory_order_relaxed);
+    InputEvent stamped = ev;
+    stamped.timestamp = qpc_now();
+    g_stat_events_captured.fetch_add(1, std::memory_order_relaxed);
+    if (!ring.try_push(stamped)) {
+        g_ring_overflows.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    // Only pay for SetEvent when the sender is parked, or when it is holding back
+    // moves (or a wheel delta) and this event must not wait behind them.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int state = g_sender_state.load();
+    if (state == SENDER_PARKED || (state == SENDER_HOLDING_MOVES && !is_move) || (state == SENDER_HOLDING_WHEEL && !is_wheel)) {
+        if (g_sender_state.compare_exchange_strong(state, SENDER_RUNNING)) SetEvent(g_sender_wake_event);
+    }
+}
+
+// Called from the hook thread only.
+void queue_event(const InputEvent& ev) {
+    push_to_sender(g_event_ring, ev);
+}
+
+// Sender thread: pops whichever ring holds the earlier capture, so raw input motion
+// and hook events reach the client in the order they happened.
+bool pop_next_event(InputEvent& ev) {
+    const InputEvent* hook = g_event_ring.front();
+    const InputEvent* raw = g_raw_motion_ring.front();
+    if (raw && (!hook || raw->timestamp < hook->timestamp)) return g_raw_motion_ring.try_pop(ev);
+    return g_event_ring.try_pop(ev);
+}
+
+// --- Raw Input Capture ---
+
+// Confines the cursor to its park position while raw input drives a client, and frees
+// it otherwise. Hook thread only.
+void update_pointer_clip() {
+    if (g_raw_input_active && g_is_controlling_remote) {
+        RECT clip = { g_center_pos.x, g_center_pos.y, g_center_pos.x + 1, g_center_pos.y + 1 };
+        ClipCursor(&clip);
+    } else {
+        ClipCursor(NULL);
+    }
+}
+
+LRESULT CALLBACK raw_input_wnd_proc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam) {
+    if (message == WM_INPUT) {
+        RAWINPUT raw;
+        UINT size = sizeof(raw);
+        if (GetRawInputData((HRAWINPUT)lParam, RID_INPUT, &raw, &size, sizeof(RAWINPUTHEADER)) != (UINT)-1 &&
+            raw.header.dwType == RIM_TYPEMOUSE && !(raw.data.mouse.usFlags & MOUSE_MOVE_ABSOLUTE) &&
+            (raw.data.mouse.lLastX != 0 || raw.data.mouse.lLastY != 0) && g_is_controlling_remote) {
+            // Device counts, before pointer acceleration; the client's own settings apply once.
+            InputEvent ev = { EventType::MouseMove };
+            ev.dx = raw.data.mouse.lLastX;
+            ev.dy = raw.data.mouse.lLastY;
+            push_to_sender(g_raw_motion_ring, ev);
+        }
+        // Falls through: DefWindowProc does the required cleanup for WM_INPUT.
+    }
+    return DefWindowProc(hWnd, message, wParam, lParam);
+}
+
+// Raw input thread: a message-only window registered as a background sink for
+// mouse input. Runs until stop_raw_input_capture posts WM_QUIT.
+void run_raw_input_thread(HANDLE ready_event) {
+    HANDLE mmcss_task = raise_input_thread_priority("Raw input", LogServerMessage);
+    WNDCLASS wc = {};
+    wc.lpfnWndProc = raw_input_wnd_proc;
+    wc.hInstance = GetModuleHandle(NULL);
+    wc.lpszClassName = "KVMRawInputSink";
+    RegisterClass(&wc);
+    HWND sink = CreateWindowEx(0, wc.lpszClassName, "", 0, 0, 0, 0, 0, HWND_MESSAGE, NULL, wc.hInstance, NULL);
+
+    RAWINPUTDEVICE device = {};
+    device.usUsagePage = 0x01; // Generic desktop
+    device.usUsage = 0x02;     // Mouse
+    device.dwFlags = RIDEV_INPUTSINK; // Deliver even when another window has focus
+    device.hwndTarget = sink;
+    bool registered = sink != NULL && RegisterRawInputDevices(&device, 1, sizeof(device));
+    g_raw_input_thread_id = GetCurrentThreadId();
+    g_raw_input_active = registered;
+    SetEvent(ready_event);
+
+    if (registered) {
+        MSG msg;
+        while (GetMessage(&msg, NULL, 0, 0) > 0) {
+            DispatchMessage(&msg);
+        }
+        device.dwFlags = RIDEV_REMOVE;
+        device.hwndTarget = NULL;
+        RegisterRawInputDevices(&device, 1, sizeof(device));
+    }
+    g_raw_input_active = false;
+    if (sink != NULL) DestroyWindow(sink);
+    restore_input_thread_priority(mmcss_task);
+}
+
+// Called from InstallHooks. Falls back to hook capture if registration fails.
+void start_raw_input_capture() {
+    HANDLE ready_event = CreateEvent(NULL, TRUE, FALSE, NULL);
+    g_raw_input_thread = std::thread(run_raw_input_thread, ready_event);
+    WaitForSingleObject(ready_event, INFINITE);
+    CloseHandle(ready_event);
+    if (g_raw_input_active) {
+        LogServerMessage("Mouse capture: raw input.");
+    } else {
+        LogServerMessage(LogLevel::Warning, "!! Raw input registration failed; using hook capture.");
+        g_raw_input_thread.join();
+    }
+}
+
+void stop_raw_input_capture() {
+    if (!g_raw_input_thread.joinable()) return;
+    PostThreadMessage(g_raw_input_thread_id, WM_QUIT, 0, 0);
+    g_raw_input_thread.join();
+    update_pointer_clip();
+}
+
+size_t encode_frame(const InputEvent& ev, int protocol, char* out, size_t capacity) {
+    return (protocol >= 1)
+        ? encode_binary_frame(ev, (uint8_t*)out)
+        : encode_text_frame(ev, out, capacity);
+}
+
+// Frames produced by one sender pass. With the hybrid transport, motion goes into UDP
+// datagrams and everything else into the TCP batch. Switching channels flushes the
+// other one first, and a TCP event that follows motion is preceded by a UdpBarrier,
+// so the client can apply everything in its original order.
+// Caller must hold session->send_mutex from begin() through the final flush(). A batch
+// with no session (nobody under control) silently drops what is appended. So does one
+// for a client that has not finished pairing while a pairing key is set.
+// Once paired, the TCP batch becomes one sealed record and each datagram carries a tag.
+struct OutgoingBatch {
+    ClientSession* session = nullptr;
+    int protocol = KVM_PROTOCOL_TEXT;
+    bool use_udp = false;
+    char tcp[8192];
+    size_t tcp_len = 0;
+    uint8_t udp[MAX_UDP_DATAGRAM_SIZE];
+    size_t udp_len = 0;
+    size_t udp_capacity = MAX_UDP_DATAGRAM_SIZE; // Less room for the tag when sealed
+    int64_t newest_timestamp = 0; // Capture time of the last input event appended
+
+    void begin(ClientSession* target) {
+        session = (target && g_pairing_enabled && !target->secure.active) ? nullptr : target;
+        protocol = session ? session->protocol : KVM_PROTOCOL_TEXT;
+        bool sealed = session && session->secure.active;
+        // A sealed datagram's nonce is its sequence number, which must never repeat.
+        use_udp = session && session->udp_socket != INVALID_SOCKET && !(sealed && session->udp_seq == UINT32_MAX);
+        udp_capacity = sizeof(udp) - (sealed ? RECORD_TAG_SIZE : 0);
+        tcp_len = 0;
+        udp_len = 0;
+        newest_timestamp = 0;
+    }
+
+    // Room for a pending move or wheel, a barrier and one more frame.
+    bool has_room() const { return tcp_len + 3 * MAX_TEXT_FRAME_SIZE <= sizeof(tcp); }
+
+    void append(const InputEvent& ev) {
+        if (!session) return;
+        if (ev.type == EventType::CursorEnter && protocol < 4) return; // Older clients cannot place the cursor
+        if (protocol < 7 && (ev.type == EventType::MouseHScroll ||
+                             (ev.button >= MOUSE_BUTTON_X1 && (ev.type == EventType::MouseDown || ev.type == EventType::MouseUp)))) {
+            return; // Nor take the horizontal wheel or the X buttons
+        }
+        if (ev.timestamp != 0) {
+            newest_timestamp = ev.timestamp;
+            g_stat_events_sent.fetch_add(1, std::memory_order_relaxed);
+        }
+        if (use_udp && (ev.type == EventType::MouseMove || is_wheel_event(ev.type))) {
+            flush_tcp();
+            if (udp_len + MAX_BINARY_FRAME_SIZE > udp_capacity) flush_udp();
+            if (udp_len == 0) udp_len = UDP_HEADER_SIZE; // Header is written by flush_udp
+            udp_len += encode_binary_frame(ev, udp + udp_len);
+            return;
+        }
+        flush_udp();
+        if (session->udp_barrier_pending) {
+            InputEvent barrier = { EventType::UdpBarrier };
+            barrier.seq = session->udp_seq;
+            tcp_len += encode_binary_frame(barrier, (uint8_t*)tcp + tcp_len);
+            session->udp_barrier_pending = false;
+        }
+        if (ev.type == EventType::KeySync) {
+            append_key_sync();
+            return;
+        }
+        tcp_len += encode_frame(ev, protocol, tcp + tcp_len, sizeof(tcp) - tcp_len);
+    }
+
+    // The keys published with the KeySync (see resync_held_keys): one frame for v6
+    // clients, a key press per held key for older ones.
+    void append_key_sync() {
+        KeySet keys;
+        {
+            std::lock_guard<std::mutex> lock(g_key_sync_mutex);
+            keys = g_key_sync;
+        }
+        if (protocol >= 6) {
+            tcp_len += encode_key_sync(keys, (uint8_t*)tcp + tcp_len);
+            return;
+        }
+        keys.for_each([this](uint16_t vk) {
+            if (tcp_len + MAX_TEXT_FRAME_SIZE > sizeof(tcp)) flush_tcp();
+            InputEvent press = { EventType::KeyPress };
+            press.vk_code = vk;
+            tcp_len += encode_frame(press, protocol, tcp + tcp_len, sizeof(tcp) - tcp_len);
+        });
+    }
+
+    void flush_tcp() {
+        if (tcp_len > 0) {
+            send_to_client(*session, tcp, tcp_len);
+            g_stat_bytes_sent.fetch_add(tcp_len, std::memory_order_relaxed);
+        }
+        tcp_len = 0;
+    }
+
+    void flush_udp() {
+        if (udp_len > UDP_HEADER_SIZE) {
+            encode_udp_header(udp, session->udp_token, ++session->udp_seq);
+            if (session->secure.active) {
+                uint8_t* frames = udp + UDP_HEADER_SIZE;
+                if (!aead_seal(session->secure.motion, session->udp_seq, udp, UDP_HEADER_SIZE,
+                               frames, udp_len - UDP_HEADER_SIZE, frames, udp + udp_len)) {
+                    udp_len = 0;
+                    return;
+                }
+                udp_len += RECORD_TAG_SIZE;
+            }
+            send(session->udp_socket, (const char*)udp, (int)udp_len, 0); // Loss is tolerated by design
+            g_stat_bytes_sent.fetch_add(udp_len, std::memory_order_relaxed);
+            session->udp_barrier_pending = true;
+        }
+        udp_len = 0;
+    }
+
+    void flush() {
+        flush_tcp();
+        flush_udp();
+    }
+};
+
+// True if adding ev to pending keeps the summed delta representable in a binary frame.
+bool can_merge_move(const InputEvent& pending, const InputEvent& ev) {
+    int32_t dx = pending.dx + ev.dx;
+    int32_t dy = pending.dy + ev.dy;
+    return dx >= INT16_MIN && dx <= INT16_MAX && dy >= INT16_MIN && dy <= INT16_MAX;
+}
+
+// Likewise for two wheel events: same axis, and a sum that fits.
+bool can_merge_wheel(const InputEvent& pending, const InputEvent& ev) {
+    int32_t delta = pending.delta + ev.delta;
+    return pending.type == ev.type && delta >= INT16_MIN && delta <= INT16_MAX;
+}
+
+// Sender thread: drains everything queued since the last wake-up, encodes it in the
+// client's negotiated protocol and writes it with as few sends as possible.
+//
+// Consecutive mouse moves are merged into one summed delta. A merged move is sent
+// right away if no move went out in the last g_move_flush_interval_us; otherwise it
+// is held until that interval has passed, so a burst from a high-rate mouse costs one
+// frame per interval while an isolated move is never delayed. Wheel deltas of one
+// axis are summed the same way over g_wheel_flush_interval_us, which turns a touchpad
+// or free-spinning wheel into a few frames without rounding the delta. Only one of the
+// two is pending at a time. Any other event flushes the pending one first and is sent
+// immediately, preserving ordering.
+//
+// Only the client under control receives input. ControlAcquire (whose seq names the
+// client) switches the target and ControlRelease clears it, both in ring order.
+void run_event_sender(const StopSignal& stop) {
+    InputEvent ev;
+    while (pop_next_event(ev)) {} // Discard anything left over from a previous session
+
+    // High-resolution timer where available (Windows 10 1803+); a regular one otherwise.
+    HANDLE flush_timer = CreateWaitableTimerExW(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+    if (flush_timer == NULL) flush_timer = CreateWaitableTimer(NULL, TRUE, NULL);
+
+    static OutgoingBatch batch; // Only one sender runs at a time; too big for the stack
+    std::shared_ptr<ClientSession> target;
+    InputEvent pending_move = {};
+    bool has_pending_move = false;
+    int64_t last_move_sent = 0;
+    InputEvent pending_wheel = {};
+    bool has_pending_wheel = false;
+    int64_t last_wheel_sent = 0;
+    int64_t last_probe_sent = 0;
+    uint64_t reported_overflows = g_ring_overflows.load();
+    while (!stop.requested()) {
+        size_t depth = g_event_ring.size() + g_raw_motion_ring.size();
+        if (depth > g_ring_peak_depth.load(std::memory_order_relaxed)) {
+            g_ring_peak_depth.store(depth, std::memory_order_relaxed);
+        }
+
+        const bool coalesce = g_coalesce_moves;
+        const int64_t flush_interval = (flush_timer != NULL) ? (int64_t)g_move_flush_interval_us * g_qpc_frequency / 1000000 : 0;
+        const int64_t wheel_interval = (flush_timer != NULL) ? (int64_t)g_wheel_flush_interval_us * g_qpc_frequency / 1000000 : 0;
+        const uint64_t non_moves_seen = g_non_move_events_queued.load(std::memory_order_relaxed);
+        const uint64_t non_wheels_seen = g_non_wheel_events_queued.load(std::memory_order_relaxed);
+        int64_t hold_until = 0;
+
+        if (depth > 0 || has_pending_move || has_pending_wheel) {
+            std::unique_lock<std::mutex> lock;
+            if (target) lock = std::unique_lock<std::mutex>(target->send_mutex);
+            batch.begin(target.get());
+            while (batch.has_room() && pop_next_event(ev)) {
+                if (ev.type == EventType::ControlAcquire) {
+                    // Whatever was pending belongs to the previous target.
+                    if (has_pending_move) {
+                        batch.append(pending_move);
+                        has_pending_move = false;
+                    }
+                    if (has_pending_wheel) {
+                        batch.append(pending_wheel);
+                        has_pending_wheel = false;
+                    }
+                    batch.flush();
+                    if (lock.owns_lock()) lock.unlock();
+                    target = find_session((int)ev.seq);
+                    if (target) lock = std::unique_lock<std::mutex>(target->send_mutex);
+                    batch.begin(target.get());
+                    batch.append(ev);
+                    continue;
+                }
+                if (is_wheel_event(ev.type)) {
+                    if (has_pending_wheel && can_merge_wheel(pending_wheel, ev)) {
+                        pending_wheel.delta += ev.delta;
+                        g_events_coalesced.fetch_add(1, std::memory_order_relaxed);
+                        continue;
+                    }
+                    if (has_pending_move) {
+                        batch.append(pending_move);
+                        has_pending_move = false;
+                        last_move_sent = qpc_now();
+                    }
+                    if (has_pending_wheel) batch.append(pending_wheel);
+                    pending_wheel = ev;
+                    has_pending_wheel = true;
+                    continue;
+                }
+                if (has_pending_wheel) {
+                    batch.append(pending_wheel);
+                    has_pending_wheel = false;
+                    last_wheel_sent = qpc_now();
+                }
+                if (ev.type == EventType::MouseMove && coalesce) {
+                    if (has_pending_move && can_merge_move(pending_move, ev)) {
+                        pending_move.dx += ev.dx;
+                        pending_move.dy += ev.dy;
+                        g_events_coalesced.fetch_add(1, std::memory_order_relaxed);
+                        continue;
+                    }
+                    if (has_pending_move) batch.append(pending_move);
+                    pending_move = ev;
+                    has_pending_move = true;
+                    continue;
+                }
+                if (has_pending_move) {
+                    batch.append(pending_move);
+                    has_pending_move = false;
+                    last_move_sent = qpc_now();
+                }
+                batch.append(ev);
+                if (ev.type == EventType::ControlRelease) {
+                    batch.flush();
+                    if (lock.owns_lock()) lock.unlock();
+                    target.reset();
+                    batch.begin(nullptr);
+                }
+            }
+
+            if (has_pending_move) {
+                int64_t now = qpc_now();
+                if (now - last_move_sent >= flush_interval) {
+                    batch.append(pending_move);
+                    has_pending_move = false;
+                    last_move_sent = now;
+                } else {
+                    hold_until = last_move_sent + flush_interval;
+                }
+            }
+            if (has_pending_wheel) {
+                int64_t now = qpc_now();
+                if (now - last_wheel_sent >= wheel_interval) {
+                    batch.append(pending_wheel);
+                    has_pending_wheel = false;
+                    last_wheel_sent = now;
+                } else {
+                    hold_until = last_wheel_sent + wheel_interval;
+                }
+            }
+
+            // Follow this pass with a latency probe if one is due (v3 clients only).
+            int64_t now = qpc_now();
+            if (batch.protocol >= 3 && batch.newest_timestamp != 0 &&
+                now - last_probe_sent >= LATENCY_PROBE_INTERVAL_MS * g_qpc_frequency / 1000) {
+                InputEvent probe = { EventType::LatencyProbe };
+                probe.seq = register_latency_probe(batch.newest_timestamp, now);
+                batch.append(probe);
+                last_probe_sent = now;
+            }
+            batch.flush();
+        }
+
+        uint64_t overflows = g_ring_overflows.load(std::memory_order_relaxed);
+        if (overflows != reported_overflows) {
+            LogServerMessage(LogLevel::Warning, "!! Event ring overflow: " + std::to_string(overflows - reported_overflows) +
+                             " events dropped (peak depth " + std::to_string(g_ring_peak_depth.load()) +
+                             "/" + std::to_string(EVENT_RING_CAPACITY) + ").");
+            reported_overflows = overflows;
+        }
+
+        if (has_pending_move || has_pending_wheel) {
+            // Holding moves (or a wheel delta): sleep until the flush deadline. More of
+            // the same just piles up in the ring; any other event wakes us early.
+            g_sender_state = has_pending_move ? SENDER_HOLDING_MOVES : SENDER_HOLDING_WHEEL;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            bool urgent = has_pending_move ? g_non_move_events_queued.load() != non_moves_seen
+                                           : g_non_wheel_events_queued.load() != non_wheels_seen;
+            if (!urgent) {
+                LARGE_INTEGER due;
+                due.QuadPart = -(((hold_until - qpc_now()) * 10000000) / g_qpc_frequency); // Relative, 100 ns units
+                if (due.QuadPart >= 0) due.QuadPart = -1;
+                SetWaitableTimer(flush_timer, &due, 0, NULL, NULL, FALSE);
+                HANDLE handles[3] = { g_sender_wake_event, flush_timer, stop.handle() };
+                WaitForMultipleObjects(3, handles, FALSE, INFINITE);
+            }
+        } else {
+            // Park until the hooks queue more work or the server stops.
+            g_sender_state = SENDER_PARKED;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (g_event_ring.empty() && g_raw_motion_ring.empty()) {
+                HANDLE handles[2] = { g_sender_wake_event, stop.handle() };
+                WaitForMultipleObjects(2, handles, FALSE, INFINITE);
+            }
+        }
+        g_sender_state = SENDER_RUNNING;
+    }
+
+    if (flush_timer != NULL) CloseHandle(flush_timer);
+}
+
+// Hook thread, when control comes back to this machine. Keys pressed here before
+// control moved away (the hotkey's modifiers, say) had their release sent to the
+// client, so this machine still thinks they are down. Releases exactly those, with one
+// SendInput; keys the user is still holding stay down.
+void release_stuck_server_keys() {
+    KeySet stuck = g_keys_local.without(g_keys_held);
+    if (stuck.empty()) return;
+    INPUT inputs[256];
+    UINT count = 0;
+    stuck.for_each([&](uint16_t vk) {
+        inputs[count] = {};
+        inputs[count].type = INPUT_KEYBOARD;
+        inputs[count].ki.wVk = vk;
+        inputs[count].ki.dwFlags = KEYEVENTF_KEYUP;
+        ++count;
+    });
+    g_keys_local = g_keys_local.without(stuck); // The injected releases may go remote if control moves again
+    SendInput(count, inputs, sizeof(INPUT));
+    LogServerMessage("Released " + std::to_string(count) + " keys left down on this machine.");
+}
+
+// --- Pointer Profile ---
+// The client shapes relative motion before injecting it: a gain that depends on speed
+// (server counts per millisecond), times the sensitivity, times the ratio of this
+// client's DPI to the server's when dpi_scaling is on. Everything but the speed is
+// folded into a lookup table when the connection starts, so a move costs one sqrt.
+//
+// Speed is the motion that arrived in one network read over the time since the previous
+// read, measured where the moves are injected. Dividing by the elapsed time keeps the
+// curve independent of how often the server sends moves (move_flush_interval_us) and of
+// how many frames the transport coalesces into one read.
+
+const int POINTER_GAIN_TABLE_SIZE = 128; // Entries for speeds 0..127; faster moves use the last
+const int64_t POINTER_SAME_READ_US = 50;  // Moves closer than this came from the same read
+const double POINTER_MIN_INTERVAL_US = 125; // Floor for the time between reads (an 8 kHz mouse)
+
+struct PointerShaper {
+    float gain[POINTER_GAIN_TABLE_SIZE];
+    bool identity = true;
+    float carry_x = 0, carry_y = 0; // Fractions left over from earlier moves
+    int64_t last_move_qpc = 0;        // When the previous move was shaped
+    float read_interval_us = 1000;    // Time between the current read and the one before it
+    float read_length = 0;            // Counts of the moves shaped so far in the current read
+
+    void configure(const PointerSettings& settings, double dpi_factor) {
+        const auto& curve = settings.acceleration;
+        identity = curve.empty() && settings.sensitivity == 1.0 && dpi_factor == 1.0;
+        carry_x = carry_y = 0;
+        last_move_qpc = 0;
+        read_length = 0;
+        for (int speed = 0; speed < POINTER_GAIN_TABLE_SIZE; ++speed) {
+            double g = 1.0;
+            if (!curve.empty()) {
+                auto upper = std::find_if(curve.begin(), curve.end(), [&](const auto& point) { return point.first > speed; });
+                if (upper == curve.begin()) g = curve.front().second;
+                else if (upper == curve.end()) g = curve.back().second;
+                else {
+                    auto lower = upper - 1;
+                    double t = (speed - lower->first) / (upper->first - lower->first);
+                    g = lower->second + t * (upper->second - lower->second);
+                }
+            }
+            gain[speed] = (float)(g * settings.sensitivity * dpi_factor);
+        }
+    }
+
+    // Scales one move, injected at now (QPC ticks), in place. The result is cut toward
+    // zero and the remainder carried into the next move, so slow motion with a gain
+    // below 1 still adds up.
+    void shape(int32_t& dx, int32_t& dy, int64_t now) {
+        if (identity) return;
+        int64_t elapsed_us = last_move_qpc != 0 ? (now - last_move_qpc) * 1000000 / g_qpc_frequency : 1000;
+        if (elapsed_us >= POINTER_SAME_READ_US) {
+            read_interval_us = (float)(std::max)((double)elapsed_us, POINTER_MIN_INTERVAL_US);
+            read_length = 0;
+        }
+        last_move_qpc = now;
+        read_length += std::sqrt((float)dx * dx + (float)dy * dy);
+        float speed = read_length * 1000.0f / read_interval_us;
+        float g = gain[(int)(std::min)(speed, (float)(POINTER_GAIN_TABLE_SIZE - 1))];
+        float x = dx * g + carry_x;
+        float y = dy * g + carry_y;
+        dx = (int32_t)x;
+        dy = (int32_t)y;
+        carry_x = x - dx;
+        carry_y = y - dy;
+    }
+};
+
+// Settings the client's own mouse acceleration had before disable_system_acceleration
+// turned it off, so the session can put them back.
+struct SystemMouseAcceleration {
+    int saved[3] = {};
+    bool changed = false;
+
+    void disable() {
+        if (changed || !SystemParametersInfo(SPI_GETMOUSE, 0, saved, 0) || saved[2] == 0) return;
+        int flat[3] = { saved[0], saved[1], 0 };
+        changed = SystemParametersInfo(SPI_SETMOUSE, 0, flat, 0) != FALSE; // Not persisted to the profile
+    }
+    void restore() {
+        if (!changed) return;
+        SystemParametersInfo(SPI_SETMOUSE, 0, saved, 0);
+        changed = false;
+    }
+    ~SystemMouseAcceleration() { restore(); }
+};
+
+// The DPI this machine scales its desktop by, as seen by a system-aware thread. 96
+// (100%) where the API is missing.
+UINT query_system_dpi() {
+    typedef HANDLE (WINAPI *SetThreadDpiAwarenessContextFn)(HANDLE);
+    typedef UINT (WINAPI *GetDpiForSystemFn)();
+    HMODULE user32 = GetModuleHandleA("user32.dll");
+    if (!user32) return 96;
+    auto set_context = (SetThreadDpiAwarenessContextFn)(void*)GetProcAddress(user32, "SetThreadDpiAwarenessContext");
+    auto get_dpi = (GetDpiForSystemFn)(void*)GetProcAddress(user32, "GetDpiForSystem");
+    if (!get_dpi) return 96;
+    HANDLE previous = set_context ? set_context((HANDLE)-2) : nullptr; // DPI_AWARENESS_CONTEXT_SYSTEM_AWARE
+    UINT dpi = get_dpi();
+    if (previous) set_context(previous);
+    return dpi ? dpi : 96;
+}
+
+// --- Client Input Injection ---
+// Inputs decoded from one network read are collected in an InjectBatch and injected
+// with a single SendInput call, in the order they arrived. The batch also remembers
+// which keys it has pressed, so releasing on control loss touches only those.
+
+const UINT INJECT_BATCH_CAPACITY = 256;
+const int INJECT_HISTOGRAM_BUCKETS = 8; // Batch sizes 1, 2, 3-4, 5-8, 9-16, 17-32, 33-64, 65+
+std::atomic<uint64_t> g_inject_batch_histogram[INJECT_HISTOGRAM_BUCKETS];
+
+struct InjectBatch {
+    INPUT inputs[INJECT_BATCH_CAPACITY];
+    UINT count = 0;
+    int32_t moved_dx = 0; // Relative motion queued since the last edge check
+    int32_t moved_dy = 0;
+    KeySet keys_down;     // Pressed and not yet released, over the whole connection
+    PointerShaper pointer; // Set up from the pointer profile once the server's ack arrives
+
+    INPUT& next() {
+        if (count == INJECT_BATCH_CAPACITY) flush();
+        INPUT& input = inputs[count++];
+        input = {};
+        return input;
+    }
+
+    void add_key(WORD vk_code, bool is_down) {
+        INPUT& input = next();
+        input.type = INPUT_KEYBOARD;
+        input.ki.wVk = vk_code;
+        input.ki.dwFlags = is_down ? 0 : KEYEVENTF_KEYUP;
+        keys_down.set(vk_code, is_down);
+    }
+
+    // Makes the held keys match wanted (KeySync), then injects.
+    void sync_keys(const KeySet& wanted) {
+        wanted.without(keys_down).for_each([this](uint16_t vk) { add_key(vk, true); });
+        keys_down.without(wanted).for_each([this](uint16_t vk) { add_key(vk, false); });
+        flush();
+    }
+
+    // Releases every key still held, in one SendInput with whatever is queued before.
+    // Returns how many there were.
+    size_t release_keys() {
+        size_t released = 0;
+        KeySet held = keys_down;
+        held.for_each([&](uint16_t vk) {
+            add_key(vk, false);
+            ++released;
+        });
+        flush();
+        return released;
+    }
+
+    void add_mouse(DWORD flags, LONG dx, LONG dy, DWORD mouse_data) {
+        INPUT& input = next();
+        input.type = INPUT_MOUSE;
+        input.mi.dwFlags = flags;
+        input.mi.dx = dx;
+        input.mi.dy = dy;
+        input.mi.mouseData = mouse_data;
+        if (flags & MOUSEEVENTF_MOVE) {
+            moved_dx += dx;
+            moved_dy += dy;
+        }
+    }
+
+    // flags is MOUSEEVENTF_WHEEL or MOUSEEVENTF_HWHEEL. Adds to the previous input if
+    // that was the same wheel, so a run of small deltas costs one injected event.
+    void add_wheel(DWORD flags, int32_t delta) {
+        if (count > 0 && inputs[count - 1].type == INPUT_MOUSE && inputs[count - 1].mi.dwFlags == flags) {
+            int32_t sum = (int32_t)inputs[count - 1].mi.mouseData + delta;
+            if (sum >= INT16_MIN && sum <= INT16_MAX) {
+                inputs[count - 1].mi.mouseData = (DWORD)sum;
+                return;
+            }
+        }
+        add_mouse(flags, 0, 0, (DWORD)delta);
+    }
+
+    void flush() {
+        if (count == 0) return;
+        SendInput(count, inputs, sizeof(INPUT));
+        g_stat_events_injected.fetch_add(count, std::memory_order_relaxed);
+        int bucket = 0;
+        for (UINT n = count - 1; n > 0 && bucket < INJECT_HISTOGRAM_BUCKETS - 1; n >>= 1) ++bucket;
+        g_inject_batch_histogram[bucket].fetch_add(1, std::memory_order_relaxed);
+        count = 0;
+    }
+};
+
+std::string format_inject_histogram() {
+    static const char* labels[INJECT_HISTOGRAM_BUCKETS] = { "1", "2", "3-4", "5-8", "9-16", "17-32", "33-64", "65+" };
+    std::string result;
+    for (int i = 0; i < INJECT_HISTOGRAM_BUCKETS; ++i) {
+        if (!result.empty()) result += ", ";
+        result += std::string(labels[i]) + ": " + std::to_string(g_inject_batch_histogram[i].load());
+    }
+    return result;
+}
+
+DWORD mouse_button_flags(uint8_t button, bool is_down) {
+    switch (button) {
+        case MOUSE_BUTTON_LEFT:  return is_down ? MOUSEEVENTF_LEFTDOWN : MOUSEEVENTF_LEFTUP;
+        case MOUSE_BUTTON_RIGHT: return is_down ? MOUSEEVENTF_RIGHTDOWN : MOUSEEVENTF_RIGHTUP;
+        case MOUSE_BUTTON_X1:
+        case MOUSE_BUTTON_X2:    return is_down ? MOUSEEVENTF_XDOWN : MOUSEEVENTF_XUP;
+        default:                 return is_down ? MOUSEEVENTF_MIDDLEDOWN : MOUSEEVENTF_MIDDLEUP;
+    }
+}
+
+// mouseData for a button event: which X button, 0 for the others.
+DWORD mouse_button_data(uint8_t button) {
+    if (button == MOUSE_BUTTON_X1) return XBUTTON1;
+    if (button == MOUSE_BUTTON_X2) return XBUTTON2;
+    return 0;
+}
+
+void release_client_keys(InjectBatch& inject) {
+    size_t released = inject.release_keys();
+    if (released > 0) LogClientMessage("Released " + std::to_string(released) + " keys the server left held down.");
+}
+
+
+void apply_input_event(const InputEvent& ev, InjectBatch& inject);
+
+// Decodes one legacy text line and queues its input. Lines that do not decode are
+// reported to the caller and otherwise ignored, as before.
+DecodeStatus process_message(std::string_view line, InjectBatch& inject) {
+    InputEvent ev;
+    DecodeStatus status = decode_text_frame(line, ev);
+    if (status == DecodeStatus::Ok) apply_input_event(ev, inject);
+    return status;
+}
+
+// Queues the input for a decoded event. Control events are handled inline; a control
+// release injects the pending input together with the release of every held key.
+void apply_input_event(const InputEvent& ev, InjectBatch& inject) {
+    switch (ev.type) {
+        case EventType::ControlAcquire: LogClientMessage("Server is now in control."); break;
+        case EventType::ControlRelease:
+            LogClientMessage("Server has released control.");
+            release_client_keys(inject);
+            break;
+        case EventType::KeyPress:       inject.add_key(ev.vk_code, true); break;
+        case EventType::KeyRelease:     inject.add_key(ev.vk_code, false); break;
+        case EventType::MouseMove: {
+            int32_t dx = ev.dx, dy = ev.dy;
+            inject.pointer.shape(dx, dy, qpc_now());
+            if (dx != 0 || dy != 0) inject.add_mouse(MOUSEEVENTF_MOVE, dx, dy, 0);
+            break;
+        }
+        case EventType::MouseDown:      inject.add_mouse(mouse_button_flags(ev.button, true), 0, 0, mouse_button_data(ev.button)); break;
+        case EventType::MouseUp:        inject.add_mouse(mouse_button_flags(ev.button, false), 0, 0, mouse_button_data(ev.button)); break;
+        case EventType::MouseScroll:    inject.add_wheel(MOUSEEVENTF_WHEEL, ev.delta); break;
+        case EventType::MouseHScroll:   inject.add_wheel(MOUSEEVENTF_HWHEEL, ev.delta); break;
+        default: break;
+    }
+}
+
+// --- Server Cache ---
+// Servers past scans heard from, in kvm_servers.json next to the config, so the client
+// page can list them before the scan that refreshes them has finished. Each scan
+// merges what it heard into the file; the GUI reads it when a scan starts.
+
+int64_t unix_time_now() {
+    return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+std::filesystem::path server_cache_path() {
+    return GetConfigPath().parent_path() / SERVER_CACHE_FILE_NAME;
+}
+
+// Cached servers seen within SERVER_CACHE_MAX_AGE_S, most recent first.
+std::vector<DiscoveredServer> load_server_cache() {
+    std::vector<DiscoveredServer> servers;
+    try {
+        std::ifstream file(server_cache_path());
+        if (!file.is_open()) return servers;
+        json cache = json::parse(file);
+        int64_t now = unix_time_now();
+        for (const json& entry : cache.value("servers", json::array())) {
+            DiscoveredServer server;
+            server.address = entry.value("address", std::string());
+            server.port = (uint16_t)std::clamp(entry.value("port", KVM_PORT), 1, 65535);
+            server.host = entry.value("host", server.address);
+            server.version = entry.value("version", -1);
+            server.last_seen = entry.value("last_seen", (int64_t)0);
+            SocketAddress parsed;
+            if (server.last_seen <= 0 || now - server.last_seen > SERVER_CACHE_MAX_AGE_S) continue;
+            if (!parse_socket_address(server.address, server.port, parsed)) continue;
+            servers.push_back(server);
+        }
+    } catch (const std::exception&) {
+        servers.clear(); // A damaged cache only costs the head start
+    }
+    std::stable_sort(servers.begin(), servers.end(),
+                     [](const DiscoveredServer& a, const DiscoveredServer& b) { return a.last_seen > b.last_seen; });
+    if (servers.size() > SERVER_CACHE_MAX_ENTRIES) servers.resize(SERVER_CACHE_MAX_ENTRIES);
+    return servers;
+}
+
+// Scan thread: marks the servers this scan heard as seen now, keeping the others.
+void remember_servers(const std::vector<DiscoveredServer>& heard) {
+    if (heard.empty()) return;
+    std::vector<DiscoveredServer> servers = load_server_cache();
+    int64_t now = unix_time_now();
+    for (DiscoveredServer server : heard) {
+        servers.erase(std::remove_if(servers.begin(), servers.end(),
+                                     [&](const DiscoveredServer& cached) { return cached.address == server.address; }),
+                      servers.end());
+        server.last_seen = now;
+        servers.insert(servers.begin(), server);
+    }
+    if (servers.size() > SERVER_CACHE_MAX_ENTRIES) servers.resize(SERVER_CACHE_MAX_ENTRIES);
+
+    json entries = json::array();
+    for (const DiscoveredServer& server : servers) {
+        entries.push_back({ {"address", server.address}, {"port", server.port}, {"host", server.host},
+                            {"version", server.version}, {"last_seen", server.last_seen} });
+    }
+    DWORD error = ERROR_INVALID_DATA;
+    try {
+        error = write_file_atomically(server_cache_path(), json({ {"servers", entries} }).dump(4));
+    } catch (const json::exception&) {
+        // A host name that is not valid UTF-8; the cache stays as it was
+    }
+    if (error != 0) LogClientMessage(LogLevel::Debug, "Could not update the server cache (error " + std::to_string(error) + ").");
+}
+
+// Active discovery: probes the multicast groups (IPv4 and IPv6) on every interface and
+// every broadcast address, and collects the unicast replies for DISCOVERY_WINDOW_MS.
+// A server that answers on both stacks is listed once, under the first address heard. The group gets
+// every round of probes; broadcasts, which reach every host on the network, only the
+// first, for servers that predate the group. Servers from before active discovery
+// never reply, so while nothing has answered the scan also listens for their periodic
+// broadcast, for up to DISCOVERY_LEGACY_WINDOW_MS.
+void run_client_scan_logic(const StopSignal& stop) {
+    LogClientMessage("Scanning for servers...");
+
+    SOCKET probe_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    BOOL broadcast = TRUE;
+    setsockopt(probe_socket, SOL_SOCKET, SO_BROADCAST, (const char*)&broadcast, sizeof(broadcast));
+    sockaddr_in local_addr = {};
+    local_addr.sin_family = AF_INET;
+    local_addr.sin_addr.s_addr = INADDR_ANY;
+    if (probe_socket == INVALID_SOCKET || bind(probe_socket, (SOCKADDR*)&local_addr, sizeof(local_addr)) == SOCKET_ERROR) {
+        LogClientMessage(LogLevel::Error, "Discovery socket setup failed.");
+        if (probe_socket != INVALID_SOCKET) closesocket(probe_socket);
+        return;
+    }
+
+    SOCKET legacy_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    local_addr.sin_port = htons(DISCOVERY_PORT);
+    if (legacy_socket != INVALID_SOCKET && bind(legacy_socket, (SOCKADDR*)&local_addr, sizeof(local_addr)) == SOCKET_ERROR) {
+        closesocket(legacy_socket); // Port taken (e.g. a second scanner); probes still work
+        legacy_socket = INVALID_SOCKET;
+    }
+    SOCKET probe_socket6 = g_discovery_multicast ? socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP) : INVALID_SOCKET;
+    std::vector<ULONG> multicast_interfaces6;
+    if (probe_socket6 != INVALID_SOCKET) {
+        SocketAddress local_addr6; // Any address, ephemeral port
+        local_addr6.storage.ss_family = AF_INET6;
+        local_addr6.length = sizeof(sockaddr_in6);
+        DWORD hops = (DWORD)g_discovery_multicast_ttl;
+        if (bind(probe_socket6, local_addr6.get(), local_addr6.length) == SOCKET_ERROR) {
+            closesocket(probe_socket6); // No IPv6 here; IPv4 discovery still works
+            probe_socket6 = INVALID_SOCKET;
+        } else {
+            setsockopt(probe_socket6, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, (const char*)&hops, sizeof(hops));
+            multicast_interfaces6 = get_ipv6_interfaces(probe_socket6);
+        }
+    }
+    SocketEvent replies, replies6, announcements;
+    replies.watch(probe_socket, FD_READ);
+    if (probe_socket6 != INVALID_SOCKET) replies6.watch(probe_socket6, FD_READ);
+    if (legacy_socket != INVALID_SOCKET) announcements.watch(legacy_socket, FD_READ);
+
+    std::vector<in_addr> targets = get_broadcast_addresses(probe_socket);
+    std::vector<in_addr> multicast_interfaces;
+    sockaddr_in group = {};
+    group.sin_family = AF_INET;
+    group.sin_port = htons(DISCOVERY_PROBE_PORT);
+    inet_pton(AF_INET, DISCOVERY_MULTICAST_GROUP, &group.sin_addr);
+    if (g_discovery_multicast) {
+        DWORD ttl = (DWORD)g_discovery_multicast_ttl;
+        setsockopt(probe_socket, IPPROTO_IP, IP_MULTICAST_TTL, (const char*)&ttl, sizeof(ttl));
+        for (const INTERFACE_INFO& info : get_ipv4_interfaces(probe_socket, IFF_MULTICAST)) {
+            multicast_interfaces.push_back(info.iiAddress.AddressIn.sin_addr);
+        }
+    }
+    std::string probe = make_handshake_line("discover", KVM_PROTOCOL_VERSION);
+    probe.pop_back();
+    const size_t probe_rounds = sizeof(DISCOVERY_PROBE_SCHEDULE_MS) / sizeof(DISCOVERY_PROBE_SCHEDULE_MS[0]);
+    size_t probes_sent = 0;
+
+    std::vector<std::string> found;        // Addresses that answered a probe
+    std::vector<std::string> legacy_found; // Addresses only heard announcing
+    std::vector<DiscoveredServer> heard;   // Everything listed, for the server cache
+    ULONGLONG start = GetTickCount64();
+    bool stopped = false;
+    for (;;) {
+        DWORD elapsed = (DWORD)(GetTickCount64() - start);
+        DWORD window = found.empty() ? DISCOVERY_LEGACY_WINDOW_MS : DISCOVERY_WINDOW_MS;
+        if (elapsed >= window) break;
+        for (; probes_sent < probe_rounds && elapsed >= DISCOVERY_PROBE_SCHEDULE_MS[probes_sent]; ++probes_sent) {
+            for (const in_addr& interface_addr : multicast_interfaces) {
+                setsockopt(probe_socket, IPPROTO_IP, IP_MULTICAST_IF, (const char*)&interface_addr, sizeof(interface_addr));
+                sendto(probe_socket, probe.c_str(), (int)probe.length(), 0, (SOCKADDR*)&group, sizeof(group));
+            }
+            for (ULONG index : multicast_interfaces6) {
+                setsockopt(probe_socket6, IPPROTO_IPV6, IPV6_MULTICAST_IF, (const char*)&index, sizeof(index));
+                for (const char* group6 : DISCOVERY_MULTICAST_GROUPS_V6) {
+                    SocketAddress target;
+                    parse_socket_address(group6, DISCOVERY_PROBE_PORT, target);
+                    sendto(probe_socket6, probe.c_str(), (int)probe.length(), 0, target.get(), target.length);
+                }
+            }
+            if (!multicast_interfaces.empty() && probes_sent > 0) continue;
+            sockaddr_in target = {};
+            target.sin_family = AF_INET;
+            target.sin_port = htons(DISCOVERY_PROBE_PORT);
+            for (const in_addr& address : targets) {
+                target.sin_addr = address;
+                sendto(probe_socket, probe.c_str(), (int)probe.length(), 0, (SOCKADDR*)&target, sizeof(target));
+            }
+        }
+        DWORD wait = window - elapsed;
+        if (probes_sent < probe_rounds) wait = (std::min)(wait, DISCOVERY_PROBE_SCHEDULE_MS[probes_sent] - elapsed);
+
+        WaitResult woke = wait_for_sockets(stop, {&replies, probe_socket6 != INVALID_SOCKET ? &replies6 : nullptr,
+                                                  legacy_socket != INVALID_SOCKET ? &announcements : nullptr}, wait);
+        if (woke == WaitResult::Stopped) {
+            stopped = true;
+            break;
+        }
+        if (woke == WaitResult::Timeout) continue;
+
+        char buffer[512];
+        SocketAddress from;
+        for (SOCKET sock : { probe_socket, probe_socket6 }) {
+            if (!((sock == probe_socket ? replies : replies6).fired & FD_READ)) continue;
+            from.length = sizeof(from.storage);
+            int bytes = recvfrom(sock, buffer, sizeof(buffer), 0, from.get(), &from.length);
+            std::string_view reply(buffer, bytes > 0 ? bytes : 0);
+            DiscoveredServer server;
+            uint32_t port = KVM_PORT;
+            std::string_view host;
+            if (!parse_handshake_line(reply, "server_here", server.version)) continue;
+            server.address = format_socket_address(from);
+            if (find_handshake_param(reply, "port", port) && port > 0 && port <= 0xFFFF) server.port = (uint16_t)port;
+            server.host = find_handshake_text(reply, "host", host) ? std::string(host) : server.address;
+            bool listed = std::find(found.begin(), found.end(), server.address) != found.end() ||
+                          std::any_of(heard.begin(), heard.end(), [&](const DiscoveredServer& other) {
+                              return other.host == server.host && other.port == server.port; // Its other stack
+                          });
+            if (!listed) {
+                found.push_back(server.address);
+                heard.push_back(server);
+                AddServerToList(server);
+                LogClientMessage("Found " + server.host + " at " + server.address + " (protocol v" + std::to_string(server.version) + ")");
+            }
+        }
+        if (announcements.fired & FD_READ) {
+            from.length = sizeof(from.storage);
+            int bytes = recvfrom(legacy_socket, buffer, sizeof(buffer), 0, from.get(), &from.length);
+            if (bytes > 0 && std::string_view(buffer, bytes) == DISCOVERY_MESSAGE) {
+                std::string address = format_socket_address(from);
+                if (std::find(legacy_found.begin(), legacy_found.end(), address) == legacy_found.end()) legacy_found.push_back(address);
+            }
+        }
+    }
+
+    replies.unwatch();
+    replies6.unwatch();
+    announcements.unwatch();
+    closesocket(probe_socket);
+    if (probe_socket6 != INVALID_SOCKET) closesocket(probe_socket6);
+    if (legacy_socket != INVALID_SOCKET) closesocket(legacy_socket);
+    if (stopped) return;
+
+    // Newer servers announce too; only list the ones that did not answer a probe.
+    for (const std::string& address : legacy_found) {
+        if (std::find(found.begin(), found.end(), address) != found.end()) continue;
+        DiscoveredServer server;
+        server.address = address;
+        AddServerToList(server);
+        LogClientMessage("Found server at " + address + " (older version)");
+        found.push_back(address);
+        heard.push_back(server);
+    }
+    if (found.empty()) LogClientMessage("No servers found.");
+    remember_servers(heard);
+}
+
+// Client end of the hybrid transport: receives mouse motion datagrams from the server.
+struct ClientUdpChannel {
+    SOCKET sock = INVALID_SOCKET;
+    bool active = false;       // Server acknowledged the channel
+    uint32_t token = 0;
+    bool has_seq = false;
+    uint32_t last_seq = 0;     // Newest datagram applied
+    SocketAddress server_addr;
+    RecordCipher* cipher = nullptr; // Paired: opens the datagrams (the link's motion key)
+    uint64_t received = 0;
+    uint64_t stale_dropped = 0;
+};
+
+// Binds a non-blocking UDP socket on an ephemeral port for the motion channel.
+bool open_motion_channel(ClientUdpChannel& channel, const SocketAddress& server_addr, uint16_t& port) {
+    channel.sock = socket(server_addr.family(), SOCK_DGRAM, IPPROTO_UDP);
+    if (channel.sock == INVALID_SOCKET) return false;
+
+    SocketAddress local_addr; // Any address, ephemeral port, in the server's family
+    local_addr.storage.ss_family = server_addr.storage.ss_family;
+    local_addr.length = server_addr.length;
+    u_long non_blocking = 1;
+    if (bind(channel.sock, local_addr.get(), local_addr.length) == SOCKET_ERROR ||
+        getsockname(channel.sock, local_addr.get(), &local_addr.length) == SOCKET_ERROR ||
+        ioctlsocket(channel.sock, FIONBIO, &non_blocking) == SOCKET_ERROR) {
+        closesocket(channel.sock);
+        channel.sock = INVALID_SOCKET;
+        return false;
+    }
+    channel.server_addr = server_addr;
+    port = local_addr.port();
+    return true;
+}
+
+// Applies every queued motion datagram, dropping ones that are older than what has
+// already been applied (relative motion is never worth replaying late).
+void drain_motion_datagrams(ClientUdpChannel& channel, InjectBatch& inject) {
+    uint8_t datagram[MAX_UDP_DATAGRAM_SIZE];
+    for (;;) {
+        SocketAddress from;
+        from.length = sizeof(from.storage);
+        int bytes = recvfrom(channel.sock, (char*)datagram, sizeof(datagram), 0, from.get(), &from.length);
+        if (bytes <= 0) break; // WSAEWOULDBLOCK: nothing more queued
+
+        uint32_t token = 0, seq = 0;
+        if (!same_host(from, channel.server_addr) ||
+            !decode_udp_header(datagram, (size_t)bytes, token, seq) || token != channel.token) {
+            continue;
+        }
+        size_t end = (size_t)bytes;
+        if (channel.cipher) {
+            // Checked before the sequence number counts, so forged datagrams cannot
+            // make real ones look stale.
+            if (end < UDP_HEADER_SIZE + RECORD_TAG_SIZE) continue;
+            end -= RECORD_TAG_SIZE;
+            uint8_t* frames = datagram + UDP_HEADER_SIZE;
+            if (!aead_open(*channel.cipher, seq, datagram, UDP_HEADER_SIZE, frames, end - UDP_HEADER_SIZE, frames, datagram + end)) {
+                continue;
+            }
+        }
+        if (channel.has_seq && !seq_newer(seq, channel.last_seq)) {
+            ++channel.stale_dropped;
+            continue;
+        }
+        channel.has_seq = true;
+        channel.last_seq = seq;
+        ++channel.received;
+
+        size_t offset = UDP_HEADER_SIZE;
+        InputEvent ev;
+        size_t consumed = 0;
+        while (offset < end && decode_binary_frame(datagram + offset, end - offset, ev, consumed) == DecodeStatus::Ok) {
+            offset += consumed;
+            if (ev.type == EventType::MouseMove || is_wheel_event(ev.type)) apply_input_event(ev, inject);
+        }
+    }
+}
+
+// Called for a UdpBarrier on the TCP stream: gives motion sent before the next key or
+// button a brief chance to arrive so it is applied first. Lost datagrams are skipped.
+void wait_for_motion(ClientUdpChannel& channel, uint32_t seq, InjectBatch& inject) {
+    int64_t deadline = qpc_now() + (int64_t)UDP_BARRIER_WAIT_MS * g_qpc_frequency / 1000;
+    while (!channel.has_seq || seq_newer(seq, channel.last_seq)) {
+        int64_t remaining = deadline - qpc_now();
+        if (remaining <= 0) break;
+        fd_set read_set;
+        FD_ZERO(&read_set);
+        FD_SET(channel.sock, &read_set);
+        timeval timeout = { 0, (long)(remaining * 1000000 / g_qpc_frequency) };
+        if (select(0, &read_set, NULL, NULL, &timeout) <= 0) break;
+        drain_motion_datagrams(channel, inject);
+    }
+}
+
+// --- Client Edge Switching ---
+// The client works on its whole virtual desktop: the edge facing the server is the
+// bounding rectangle's edge opposite the one the server cursor left through.
+
+RECT get_virtual_desktop_rect() {
+    RECT rc;
+    rc.left = GetSystemMetrics(SM_XVIRTUALSCREEN);
+    rc.top = GetSystemMetrics(SM_YVIRTUALSCREEN);
+    rc.right = rc.left + GetSystemMetrics(SM_CXVIRTUALSCREEN);
+    rc.bottom = rc.top + GetSystemMetrics(SM_CYVIRTUALSCREEN);
+    return rc;
+}
+
+// Places the cursor where the server's cursor came in (CursorEnter).
+void place_cursor_at_entry(const InputEvent& ev) {
+    RECT rc = get_virtual_desktop_rect();
+    uint8_t edge = opposite_edge(ev.edge);
+    bool horizontal = (edge == EDGE_TOP || edge == EDGE_BOTTOM);
+    LONG start = horizontal ? rc.left : rc.top;
+    LONG length = horizontal ? rc.right - rc.left : rc.bottom - rc.top;
+    LONG along = start + (LONG)(((int64_t)ev.position * (std::max)(1L, length - 1)) / 65535);
+    switch (edge) {
+        case EDGE_LEFT:  SetCursorPos(rc.left + EDGE_REENTRY_INSET, along); break;
+        case EDGE_RIGHT: SetCursorPos(rc.right - 1 - EDGE_REENTRY_INSET, along); break;
+        case EDGE_TOP:   SetCursorPos(along, rc.top + EDGE_REENTRY_INSET); break;
+        default:         SetCursorPos(along, rc.bottom - 1 - EDGE_REENTRY_INSET); break;
+    }
+}
+
+// Client connection thread. Everything the client sends after its hello goes through
+// here, sealed once the connection is paired.
+void send_to_server(SOCKET sock, SecureLink& link, const uint8_t* data, size_t length) {
+    if (!link.active) {
+        send_all(sock, (const char*)data, length);
+        return;
+    }
+    uint8_t record[MAX_CLIENT_RECORD_PAYLOAD + RECORD_OVERHEAD];
+    size_t record_length = (length <= MAX_CLIENT_RECORD_PAYLOAD) ? seal_record(link.seal, data, length, record) : 0;
+    if (record_length > 0) send_all(sock, (const char*)record, record_length);
+}
+
+// Client connection thread, on the first line from the server while a pairing key is
+// set. Checks the server's proof, answers with ours and switches to encrypted records.
+// nonces holds our nonce; the server's is stored after it. False (after logging) if the
+// server did not ask for the key or does not know it.
+bool answer_pairing_challenge(SOCKET sock, SecureLink& link, std::string_view line, uint8_t* nonces) {
+    std::string_view nonce_hex, proof_hex;
+    uint8_t proof[PAIRING_PROOF_SIZE], server_proof[PAIRING_PROOF_SIZE], client_proof[PAIRING_PROOF_SIZE];
+    ChannelSecret secret;
+    if (!is_handshake_message(line, "auth_challenge") || !find_handshake_text(line, "nonce", nonce_hex) ||
+        !find_handshake_text(line, "proof", proof_hex) || !decode_hex(nonce_hex, nonces + PAIRING_NONCE_SIZE, PAIRING_NONCE_SIZE) ||
+        !decode_hex(proof_hex, proof, sizeof(proof))) {
+        LogClientMessage(LogLevel::Error, "The server does not use a pairing key. Not connecting without encryption; "
+                         "clear security.pairing_key to connect anyway.");
+        return false;
+    }
+    if (!derive_pairing(nonces, server_proof, client_proof, secret) || !proofs_equal(proof, server_proof)) {
+        LogClientMessage(LogLevel::Error, "The server has a different pairing key. Set the same security.pairing_key on both machines.");
+        return false;
+    }
+    std::string response = "event:auth_response,proof:" + encode_hex(client_proof, sizeof(client_proof)) + "\n";
+    send_all(sock, response.c_str(), response.length());
+    bool started = start_secure_link(link, secret, "input", false);
+    SecureZeroMemory(secret.data(), secret.size());
+    if (!started) {
+        LogClientMessage(LogLevel::Error, "!! Could not set up encryption.");
+        return false;
+    }
+    LogClientMessage("Paired with the server. The connection is encrypted.");
+    return true;
+}
+
+// After an injection batch: if the motion pushed the cursor against the edge facing
+// the server, tells the server to take control back. Returns true once sent.
+bool check_edge_return(InjectBatch& inject, uint8_t edge, SOCKET sock, SecureLink& link) {
+    int32_t dx = inject.moved_dx, dy = inject.moved_dy;
+    inject.moved_dx = inject.moved_dy = 0;
+    bool pushing = (edge == EDGE_LEFT && dx < 0) || (edge == EDGE_RIGHT && dx > 0) ||
+                   (edge == EDGE_TOP && dy < 0) || (edge == EDGE_BOTTOM && dy > 0);
+    if (!pushing) return false;
+
+    POINT pt;
+    GetCursorPos(&pt);
+    RECT rc = get_virtual_desktop_rect();
+    bool at_edge = (edge == EDGE_LEFT && pt.x <= rc.left) || (edge == EDGE_RIGHT && pt.x >= rc.right - 1) ||
+                   (edge == EDGE_TOP && pt.y <= rc.top) || (edge == EDGE_BOTTOM && pt.y >= rc.bottom - 1);
+    if (!at_edge) return false;
+
+    bool horizontal = (edge == EDGE_TOP || edge == EDGE_BOTTOM);
+    LONG offset = horizontal ? pt.x - rc.left : pt.y - rc.top;
+    LONG length = horizontal ? rc.right - rc.left : rc.bottom - rc.top;
+    InputEvent ret = { EventType::EdgeReturn };
+    ret.position = (uint16_t)std::clamp<int64_t>(((int64_t)offset * 65535) / (std::max)(1L, length - 1), 0, 65535);
+    uint8_t frame[MAX_BINARY_FRAME_SIZE];
+    size_t len = encode_binary_frame(ret, frame);
+    send_to_server(sock, link, frame, len);
+    LogClientMessage("Cursor left through the server edge. Returning control.");
+    return true;
+}
+
+// Side channels the server's ack offered, opened by their own thread so a port that
+// never answers cannot hold up injection or heartbeat acks (heartbeats time out long
+// before a side-channel connect does).
+struct SideChannelOffer {
+    SocketAddress server_addr;
+    uint16_t clipboard_port = 0; // 0 = not offered, or sharing is off here
+    uint16_t file_port = 0;      // Likewise for file transfer
+    uint32_t session_token = 0;
+    const ChannelSecret* secret = nullptr; // The paired session's; outlives the thread
+};
+
+// Side-channel thread of one client session. stop is the session's, requested when
+// it ends.
+void run_side_channel_opener(const StopSignal& stop, SideChannelOffer offer) {
+    if (offer.clipboard_port != 0) {
+        open_clipboard_channel(stop, offer.server_addr, offer.clipboard_port, offer.session_token, offer.secret);
+    }
+    if (offer.file_port != 0 && !stop.requested()) {
+        open_file_channel(stop, offer.server_addr, offer.file_port, offer.session_token, offer.secret);
+    }
+}
+
+// One connection's worth of client work: handshake, then receive and inject until the
+// stream ends. Returns true if the link was lost (worth reconnecting), false if the
+// user stopped the client or the server sent something we cannot parse.
+// session_token carries the server's resume token from one connection to the next.
+bool run_client_session(const StopSignal& stop, SOCKET connect_socket, const SocketAddress& server_addr, uint32_t& session_token) {
+    // The session waits on both streams and stop together; motion datagrams are applied
+    // as soon as they land. Sends go through send_all, which copes with the socket
+    // being non-blocking meanwhile.
+    SocketEvent stream_event, motion_event;
+    if (!stream_event.watch(connect_socket, FD_READ | FD_CLOSE)) {
+        LogClientMessage(LogLevel::Error, "Could not wait on the connection. Error: " + std::to_string(WSAGetLastError()));
+        return false;
+    }
+
+    // Offer the binary protocol (and our motion port, if the hybrid transport is on).
+    // Older servers ignore this and keep sending text.
+    ClientUdpChannel udp;
+    uint16_t udp_port = 0;
+    std::string hello = "event:hello,version:" + std::to_string(KVM_PROTOCOL_VERSION);
+    if (g_udp_transport_enabled && open_motion_channel(udp, server_addr, udp_port) && motion_event.watch(udp.sock, FD_READ)) {
+        hello += ",udp_port:" + std::to_string(udp_port);
+    }
+    if (session_token != 0) hello += ",resume:" + std::to_string(session_token);
+    SecureLink link; // Active once paired
+    uint8_t pairing_nonces[2 * PAIRING_NONCE_SIZE]; // Ours, then the server's
+    if (g_pairing_enabled) {
+        if (!random_bytes(pairing_nonces, PAIRING_NONCE_SIZE)) return false;
+        hello += ",auth_nonce:" + encode_hex(pairing_nonces, PAIRING_NONCE_SIZE);
+    }
+    hello += "\n";
+    send_all(connect_socket, hello.c_str(), hello.length());
+
+    int protocol = KVM_PROTOCOL_TEXT;
+    bool stream_error = false;
+    bool link_lost = false;
+    uint64_t ignored_text_lines = 0;
+    InjectBatch inject;
+    PointerSettings pointer_settings;
+    {
+        std::lock_guard<std::mutex> lock(g_pointer_settings_mutex);
+        pointer_settings = g_pointer_settings;
+    }
+    inject.pointer.configure(pointer_settings, 1.0); // Text-only servers announce no DPI
+    SystemMouseAcceleration system_acceleration; // Restored when the session ends
+    if (pointer_settings.disable_system_acceleration) system_acceleration.disable();
+    uint32_t probe_ids[16]; // Latency probes to echo once this read has been injected
+    size_t probe_count = 0;
+    bool edge_return_armed = false; // Control arrived through a screen edge (CursorEnter)
+    uint8_t return_edge = EDGE_LEFT;
+    uint32_t heartbeat_timeout_ms = 0; // Announced in the ack; 0 = the server sends no heartbeats
+    ULONGLONG last_heard = GetTickCount64(); // Last TCP data from the server
+    static FrameBuffer<CLIENT_RECEIVE_BUFFER_SIZE> receive_buffer;
+    static FrameBuffer<CLIENT_RECEIVE_BUFFER_SIZE> plain_buffer; // Decrypted records, once paired
+    receive_buffer.clear();
+    plain_buffer.clear();
+    FrameBuffer<CLIENT_RECEIVE_BUFFER_SIZE>* frames = &receive_buffer; // Where frames are decoded from
+    StopSignal side_channels_stop; // Requested when the session ends
+    std::thread side_channels;
+    while (!stream_error) {
+        // With heartbeats on, a server that stays silent too long counts as gone.
+        DWORD wait_ms = INFINITE;
+        if (heartbeat_timeout_ms > 0) {
+            ULONGLONG silent_ms = GetTickCount64() - last_heard;
+            if (silent_ms >= heartbeat_timeout_ms) {
+                LogClientMessage(LogLevel::Warning, "No heartbeat from the server for " + std::to_string(silent_ms) + " ms.");
+                link_lost = true;
+                break;
+            }
+            wait_ms = (DWORD)(heartbeat_timeout_ms - silent_ms);
+        }
+        WaitResult woke = wait_for_sockets(stop, {&stream_event, udp.active ? &motion_event : nullptr}, wait_ms);
+        if (woke == WaitResult::Stopped) break;
+        if (woke == WaitResult::Timeout) continue;
+        if (udp.active && (motion_event.fired & FD_READ)) {
+            drain_motion_datagrams(udp, inject);
+            inject.flush();
+            if (edge_return_armed && check_edge_return(inject, return_edge, connect_socket, link)) edge_return_armed = false;
+        }
+        if (!(stream_event.fired & (FD_READ | FD_CLOSE))) continue;
+
+        uint8_t* write_ptr = receive_buffer.write_ptr();
+        int bytes = recv(connect_socket, (char*)write_ptr, (int)receive_buffer.write_space(), 0);
+        if (bytes == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK) continue;
+        if (bytes <= 0) {
+            link_lost = true;
+            break;
+        }
+        receive_buffer.commit(bytes);
+        int64_t received_qpc = qpc_now();
+        last_heard = GetTickCount64();
+        if (link.active && !open_records(link.open, receive_buffer, plain_buffer, MAX_RECORD_PAYLOAD)) {
+            LogClientMessage(LogLevel::Error, "Data from the server failed authentication. Disconnecting.");
+            stream_error = true;
+            break;
+        }
+
+        while (!frames->empty()) {
+            if (protocol == KVM_PROTOCOL_TEXT) {
+                std::string_view message;
+                if (!frames->next_line(message)) {
+                    if (frames->size() > MAX_HANDSHAKE_LINE_SIZE) {
+                        LogClientMessage("Received an oversized text frame from the server. Disconnecting.");
+                        stream_error = true;
+                    }
+                    break;
+                }
+
+                int version = 0;
+                if (g_pairing_enabled && !link.active) {
+                    // Only the challenge may come before encryption starts; the rest of
+                    // what arrived is already records.
+                    if (!answer_pairing_challenge(connect_socket, link, message, pairing_nonces) ||
+                        !open_records(link.open, receive_buffer, plain_buffer, MAX_RECORD_PAYLOAD)) {
+                        stream_error = true;
+                        break;
+                    }
+                    frames = &plain_buffer;
+                } else if (is_handshake_message(message, "auth_required")) {
+                    LogClientMessage(LogLevel::Error, "The server requires a pairing key. Set security.pairing_key to the server's key.");
+                    stream_error = true;
+                    break;
+                } else if (parse_handshake_line(message, "hello_ack", version) && version > KVM_PROTOCOL_TEXT) {
+                    protocol = version;
+                    udp.active = (udp.sock != INVALID_SOCKET && find_handshake_param(message, "udp_token", udp.token));
+                    udp.cipher = link.active ? &link.motion : nullptr;
+                    if (!find_handshake_param(message, "session", session_token)) session_token = 0;
+                    if (!find_handshake_param(message, "heartbeat_timeout_ms", heartbeat_timeout_ms)) heartbeat_timeout_ms = 0;
+                    LogClientMessage("Server accepted binary protocol v" + std::to_string(version) +
+                                     (udp.active ? " with UDP mouse motion." : " over TCP only."));
+                    uint32_t server_dpi = 96;
+                    if (!find_handshake_param(message, "dpi", server_dpi) || server_dpi == 0) server_dpi = 96;
+                    UINT client_dpi = pointer_settings.dpi_scaling ? query_system_dpi() : server_dpi;
+                    inject.pointer.configure(pointer_settings, (double)client_dpi / server_dpi);
+                    if (!inject.pointer.identity) {
+                        LogClientMessage("Pointer profile: sensitivity " + std::to_string(pointer_settings.sensitivity).substr(0, 4) +
+                                         ", " + std::to_string(pointer_settings.acceleration.size()) + " curve points, DPI " +
+                                         std::to_string(client_dpi) + " here / " + std::to_string(server_dpi) + " on the server.");
+                    }
+                    SideChannelOffer offer;
+                    offer.server_addr = server_addr;
+                    offer.session_token = session_token;
+                    offer.secret = link.active ? &link.secret : nullptr;
+                    uint32_t clipboard_port = 0;
+                    if (g_clipboard_enabled && session_token != 0 &&
+                        find_handshake_param(message, "clipboard_port", clipboard_port) && clipboard_port > 0 && clipboard_port <= 0xFFFF) {
+                        offer.clipboard_port = (uint16_t)clipboard_port;
+                    }
+                    uint32_t file_port = 0;
+                    if (g_file_transfer_enabled && session_token != 0 &&
+                        find_handshake_param(message, "file_port", file_port) && file_port > 0 && file_port <= 0xFFFF) {
+                        offer.file_port = (uint16_t)file_port;
+                    }
+                    if ((offer.clipboard_port != 0 || offer.file_port != 0) && !side_channels.joinable()) {
+                        side_channels = std::thread(run_side_channel_opener, std::cref(side_channels_stop), offer);
+                    }
+                } else if (!message.empty() && process_message(message, inject) != DecodeStatus::Ok) {
+                    ++ignored_text_lines;
+                }
+            } else {
+                InputEvent ev;
+                size_t consumed = 0;
+                DecodeStatus status = decode_binary_frame(frames->data(), frames->size(), ev, consumed);
+                if (status == DecodeStatus::NeedMore) break;
+                if (status == DecodeStatus::Invalid) {
+                    LogClientMessage("Received an invalid frame from the server. Disconnecting.");
+                    stream_error = true;
+                    break;
+                }
+                if (ev.type == EventType::KeySync) inject.sync_keys(decode_key_sync(frames->data())); // Before the bytes go
+                frames->consume(consumed);
+                if (ev.type == EventType::UdpBarrier) {
+                    if (udp.active) wait_for_motion(udp, ev.seq, inject);
+                } else if (ev.type == EventType::LatencyProbe) {
+                    if (probe_count < 16) probe_ids[probe_count++] = ev.seq;
+                } else if (ev.type == EventType::Heartbeat) {
+                    // Answer before injecting, so the round trip measures the network only.
+                    InputEvent ack = { EventType::HeartbeatAck };
+                    ack.seq = ev.seq;
+                    uint8_t frame[MAX_BINARY_FRAME_SIZE];
+                    send_to_server(connect_socket, link, frame, encode_binary_frame(ack, frame));
+                } else if (ev.type == EventType::CursorEnter) {
+                    inject.flush(); // Anything before the entry lands at the old position
+                    place_cursor_at_entry(ev);
+                    inject.moved_dx = inject.moved_dy = 0;
+                    return_edge = opposite_edge(ev.edge);
+                    edge_return_armed = true;
+                } else {
+                    if (ev.type == EventType::ControlAcquire || ev.type == EventType::ControlRelease) edge_return_armed = false;
+                    apply_input_event(ev, inject);
+                }
+            }
+        }
+        inject.flush(); // One SendInput for everything decoded from this read
+        if (edge_return_armed && check_edge_return(inject, return_edge, connect_socket, link)) edge_return_armed = false;
+
+        if (probe_count > 0) {
+            uint8_t echoes[16 * MAX_BINARY_FRAME_SIZE];
+            size_t echo_len = 0;
+            InputEvent echo = { EventType::LatencyEcho };
+            echo.elapsed_us = qpc_to_us(qpc_now() - received_qpc);
+            for (size_t i = 0; i < probe_count; ++i) {
+                echo.seq = probe_ids[i];
+                echo_len += encode_binary_frame(echo, echoes + echo_len);
+            }
+            send_to_server(connect_socket, link, echoes, echo_len);
+            probe_count = 0;
+        }
+    }
+    inject.flush();
+    LogClientMessage("Injection batch sizes: " + format_inject_histogram());
+    if (ignored_text_lines > 0) {
+        LogClientMessage("Ignored " + std::to_string(ignored_text_lines) + " undecodable text messages.");
+    }
+
+    if (udp.sock != INVALID_SOCKET) {
+        if (udp.active) {
+            LogClientMessage("UDP motion: " + std::to_string(udp.received) + " datagrams applied, " +
+                             std::to_string(udp.stale_dropped) + " stale dropped.");
+        }
+        motion_event.unwatch();
+        closesocket(udp.sock);
+    }
+    side_channels_stop.request();
+    if (side_channels.joinable()) side_channels.join();
+    prune_clipboard_peers(true);
+    prune_file_channels(true);
+    release_client_keys(inject);
+    return link_lost && !stop.requested();
+}
+
+// Connects and runs sessions until the user disconnects. If an established link drops,
+// reconnects with exponential backoff, offering the session token so the server can
+// re-attach this client as the same one (see resume_parked_session).
+void run_client_connect_logic(const StopSignal& stop, std::string server_ip, uint16_t port) {
+    HANDLE mmcss_task = raise_input_thread_priority("Injection", LogClientMessage);
+    SocketAddress server_connect_addr;
+    bool address_ok = parse_socket_address(server_ip, port, server_connect_addr);
+    if (!address_ok) LogClientMessage(LogLevel::Error, server_ip + " is not an IPv4 or IPv6 address.");
+
+    uint32_t session_token = 0;
+    bool connected_once = false;
+    ULONGLONG link_lost_at = 0; // When the last established link dropped
+    DWORD backoff_ms = RECONNECT_INITIAL_DELAY_MS;
+    bool key_ready = load_pairing_key(LogClientMessage);
+    while (address_ok && key_ready && !stop.requested()) {
+        if (!connected_once) LogClientMessage("Connecting to " + server_ip + "...");
+        SOCKET connect_socket = socket(server_connect_addr.family(), SOCK_STREAM, IPPROTO_TCP);
+        if (connect_socket == INVALID_SOCKET || !connect_or_stop(stop, connect_socket, server_connect_addr)) {
+            if (connect_socket != INVALID_SOCKET) closesocket(connect_socket);
+            if (stop.requested()) break;
+            if (!connected_once) {
+                LogClientMessage(LogLevel::Error, "Failed to connect to server.");
+                break;
+            }
+        } else {
+            if (!connected_once) {
+                if (g_front_end->client_connected) g_front_end->client_connected();
+                LogClientMessage("Connected to server. Awaiting remote control...");
+            } else {
+                LogClientMessage("Reconnected to " + server_ip + ".");
+                g_stat_reconnects.fetch_add(1, std::memory_order_relaxed);
+                if (trace_enabled(TRACE_LEVEL_INFO, TRACE_KEYWORD_NETWORK)) {
+                    uint64_t downtime_ms = GetTickCount64() - link_lost_at;
+                    write_trace_event(TRACE_RECONNECTED, { trace_data(downtime_ms) });
+                }
+            }
+            connected_once = true;
+            apply_socket_tuning(connect_socket, LogClientMessage);
+            ULONGLONG session_start = GetTickCount64();
+            bool link_lost = run_client_session(stop, connect_socket, server_connect_addr, session_token);
+            close_tuned_socket(connect_socket);
+            if (!link_lost || !g_auto_reconnect) break;
+            link_lost_at = GetTickCount64();
+            if (link_lost_at - session_start >= RECONNECT_STABLE_MS) backoff_ms = RECONNECT_INITIAL_DELAY_MS;
+        }
+        if (stop.requested()) break;
+        LogClientMessage(LogLevel::Warning, "Connection to the server lost. Retrying in " + std::to_string(backoff_ms) + " ms...");
+        if (WaitForSingleObject(stop.handle(), backoff_ms) == WAIT_OBJECT_0) break;
+        backoff_ms = (std::min)(backoff_ms * 2, RECONNECT_MAX_DELAY_MS);
+    }
+    restore_input_thread_priority(mmcss_task);
+
+    if (g_front_end->client_stopped) g_front_end->client_stopped();
+    LogClientMessage("Client logic thread finished.");
+}
+
+// =================================================================================
+// Headless Front-End
+// =================================================================================
+// "--server" or "--client [address[:port]]" (or "headless.mode" in the config) runs the
+// engine without the GUI: no visible window, brushes, fonts or controls. Logs go to
+// kvm_log.txt, and to the console when started from one. The only window is an
+// invisible one that owns the shared clipboard and hears display changes. A headless
+// client stays connected on its own: it reconnects, and rescans when it has no
+// address, until Ctrl+C or "--stop".
+
+const char HEADLESS_STOP_EVENT_NAME[] = "Local\\SimpleKVM.Headless.Stop"; // Also marks a running instance
+const ULONGLONG HEADLESS_RETRY_MS = 5000;       // After a connect loop gives up or a scan finds nothing
+const ULONGLONG HEADLESS_SCAN_MS = DISCOVERY_LEGACY_WINDOW_MS + 500;
+HANDLE g_headless_stop_event = NULL;
+
+std::mutex g_headless_mutex;
+DiscoveredServer g_headless_found;               // Guarded by g_headless_mutex; address empty = none yet
+std::atomic<bool> g_headless_client_stopped(false);
+
+void headless_server_found(const DiscoveredServer& server) {
+    std::lock_guard<std::mutex> lock(g_headless_mutex);
+    // The remembered server wins; otherwise whichever answered first.
+    if (g_headless_found.address.empty() || server.address == g_last_server_address) g_headless_found = server;
+}
+void headless_client_stopped() { g_headless_client_stopped = true; }
+
+const FrontEnd HEADLESS_FRONT_END = {
+    headless_server_found, nullptr, headless_client_stopped,
+    nullptr, nullptr, nullptr, // No hotkey capture or drop strip without a GUI
+    nullptr
+};
+
+bool parse_launch_options(const char* command_line, LaunchOptions& options) {
+    options.mode = g_headless_mode;
+    std::vector<std::string> args;
+    std::string arg;
+    for (const char* c = command_line ? command_line : ""; ; ++c) {
+        if (*c == '\0' || *c == ' ' || *c == '\t') {
+            if (!arg.empty()) args.push_back(arg);
+            arg.clear();
+            if (*c == '\0') break;
+        } else {
+            arg += *c;
+        }
+    }
+    for (size_t i = 0; i < args.size(); ++i) {
+        if (args[i] == "--gui") {
+            options.mode = HeadlessMode::Off;
+        } else if (args[i] == "--server") {
+            options.mode = HeadlessMode::Server;
+        } else if (args[i] == "--client") {
+            options.mode = HeadlessMode::Client;
+            if (i + 1 < args.size() && args[i + 1].compare(0, 2, "--") != 0) {
+                // "a.b.c.d[:port]", or an IPv6 address bare or as "[address]:port".
+                std::string target = args[++i];
+                size_t colon = target.rfind(':');
+                if (target[0] == '[') {
+                    size_t bracket = target.find(']');
+                    if (bracket == std::string::npos || (bracket + 1 < target.size() && target[bracket + 1] != ':')) return false;
+                    colon = (bracket + 1 < target.size()) ? bracket + 1 : std::string::npos;
+                    options.address = target.substr(1, bracket - 1);
+                } else {
+                    if (target.find(':') != colon) colon = std::string::npos; // Bare IPv6
+                    options.address = target.substr(0, colon);
+                }
+                uint32_t port = KVM_PORT;
+                if (colon != std::string::npos &&
+                    (!parse_handshake_number(std::string_view(target).substr(colon + 1), port) || port == 0 || port > 0xFFFF)) {
+                    return false;
+                }
+                options.port = (uint16_t)port;
+                SocketAddress parsed;
+                if (!parse_socket_address(options.address, options.port, parsed)) return false;
+            }
+        } else if (args[i] == "--stop") {
+            options.stop = true;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Sends stdout to the console we were started from, if there is one. The exe is a
+// GUI-subsystem program, so it has none of its own.
+bool attach_parent_console() {
+    if (!AttachConsole(ATTACH_PARENT_PROCESS)) return false;
+    return freopen("CONOUT$", "w", stdout) != nullptr;
+}
+
+int show_usage() {
+    const char usage[] =
+        "Usage: Simple_KVM.exe [--gui | --server | --client [address[:port]] | --stop]\n\n"
+        "--server   Run the server without a window.\n"
+        "--client   Run a client without a window. Without an address it connects to the\n"
+        "           last server, or the first one a scan finds. An IPv6 address with a\n"
+        "           port goes in brackets: [address]:port.\n"
+        "--stop     Stop the running headless instance.\n"
+        "--gui      Show the window even if headless.mode is set in the config.\n";
+    if (attach_parent_console()) printf("\n%s", usage);
+    else MessageBox(NULL, usage, "Simple KVM", MB_OK | MB_ICONINFORMATION);
+    return 2;
+}
+
+int stop_headless_instance() {
+    bool attached = attach_parent_console();
+    HANDLE stop_event = OpenEvent(EVENT_MODIFY_STATE, FALSE, HEADLESS_STOP_EVENT_NAME);
+    if (stop_event == NULL) {
+        if (attached) printf("\nNo headless Simple KVM is running.\n");
+        return 1;
+    }
+    SetEvent(stop_event);
+    CloseHandle(stop_event);
+    if (attached) printf("\nAsked the headless Simple KVM to stop.\n");
+    return 0;
+}
+
+BOOL WINAPI headless_console_handler(DWORD control_type) {
+    // Ctrl+C, Ctrl+Break, console closed, logoff or shutdown. For the last three Windows
+    // ends the process once this returns, so give the main loop a moment to clean up.
+    SetEvent(g_headless_stop_event);
+    if (control_type != CTRL_C_EVENT && control_type != CTRL_BREAK_EVENT) Sleep(2000);
+    return TRUE;
+}
+
+LRESULT CALLBACK headless_wnd_proc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam) {
+    switch (message) {
+        case WM_CLIPBOARDUPDATE:
+            advertise_local_clipboard();
+            return 0;
+        case WM_APP_CLIPBOARD_OFFER: {
+            ClipboardOffer* offer = (ClipboardOffer*)wParam;
+            accept_clipboard_offer(*offer);
+            delete offer;
+            return 0;
+        }
+        case WM_RENDERFORMAT:
+            render_clipboard_format((UINT)wParam);
+            return 0;
+        case WM_RENDERALLFORMATS:
+            render_all_clipboard_formats();
+            return 0;
+        case WM_DESTROYCLIPBOARD:
+            forget_clipboard_offer();
+            return 0;
+        case WM_DISPLAYCHANGE:
+            post_to_hook_thread(WM_DISPLAYCHANGE, 0, 0);
+            return 0;
+    }
+    return DefWindowProc(hWnd, message, wParam, lParam);
+}
+
+// Headless main thread, on every tick. Keeps one client connect loop running: with
+// no address it scans first, and a loop that has given up is started again after
+// HEADLESS_RETRY_MS.
+struct HeadlessClient {
+    enum class Phase { Idle, Scanning, Connecting } phase = Phase::Idle;
+    std::string address; // Fixed target; empty = scan every time
+    uint16_t port = KVM_PORT;
+    ULONGLONG deadline = 0; // Idle: next attempt. Scanning: give up
+};
+
+void service_headless_client(HeadlessClient& client) {
+    ULONGLONG now = GetTickCount64();
+    switch (client.phase) {
+        case HeadlessClient::Phase::Idle:
+            if (now < client.deadline) return;
+            if (!client.address.empty()) {
+                g_headless_client_stopped = false;
+                start_network_thread(run_client_connect_logic, client.address, client.port);
+                client.phase = HeadlessClient::Phase::Connecting;
+            } else {
+                {
+                    std::lock_guard<std::mutex> lock(g_headless_mutex);
+                    g_headless_found = DiscoveredServer();
+                }
+                start_network_thread(run_client_scan_logic);
+                client.phase = HeadlessClient::Phase::Scanning;
+                client.deadline = now + HEADLESS_SCAN_MS;
+            }
+            break;
+        case HeadlessClient::Phase::Scanning: {
+            DiscoveredServer found;
+            {
+                std::lock_guard<std::mutex> lock(g_headless_mutex);
+                found = g_headless_found;
+            }
+            // Let the scan run its course when the remembered server may still answer.
+            bool settled = !found.address.empty() && (found.address == g_last_server_address || now >= client.deadline);
+            if (!settled && now < client.deadline) return;
+            stop_network_threads();
+            if (found.address.empty()) {
+                LogClientMessage(LogLevel::Warning, "No server found. Scanning again in " + std::to_string(HEADLESS_RETRY_MS / 1000) + " s.");
+                client.phase = HeadlessClient::Phase::Idle;
+                client.deadline = now + HEADLESS_RETRY_MS;
+            } else {
+                g_headless_client_stopped = false;
+                start_network_thread(run_client_connect_logic, found.address, found.port);
+                client.phase = HeadlessClient::Phase::Connecting;
+            }
+            break;
+        }
+        case HeadlessClient::Phase::Connecting:
+            if (!g_headless_client_stopped.exchange(false)) return;
+            stop_network_threads(); // Joins the finished thread
+            LogClientMessage("Trying again in " + std::to_string(HEADLESS_RETRY_MS / 1000) + " s.");
+            client.phase = HeadlessClient::Phase::Idle;
+            client.deadline = now + HEADLESS_RETRY_MS;
+            break;
+    }
+}
+
+int run_headless(const LaunchOptions& options) {
+    bool server = options.mode == HeadlessMode::Server;
+    void (*log)(const std::string&) = LogClientMessage;
+    if (server) log = LogServerMessage;
+    g_log_to_console = attach_parent_console();
+
+    g_headless_stop_event = CreateEvent(NULL, TRUE, FALSE, HEADLESS_STOP_EVENT_NAME);
+    if (g_headless_stop_event == NULL || GetLastError() == ERROR_ALREADY_EXISTS) {
+        log("!! Another headless Simple KVM is already running. Stop it with --stop first.");
+        drain_log_ring();
+        if (g_headless_stop_event != NULL) CloseHandle(g_headless_stop_event);
+        return 1;
+    }
+    SetConsoleCtrlHandler(headless_console_handler, TRUE);
+
+    WNDCLASS wc = {};
+    wc.lpfnWndProc = headless_wnd_proc;
+    wc.hInstance = GetModuleHandle(NULL);
+    wc.lpszClassName = "KVMHeadlessWindow";
+    RegisterClass(&wc);
+    g_hwnd = CreateWindowEx(0, wc.lpszClassName, "Simple KVM", WS_POPUP, 0, 0, 0, 0, NULL, NULL, wc.hInstance, NULL);
+    if (g_hwnd != NULL) AddClipboardFormatListener(g_hwnd);
+
+    log(std::string("Running headless as a ") + (server ? "server" : "client") + ". Stop with Ctrl+C or Simple_KVM.exe --stop.");
+    int exit_code = 0;
+    HeadlessClient client;
+    if (server) {
+        InstallHooks();
+        if (g_hook_thread.joinable()) {
+            g_is_server_active = true;
+            start_network_thread(run_server_logic);
+        } else {
+            exit_code = 1;
+        }
+    } else {
+        client.address = options.address.empty() ? g_last_server_address : options.address;
+        client.port = options.address.empty() ? g_last_server_port : options.port;
+    }
+
+    while (exit_code == 0) {
+        DWORD wait = MsgWaitForMultipleObjects(1, &g_headless_stop_event, FALSE, LOG_DRAIN_MS, QS_ALLINPUT);
+        if (wait == WAIT_OBJECT_0) break;
+        MSG msg;
+        bool quit = false;
+        while (PeekMessage(&msg, NULL, 0, 0, PM_REMOVE)) {
+            if (msg.message == WM_QUIT) quit = true;
+            DispatchMessage(&msg);
+        }
+        if (quit) break;
+        if (!server) service_headless_client(client);
+        drain_log_ring();
+    }
+
+    log("Stopping...");
+    g_is_server_active = false;
+    stop_kvm_logic();
+    if (g_hwnd != NULL) {
+        RemoveClipboardFormatListener(g_hwnd);
+        DestroyWindow(g_hwnd);
+        g_hwnd = NULL;
+    }
+    drain_log_ring();
+    SetConsoleCtrlHandler(headless_console_handler, FALSE);
+    CloseHandle(g_headless_stop_event);
+    g_headless_stop_event = NULL;
+    return exit_code;
+}
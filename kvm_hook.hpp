@@ -0,0 +1,59 @@
+// kvm_hook.hpp
+// The portable part of the keyboard hook's fast path.
+//
+// For every key the hook sees, it updates the mask of held modifier keys (which the
+// hotkey check reads instead of calling GetAsyncKeyState) and, while a client is
+// under control, builds the InputEvent it queues for the sender. Both steps live here
+// so that kvm_bench measures the same code the hook runs.
+//
+// This header is intentionally free of Windows dependencies.
+
+#pragma once
+
+#include <cstdint>
+#include "kvm_protocol.hpp"
+
+// Bits of the held-modifier mask.
+enum ModifierBit : uint8_t {
+    MOD_LCONTROL = 1 << 0, MOD_RCONTROL = 1 << 1,
+    MOD_LMENU    = 1 << 2, MOD_RMENU    = 1 << 3,
+    MOD_LSHIFT   = 1 << 4, MOD_RSHIFT   = 1 << 5,
+};
+const uint8_t MOD_CONTROL = MOD_LCONTROL | MOD_RCONTROL;
+const uint8_t MOD_MENU = MOD_LMENU | MOD_RMENU;
+const uint8_t MOD_SHIFT = MOD_LSHIFT | MOD_RSHIFT;
+
+// Virtual-key codes of the left/right modifier keys (VK_LSHIFT ... VK_RMENU).
+const uint32_t HOOK_VK_LSHIFT = 0xA0, HOOK_VK_RSHIFT = 0xA1;
+const uint32_t HOOK_VK_LCONTROL = 0xA2, HOOK_VK_RCONTROL = 0xA3;
+const uint32_t HOOK_VK_LMENU = 0xA4, HOOK_VK_RMENU = 0xA5;
+
+// The mask bit of vk_code, or 0 for a key that is not a tracked modifier.
+inline uint8_t modifier_bit(uint32_t vk_code) {
+    switch (vk_code) {
+        case HOOK_VK_LCONTROL: return MOD_LCONTROL;
+        case HOOK_VK_RCONTROL: return MOD_RCONTROL;
+        case HOOK_VK_LMENU:    return MOD_LMENU;
+        case HOOK_VK_RMENU:    return MOD_RMENU;
+        case HOOK_VK_LSHIFT:   return MOD_LSHIFT;
+        case HOOK_VK_RSHIFT:   return MOD_RSHIFT;
+        default:               return 0;
+    }
+}
+
+// Applies one key transition to the held-modifier mask.
+inline void track_modifier(uint8_t& modifiers, uint32_t vk_code, bool is_key_down) {
+    if (uint8_t bit = modifier_bit(vk_code)) {
+        if (is_key_down) modifiers |= bit;
+        else modifiers &= ~bit;
+    }
+}
+
+// The event the hook queues for a key forwarded to the client. The sender ring stamps
+// the capture time.
+inline InputEvent make_key_event(uint32_t vk_code, bool is_key_down) {
+    InputEvent ev = {};
+    ev.type = is_key_down ? EventType::KeyPress : EventType::KeyRelease;
+    ev.vk_code = (uint16_t)vk_code;
+    return ev;
+}
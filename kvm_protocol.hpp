@@ -0,0 +1,704 @@
+// kvm_protocol.hpp
+// Wire protocol shared by the KVM server and client.
+//
+// Two encodings can travel over the KVM TCP stream:
+//
+//   Text (legacy)   One "event:<type>,key:value,...\n" line per event. This is what
+//                   every build before the binary protocol speaks.
+//
+//   Binary (v1+)    A 1-byte opcode followed by packed little-endian fields. Every
+//                   opcode has a fixed frame size, so frames need no length prefix
+//                   or delimiter.
+//
+// Negotiation: right after connecting, the client sends "event:hello,version:<n>\n"
+// with the highest binary version it understands. An old server ignores the line
+// and keeps sending text. A new server answers "event:hello_ack,version:<m>\n"
+// (m = min of both versions) and sends binary frames from then on. A client that
+// never sees the ack keeps parsing text, so both old/new combinations interoperate.
+//
+// Hybrid transport (v2): a client that can take mouse motion over UDP appends
+// ",udp_port:<p>" to its hello. If the server agrees, its ack carries ",udp_token:<t>"
+// and from then on mouse moves and scrolls travel in UDP datagrams to that port:
+//
+//   u16 magic 'KV' | u32 token | u32 seq | binary frames...
+//
+// Datagrams that arrive with a sequence number at or below the newest one already
+// applied are stale and dropped. Keys, buttons and control events stay on TCP; before
+// any of them the server sends a UdpBarrier frame naming the last datagram sequence
+// number, so the client can let in-flight motion land before a click.
+//
+// Latency probes (v3): every so often the server follows an event with a LatencyProbe
+// frame. Once the client has injected everything up to the probe, it sends a
+// LatencyEcho back on the same TCP connection carrying the probe id and how long it
+// held the data (receive to SendInput). The server combines that with its own queueing
+// time and the round trip to estimate hook-to-SendInput latency without synchronised
+// clocks.
+//
+// Edge switching (v4): when the server cursor leaves through a screen edge that the
+// layout maps to a client, the server follows its ControlAcquire with CursorEnter
+// (which server edge was crossed, and where along it). The client puts its cursor at
+// the matching spot on its opposite edge. When the client cursor is pushed back out
+// through that edge, the client sends EdgeReturn and the server takes control back.
+//
+// Heartbeat (v5): the ack names ",heartbeat_ms:<interval>,heartbeat_timeout_ms:<t>".
+// The server sends a Heartbeat frame every interval and the client answers each one
+// with a HeartbeatAck carrying the same id, straight away. Either side that hears
+// nothing from its peer for the timeout treats the connection as dead; the server also
+// turns each answered heartbeat into a round-trip sample.
+//
+// Key state (v6): when control returns to a client that reconnected while it had it,
+// the server follows ControlAcquire with a KeySync frame: a 256-bit set of the virtual
+// keys its user is holding right now (bit n = vk n). The client presses the ones it
+// has not injected yet and releases any others it still holds, in one SendInput.
+// Independently of the version, a client remembers which keys it injected down, and on
+// ControlRelease or a lost connection releases exactly those.
+//
+// Wheel and extra buttons (v7): MouseHScroll carries the horizontal wheel, and
+// MouseDown/MouseUp may name the X1/X2 buttons. The server drops both for older
+// clients. Wheel deltas keep their full resolution (not rounded to 120), and the
+// server may sum consecutive ones into a single frame.
+//
+// Session resumption: every hello_ack also carries ",session:<token>". A client that
+// loses its connection reconnects and appends ",resume:<token>" to its hello; if the
+// server still remembers that session, the new connection takes over its identity
+// (and control, if it had it). Both parameters are optional and ignored by older builds.
+//
+// Display scale: the ack also names ",dpi:<n>", the server's system DPI (96 = 100%).
+// A client may scale relative motion by its own DPI over this one; missing means 96.
+//
+// Clipboard channel: if the ack carries ",clipboard_port:<p>", the client may open a
+// second TCP connection to that port and send "event:clipboard,version:<n>,session:<t>\n"
+// with its session token. Clipboard data then never queues behind input frames. Both
+// directions carry messages with a 9-byte header, "u8 kind | u32 arg | u32 length",
+// followed by length payload bytes (see ClipboardMessage). Changes on either side are
+// advertised as a format list; contents only move when the other side pastes.
+//
+// File channel: likewise, ",file_port:<p>" in the ack lets the client open a TCP
+// connection for file transfers, announced with "event:files,version:<n>,session:<t>\n".
+// Either side may then send a batch of files, each as a FileHeader followed directly by
+// the raw file contents (size bytes, unframed), and a BatchEnd after the last one:
+//
+//   FileHeader: u8 kind | u32 batch id | u64 size | u16 name length | UTF-8 file name
+//   BatchEnd:   u8 kind | u32 batch id | u32 file count
+//
+// Pairing: with a pairing key configured, the client appends ",auth_nonce:<hex>" (16
+// random bytes) to its hello. Instead of the ack, the server answers
+// "event:auth_challenge,nonce:<hex>,proof:<hex>\n" with a nonce of its own, and the
+// client replies "event:auth_response,proof:<hex>\n". Each proof is an HMAC-SHA256 of
+// both nonces under the key, so either side learns that the other knows the key
+// without it ever crossing the wire. A server that requires pairing answers a hello
+// without a nonce with "event:auth_required\n" and closes the connection.
+//
+// Once paired, both directions of the stream are encrypted records,
+// "u32 length | ciphertext | 16-byte tag" (AES-256-GCM; the nonce is a per-direction
+// record counter and the length is authenticated). The ack and everything after it
+// travel inside records. Motion datagrams keep their header in the clear, append a tag
+// and use their sequence number as the nonce. Every direction of every channel has a
+// key of its own, derived from both nonces, so no key is ever used on two connections.
+// Side channels of a paired session are encrypted the same way after their first line.
+//
+// Discovery uses the same line format over UDP, outside any connection. A client sends
+// "event:discover,version:<n>" to the probe port at the multicast group 239.255.65.34
+// on each interface, and on every broadcast address it has for servers that predate
+// the group. Over IPv6 the same probe goes to ff02::4b56:4d22 and ff05::4b56:4d22
+// (link- and site-local scope). Each server answers the sender directly with
+// "event:server_here,version:<n>,port:<tcp port>,host:<hostname>".
+//
+// This header is intentionally free of Windows dependencies.
+
+#pragma once
+
+#include <charconv>
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+// Highest binary protocol version this build speaks. 0 means "legacy text".
+constexpr int KVM_PROTOCOL_TEXT = 0;
+constexpr int KVM_PROTOCOL_VERSION = 7;
+
+// Large enough for any single binary frame or legacy text line we produce.
+constexpr size_t MAX_BINARY_FRAME_SIZE = 33; // KeySync; every other frame is at most 9
+constexpr size_t MAX_TEXT_FRAME_SIZE = 64;
+constexpr size_t MAX_HANDSHAKE_LINE_SIZE = 256; // hello, ack and pairing lines
+
+// Opcodes double as the event type. Values are part of the wire format: never reuse
+// or renumber them, only append.
+enum class EventType : uint8_t {
+    None           = 0x00,
+    KeyPress       = 0x01, // u16 vk_code
+    KeyRelease     = 0x02, // u16 vk_code
+    MouseMove      = 0x03, // i16 dx, i16 dy
+    MouseDown      = 0x04, // u8 button
+    MouseUp        = 0x05, // u8 button
+    MouseScroll    = 0x06, // i16 delta
+    ControlAcquire = 0x07, // (no payload)
+    ControlRelease = 0x08, // (no payload)
+    UdpBarrier     = 0x09, // u32 seq (v2, TCP only)
+    LatencyProbe   = 0x0A, // u32 probe id (v3, server -> client)
+    LatencyEcho    = 0x0B, // u32 probe id, u32 client hold time in us (v3, client -> server)
+    CursorEnter    = 0x0C, // u8 edge, u16 position (v4, server -> client)
+    EdgeReturn     = 0x0D, // u16 position (v4, client -> server)
+    Heartbeat      = 0x0E, // u32 heartbeat id (v5, server -> client)
+    HeartbeatAck   = 0x0F, // u32 heartbeat id (v5, client -> server)
+    KeySync        = 0x10, // u8[32] held keys, bit n of byte n/8 = vk n (v6, server -> client)
+    MouseHScroll   = 0x11, // i16 delta, positive = right (v7)
+};
+
+// Screen edges for edge switching. Positions along an edge are scaled to 0-65535.
+enum ScreenEdge : uint8_t { EDGE_LEFT = 0, EDGE_RIGHT = 1, EDGE_TOP = 2, EDGE_BOTTOM = 3 };
+
+inline uint8_t opposite_edge(uint8_t edge) {
+    switch (edge) {
+        case EDGE_LEFT:  return EDGE_RIGHT;
+        case EDGE_RIGHT: return EDGE_LEFT;
+        case EDGE_TOP:   return EDGE_BOTTOM;
+        default:         return EDGE_TOP;
+    }
+}
+
+// Button indices as carried on the wire (also the legacy text protocol order).
+// X1/X2 are binary only (v7); the text protocol has no name for them.
+enum MouseButton : uint8_t {
+    MOUSE_BUTTON_LEFT = 0, MOUSE_BUTTON_RIGHT = 1, MOUSE_BUTTON_MIDDLE = 2,
+    MOUSE_BUTTON_X1 = 3, MOUSE_BUTTON_X2 = 4,
+};
+
+inline bool is_wheel_event(EventType type) {
+    return type == EventType::MouseScroll || type == EventType::MouseHScroll;
+}
+
+// Set of held virtual-key codes, one bit per code, as kept by the server's hook and
+// the client's injector. Codes above 255 do not exist and are ignored.
+struct KeySet {
+    uint64_t words[4] = {};
+
+    void set(uint16_t vk, bool down) {
+        if (vk > 255) return;
+        uint64_t bit = uint64_t(1) << (vk & 63);
+        if (down) words[vk >> 6] |= bit;
+        else words[vk >> 6] &= ~bit;
+    }
+    bool test(uint16_t vk) const { return vk <= 255 && (words[vk >> 6] >> (vk & 63)) & 1; }
+    bool empty() const { return (words[0] | words[1] | words[2] | words[3]) == 0; }
+
+    // The keys in this set that are not in other.
+    KeySet without(const KeySet& other) const {
+        KeySet result;
+        for (int i = 0; i < 4; ++i) result.words[i] = words[i] & ~other.words[i];
+        return result;
+    }
+
+    // Calls fn(vk) for every key in the set, in ascending order.
+    template <typename Fn>
+    void for_each(Fn fn) const {
+        for (int i = 0; i < 4; ++i) {
+            for (uint64_t w = words[i]; w != 0; w &= w - 1) {
+                int bit = 0;
+                while (!((w >> bit) & 1)) ++bit;
+                fn(static_cast<uint16_t>(i * 64 + bit));
+            }
+        }
+    }
+};
+
+// Plain-old-data event passed between capture, transport and injection.
+struct InputEvent {
+    EventType type;
+    uint8_t button;   // MouseDown / MouseUp
+    uint16_t vk_code; // KeyPress / KeyRelease
+    int32_t dx;       // MouseMove
+    int32_t dy;       // MouseMove
+    int32_t delta;    // MouseScroll / MouseHScroll
+    uint32_t seq;     // UdpBarrier; probe id for LatencyProbe / LatencyEcho; Heartbeat(Ack) id
+    uint32_t elapsed_us; // LatencyEcho
+    uint8_t edge;        // CursorEnter
+    uint16_t position;   // CursorEnter / EdgeReturn
+    int64_t timestamp;   // QPC ticks at capture (server side only, never on the wire)
+};
+
+enum class DecodeStatus { Ok, NeedMore, Invalid };
+
+// --- Binary encoding ---
+
+// Returns the full frame size (opcode included) for an opcode, or 0 if unknown.
+inline size_t binary_frame_size(uint8_t opcode) {
+    switch (static_cast<EventType>(opcode)) {
+        case EventType::KeyPress:
+        case EventType::KeyRelease:     return 3;
+        case EventType::MouseMove:      return 5;
+        case EventType::MouseDown:
+        case EventType::MouseUp:        return 2;
+        case EventType::MouseScroll:
+        case EventType::MouseHScroll:   return 3;
+        case EventType::ControlAcquire:
+        case EventType::ControlRelease: return 1;
+        case EventType::UdpBarrier:
+        case EventType::LatencyProbe:
+        case EventType::Heartbeat:
+        case EventType::HeartbeatAck:   return 5;
+        case EventType::LatencyEcho:    return 9;
+        case EventType::CursorEnter:    return 4;
+        case EventType::EdgeReturn:     return 3;
+        case EventType::KeySync:        return 33;
+        default:                        return 0;
+    }
+}
+
+inline void put_u16_le(uint8_t* out, uint16_t v) {
+    out[0] = static_cast<uint8_t>(v & 0xFF);
+    out[1] = static_cast<uint8_t>(v >> 8);
+}
+
+inline uint16_t get_u16_le(const uint8_t* in) {
+    return static_cast<uint16_t>(in[0] | (in[1] << 8));
+}
+
+inline void put_u32_le(uint8_t* out, uint32_t v) {
+    out[0] = static_cast<uint8_t>(v & 0xFF);
+    out[1] = static_cast<uint8_t>((v >> 8) & 0xFF);
+    out[2] = static_cast<uint8_t>((v >> 16) & 0xFF);
+    out[3] = static_cast<uint8_t>(v >> 24);
+}
+
+inline uint32_t get_u32_le(const uint8_t* in) {
+    return static_cast<uint32_t>(in[0]) | (static_cast<uint32_t>(in[1]) << 8) |
+           (static_cast<uint32_t>(in[2]) << 16) | (static_cast<uint32_t>(in[3]) << 24);
+}
+
+inline void put_u64_le(uint8_t* out, uint64_t v) {
+    put_u32_le(out, static_cast<uint32_t>(v));
+    put_u32_le(out + 4, static_cast<uint32_t>(v >> 32));
+}
+
+inline uint64_t get_u64_le(const uint8_t* in) {
+    return static_cast<uint64_t>(get_u32_le(in)) | (static_cast<uint64_t>(get_u32_le(in + 4)) << 32);
+}
+
+inline int16_t clamp_i16(int32_t v) {
+    if (v > INT16_MAX) return INT16_MAX;
+    if (v < INT16_MIN) return INT16_MIN;
+    return static_cast<int16_t>(v);
+}
+
+// Writes one binary frame into out (at least MAX_BINARY_FRAME_SIZE bytes) and returns
+// its length, or 0 for an event that has no binary form. Motion and wheel values are
+// clamped to 16 bits. KeySync carries a KeySet, so it has encode_key_sync instead.
+inline size_t encode_binary_frame(const InputEvent& ev, uint8_t* out) {
+    out[0] = static_cast<uint8_t>(ev.type);
+    switch (ev.type) {
+        case EventType::KeyPress:
+        case EventType::KeyRelease:
+            put_u16_le(out + 1, ev.vk_code);
+            return 3;
+        case EventType::MouseMove:
+            put_u16_le(out + 1, static_cast<uint16_t>(clamp_i16(ev.dx)));
+            put_u16_le(out + 3, static_cast<uint16_t>(clamp_i16(ev.dy)));
+            return 5;
+        case EventType::MouseDown:
+        case EventType::MouseUp:
+            out[1] = ev.button;
+            return 2;
+        case EventType::MouseScroll:
+        case EventType::MouseHScroll:
+            put_u16_le(out + 1, static_cast<uint16_t>(clamp_i16(ev.delta)));
+            return 3;
+        case EventType::ControlAcquire:
+        case EventType::ControlRelease:
+            return 1;
+        case EventType::UdpBarrier:
+        case EventType::LatencyProbe:
+        case EventType::Heartbeat:
+        case EventType::HeartbeatAck:
+            put_u32_le(out + 1, ev.seq);
+            return 5;
+        case EventType::LatencyEcho:
+            put_u32_le(out + 1, ev.seq);
+            put_u32_le(out + 5, ev.elapsed_us);
+            return 9;
+        case EventType::CursorEnter:
+            out[1] = ev.edge;
+            put_u16_le(out + 2, ev.position);
+            return 4;
+        case EventType::EdgeReturn:
+            put_u16_le(out + 1, ev.position);
+            return 3;
+        default:
+            return 0;
+    }
+}
+
+// Decodes the frame at the start of data. On Ok, consumed holds the frame length.
+// NeedMore means the frame is incomplete; Invalid means an unknown opcode, after
+// which the stream cannot be resynchronised. For KeySync only the type is set; read
+// the keys from the same bytes with decode_key_sync.
+inline DecodeStatus decode_binary_frame(const uint8_t* data, size_t len, InputEvent& ev, size_t& consumed) {
+    if (len == 0) return DecodeStatus::NeedMore;
+    size_t frame_size = binary_frame_size(data[0]);
+    if (frame_size == 0) return DecodeStatus::Invalid;
+    if (len < frame_size) return DecodeStatus::NeedMore;
+
+    ev = {};
+    ev.type = static_cast<EventType>(data[0]);
+    switch (ev.type) {
+        case EventType::KeyPress:
+        case EventType::KeyRelease:
+            ev.vk_code = get_u16_le(data + 1);
+            break;
+        case EventType::MouseMove:
+            ev.dx = static_cast<int16_t>(get_u16_le(data + 1));
+            ev.dy = static_cast<int16_t>(get_u16_le(data + 3));
+            break;
+        case EventType::MouseDown:
+        case EventType::MouseUp:
+            ev.button = data[1];
+            break;
+        case EventType::MouseScroll:
+        case EventType::MouseHScroll:
+            ev.delta = static_cast<int16_t>(get_u16_le(data + 1));
+            break;
+        case EventType::UdpBarrier:
+        case EventType::LatencyProbe:
+        case EventType::Heartbeat:
+        case EventType::HeartbeatAck:
+            ev.seq = get_u32_le(data + 1);
+            break;
+        case EventType::LatencyEcho:
+            ev.seq = get_u32_le(data + 1);
+            ev.elapsed_us = get_u32_le(data + 5);
+            break;
+        case EventType::CursorEnter:
+            ev.edge = data[1];
+            ev.position = get_u16_le(data + 2);
+            break;
+        case EventType::EdgeReturn:
+            ev.position = get_u16_le(data + 1);
+            break;
+        default:
+            break;
+    }
+    consumed = frame_size;
+    return DecodeStatus::Ok;
+}
+
+// Writes a KeySync frame for keys into out and returns its length.
+inline size_t encode_key_sync(const KeySet& keys, uint8_t* out) {
+    out[0] = static_cast<uint8_t>(EventType::KeySync);
+    for (int i = 0; i < 4; ++i) put_u64_le(out + 1 + i * 8, keys.words[i]);
+    return 33;
+}
+
+// frame points at a complete KeySync frame (opcode included).
+inline KeySet decode_key_sync(const uint8_t* frame) {
+    KeySet keys;
+    for (int i = 0; i < 4; ++i) keys.words[i] = get_u64_le(frame + 1 + i * 8);
+    return keys;
+}
+
+// --- UDP datagrams (hybrid transport) ---
+
+constexpr uint16_t UDP_DATAGRAM_MAGIC = 0x564B; // "KV" on the wire
+constexpr size_t UDP_HEADER_SIZE = 10;
+constexpr size_t MAX_UDP_DATAGRAM_SIZE = 1200;  // Stays below typical path MTUs
+
+inline void encode_udp_header(uint8_t* out, uint32_t token, uint32_t seq) {
+    put_u16_le(out, UDP_DATAGRAM_MAGIC);
+    put_u32_le(out + 2, token);
+    put_u32_le(out + 6, seq);
+}
+
+inline bool decode_udp_header(const uint8_t* data, size_t len, uint32_t& token, uint32_t& seq) {
+    if (len < UDP_HEADER_SIZE || get_u16_le(data) != UDP_DATAGRAM_MAGIC) return false;
+    token = get_u32_le(data + 2);
+    seq = get_u32_le(data + 6);
+    return true;
+}
+
+// Sequence comparison that survives 32-bit wrap-around.
+inline bool seq_newer(uint32_t a, uint32_t b) {
+    return static_cast<int32_t>(a - b) > 0;
+}
+
+// --- Legacy text encoding ---
+
+inline const char* mouse_button_name(uint8_t button) {
+    switch (button) {
+        case MOUSE_BUTTON_LEFT:  return "left";
+        case MOUSE_BUTTON_RIGHT: return "right";
+        default:                 return "middle";
+    }
+}
+
+// Writes the legacy "event:...\n" line for ev into out and returns its length
+// (0 if the event has no text form).
+inline size_t encode_text_frame(const InputEvent& ev, char* out, size_t capacity) {
+    int n = 0;
+    switch (ev.type) {
+        case EventType::KeyPress:       n = snprintf(out, capacity, "event:key_press,vk_code:%u\n", (unsigned)ev.vk_code); break;
+        case EventType::KeyRelease:     n = snprintf(out, capacity, "event:key_release,vk_code:%u\n", (unsigned)ev.vk_code); break;
+        case EventType::MouseMove:      n = snprintf(out, capacity, "event:mouse_move,dx:%d,dy:%d\n", (int)ev.dx, (int)ev.dy); break;
+        case EventType::MouseDown:      n = snprintf(out, capacity, "event:mouse_down,button:%s\n", mouse_button_name(ev.button)); break;
+        case EventType::MouseUp:        n = snprintf(out, capacity, "event:mouse_up,button:%s\n", mouse_button_name(ev.button)); break;
+        case EventType::MouseScroll:    n = snprintf(out, capacity, "event:mouse_scroll,delta:%d\n", (int)ev.delta); break;
+        case EventType::ControlAcquire: n = snprintf(out, capacity, "event:control_acquire\n"); break;
+        case EventType::ControlRelease: n = snprintf(out, capacity, "event:control_release\n"); break;
+        default: return 0;
+    }
+    return (n > 0 && (size_t)n < capacity) ? (size_t)n : 0;
+}
+
+// Event names of the text protocol, with the number of ",key:value" parameters each one
+// needs. Parameters are read by position, as the original parser did; the keys are
+// not checked.
+struct TextEventSpec {
+    std::string_view name;
+    EventType type;
+    uint8_t param_count;
+};
+
+constexpr TextEventSpec TEXT_EVENT_TABLE[] = {
+    { "mouse_move",      EventType::MouseMove,      2 },
+    { "key_press",       EventType::KeyPress,       1 },
+    { "key_release",     EventType::KeyRelease,     1 },
+    { "mouse_down",      EventType::MouseDown,      1 },
+    { "mouse_up",        EventType::MouseUp,        1 },
+    { "mouse_scroll",    EventType::MouseScroll,    1 },
+    { "control_acquire", EventType::ControlAcquire, 0 },
+    { "control_release", EventType::ControlRelease, 0 },
+};
+
+// Parses a signed decimal at the start of text. Trailing characters (e.g. '\r') are
+// ignored, matching std::stoi.
+inline bool parse_text_int(std::string_view text, int32_t& value) {
+    const char* first = text.data();
+    const char* last = first + text.size();
+    if (first != last && *first == '+') ++first;
+    auto result = std::from_chars(first, last, value);
+    return result.ec == std::errc() && result.ptr != first;
+}
+
+inline uint8_t parse_text_button(std::string_view name) {
+    if (name == "left") return MOUSE_BUTTON_LEFT;
+    if (name == "right") return MOUSE_BUTTON_RIGHT;
+    return MOUSE_BUTTON_MIDDLE;
+}
+
+// Decodes one legacy text line (without the trailing newline) into ev. Text before
+// "event:" is skipped. Returns Invalid for an unknown event name, missing parameters
+// or a malformed number. Never allocates or throws.
+inline DecodeStatus decode_text_frame(std::string_view line, InputEvent& ev) {
+    size_t pos = line.find("event:");
+    if (pos == std::string_view::npos) return DecodeStatus::Invalid;
+    std::string_view rest = line.substr(pos + 6);
+
+    size_t name_end = rest.find(',');
+    std::string_view name = rest.substr(0, name_end);
+    const TextEventSpec* spec = nullptr;
+    for (const TextEventSpec& entry : TEXT_EVENT_TABLE) {
+        if (entry.name == name) { spec = &entry; break; }
+    }
+    if (!spec) return DecodeStatus::Invalid;
+
+    std::string_view values[2];
+    size_t found = 0;
+    while (found < spec->param_count && name_end != std::string_view::npos) {
+        rest = rest.substr(name_end + 1);
+        size_t colon = rest.find(':');
+        if (colon == std::string_view::npos) break;
+        name_end = rest.find(',', colon);
+        values[found++] = rest.substr(colon + 1, name_end == std::string_view::npos ? std::string_view::npos : name_end - colon - 1);
+    }
+    if (found < spec->param_count) return DecodeStatus::Invalid;
+
+    ev = {};
+    ev.type = spec->type;
+    int32_t number = 0;
+    switch (spec->type) {
+        case EventType::KeyPress:
+        case EventType::KeyRelease:
+            if (!parse_text_int(values[0], number)) return DecodeStatus::Invalid;
+            ev.vk_code = static_cast<uint16_t>(number);
+            break;
+        case EventType::MouseMove:
+            if (!parse_text_int(values[0], ev.dx) || !parse_text_int(values[1], ev.dy)) return DecodeStatus::Invalid;
+            break;
+        case EventType::MouseDown:
+        case EventType::MouseUp:
+            ev.button = parse_text_button(values[0]);
+            break;
+        case EventType::MouseScroll:
+            if (!parse_text_int(values[0], ev.delta)) return DecodeStatus::Invalid;
+            break;
+        default:
+            break;
+    }
+    return DecodeStatus::Ok;
+}
+
+// --- Handshake ---
+
+// Builds "event:<name>,version:<n>\n", e.g. the client "hello" or server "hello_ack".
+inline std::string make_handshake_line(const char* name, int version) {
+    return "event:" + std::string(name) + ",version:" + std::to_string(version) + "\n";
+}
+
+// Parses an unsigned decimal that ends at ',' '\r' or the end of text.
+inline bool parse_handshake_number(std::string_view text, uint32_t& value) {
+    uint64_t result = 0;
+    size_t i = 0;
+    for (; i < text.size() && text[i] != ',' && text[i] != '\r'; ++i) {
+        char c = text[i];
+        if (c < '0' || c > '9') return false;
+        result = result * 10 + (c - '0');
+        if (result > 0xFFFFFFFFull) return false;
+    }
+    if (i == 0) return false;
+    value = static_cast<uint32_t>(result);
+    return true;
+}
+
+// Parses a handshake line (without the trailing newline). Returns false if the line
+// is not the named handshake message. Extra ",key:value" parameters after the version
+// are allowed; read them with find_handshake_param.
+inline bool parse_handshake_line(std::string_view line, const char* name, int& version) {
+    std::string prefix = "event:" + std::string(name) + ",version:";
+    if (line.size() <= prefix.size() || line.compare(0, prefix.size(), prefix) != 0) return false;
+    uint32_t value = 0;
+    if (!parse_handshake_number(line.substr(prefix.size()), value) || value > 0xFFFF) return false;
+    version = static_cast<int>(value);
+    return true;
+}
+
+// Looks up an optional ",key:<number>" parameter in a handshake line.
+inline bool find_handshake_param(std::string_view line, const char* key, uint32_t& value) {
+    std::string needle = "," + std::string(key) + ":";
+    size_t pos = line.find(needle);
+    if (pos == std::string_view::npos) return false;
+    return parse_handshake_number(line.substr(pos + needle.size()), value);
+}
+
+// Looks up an optional ",key:<text>" parameter (up to the next ',' or '\r'). Used for
+// the host name in discovery replies, which therefore must not contain a comma.
+inline bool find_handshake_text(std::string_view line, const char* key, std::string_view& value) {
+    std::string needle = "," + std::string(key) + ":";
+    size_t pos = line.find(needle);
+    if (pos == std::string_view::npos) return false;
+    std::string_view rest = line.substr(pos + needle.size());
+    value = rest.substr(0, rest.find_first_of(",\r"));
+    return true;
+}
+
+// True if line is the named handshake message, with or without parameters.
+inline bool is_handshake_message(std::string_view line, const char* name) {
+    std::string prefix = "event:" + std::string(name);
+    return line.compare(0, prefix.size(), prefix) == 0 && (line.size() == prefix.size() || line[prefix.size()] == ',');
+}
+
+inline std::string encode_hex(const uint8_t* data, size_t length) {
+    static const char digits[] = "0123456789abcdef";
+    std::string text(length * 2, '0');
+    for (size_t i = 0; i < length; ++i) {
+        text[i * 2] = digits[data[i] >> 4];
+        text[i * 2 + 1] = digits[data[i] & 0x0F];
+    }
+    return text;
+}
+
+// Decodes exactly length bytes from 2 * length hex digits.
+inline bool decode_hex(std::string_view text, uint8_t* out, size_t length) {
+    if (text.size() != length * 2) return false;
+    for (size_t i = 0; i < text.size(); ++i) {
+        char c = text[i];
+        int value = (c >= '0' && c <= '9') ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10 : (c >= 'A' && c <= 'F') ? c - 'A' + 10 : -1;
+        if (value < 0) return false;
+        if (i % 2 == 0) out[i / 2] = static_cast<uint8_t>(value << 4);
+        else out[i / 2] |= static_cast<uint8_t>(value);
+    }
+    return true;
+}
+
+// --- Clipboard channel ---
+
+enum class ClipboardMessage : uint8_t {
+    Formats   = 1, // arg 0; payload: u32 clipboard format ids the sender now offers
+    Request   = 2, // arg request id; payload: u32 format
+    DataBegin = 3, // arg request id; payload: u8 codec, u32 original size, u32 encoded size
+    DataChunk = 4, // arg request id; payload: the next piece of the encoded data
+    DataError = 5, // arg request id; the sender cannot provide the format
+};
+
+enum ClipboardCodec : uint8_t { CLIPBOARD_CODEC_NONE = 0, CLIPBOARD_CODEC_XPRESS_HUFF = 1 };
+
+constexpr size_t CLIPBOARD_HEADER_SIZE = 9;
+constexpr size_t CLIPBOARD_CHUNK_SIZE = 64 * 1024;            // Largest payload in one message
+constexpr uint32_t MAX_CLIPBOARD_DATA_SIZE = 64 * 1024 * 1024; // Larger contents are not offered
+
+inline void encode_clipboard_header(uint8_t* out, ClipboardMessage kind, uint32_t arg, uint32_t length) {
+    out[0] = static_cast<uint8_t>(kind);
+    put_u32_le(out + 1, arg);
+    put_u32_le(out + 5, length);
+}
+
+// Returns false for an unknown kind or a payload longer than CLIPBOARD_CHUNK_SIZE,
+// either of which means the stream can no longer be trusted.
+inline bool decode_clipboard_header(const uint8_t* in, ClipboardMessage& kind, uint32_t& arg, uint32_t& length) {
+    if (in[0] < static_cast<uint8_t>(ClipboardMessage::Formats) || in[0] > static_cast<uint8_t>(ClipboardMessage::DataError)) return false;
+    kind = static_cast<ClipboardMessage>(in[0]);
+    arg = get_u32_le(in + 1);
+    length = get_u32_le(in + 5);
+    return length <= CLIPBOARD_CHUNK_SIZE;
+}
+
+// --- File channel ---
+
+enum class FileMessage : uint8_t {
+    FileHeader = 1,
+    BatchEnd   = 2,
+};
+
+constexpr size_t FILE_HEADER_SIZE = 15;      // Without the name
+constexpr size_t FILE_BATCH_END_SIZE = 9;
+constexpr size_t MAX_FILE_NAME_BYTES = 1024;
+
+inline void encode_file_header(uint8_t* out, uint32_t batch_id, uint64_t size, uint16_t name_length) {
+    out[0] = static_cast<uint8_t>(FileMessage::FileHeader);
+    put_u32_le(out + 1, batch_id);
+    put_u64_le(out + 5, size);
+    put_u16_le(out + 13, name_length);
+}
+
+inline void encode_file_batch_end(uint8_t* out, uint32_t batch_id, uint32_t file_count) {
+    out[0] = static_cast<uint8_t>(FileMessage::BatchEnd);
+    put_u32_le(out + 1, batch_id);
+    put_u32_le(out + 5, file_count);
+}
+
+// --- Encrypted records ---
+
+constexpr size_t PAIRING_NONCE_SIZE = 16;
+constexpr size_t PAIRING_PROOF_SIZE = 32;
+constexpr size_t RECORD_HEADER_SIZE = 4; // u32 payload length
+constexpr size_t RECORD_TAG_SIZE = 16;
+constexpr size_t RECORD_OVERHEAD = RECORD_HEADER_SIZE + RECORD_TAG_SIZE;
+constexpr size_t RECORD_NONCE_SIZE = 12;
+constexpr size_t MAX_RECORD_PAYLOAD = 16384;      // Longer data is split across records
+constexpr size_t MAX_CLIENT_RECORD_PAYLOAD = 256; // Client -> server on the KVM stream (echoes, acks)
+
+// 96-bit AES-GCM nonce: four zero bytes, then the record counter or datagram sequence.
+inline void make_record_nonce(uint64_t counter, uint8_t* out) {
+    put_u32_le(out, 0);
+    put_u64_le(out + 4, counter);
+}
+
+// Checks the record at the front of a stream. NeedMore until all of it is buffered;
+// Invalid if it claims more than max_payload bytes, which only a corrupt or hostile
+// stream does.
+inline DecodeStatus decode_record_header(const uint8_t* in, size_t available, size_t max_payload, uint32_t& payload_length) {
+    if (available < RECORD_HEADER_SIZE) return DecodeStatus::NeedMore;
+    payload_length = get_u32_le(in);
+    if (payload_length > max_payload) return DecodeStatus::Invalid;
+    return available < RECORD_OVERHEAD + payload_length ? DecodeStatus::NeedMore : DecodeStatus::Ok;
+}
\ No newline at end of file
@@ -0,0 +1,361 @@
+// kvm_replay.cpp
+// Replays input traces through the whole input path without touching real devices. A
+// hook thread pushes each event into the SpscRing, as low_level_mouse_proc does; a
+// sender thread drains it, encodes frames and writes them to a loopback TCP socket,
+// as run_event_sender does; and the main thread receives into a FrameBuffer and
+// decodes, as the client does right before SendInput. Each trace runs twice: flooded,
+// for throughput, and paced at its own timing, for latency. Reported per run: events/s,
+// wire bytes per event, heap allocations per event (all threads, counted by a global
+// operator new) and hook-to-decode latency percentiles.
+//
+// How to compile:
+// g++ -std=c++17 -O2 -pthread kvm_replay.cpp -o kvm_replay          (Linux, macOS)
+// g++ -std=c++17 -O2 kvm_replay.cpp -o kvm_replay.exe -lws2_32     (MinGW)
+//
+// Usage: kvm_replay [--text] [--repeat N] [trace files...]
+// --text replays over the legacy text protocol instead of binary frames. --repeat sets
+// how many times a flooded run loops over its trace (default 50). Without trace files
+// the built-in synthetic traces run. A trace file holds one event per line: its offset
+// in microseconds from the start, a space, and the event as a text frame, for example
+// "125 event:mouse_move,dx:3,dy:-1". Lines starting with '#' are skipped.
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+typedef SOCKET socket_t;
+#define close_socket closesocket
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+typedef int socket_t;
+#define INVALID_SOCKET (-1)
+#define close_socket close
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+#include "kvm_buffer.hpp"
+#include "kvm_protocol.hpp"
+#include "kvm_ring.hpp"
+
+// --- Allocation counting ---
+static std::atomic<uint64_t> g_allocations(0);
+
+void* operator new(size_t size) {
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete" // GCC cannot see that new above is malloc
+#endif
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+
+// --- Traces ---
+struct TraceEvent {
+    int64_t offset_us; // From the start of the trace
+    InputEvent ev;
+};
+
+struct Trace {
+    std::string name;
+    std::vector<TraceEvent> events;
+};
+
+static InputEvent make_event(EventType type) {
+    InputEvent ev = {};
+    ev.type = type;
+    return ev;
+}
+
+// One second of an 8 kHz gaming mouse: a move every 125 us, never two alike in a row.
+static Trace make_mouse_8khz() {
+    Trace trace;
+    trace.name = "mouse 8 kHz";
+    for (int i = 0; i < 8000; ++i) {
+        InputEvent ev = make_event(EventType::MouseMove);
+        ev.dx = (i % 7) - 3;
+        ev.dy = (i % 5) - 2;
+        trace.events.push_back({ i * 125LL, ev });
+    }
+    return trace;
+}
+
+// A fast typist's burst: 200 keys, one every 4 ms, each held for 2 ms.
+static Trace make_typing_burst() {
+    Trace trace;
+    trace.name = "typing burst";
+    for (int i = 0; i < 200; ++i) {
+        InputEvent press = make_event(EventType::KeyPress);
+        press.vk_code = (uint16_t)(0x41 + i % 26);
+        InputEvent release = press;
+        release.type = EventType::KeyRelease;
+        trace.events.push_back({ i * 4000LL, press });
+        trace.events.push_back({ i * 4000LL + 2000, release });
+    }
+    return trace;
+}
+
+// One second of desktop use: a 1 kHz mouse with a click every 250 ms and a wheel
+// notch every 100 ms.
+static Trace make_desktop_mix() {
+    Trace trace;
+    trace.name = "desktop mix";
+    for (int i = 0; i < 1000; ++i) {
+        int64_t t = i * 1000LL;
+        InputEvent move = make_event(EventType::MouseMove);
+        move.dx = (i % 11) - 5;
+        move.dy = (i % 3) - 1;
+        trace.events.push_back({ t, move });
+        if (i % 250 == 100) {
+            InputEvent down = make_event(EventType::MouseDown);
+            down.button = MOUSE_BUTTON_LEFT;
+            InputEvent up = down;
+            up.type = EventType::MouseUp;
+            trace.events.push_back({ t + 300, down });
+            trace.events.push_back({ t + 900, up });
+        } else if (i % 100 == 50) {
+            InputEvent wheel = make_event(EventType::MouseScroll);
+            wheel.delta = -120;
+            trace.events.push_back({ t + 500, wheel });
+        }
+    }
+    return trace;
+}
+
+static bool load_trace(const char* path, Trace& trace) {
+    std::ifstream file(path);
+    if (!file) {
+        fprintf(stderr, "Cannot open %s\n", path);
+        return false;
+    }
+    trace.name = path;
+    std::string line;
+    int line_number = 0;
+    while (std::getline(file, line)) {
+        ++line_number;
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.empty() || line[0] == '#') continue;
+        size_t space = line.find(' ');
+        TraceEvent te;
+        if (space == std::string::npos ||
+            decode_text_frame(std::string_view(line).substr(space + 1), te.ev) != DecodeStatus::Ok) {
+            fprintf(stderr, "%s:%d: not a trace event\n", path, line_number);
+            return false;
+        }
+        te.offset_us = strtoll(line.c_str(), nullptr, 10);
+        trace.events.push_back(te);
+    }
+    if (trace.events.empty()) {
+        fprintf(stderr, "%s has no events\n", path);
+        return false;
+    }
+    return true;
+}
+
+// --- Pipeline ---
+static int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// A connected pair of loopback TCP sockets, Nagle off on the sending end as the server does.
+static bool open_loopback_pair(socket_t& sender, socket_t& receiver) {
+    socket_t listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addr_len = sizeof(addr);
+    sender = receiver = INVALID_SOCKET;
+    if (listener == INVALID_SOCKET || bind(listener, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(listener, 1) != 0 ||
+        getsockname(listener, (sockaddr*)&addr, &addr_len) != 0) {
+        if (listener != INVALID_SOCKET) close_socket(listener);
+        return false;
+    }
+    sender = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (sender != INVALID_SOCKET && connect(sender, (sockaddr*)&addr, sizeof(addr)) == 0) receiver = accept(listener, nullptr, nullptr);
+    close_socket(listener);
+    if (receiver == INVALID_SOCKET) {
+        if (sender != INVALID_SOCKET) close_socket(sender);
+        return false;
+    }
+    int one = 1;
+    setsockopt(sender, IPPROTO_TCP, TCP_NODELAY, (const char*)&one, sizeof(one));
+    return true;
+}
+
+static bool send_all(socket_t sock, const uint8_t* data, size_t len) {
+    while (len > 0) {
+        int sent = (int)send(sock, (const char*)data, (int)len, 0);
+        if (sent <= 0) return false;
+        data += sent;
+        len -= sent;
+    }
+    return true;
+}
+
+// Waits until the trace offset is due; sleeps only when it is far off, since sleeps
+// overshoot by up to a scheduler tick.
+static void wait_until(int64_t deadline_ns) {
+    for (int64_t now = now_ns(); now < deadline_ns; now = now_ns()) {
+        if (deadline_ns - now > 2000000) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        else std::this_thread::yield();
+    }
+}
+
+static std::string format_ns(int64_t ns) {
+    char text[32];
+    if (ns < 1000000) snprintf(text, sizeof(text), "%.1f us", ns / 1000.0);
+    else snprintf(text, sizeof(text), "%.2f ms", ns / 1000000.0);
+    return text;
+}
+
+constexpr size_t SENDER_BATCH_EVENTS = 64; // Most the sender drains into one send()
+
+static SpscRing<InputEvent, 4096> g_ring;
+static FrameBuffer<32768> g_receive_buffer;
+
+static bool run_pipeline(const Trace& trace, size_t repeat, bool paced, bool text) {
+    socket_t send_sock, recv_sock;
+    if (!open_loopback_pair(send_sock, recv_sock)) {
+        fprintf(stderr, "Cannot open a loopback connection\n");
+        return false;
+    }
+    const size_t total = trace.events.size() * repeat;
+    std::unique_ptr<std::atomic<int64_t>[]> taken(new std::atomic<int64_t>[total]); // Hook time of event i
+    std::vector<int64_t> latencies(total);
+    std::atomic<bool> go(false), hook_done(false);
+    uint64_t bytes_sent = 0, ring_stalls = 0;
+    int64_t start = 0;
+
+    std::thread hook([&]() {
+        while (!go.load(std::memory_order_acquire)) std::this_thread::yield();
+        size_t index = 0;
+        for (size_t pass = 0; pass < repeat; ++pass) {
+            for (const TraceEvent& te : trace.events) {
+                if (paced) wait_until(start + te.offset_us * 1000);
+                taken[index++].store(now_ns(), std::memory_order_release);
+                while (!g_ring.try_push(te.ev)) {
+                    ++ring_stalls; // The app drops here; the harness waits so every event arrives
+                    std::this_thread::yield();
+                }
+            }
+        }
+        hook_done.store(true, std::memory_order_release);
+    });
+
+    std::thread sender([&]() {
+        uint8_t batch[SENDER_BATCH_EVENTS * MAX_TEXT_FRAME_SIZE];
+        while (!go.load(std::memory_order_acquire)) std::this_thread::yield();
+        for (;;) {
+            bool done = hook_done.load(std::memory_order_acquire);
+            size_t len = 0;
+            InputEvent ev;
+            for (size_t n = 0; n < SENDER_BATCH_EVENTS && g_ring.try_pop(ev); ++n) {
+                len += text ? encode_text_frame(ev, (char*)batch + len, sizeof(batch) - len) : encode_binary_frame(ev, batch + len);
+            }
+            if (len > 0) {
+                if (!send_all(send_sock, batch, len)) break;
+                bytes_sent += len;
+            } else if (done) {
+                break;
+            } else {
+                std::this_thread::yield();
+            }
+        }
+        shutdown(send_sock, 1); // SHUT_WR / SD_SEND
+    });
+
+    g_receive_buffer.clear();
+    uint64_t allocations_before = g_allocations.load();
+    start = now_ns();
+    go.store(true, std::memory_order_release);
+
+    size_t received = 0;
+    uint64_t checksum = 0; // Stands in for SendInput, so the decode cannot be optimised away
+    while (received < total) {
+        uint8_t* write_ptr = g_receive_buffer.write_ptr(); // Compacts, so before write_space()
+        int bytes = (int)recv(recv_sock, (char*)write_ptr, (int)g_receive_buffer.write_space(), 0);
+        if (bytes <= 0) break;
+        g_receive_buffer.commit(bytes);
+        InputEvent ev;
+        for (;;) {
+            if (text) {
+                std::string_view line;
+                if (!g_receive_buffer.next_line(line) || decode_text_frame(line, ev) != DecodeStatus::Ok) break;
+            } else {
+                size_t consumed = 0;
+                if (decode_binary_frame(g_receive_buffer.data(), g_receive_buffer.size(), ev, consumed) != DecodeStatus::Ok) break;
+                g_receive_buffer.consume(consumed);
+            }
+            if (received == total) break;
+            latencies[received] = now_ns() - taken[received].load(std::memory_order_acquire);
+            checksum += (uint64_t)ev.type + (uint32_t)ev.dx + ev.vk_code;
+            ++received;
+        }
+    }
+    int64_t elapsed = now_ns() - start;
+    hook.join();
+    sender.join();
+    uint64_t allocations = g_allocations.load() - allocations_before;
+    close_socket(send_sock);
+    close_socket(recv_sock);
+
+    if (received != total) {
+        fprintf(stderr, "%s: only %zu of %zu events arrived\n", trace.name.c_str(), received, total);
+        return false;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&](size_t per_mille) { return latencies[(std::min)(total - 1, total * per_mille / 1000)]; };
+    printf("%-14s %-6s %-6s %8zu ev %11.0f ev/s %5.2f B/ev %6.3f alloc/ev  p50 %s, p99 %s, p99.9 %s, max %s  (ring stalls %llu, checksum %llu)\n",
+           trace.name.c_str(), text ? "text" : "binary", paced ? "paced" : "flood", total, total / (elapsed / 1e9),
+           (double)bytes_sent / total, (double)allocations / total, format_ns(percentile(500)).c_str(), format_ns(percentile(990)).c_str(),
+           format_ns(percentile(999)).c_str(), format_ns(latencies.back()).c_str(), (unsigned long long)ring_stalls,
+           (unsigned long long)checksum);
+    return true;
+}
+
+int main(int argc, char** argv) {
+    bool text = false;
+    size_t repeat = 50;
+    std::vector<Trace> traces;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--text") == 0) {
+            text = true;
+        } else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) {
+            repeat = (std::max)(1ul, strtoul(argv[++i], nullptr, 10));
+        } else {
+            Trace trace;
+            if (!load_trace(argv[i], trace)) return 1;
+            traces.push_back(std::move(trace));
+        }
+    }
+    if (traces.empty()) traces = { make_mouse_8khz(), make_typing_burst(), make_desktop_mix() };
+
+#ifdef _WIN32
+    WSADATA wsa_data;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0) return 1;
+#endif
+    bool ok = true;
+    for (const Trace& trace : traces) {
+        ok = run_pipeline(trace, repeat, false, text) && ok;
+        ok = run_pipeline(trace, 1, true, text) && ok;
+    }
+#ifdef _WIN32
+    WSACleanup();
+#endif
+    return ok ? 0 : 1;
+}
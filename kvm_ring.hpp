@@ -0,0 +1,128 @@
+// kvm_ring.hpp
+// Fixed-capacity, lock-free ring buffers.
+//
+// All storage is preallocated, so try_push never allocates or blocks, which makes it
+// safe to call from a low-level input hook. SpscRing allows exactly one pushing and
+// one (other) popping thread; MpscRing allows any number of pushing threads and one
+// popping thread.
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+template <typename T, size_t Capacity>
+class SpscRing {
+    static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+public:
+    // Producer side. Returns false (and drops the item) when the ring is full.
+    bool try_push(const T& item) {
+        size_t head = head_.load(std::memory_order_relaxed);
+        if (head - cached_tail_ == Capacity) {
+            cached_tail_ = tail_.load(std::memory_order_acquire);
+            if (head - cached_tail_ == Capacity) return false;
+        }
+        items_[head & (Capacity - 1)] = item;
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side. Returns false when the ring is empty.
+    bool try_pop(T& item) {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail == cached_head_) {
+            cached_head_ = head_.load(std::memory_order_acquire);
+            if (tail == cached_head_) return false;
+        }
+        item = items_[tail & (Capacity - 1)];
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side. Returns the oldest item without removing it, or nullptr when empty.
+    // The pointer stays valid until the next try_pop.
+    const T* front() {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail == cached_head_) {
+            cached_head_ = head_.load(std::memory_order_acquire);
+            if (tail == cached_head_) return nullptr;
+        }
+        return &items_[tail & (Capacity - 1)];
+    }
+
+    // Approximate number of queued items; exact when called from either endpoint
+    // while the other one is idle.
+    size_t size() const {
+        size_t tail = tail_.load(std::memory_order_acquire);
+        size_t head = head_.load(std::memory_order_acquire);
+        return head - tail;
+    }
+
+    bool empty() const { return size() == 0; }
+
+    static constexpr size_t capacity() { return Capacity; }
+
+private:
+    // Producer and consumer indices live on separate cache lines to avoid false sharing.
+    alignas(64) std::atomic<size_t> head_{0};
+    size_t cached_tail_ = 0; // Producer's last view of tail_
+    alignas(64) std::atomic<size_t> tail_{0};
+    size_t cached_head_ = 0; // Consumer's last view of head_
+    alignas(64) T items_[Capacity];
+};
+
+template <typename T, size_t Capacity>
+class MpscRing {
+    static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+public:
+    MpscRing() {
+        for (size_t i = 0; i < Capacity; ++i) slots_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    // Any thread. Returns false (and drops the item) when the ring is full.
+    bool try_push(const T& item) {
+        size_t head = head_.load(std::memory_order_relaxed);
+        for (;;) {
+            Slot& slot = slots_[head & (Capacity - 1)];
+            size_t sequence = slot.sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)sequence - (intptr_t)head;
+            if (diff == 0) {
+                // The slot is free for this position; claim it.
+                if (head_.compare_exchange_weak(head, head + 1, std::memory_order_relaxed)) {
+                    slot.item = item;
+                    slot.sequence.store(head + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false; // The consumer has not freed this slot yet
+            } else {
+                head = head_.load(std::memory_order_relaxed); // Another producer took it
+            }
+        }
+    }
+
+    // Consumer side. Returns false when the ring is empty or the oldest item is still
+    // being written.
+    bool try_pop(T& item) {
+        Slot& slot = slots_[tail_ & (Capacity - 1)];
+        if (slot.sequence.load(std::memory_order_acquire) != tail_ + 1) return false;
+        item = slot.item;
+        slot.sequence.store(tail_ + Capacity, std::memory_order_release);
+        ++tail_;
+        return true;
+    }
+
+    static constexpr size_t capacity() { return Capacity; }
+
+private:
+    struct Slot {
+        std::atomic<size_t> sequence; // == position when free, position + 1 when filled
+        T item;
+    };
+    alignas(64) std::atomic<size_t> head_{0};
+    alignas(64) size_t tail_ = 0; // Consumer only
+    alignas(64) Slot slots_[Capacity];
+};